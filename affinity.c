@@ -0,0 +1,90 @@
+/* CPU and NUMA placement, see affinity.h.
+ * The memory policy is set with the raw system call, which is all
+ * libnuma would do for it.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <sched.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+
+#include "affinity.h"
+
+/* Reads a list like 0,2-3 into cpus. How many there are, or -1 if the
+ * list is malformed or holds more than max
+ */
+int affinityParse(const char *list, int *cpus, int max)
+{
+	const char *p = list;
+	char *end = NULL;
+	long first = 0, last = 0;
+	int count = 0;
+
+	while (*p != '\0')
+	{
+		if (!isdigit((unsigned char) *p))
+			return -1;
+		first = last = strtol(p, &end, 10);
+		if (*end == '-')
+		{
+			if (!isdigit((unsigned char) end[1]))
+				return -1;
+			last = strtol(end + 1, &end, 10);
+		}
+		if (last < first || last >= CPU_SETSIZE)
+			return -1;
+		for (; first <= last; first++)
+		{
+			if (count == max)
+				return -1;
+			cpus[count++] = first;
+		}
+		if (*end == ',')
+			end++;
+		else if (*end != '\0')
+			return -1;
+		p = end;
+	}
+	return count;
+}
+
+/* Keeps the calling thread on cpu. 0, or -1 if it isn't allowed there */
+int affinityPin(int cpu)
+{
+	cpu_set_t set;
+
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0)
+		return -1;
+	return 0;
+}
+
+/* Memory the calling thread faults in from now on comes from the node
+ * it's running on (first touch is the default, but not a guarantee
+ * under a process wide policy). 0, or -1 without NUMA support
+ */
+int affinityLocalMemory()
+{
+	return syscall(SYS_set_mempolicy, MPOL_LOCAL, NULL, 0) == 0 ? 0 : -1;
+}
+
+/* The NUMA node cpu belongs to, -1 if the system doesn't say */
+int affinityNode(int cpu)
+{
+	char path[64];
+	int node = 0;
+
+	for (node = 0; node < 1024; node++)
+	{
+		snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/node%d", cpu, node);
+		if (access(path, F_OK) == 0)
+			return node;
+	}
+	return -1;
+}
@@ -0,0 +1,19 @@
+/* CPU and NUMA placement.
+ * Pins the calling thread to one CPU and has the kernel take the memory
+ * it faults in from that CPU's own NUMA node, so a latency critical
+ * thread isn't migrated away from its caches or left reading memory
+ * across the interconnect. CPU lists are written like taskset's,
+ * e.g. 2,4-7.
+ */
+
+#ifndef AFFINITY_H
+#define AFFINITY_H
+
+#define AFFINITY_MAX_CPUS 64
+
+int affinityParse(const char *list, int *cpus, int max);
+int affinityPin(int cpu);
+int affinityLocalMemory();
+int affinityNode(int cpu);
+
+#endif
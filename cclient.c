@@ -3,57 +3,162 @@
  * Modified by Dylan Carr April 2020
  * dscarr94@gmail.com
  */
+#include <errno.h>
+#include <time.h>
+
 #include "networks.h"
 #include "pollLib.h"
 #include "packets.h"
+#include "historyRing.h"
+#include "validate.h"
+#include "compress.h"
+#include "tlsSocket.h"
 
 /* Client scope MACROS */
 #define DEBUG_FLAG 1
 #define SETUP_FLAG 1
+#define HISTORY_DEFAULT 20 // packets replayed by a bare %H
+#define BATCH_IN_BYTES 65536 // stdin read at a time with -b
+#define BATCH_OUT_BYTES 65536 // frames gathered per send with -b
+#define RESUME_BACKOFF_MIN 100 // ms before the first reconnect, doubling each try
+#define RESUME_BACKOFF_MAX 5000
+#define RESEND_BYTES 32768 // frames kept for resending after a resume
+#define RESEND_FRAMES 512
+
+static int batchMode = 0; // -b: commands from stdin, pipelined, no prompt
+static uint8_t *batchOut = NULL; // frames not yet sent
+static int batchOutLen = 0;
+static int handlesPending = -1; // flag 12s still to come for a %L, -1 = none
+static int offerCodec = 1; // -z off: don't ask for compression
+static uint8_t codec = COMPRESS_NONE; // agreed in flag 2
+
+/* Resumable session (flag 25) */
+static char *serverName = NULL; // to reconnect to
+static char *serverPort = NULL;
+static Handle *loginHandle = NULL;
+static int sessionRequested = 0; // flag 25 sent, counting what we send
+static int resumable = 0; // token received, counting what we get
+static uint8_t sessionToken[RESUME_TOKEN_LEN];
+static uint32_t sessionGrace = 0; // ms the server holds the session for
+static uint32_t framesSent = 0;
+static uint32_t framesReceived = 0;
+static HistoryRing sentFrames; // the latest frames sent, by number
+static int exiting = 0; // %E sent
 
 /* Function prototypes */
 uint16_t getFromStdin(char * sendBuf);
 void checkArgs(int argc, char * argv[]);
 int checkHandle(char *handle, int setupFlag);
 void run(int clientSocket, Handle *handle);
-void initPacket_F1(uint8_t handle[MAXBUF+1], int clientSocket);
+void initPacket_F1(uint8_t handle[MAX_HANDLE+1], int clientSocket);
 void checkServerResponse(int clientSocket);
 void recvFromServer(int clientSocket);
 void handleUserInput(int clientSocket, Handle *handle);
+void handleCommand(uint8_t buf[MAXBUF], uint16_t len, int clientSocket, Handle *handle);
+void runBatch(int clientSocket, Handle *handle);
+int readCommands(int clientSocket, Handle *handle);
+void runLine(char *text, int len, int clientSocket, Handle *handle);
+void clientSend(int clientSocket, uint8_t *buf, uint16_t len);
+void batchFlush(int clientSocket);
 int messageClients(uint8_t buf[MAXBUF], uint16_t len, Handle *src_handle, int clientSocket);
-void invalidClient(uint8_t buf[MAXBUF]);
 void clientExit(int clientSocket);
 int messageClients(uint8_t buf[MAXBUF], uint16_t len, Handle *src_handle, int clientSocket);
 void sendMessage(int num_handles, Handle handles[MAX_DEST_HANDLES], char *msg, Handle *src_handle, int clientSocket);
 void requestHandleList(int clientSocket);
-int getHandleList(uint8_t buf[MAXBUF], int num_clients, int clientSocket);
-int getNumHandles(uint8_t buf[MAXBUF]);
-void invalidClient(uint8_t buf[MAXBUF]);
-void receiveMessage(uint8_t buf[MAXBUF]);
+void receiveNumHandles(Frame *f, int clientSocket);
+void receiveHandle(Frame *f, int clientSocket);
+void endHandleList(Frame *f, int clientSocket);
+void invalidClient(Frame *f, int clientSocket);
+void messageBlocked(Frame *f, int clientSocket);
+void receiveMessage(Frame *f, int clientSocket);
 void broadcastClients(uint8_t buf[MAXBUF], uint16_t len, Handle *src_handle, int clientSocket);
-void sendBroadcast();
-void receiveBroadcast(uint8_t buf[MAXBUF]);
+void sendBroadcast(char *msg, Handle *src_handle, int clientSocket);
+void receiveBroadcast(Frame *f, int clientSocket);
+void sendHeartbeatAck(Frame *f, int clientSocket);
+void requestHistory(uint8_t buf[MAXBUF], int clientSocket);
+void receiveHistory(Frame *f, int clientSocket);
+void requestSearch(uint8_t buf[MAXBUF], uint16_t len, int clientSocket);
+void receiveSearchResult(Frame *f, int clientSocket);
+void handleTaken(Frame *f, int clientSocket);
+void exitAcked(Frame *f, int clientSocket);
+void ignoreFrame(Frame *f, int clientSocket);
+void sendEmpty(int clientSocket, uint8_t flag);
+void requestSession(int clientSocket);
+void startSession(Frame *f, int clientSocket);
+void resumeSession(int clientSocket);
+int tryResume(int clientSocket);
+uint64_t nowMs();
+
+/* What each flag from the server is handed to, once frameDecode() has
+ * checked it. Flags without a handler are reported and dropped
+ */
+typedef void (*FrameHandler)(Frame *f, int clientSocket);
+
+static const FrameHandler handlers[256] = {
+	[HANDLE_EXISTS_FLAG] = handleTaken,
+	[BROADCAST_FLAG] = receiveBroadcast,
+	[MESSAGE_FLAG] = receiveMessage,
+	[NO_HANDLE_FLAG] = invalidClient,
+	[EXIT_ACK_FLAG] = exitAcked,
+	[LIST_COUNT_FLAG] = receiveNumHandles,
+	[LIST_HANDLE_FLAG] = receiveHandle,
+	[LIST_END_FLAG] = endHandleList,
+	[HEARTBEAT_FLAG] = sendHeartbeatAck,
+	[HISTORY_FLAG] = receiveHistory,
+	[HISTORY_END_FLAG] = ignoreFrame,
+	[SEARCH_RESULT_FLAG] = receiveSearchResult,
+	[SESSION_FLAG] = startSession,
+	[BLOCKED_FLAG] = messageBlocked,
+};
 
 /* User Commands:
  * %M num-handles destination-handle [destination-handle] [text]
  * %B [text]
  * %E
  * %L
+ * %H [count | s<seq>]
+ * %S word [word ...]
 */
 
 int main(int argc, char * argv[]) {
 
 	int clientSocket = 0;  //socket descriptor
+	int opt = 0;
 	setupPollSet();
+	while((opt = getopt(argc, argv, "+bz:T:")) != -1) {
+		if(opt == 'b')
+			batchMode = 1;
+		else if(opt == 'z' && strcmp(optarg, "off") == 0)
+			offerCodec = 0;
+		else if(opt == 'T') {
+			if(tlsClientInit(optarg) < 0)
+				exit(EXIT_FAILURE);
+		}
+		else if(opt != 'z' || compressLoadDict(optarg) < 0) {
+			if(opt == 'z')
+				perror(optarg);
+			argc = 0; // usage
+			break;
+		}
+	}
+	argv[optind - 1] = argv[0]; // handle is argv[1] from here
+	argv += optind - 1;
+	argc -= optind - 1;
 	checkArgs(argc, argv); // valid handle past here
 	Handle handle;
 	memcpy(handle.handle, argv[1], (strlen(argv[1])+1) * sizeof(uint8_t));
+	loginHandle = &handle;
+	serverName = argv[2];
+	serverPort = argc > 3 ? argv[3] : NULL;
 
-	/* set up the TCP Client socket  */
- 	clientSocket = tcpClientSetup(argv[2], argv[3], 0);
+	/* set up the TCP (or unix:/path, or tls:host) Client socket  */
+ 	clientSocket = clientSetup(argv[2], argc > 3 ? argv[3] : NULL, 0);
 
 	/* Pass handle and socketNum to run function */
-	run(clientSocket, &handle);
+	if(batchMode)
+		runBatch(clientSocket, &handle);
+	else
+		run(clientSocket, &handle);
 
 	close(clientSocket);
 	return 0;
@@ -66,6 +171,7 @@ void run(int clientSocket, Handle *handle) {
 
 	// BLOCK HERE waiting for f=2 or f=3 flag from server
 	checkServerResponse(clientSocket);
+	requestSession(clientSocket);
 
 	addToPollSet(STDIN_FILENO); // add stdin after recv flag 2/3 packet
 	addToPollSet(clientSocket);
@@ -76,7 +182,8 @@ void run(int clientSocket, Handle *handle) {
 		//blocks here waiting for user input or msg from server
 		if((socketToProcess = pollCall(POLL_WAIT_FOREVER)) != -1) {
 
-			if(socketToProcess == clientSocket) {
+			// (a shared memory wakeup can be for output room, not input)
+			if(socketToProcess == clientSocket && pollRevents(clientSocket)) {
 				/* Recieve message from Server */
 				recvFromServer(clientSocket);
 			}
@@ -84,7 +191,8 @@ void run(int clientSocket, Handle *handle) {
 				/* Process user commands */
 				handleUserInput(clientSocket, handle);
 			}
-			printf("$: "); // print again before polling next socket
+			if(handlesPending < 0) // not between the lines of a %L
+				printf("$: "); // print again before polling next socket
 			fflush(stdout);
 		}
 		else {
@@ -94,11 +202,145 @@ void run(int clientSocket, Handle *handle) {
 	}
 }
 
+/* -b: reads commands from stdin in big chunks and sends them without
+ * waiting for the server, printing whatever arrives meanwhile. Output
+ * is fully buffered and only flushed when there's nothing else to do.
+ * The end of input sends %E
+ */
+void runBatch(int clientSocket, Handle *handle) {
+
+	int socketToProcess = 0;
+	batchOut = sCalloc(BATCH_OUT_BYTES, 1);
+	initPacket_F1(handle->handle, clientSocket);
+	batchFlush(clientSocket);
+	checkServerResponse(clientSocket);
+	requestSession(clientSocket);
+
+	setvbuf(stdout, NULL, _IOFBF, BATCH_OUT_BYTES);
+	addToPollSet(STDIN_FILENO);
+	addToPollSet(clientSocket);
+
+	while(1) {
+		if((socketToProcess = pollCall(0)) == -1) {
+			fflush(stdout);
+			socketToProcess = pollCall(POLL_WAIT_FOREVER);
+		}
+		while(socketToProcess != -1) {
+			if(socketToProcess == clientSocket && pollRevents(clientSocket))
+				recvFromServer(clientSocket);
+			else if(socketToProcess == STDIN_FILENO && readCommands(clientSocket, handle) == 0) {
+				removeFromPollSet(STDIN_FILENO);
+				clientExit(clientSocket);
+			}
+			socketToProcess = pollNextReady();
+		}
+		batchFlush(clientSocket);
+	}
+}
+
+/* Reads a chunk of stdin and runs every whole line in it, keeping a
+ * partial last line for the next call. Returns 0 at end of input
+ */
+int readCommands(int clientSocket, Handle *handle) {
+
+	static char in[BATCH_IN_BYTES];
+	static int inLen = 0;
+	char *start = in, *end = NULL;
+	ssize_t n = read(STDIN_FILENO, in + inLen, sizeof(in) - inLen);
+
+	if(n < 0) {
+		if(errno == EINTR)
+			return 1;
+		perror("read stdin");
+		exit(EXIT_FAILURE);
+	}
+	if(n == 0) {
+		if(inLen > 0) // no newline at the end
+			runLine(in, inLen, clientSocket, handle);
+		inLen = 0;
+		return 0;
+	}
+
+	inLen += n;
+	while((end = memchr(start, '\n', in + inLen - start)) != NULL) {
+		runLine(start, end - start, clientSocket, handle);
+		start = end + 1;
+	}
+	inLen -= start - in;
+	memmove(in, start, inLen);
+	if(inLen == sizeof(in)) { // one huge line, cut like getFromStdin() would
+		runLine(in, inLen, clientSocket, handle);
+		inLen = 0;
+	}
+	return 1;
+}
+
+void runLine(char *text, int len, int clientSocket, Handle *handle) {
+
+	uint8_t buf[MAXBUF];
+	if(len > MAXBUF - 1)
+		len = MAXBUF - 1;
+	memcpy(buf, text, len);
+	buf[len] = '\0';
+	handleCommand(buf, len + 1, clientSocket, handle);
+}
+
+/* Sends a frame, or with -b adds it to the next batchFlush() */
+void clientSend(int clientSocket, uint8_t *buf, uint16_t len) {
+
+	uint8_t packed[MAXBUF];
+	uint16_t packedLen = 0;
+
+	// deflated as sent (and as kept for a resend), when it comes out smaller
+	if(codec == COMPRESS_DEFLATE && sessionCounted(buf[PKT_LEN])
+			&& (packedLen = compressPacket(buf, len, packed)) > 0) {
+		buf = packed;
+		len = packedLen;
+	}
+	if(sessionRequested && sessionCounted(buf[PKT_LEN]))
+		historyAppend(&sentFrames, ++framesSent, buf, len);
+	if(!batchMode) {
+		// with a session, the read side notices the drop and resumes
+		if(transportSend(clientSocket, buf, len, MSG_NOSIGNAL) < 0 && !resumable) {
+			perror("sending packet call\n");
+			exit(EXIT_FAILURE);
+		}
+		return;
+	}
+	if(batchOutLen + len > BATCH_OUT_BYTES)
+		batchFlush(clientSocket);
+	memcpy(batchOut + batchOutLen, buf, len);
+	batchOutLen += len;
+}
+
+void batchFlush(int clientSocket) {
+
+	int sent = 0;
+	ssize_t n = 0;
+	while(sent < batchOutLen) {
+		if((n = transportSend(clientSocket, batchOut + sent, batchOutLen - sent, MSG_NOSIGNAL)) < 0) {
+			if(errno == EINTR)
+				continue;
+			if(resumable)
+				break; // kept in sentFrames, resent after the resume
+			perror("sending batch");
+			exit(EXIT_FAILURE);
+		}
+		sent += n;
+	}
+	batchOutLen = 0;
+}
+
 /* handles user command line input */
 void handleUserInput(int clientSocket, Handle *handle) {
 
 	uint8_t buf[MAXBUF];
 	uint16_t len = getFromStdin((char *)buf); // len includes null, buf has user input w/ null
+	handleCommand(buf, len, clientSocket, handle);
+}
+
+/* runs one command line, len includes the null */
+void handleCommand(uint8_t buf[MAXBUF], uint16_t len, int clientSocket, Handle *handle) {
 
 	uint8_t cmd = 0; //must initlaize
 	//assumes first 2 chars are %[letter]
@@ -119,27 +361,118 @@ void handleUserInput(int clientSocket, Handle *handle) {
 		case 'E' :
 			clientExit(clientSocket);
 			break;
+		case 'H' :
+			requestHistory(buf, clientSocket);
+			break;
+		case 'S' :
+			requestSearch(buf, len, clientSocket);
+			break;
 		default :
 			printf("Invalid command\n");
 	}
 }
 
 void requestHandleList(int clientSocket) {
+	sendEmpty(clientSocket, LIST_REQ_FLAG);
+}
+
+// answers the server's flag = 14 keepalive probe
+void sendHeartbeatAck(Frame *f, int clientSocket) {
+	sendEmpty(clientSocket, HEARTBEAT_ACK_FLAG);
+}
+
+// a frame that is only its header (flags 8, 10, 15, 25)
+void sendEmpty(int clientSocket, uint8_t flag) {
 
 	uint8_t buf[MAXBUF];
-	uint16_t pkt_len = 3;
-	makeChatHeader(buf, 10, pkt_len);
-	sendPacket(clientSocket, buf, pkt_len);
+	makeChatHeader(buf, flag, sizeof(ChatHeader));
+	clientSend(clientSocket, buf, sizeof(ChatHeader));
+}
 
+/* %H - last HISTORY_DEFAULT messages
+ * %H <count> - last count messages
+ * %H s<seq> - every message after sequence number seq
+ */
+void requestHistory(uint8_t buf[MAXBUF], int clientSocket) {
+
+	uint8_t mode = HISTORY_LAST;
+	uint32_t value = HISTORY_DEFAULT;
+	char *arg = strtok((char *)buf+2, " ");
+	Frame f;
+
+	if(arg != NULL) {
+		if(toupper(arg[0]) == 'S') {
+			mode = HISTORY_SINCE;
+			value = strtoul(arg+1, NULL, 10);
+		}
+		else
+			value = strtoul(arg, NULL, 10);
+	}
+
+	frameInit(&f, HISTORY_REQ_FLAG);
+	frameNum(&f, mode);
+	frameNum(&f, value);
+	clientSend(clientSocket, buf, frameEncode(buf, TO_SERVER, &f));
 }
 
-void clientExit(int clientSocket) {
+// flag = 17, a replayed flag 4 or 5 packet prefixed by its sequence number
+void receiveHistory(Frame *f, int clientSocket) {
 
-	uint8_t buf[MAXBUF];
-	uint16_t pkt_len = 3;
-	makeChatHeader(buf, 8, pkt_len);
-	sendPacket(clientSocket, buf, pkt_len);
+	Frame stored;
+
+	// stored as the sender sent it
+	if(frameDecode(f->text, f->text_len + PKT_LEN, TO_SERVER, &stored) < 0
+			|| (stored.flag != BROADCAST_FLAG && stored.flag != MESSAGE_FLAG)) {
+		fprintf(stderr, "server sent malformed history packet\n");
+		return;
+	}
+	printf("%s[%u] %.*s: %s\n", batchMode ? "" : "\n", f->nums[0],
+		stored.handle_lens[0], stored.handles[0], stored.text);
+}
+
+/* %S word [word ...] - messages containing every word. Matches still in
+ * the server's history arrive as flag 17 packets, then flag 20
+ */
+void requestSearch(uint8_t buf[MAXBUF], uint16_t len, int clientSocket) {
+
+	uint8_t sendbuf[MAXBUF];
+	Frame f;
 
+	if(len <= 4) { // "%S " + null
+		printf("Usage: %%S word [word ...]\n");
+		return;
+	}
+	if(!validText(buf+3, len-4)) {
+		printf("Invalid search, words are not UTF-8 text\n");
+		return;
+	}
+	frameInit(&f, SEARCH_REQ_FLAG);
+	frameText(&f, buf+3, len-4);
+	clientSend(clientSocket, sendbuf, frameEncode(sendbuf, TO_SERVER, &f));
+}
+
+// flag = 20, total matches then the newest matching sequence numbers
+void receiveSearchResult(Frame *f, int clientSocket) {
+
+	uint32_t seq;
+	uint32_t count = f->nums[1];
+	uint32_t i;
+
+	if(count > f->text_len / sizeof(uint32_t))
+		count = f->text_len / sizeof(uint32_t);
+	printf("\n%u matching messages", f->nums[0]);
+	if(count > 0)
+		printf(", newest:");
+	for(i = 0; i < count; i++) {
+		memcpy(&seq, f->text + i * sizeof(uint32_t), sizeof(uint32_t));
+		printf(" %u", ntohl(seq));
+	}
+	printf("\n");
+}
+
+void clientExit(int clientSocket) {
+	sendEmpty(clientSocket, EXIT_FLAG);
+	exiting = 1;
 }
 
 void broadcastClients(uint8_t buf[MAXBUF], uint16_t len, Handle *src_handle, int clientSocket) {
@@ -149,6 +482,11 @@ void broadcastClients(uint8_t buf[MAXBUF], uint16_t len, Handle *src_handle, int
 	char message[MAX_MESSAGE];
 	//len includes null (getFromStdin() appended)
 	int text_len = len - offset;
+	int chunk = 0;
+	if(text_len > 1 && !validText(buf+offset, text_len-1)) {
+		printf("Invalid message, message is not UTF-8 text\n");
+		return;
+	}
 	if(text_len <= 1) { //checks if user entered "%B" or "%B "
 		//send blank newline msg
 		message[0] = '\n';
@@ -167,11 +505,13 @@ void broadcastClients(uint8_t buf[MAXBUF], uint16_t len, Handle *src_handle, int
 		else { // here means msg (w/ null) > 200
 			//offset = start of msg
 			while(text_len > MAX_MESSAGE) {
-				memcpy(message, buf+offset, MAX_MESSAGE-1); // copy 199 bytes
-				message[MAX_MESSAGE]= '\0';
+				// 199 bytes, less any character they'd cut in two
+				chunk = utf8Boundary(buf+offset, MAX_MESSAGE-1);
+				memcpy(message, buf+offset, chunk);
+				message[chunk]= '\0';
 				sendBroadcast((char *)message, src_handle, clientSocket);
-				offset += MAX_MESSAGE-1; // move offset to next part of msg
-				text_len -= MAX_MESSAGE-1;
+				offset += chunk; // move offset to next part of msg
+				text_len -= chunk;
 			}
 			// handle remaining msg part
 			memcpy(message, buf+offset, text_len); // shld include null
@@ -182,20 +522,12 @@ void broadcastClients(uint8_t buf[MAXBUF], uint16_t len, Handle *src_handle, int
 
 void sendBroadcast(char *msg, Handle *src_handle, int clientSocket) {
 	uint8_t buf[MAXBUF];
-	uint16_t pkt_len = 0; // = sizeof(chatHdr); // 3 to start
-	uint8_t flag = BROADCAST_FLAG;
-	uint8_t src_handle_len = strlen((char *)src_handle->handle); // length without null
-	memcpy(buf+3, &src_handle_len, 1);
-	memcpy(buf+4, src_handle->handle, src_handle_len * sizeof(uint8_t)); // dont want null term in pkt
-
-	int offset = 4+src_handle_len;
-	int msg_len = strlen(msg) + 1; // strlen - no null term  so add 1
-	//offset now ready for message
-	memcpy(buf+offset, msg, msg_len * sizeof(uint8_t));
-	offset += msg_len; // should be pkt_len now
-	pkt_len = (uint16_t)offset;
-	makeChatHeader(buf, flag, pkt_len);
-	sendPacket(clientSocket, buf, pkt_len);
+	Frame f;
+
+	frameInit(&f, BROADCAST_FLAG);
+	frameHandle(&f, src_handle->handle, strlen((char *)src_handle->handle));
+	frameText(&f, msg, strlen(msg));
+	clientSend(clientSocket, buf, frameEncode(buf, TO_SERVER, &f));
 }
 
 // buf points to beginning of user input (%) and IS NULL TERMINATED
@@ -249,6 +581,11 @@ int messageClients(uint8_t buf[MAXBUF], uint16_t len, Handle *src_handle, int cl
 	//text len includes null (getFromStdin() appended)
 
 	int text_len = len - offset; //shld be 0 if user hit enter after last dest_handle
+	int chunk = 0;
+	if(offset < len && !validText(buf+offset, text_len-1)) {
+		printf("Invalid message, message is not UTF-8 text\n");
+		return -1;
+	}
 	// checks if null is last char in buff at last dest_handle - empty/blank msg
 	if(offset >= len) { //blank message, send \n as message
 		message[0] = '\n';
@@ -266,11 +603,13 @@ int messageClients(uint8_t buf[MAXBUF], uint16_t len, Handle *src_handle, int cl
 	else { // here means msg (w/ null) > 200
 		//offset = start of msg
 		while(text_len > MAX_MESSAGE) {
-			memcpy(message, buf+offset, MAX_MESSAGE-1); // copy 199 bytes
-			message[MAX_MESSAGE]= '\0';
+			// 199 bytes, less any character they'd cut in two
+			chunk = utf8Boundary(buf+offset, MAX_MESSAGE-1);
+			memcpy(message, buf+offset, chunk);
+			message[chunk]= '\0';
 			sendMessage(num_handles, handles, (char *)message, src_handle, clientSocket);
-			offset += MAX_MESSAGE-1; // move offset to next part of msg
-			text_len -= MAX_MESSAGE-1;
+			offset += chunk; // move offset to next part of msg
+			text_len -= chunk;
 		}
 		// handle remaining msg part
 		memcpy(message, buf+offset, text_len); // shld include null
@@ -284,162 +623,110 @@ int messageClients(uint8_t buf[MAXBUF], uint16_t len, Handle *src_handle, int cl
 void sendMessage(int num_handles, Handle handles[MAX_DEST_HANDLES], char *msg, Handle *src_handle, int clientSocket) {
 
 	uint8_t buf[MAXBUF];
-	uint16_t pkt_len = 0; // = sizeof(chatHdr); // 3 to start
-	uint8_t flag = MESSAGE_FLAG;
-	uint8_t src_handle_len = strlen((char *)src_handle->handle); // length without null
-	memcpy(buf+3, &src_handle_len, 1);
-	memcpy(buf+4, src_handle->handle, src_handle_len * sizeof(uint8_t)); // dont want null term in pkt
-	memcpy(buf+4+src_handle_len, &num_handles, 1);
-	int i, handle_len = 0;
-	int offset = 5+src_handle_len;
-
-	for(i = 0; i < num_handles; i++) {
-		handle_len = strlen((char *)handles[i].handle); //get handle length without null
-		memcpy(buf+offset, &handle_len, 1);
-		offset++;
-		memcpy(buf+offset, handles[i].handle, handle_len * sizeof(uint8_t));
-		offset += handle_len;
-	}
+	Frame f;
+	int i;
 
-	int msg_len = strlen(msg) + 1; // strlen - no null term  so add 1
-	//offset now ready for message
-	memcpy(buf+offset, msg, msg_len * sizeof(uint8_t));
-	offset += msg_len; // should be pkt_len now
-	pkt_len = (uint16_t)offset;
-	makeChatHeader(buf, flag, pkt_len);
-	sendPacket(clientSocket, buf, pkt_len);
+	frameInit(&f, MESSAGE_FLAG);
+	frameHandle(&f, src_handle->handle, strlen((char *)src_handle->handle));
+	for(i = 0; i < num_handles; i++) // the destination list
+		frameHandle(&f, handles[i].handle, strlen((char *)handles[i].handle));
+	frameText(&f, msg, strlen(msg));
+	clientSend(clientSocket, buf, frameEncode(buf, TO_SERVER, &f));
 }
 
 /* handles messages from the server */
 void recvFromServer(int clientSocket) {
 
 	uint8_t buf[MAXBUF];
+	uint8_t packed[MAXBUF];
 	uint8_t flag = 0;
 	int messageLen = 0;
-	int error = 0;
+	Frame f;
 
 	// checks if 0 bytes read from server
-	if((messageLen = sRecv(buf, clientSocket) < 0)) {
+	if((messageLen = sRecv(buf, clientSocket)) < 0) {
+		if(resumable) {
+			resumeSession(clientSocket);
+			return;
+		}
 		printf("Server Terminted\n");
 		exit(EXIT_FAILURE);
 	}
-	else {
-		memcpy(&flag, buf, 1);
-
-		int num_clients = 0;
-		switch(flag) {
-			case 4:
-				receiveBroadcast(buf);
-				break;
-         case 5:
-				receiveMessage(buf);
-            break;
-
-         case 7:
-				invalidClient(buf);
-            break;
-
-         case 9: // client received exit ACK
-				exit(EXIT_SUCCESS);
-            break;
-
-         case 11:
-				num_clients = getNumHandles(buf);
-				printf("Number of clients: %d\n", num_clients);
-				error = getHandleList(buf, num_clients, clientSocket);
-				if(error < 0)
-					perror("getHandleList failed\n");
-            break;
-
-         default:
-            fprintf(stderr, "server sent bad packet (wrong flag): %u\n", flag);
-      } // end switch
-	} // end else
-}
-
-// buf points to flag of first f =12 packet
-int getHandleList(uint8_t buf[MAXBUF], int num_clients, int clientSocket) {
-
-	int i;
-	uint8_t handle_len;
-	Handle handle;
-	for(i = 0; i < num_clients; i++) {
-		//buf points to flag
-		if((sRecv(buf, clientSocket) < 0)) {
-			perror("sRecv in getHandleList f=12\n");
-			exit(EXIT_FAILURE);
+	flag = buf[0];
+	if(resumable && sessionCounted(flag))
+		framesReceived++;
+
+	// handled as the frame it holds, counted once above as flag 27
+	if(flag == COMPRESSED_FLAG && codec == COMPRESS_DEFLATE) {
+		memcpy(packed, buf, messageLen - PKT_LEN);
+		if((messageLen = decompressFrame(packed, messageLen, buf)) < 0) {
+			fprintf(stderr, "server sent bad compressed packet\n");
+			return;
 		}
-		handle_len = buf[1];
-		memcpy(handle.handle, buf+2, handle_len * sizeof(uint8_t));
-		handle.handle[handle_len] = '\0';
-
-		printf("  %s\n", handle.handle);
-
+		flag = buf[0];
 	}
-	// finished processing handle List - now f = 13
-	// recv 1 last time for f = 13
-	if((sRecv(buf, clientSocket) < 0)) {
-		perror("sRecv in getHandleList f=13\n");
-		exit(EXIT_FAILURE);
+
+	if(frameDecode(buf, messageLen, TO_CLIENT, &f) < 0 || handlers[flag] == NULL) {
+		fprintf(stderr, "server sent bad packet (flag %u)\n", flag);
+		return;
 	}
-	if(buf[0] == 13)
-		return 1; // success
-	else
-		return -1;
+	handlers[flag](&f, clientSocket);
 }
 
-int getNumHandles(uint8_t buf[MAXBUF]) {
-
-	int num_handles = 0;
-	memcpy(&num_handles, buf+1, sizeof(uint32_t));
-	num_handles = ntohl(num_handles);
-	return num_handles;
+// flag = 3 - another server had this handle first
+void handleTaken(Frame *f, int clientSocket) {
+	printf("\nclient handle already exists on another server\n");
+	exit(EXIT_FAILURE);
+}
 
+// flag = 9 - client received exit ACK
+void exitAcked(Frame *f, int clientSocket) {
+	exit(EXIT_SUCCESS);
 }
 
-// received flag = 7 invalid client packet
-// buf points to flag
-void invalidClient(uint8_t buf[MAXBUF]) {
+// flags with nothing to do (flag 18 ends a replay that was printed as it came)
+void ignoreFrame(Frame *f, int clientSocket) {
+}
 
-	uint8_t handle_len = buf[1];
-	Handle handle;
-	memcpy(handle.handle, buf+2, handle_len * sizeof(uint8_t));
-	handle.handle[handle_len] = '\0';
-	printf("Client with handle <%s> does not exist\n", handle.handle);
+// flag = 11 - the handles follow as flag 12s, between other traffic
+void receiveNumHandles(Frame *f, int clientSocket) {
+	handlesPending = f->nums[0];
+	printf("Number of clients: %d\n", handlesPending);
 }
 
-//receieves a broadcast message
-// NOT COMPELTE
-void receiveBroadcast(uint8_t buf[MAXBUF]) {
+// one line of a %L, printed as it arrives
+void receiveHandle(Frame *f, int clientSocket) {
 
-	uint8_t offset = 1;
-	uint8_t source_handle_len = buf[offset++];
-	Handle handle;
+	printf("  %.*s\n", f->handle_lens[0], f->handles[0]);
+	if(handlesPending > 0)
+		handlesPending--;
+}
+
+// flag 13 - the list is complete
+void endHandleList(Frame *f, int clientSocket) {
 
-	memcpy(handle.handle, buf+offset, source_handle_len * sizeof(uint8_t));
-	offset += source_handle_len;
-	handle.handle[source_handle_len] = '\0';
-	printf("\n%s: %s\n", handle.handle, buf+offset);
+	if(handlesPending > 0)
+		fprintf(stderr, "handle list ended %d short\n", handlesPending);
+	handlesPending = -1;
 }
 
-void receiveMessage(uint8_t buf[MAXBUF]) {
+// received flag = 7 invalid client packet
+void invalidClient(Frame *f, int clientSocket) {
+	printf("Client with handle <%.*s> does not exist\n", f->handle_lens[0], f->handles[0]);
+}
 
-	uint8_t offset = 1;
-	uint8_t source_handle_len = buf[offset++];
-	Handle handle;
+void messageBlocked(Frame *f, int clientSocket) {
+	printf("Message not sent: blocked by the server's content filter\n");
+}
 
-	memcpy(handle.handle, buf+offset, source_handle_len * sizeof(uint8_t));
-	offset += source_handle_len;
-	handle.handle[source_handle_len] = '\0';
+//receieves a broadcast message
+void receiveBroadcast(Frame *f, int clientSocket) {
+	// text is null terminated, frameDecode() checked
+	printf("%s%.*s: %s\n", batchMode ? "" : "\n", f->handle_lens[0], f->handles[0], f->text);
+}
 
-	uint8_t num_dest_handles = buf[offset++];
-	int i, handle_len;
-	for(i = 0; i < num_dest_handles; i++) {
-		handle_len = buf[offset++];
-		offset+= handle_len;
-	}
-	// points to msg at end
-	printf("\n%s: %s\n", handle.handle, buf+offset);
+void receiveMessage(Frame *f, int clientSocket) {
+	printf("%s%.*s: %s\n", batchMode ? "" : "\n", f->handle_lens[0], f->handles[0], f->text);
 }
 
 /* Blocks waiting for flag = 2 or 3 from server */
@@ -447,31 +734,41 @@ void checkServerResponse(int clientSocket) {
 
 	uint8_t buf[MAXBUF];
 	uint8_t flag = 0;
-	if((sRecv(buf, clientSocket) < 0)) {
+	int len = 0;
+	Frame f;
+	if(((len = sRecv(buf, clientSocket)) < 0)) {
 		printf("Server died\n");
 		exit(EXIT_FAILURE);
 	}
 	memcpy(&flag, buf, 1);
-	if(flag == 3) {
+	if(flag == HANDLE_EXISTS_FLAG) {
 		printf("client handle already exists\n");
 		exit(EXIT_FAILURE);
 	}
+	if(flag == SERVER_FULL_FLAG) {
+		printf("server is full, try again later\n");
+		exit(EXIT_FAILURE);
+	}
+	// the codec we offered, if the server took it up
+	if(flag == GOOD_HANDLE_FLAG && frameDecode(buf, len, TO_CLIENT, &f) == 0 && f.num_count == 2
+			&& f.nums[0] == COMPRESS_DEFLATE && f.nums[1] == compressDictId())
+		codec = COMPRESS_DEFLATE;
 }
 
 // sends initial packet to server to validate clients handlename
 // blocks until receieves ACK from server
 void initPacket_F1(uint8_t handle[MAX_HANDLE+1], int clientSocket) {
 	uint8_t buf[MAXBUF];
-	uint8_t handleLen = (uint8_t)strlen((char *)handle); //doesnt calc /0 (max 99)
-	uint8_t flag = 1;
-	//sizoef(handle) includes null terminator (i.e. strlen(handle) + 1)
-	// 3 + 1 + length without /0
-	uint16_t pkt_len = sizeof(struct chatHeader) + sizeof(handleLen) + handleLen;
-
-	makeChatHeader(buf, flag, pkt_len);
-	memcpy(buf+PKT_LEN+FLAG_LEN, &handleLen, 1);
-	memcpy(buf+PKT_LEN+FLAG_LEN+1, handle, handleLen); // shouldnt include /0
-	sendPacket(clientSocket, buf, pkt_len);
+	Frame f;
+
+	codec = COMPRESS_NONE; // until flag 2 says otherwise
+	frameInit(&f, LOGIN_FLAG);
+	frameHandle(&f, handle, strlen((char *)handle)); // without the null
+	if(offerCodec) {
+		frameNum(&f, COMPRESS_DEFLATE);
+		frameNum(&f, compressDictId());
+	}
+	clientSend(clientSocket, buf, frameEncode(buf, TO_SERVER, &f));
 }
 
 // Gets input up to MAXBUF-1 (and then appends \0)
@@ -503,9 +800,12 @@ uint16_t getFromStdin(char * sendBuf) {
  */
 void checkArgs(int argc, char * argv[]) {
 	/* check command line arguments  */
-	if (argc != 4)
+	int local = argc == 3 && (strncmp(argv[2], UNIX_PREFIX, strlen(UNIX_PREFIX)) == 0
+		|| strncmp(argv[2], SHM_PREFIX, strlen(SHM_PREFIX)) == 0);
+	if (argc != 4 && !local)
 	{
-		printf("usage: %s handle host-name port-number \n", argv[0]);
+		printf("usage: %s [-b] [-z dict-file|off] [-T ca-file] handle [tls:]host-name port-number \n", argv[0]);
+		printf("       %s [-b] [-z dict-file|off] handle unix:socket-path|shm:socket-path \n", argv[0]);
 		exit(EXIT_FAILURE);
 	}
 
@@ -541,6 +841,128 @@ int checkHandle(char *handle, int setupFlag) {
 		return -1;
 	}
 
+	// check the rest is letters, digits and symbols
+	if(!validHandle((uint8_t *)handle, strlen(handle))) {
+
+		if(setupFlag)
+			printf("Invalid handle, handle has spaces or control characters\n");
+		else
+			printf("Invalid handle, handle has spaces or control characters ignoring cmd...\n");
+
+		return -1;
+	}
+
 	//valid handle
 	return 1;
 }
+
+/* flag 25 - asks for the login to be made resumable. What we send is
+ * numbered from here on, what we get once the token arrives
+ */
+void requestSession(int clientSocket) {
+
+	sendEmpty(clientSocket, SESSION_FLAG);
+	if(sentFrames.arena != NULL)
+		historyFree(&sentFrames);
+	historyInit(&sentFrames, RESEND_BYTES, RESEND_FRAMES);
+	framesSent = 0;
+	framesReceived = 0;
+	sessionRequested = 1;
+}
+
+// flag 25 reply - token, grace ms
+void startSession(Frame *f, int clientSocket) {
+
+	memcpy(sessionToken, f->token, RESUME_TOKEN_LEN);
+	sessionGrace = f->nums[0];
+	resumable = 1;
+}
+
+/* The connection dropped. Reconnects for as long as the server holds
+ * the session, backing off from RESUME_BACKOFF_MIN to RESUME_BACKOFF_MAX
+ * ms (with jitter, so a server restart isn't met by every client at once)
+ */
+void resumeSession(int clientSocket) {
+
+	uint64_t deadline = nowMs() + sessionGrace;
+	int delay = RESUME_BACKOFF_MIN;
+
+	fprintf(stderr, "connection to server lost, reconnecting\n");
+	removeFromPollSet(clientSocket);
+	batchOutLen = 0; // anything counted in it is in sentFrames
+	while(tryResume(clientSocket) < 0) {
+		if(nowMs() >= deadline) {
+			printf("Server Terminted\n");
+			exit(EXIT_FAILURE);
+		}
+		usleep(1000 * (delay / 2 + rand() % (delay / 2 + 1)));
+		delay = delay * 2 > RESUME_BACKOFF_MAX ? RESUME_BACKOFF_MAX : delay * 2;
+	}
+	addToPollSet(clientSocket);
+}
+
+/* One reconnect and flag 26. The server resends what we missed through
+ * the normal receive path, and says how many of our frames it handled
+ * so the rest are sent again. A session it no longer has means logging
+ * in afresh. -1 to try again later
+ */
+int tryResume(int clientSocket) {
+
+	uint8_t buf[MAXBUF];
+	uint16_t pkt_len;
+	int reply_len;
+	uint32_t value = 0;
+	HistoryEntry *e = NULL;
+	Frame f;
+	int sock;
+	uint32_t i;
+
+	if((sock = clientTrySetup(serverName, serverPort)) < 0)
+		return -1;
+	// the rest of the client knows the connection by its old number
+	transportClose(clientSocket);
+	dup2(sock, clientSocket);
+	transportMove(sock, clientSocket);
+	close(sock);
+
+	frameInit(&f, RESUME_FLAG);
+	f.token = sessionToken;
+	frameNum(&f, framesReceived);
+	pkt_len = frameEncode(buf, TO_SERVER, &f);
+	if(transportSend(clientSocket, buf, pkt_len, MSG_NOSIGNAL) < pkt_len
+			|| (reply_len = sRecv(buf, clientSocket)) < 0 || buf[0] != RESUME_FLAG
+			|| frameDecode(buf, reply_len, TO_CLIENT, &f) < 0)
+		return -1;
+
+	if(f.nums[0] != RESUME_OK) {
+		resumable = 0;
+		sessionRequested = 0;
+		if(exiting)
+			exit(EXIT_SUCCESS); // was logging out anyway
+		fprintf(stderr, "session expired, logging in again\n");
+		initPacket_F1(loginHandle->handle, clientSocket);
+		if(batchMode)
+			batchFlush(clientSocket);
+		checkServerResponse(clientSocket);
+		requestSession(clientSocket);
+		return 0;
+	}
+
+	value = f.nums[1];
+	i = historyFindAfter(&sentFrames, value);
+	if(value < framesSent && (i == sentFrames.count || historyEntry(&sentFrames, i)->seq != value + 1))
+		fprintf(stderr, "some messages sent before the connection dropped were lost\n");
+	for(; i < sentFrames.count; i++) {
+		e = historyEntry(&sentFrames, i);
+		transportSend(clientSocket, historyData(&sentFrames, e), e->len, MSG_NOSIGNAL);
+	}
+	fprintf(stderr, "session resumed\n");
+	return 0;
+}
+
+uint64_t nowMs() {
+
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
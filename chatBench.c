@@ -0,0 +1,271 @@
+/* Transport benchmark for the chat server.
+ * Logs two users in over loopback TCP, over the server's Unix socket and
+ * over shared memory rings set up through it (server started with -s,
+ * and -r 0 -R 0 so the rate limits stay out of the way) and times %M
+ * messages between them on each:
+ *
+ *   latency    - one message in flight, send to receive
+ *   throughput - up to BENCH_WINDOW messages in flight
+ *
+ * With -t, also over TLS to a second server with -C/-K on that port, to
+ * see what encryption adds to the tcp row (kernel offload or not, as the
+ * handshake turned out - see tlsSocket.h).
+ *
+ * Latency is given as mean, p50, p99, p99.9 and max, and with -h as a
+ * histogram of powers of two microseconds, where a tail shows up that
+ * the percentiles alone hide. -c keeps the bench on one CPU, to compare
+ * against a server pinned and busy polling with its own -c and -b.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "networks.h"
+#include "packets.h"
+#include "pollLib.h"
+#include "tlsSocket.h"
+#include "affinity.h"
+
+#define BENCH_DEFAULT_COUNT 10000
+#define BENCH_DEFAULT_BYTES 100 // message text, without the null
+#define BENCH_WINDOW 64
+#define BENCH_HIST_BUCKETS 24 // bucket k counts latencies from 2^k up to 2^(k+1) us, the last everything above
+
+typedef struct {
+   double mean; // us
+   double p50;
+   double p99;
+   double p999;
+   double max;
+   uint64_t hist[BENCH_HIST_BUCKETS];
+   double rate; // messages/sec
+   int kernel; // tlsKernel() of the sending socket, -1 if not TLS
+} BenchResult;
+
+void benchTransport(char *name, char *serverName, char *port, int count, int bytes, BenchResult *r);
+void benchLogin(int socket, char *handle);
+uint16_t benchMessage(uint8_t *buf, char *from, char *to, int bytes);
+void benchReceive(int socket);
+uint64_t nowNs();
+int compareNs(const void *a, const void *b);
+void printResult(char *name, BenchResult *r);
+void printHistogram(char *name, BenchResult *r);
+void usage(char *prog);
+
+int main(int argc, char *argv[]) {
+
+   int count = BENCH_DEFAULT_COUNT, bytes = BENCH_DEFAULT_BYTES, opt;
+   int histogram = 0, cpu = -1;
+   char unixName[MAX_HANDLE + 8], shmName[MAX_HANDLE + 8], tlsName[] = TLS_PREFIX "localhost";
+   char *tlsPort = NULL;
+   BenchResult tcp, local, shm, tls;
+
+   while((opt = getopt(argc, argv, "n:b:t:T:hc:")) != -1) {
+      switch(opt) {
+         case 'n':
+            count = atoi(optarg);
+            break;
+         case 'b':
+            bytes = atoi(optarg);
+            break;
+         case 't':
+            tlsPort = optarg;
+            break;
+         case 'T':
+            if(tlsClientInit(optarg) < 0)
+               exit(EXIT_FAILURE);
+            break;
+         case 'h':
+            histogram = 1;
+            break;
+         case 'c':
+            if(affinityParse(optarg, &cpu, 1) != 1)
+               usage(argv[0]);
+            break;
+         default:
+            usage(argv[0]);
+      }
+   }
+   if(argc - optind != 2 || count < 1 || bytes < 1 || bytes >= MAX_MESSAGE)
+      usage(argv[0]);
+   snprintf(unixName, sizeof(unixName), "%s%s", UNIX_PREFIX, argv[optind + 1]);
+   snprintf(shmName, sizeof(shmName), "%s%s", SHM_PREFIX, argv[optind + 1]);
+   if(cpu >= 0 && affinityPin(cpu) < 0) {
+      fprintf(stderr, "can't run on cpu %d\n", cpu);
+      exit(EXIT_FAILURE);
+   }
+
+   benchTransport("tcp", "localhost", argv[optind], count, bytes, &tcp);
+   benchTransport("unix", unixName, NULL, count, bytes, &local);
+   benchTransport("shm", shmName, NULL, count, bytes, &shm);
+   if(tlsPort != NULL)
+      benchTransport("tls", tlsName, tlsPort, count, bytes, &tls);
+
+   printf("%d messages of %d bytes\n", count, bytes);
+   printf("%-6s %10s %10s %10s %10s %10s %12s\n", "", "mean us", "p50 us", "p99 us", "p99.9 us",
+      "max us", "msgs/sec");
+   printResult("tcp", &tcp);
+   printResult("unix", &local);
+   printResult("shm", &shm);
+   if(tlsPort != NULL)
+      printResult("tls", &tls);
+   if(histogram) {
+      printHistogram("tcp", &tcp);
+      printHistogram("unix", &local);
+      printHistogram("shm", &shm);
+      if(tlsPort != NULL)
+         printHistogram("tls", &tls);
+   }
+   return 0;
+}
+
+/* Runs both tests over one transport */
+void benchTransport(char *name, char *serverName, char *port, int count, int bytes, BenchResult *r) {
+
+   uint8_t buf[MAXBUF];
+   char from[MAX_HANDLE + 1], to[MAX_HANDLE + 1];
+   uint64_t *ns = sCalloc(count, sizeof(uint64_t));
+
+   memset(r, 0, sizeof(BenchResult));
+   uint64_t start, total = 0, us;
+   int sender, receiver, i, k, sent, received;
+   uint16_t len;
+
+   snprintf(from, sizeof(from), "bench%d%sA", (int)getpid(), name);
+   snprintf(to, sizeof(to), "bench%d%sB", (int)getpid(), name);
+   sender = clientSetup(serverName, port, 0);
+   receiver = clientSetup(serverName, port, 0);
+   r->kernel = tlsKernel(sender);
+   benchLogin(sender, from);
+   benchLogin(receiver, to);
+   len = benchMessage(buf, from, to, bytes);
+
+   for(i = 0; i < count; i++) {
+      start = nowNs();
+      sendPacket(sender, buf, len);
+      benchReceive(receiver);
+      ns[i] = nowNs() - start;
+      total += ns[i];
+      for(us = ns[i] / 1000, k = 0; us > 1 && k < BENCH_HIST_BUCKETS - 1; us >>= 1)
+         k++;
+      r->hist[k]++;
+   }
+   qsort(ns, count, sizeof(uint64_t), compareNs);
+   r->mean = total / 1000.0 / count;
+   r->p50 = ns[count / 2] / 1000.0;
+   r->p99 = ns[(int)(count * 0.99)] / 1000.0;
+   r->p999 = ns[(int)(count * 0.999)] / 1000.0;
+   r->max = ns[count - 1] / 1000.0;
+
+   start = nowNs();
+   for(sent = received = 0; received < count; received++) {
+      while(sent < count && sent - received < BENCH_WINDOW) {
+         sendPacket(sender, buf, len);
+         sent++;
+      }
+      benchReceive(receiver);
+   }
+   r->rate = count / ((nowNs() - start) / 1e9);
+
+   transportClose(sender);
+   transportClose(receiver);
+   close(sender);
+   close(receiver);
+   free(ns);
+}
+
+/* Sends flag 1 and waits for the server to accept the handle */
+void benchLogin(int socket, char *handle) {
+
+   uint8_t buf[MAXBUF];
+   Frame f;
+
+   frameInit(&f, LOGIN_FLAG);
+   frameHandle(&f, handle, strlen(handle));
+   sendPacket(socket, buf, frameEncode(buf, TO_SERVER, &f));
+   if(sRecv(buf, socket) < 0 || buf[0] != GOOD_HANDLE_FLAG) {
+      fprintf(stderr, "server refused %s\n", handle);
+      exit(EXIT_FAILURE);
+   }
+}
+
+/* Builds a %M from one user to another, returns its length */
+uint16_t benchMessage(uint8_t *buf, char *from, char *to, int bytes) {
+
+   char text[MAX_MESSAGE];
+   Frame f;
+
+   memset(text, 'x', bytes);
+   frameInit(&f, MESSAGE_FLAG);
+   frameHandle(&f, from, strlen(from));
+   frameHandle(&f, to, strlen(to));
+   frameText(&f, text, bytes);
+   return frameEncode(buf, TO_SERVER, &f);
+}
+
+/* Blocks until the next %M arrives, skipping anything else */
+void benchReceive(int socket) {
+
+   uint8_t buf[MAXBUF];
+   int pkt_len;
+
+   while((pkt_len = sRecv(buf, socket)) > 0 && buf[0] != MESSAGE_FLAG)
+      ;
+   if(pkt_len <= 0) {
+      fprintf(stderr, "server closed the connection\n");
+      exit(EXIT_FAILURE);
+   }
+}
+
+void printResult(char *name, BenchResult *r) {
+
+   printf("%-6s %10.1f %10.1f %10.1f %10.1f %10.1f %12.0f", name, r->mean, r->p50, r->p99, r->p999,
+      r->max, r->rate);
+   if(r->kernel >= 0)
+      printf("   kernel TLS: tx %s, rx %s", r->kernel & TLS_KERNEL_TX ? "yes" : "no",
+         r->kernel & TLS_KERNEL_RX ? "yes" : "no");
+   printf("\n");
+}
+
+/* One line per non-empty bucket, with a bar scaled to the biggest */
+void printHistogram(char *name, BenchResult *r) {
+
+   uint64_t most = 0;
+   int k, width;
+
+   for(k = 0; k < BENCH_HIST_BUCKETS; k++)
+      if(r->hist[k] > most)
+         most = r->hist[k];
+   printf("\n%s latency\n", name);
+   for(k = 0; k < BENCH_HIST_BUCKETS; k++) {
+      if(r->hist[k] == 0)
+         continue;
+      width = (int)(r->hist[k] * 50 / most);
+      if(k == BENCH_HIST_BUCKETS - 1)
+         printf("%8llu+        us %8llu ", 1ull << k, (unsigned long long)r->hist[k]);
+      else
+         printf("%8llu-%-8llu us %8llu ", k == 0 ? 0ull : 1ull << k, 1ull << (k + 1),
+            (unsigned long long)r->hist[k]);
+      printf("%.*s\n", width > 0 ? width : 1, "##################################################");
+   }
+}
+
+uint64_t nowNs() {
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+int compareNs(const void *a, const void *b) {
+   uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+   return x < y ? -1 : x > y;
+}
+
+void usage(char *prog) {
+   fprintf(stderr, "Usage %s [-n messages] [-b message-bytes] [-t tls-port [-T ca-file]] [-h] [-c cpu] tcp-port unix-socket-path\n", prog);
+   exit(EXIT_FAILURE);
+}
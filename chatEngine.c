@@ -0,0 +1,351 @@
+/* Multi-session client engine.
+ * Sessions are found by socket number, like the server's connections.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+#include "chatEngine.h"
+#include "pollLib.h"
+#include "packets.h"
+#include "compress.h"
+
+#define INIT_SESSIONS 64
+
+static ChatSession **sessions = NULL; // indexed by socket
+static int sessionTableSize = 0;
+static int numSessions = 0;
+static ChatSession *dirtySessions = NULL;
+static uint8_t *readBuf = NULL; // shared by every session
+static struct {
+   int fd;
+   WatchHandler ready;
+   void *arg;
+} watches[ENGINE_MAX_WATCHES];
+static int numWatches = 0;
+static int offerCodec = 1;
+
+static void sessionRead(ChatSession *s);
+static void sessionFrame(ChatSession *s, uint8_t *frame, uint16_t len);
+static void sessionFlush(ChatSession *s);
+static void sessionClose(ChatSession *s);
+static void flushDirty();
+
+/* One descriptor per session - lift the soft limit as far as allowed */
+void engineSetup() {
+
+   struct rlimit limit;
+
+   setupPollSet();
+   readBuf = sCalloc(ENGINE_READ_BYTES, 1);
+   if(getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+      limit.rlim_cur = limit.rlim_max;
+      setrlimit(RLIMIT_NOFILE, &limit);
+   }
+}
+
+/* Whether sessions opened from here on ask for compression */
+void engineCompress(int enable) {
+   offerCodec = enable;
+}
+
+/* Connects a session and queues its login. The outcome arrives at the
+ * handler as flag 2 or 3 (then the close) during a later enginePoll()
+ */
+ChatSession *engineOpen(char *serverName, char *port, char *handle, ChatHandler handler, void *arg) {
+
+   uint8_t buf[MAXBUF];
+   ChatSession *s = NULL;
+   Frame f;
+   int socketNum, i;
+
+   if(strlen(handle) > MAX_HANDLE)
+      return NULL;
+   socketNum = clientSetup(serverName, port, 0); // looked up once, see resolver.h
+   if(socketNum >= sessionTableSize) {
+      int newSize = socketNum + INIT_SESSIONS;
+      sessions = srealloc(sessions, sizeof(ChatSession *) * newSize);
+      for(i = sessionTableSize; i < newSize; i++)
+         sessions[i] = NULL;
+      sessionTableSize = newSize;
+   }
+
+   s = sCalloc(1, sizeof(ChatSession));
+   s->socket = socketNum;
+   s->state = SESSION_LOGIN;
+   strcpy(s->handle, handle);
+   s->handler = handler;
+   s->arg = arg;
+   outQueueInit(&s->out);
+   sessions[socketNum] = s;
+   numSessions++;
+   addToPollSet(socketNum);
+
+   frameInit(&f, LOGIN_FLAG);
+   frameHandle(&f, handle, strlen(handle));
+   if(offerCodec) {
+      frameNum(&f, COMPRESS_DEFLATE);
+      frameNum(&f, compressDictId());
+   }
+   engineSend(s, buf, frameEncode(buf, TO_SERVER, &f));
+   return s;
+}
+
+/* Queues a whole frame, written at the end of the current (or next) pass */
+void engineSend(ChatSession *s, uint8_t *frame, uint16_t len) {
+
+   uint8_t packed[MAXBUF];
+   uint16_t packedLen = 0;
+
+   if(s->codec == COMPRESS_DEFLATE && sessionCounted(frame[PKT_LEN])
+         && (packedLen = compressPacket(frame, len, packed)) > 0) {
+      frame = packed;
+      len = packedLen;
+   }
+   outQueuePush(&s->out, frame, len, 0, 0);
+   if(!s->dirty) {
+      s->dirty = 1;
+      s->next_dirty = dirtySessions;
+      dirtySessions = s;
+   }
+}
+
+/* %B from the session's handle. -1 if the text doesn't fit one frame */
+int engineBroadcast(ChatSession *s, char *text) {
+
+   uint8_t buf[MAXBUF];
+   uint16_t pkt_len;
+   Frame f;
+
+   frameInit(&f, BROADCAST_FLAG);
+   frameHandle(&f, s->handle, strlen(s->handle));
+   frameText(&f, text, strlen(text));
+   if((pkt_len = frameEncode(buf, TO_SERVER, &f)) == 0)
+      return -1;
+   engineSend(s, buf, pkt_len);
+   return 0;
+}
+
+/* %M from the session's handle to up to MAX_DEST_HANDLES others */
+int engineMessage(ChatSession *s, char **dests, int numDests, char *text) {
+
+   uint8_t buf[MAXBUF];
+   uint16_t pkt_len;
+   Frame f;
+   int i;
+
+   if(numDests < 1 || numDests > MAX_DEST_HANDLES)
+      return -1;
+   frameInit(&f, MESSAGE_FLAG);
+   frameHandle(&f, s->handle, strlen(s->handle));
+   for(i = 0; i < numDests; i++) {
+      if(strlen(dests[i]) > MAX_HANDLE)
+         return -1;
+      frameHandle(&f, dests[i], strlen(dests[i]));
+   }
+   frameText(&f, text, strlen(text));
+   if((pkt_len = frameEncode(buf, TO_SERVER, &f)) == 0)
+      return -1;
+   engineSend(s, buf, pkt_len);
+   return 0;
+}
+
+/* %E - the session closes when the server acks it */
+void engineExit(ChatSession *s) {
+
+   uint8_t buf[MAXBUF];
+
+   if(s->state == SESSION_EXITING)
+      return;
+   s->state = SESSION_EXITING;
+   makeChatHeader(buf, EXIT_FLAG, sizeof(ChatHeader));
+   engineSend(s, buf, sizeof(ChatHeader));
+}
+
+/* Calls ready whenever fd is readable, from inside enginePoll(). A NULL
+ * ready stops watching fd
+ */
+void engineWatch(int fd, WatchHandler ready, void *arg) {
+
+   int i;
+   for(i = 0; i < numWatches && watches[i].fd != fd; i++)
+      ;
+   if(ready == NULL) {
+      if(i < numWatches) {
+         watches[i] = watches[--numWatches];
+         removeFromPollSet(fd);
+      }
+      return;
+   }
+   if(i == numWatches) {
+      if(numWatches == ENGINE_MAX_WATCHES) {
+         fprintf(stderr, "engineWatch: too many descriptors\n");
+         exit(EXIT_FAILURE);
+      }
+      numWatches++;
+      addToPollSet(fd);
+   }
+   watches[i].fd = fd;
+   watches[i].ready = ready;
+   watches[i].arg = arg;
+}
+
+/* Writes what's been queued, waits up to timeInMilliSeconds for input
+ * and hands every complete frame to its session. Returns the number of
+ * sessions still open
+ */
+int enginePoll(int timeInMilliSeconds) {
+
+   ChatSession *s = NULL;
+   short revents = 0;
+   int socketNum, i;
+
+   flushDirty();
+   socketNum = pollCall(dirtySessions != NULL ? 0 : timeInMilliSeconds);
+   while(socketNum != -1) {
+      if(socketNum < sessionTableSize && (s = sessions[socketNum]) != NULL) {
+         revents = pollRevents(socketNum);
+         if(revents & POLLOUT)
+            sessionFlush(s);
+         if(revents & ~POLLOUT)
+            sessionRead(s);
+         if(s->closing)
+            sessionClose(s);
+      }
+      else {
+         for(i = 0; i < numWatches && watches[i].fd != socketNum; i++)
+            ;
+         if(i < numWatches)
+            watches[i].ready(socketNum, watches[i].arg);
+      }
+      socketNum = pollNextReady();
+   }
+   flushDirty();
+   return numSessions;
+}
+
+int engineSessions() {
+   return numSessions;
+}
+
+/* One read for the session into the shared buffer, after whatever was
+ * cut off last time, then every whole frame in it
+ */
+static void sessionRead(ChatSession *s) {
+
+   uint8_t *p = readBuf;
+   uint8_t *end = NULL;
+   uint16_t pkt_len = 0;
+   ssize_t n = 0;
+
+   memcpy(readBuf, s->partial, s->partial_len);
+   n = transportRecv(s->socket, readBuf + s->partial_len, ENGINE_READ_BYTES - s->partial_len, MSG_DONTWAIT);
+   if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+      return;
+   if(n <= 0) {
+      s->closing = 1;
+      return;
+   }
+
+   end = readBuf + s->partial_len + n;
+   while(end - p >= PKT_LEN && !s->closing) {
+      memcpy(&pkt_len, p, PKT_LEN);
+      pkt_len = ntohs(pkt_len);
+      if(pkt_len < sizeof(ChatHeader) || pkt_len > MAXBUF) {
+         s->closing = 1; // lost framing
+         return;
+      }
+      if(end - p < pkt_len)
+         break;
+      sessionFrame(s, p + PKT_LEN, pkt_len);
+      p += pkt_len;
+   }
+   s->partial_len = end - p;
+   memcpy(s->partial, p, s->partial_len);
+}
+
+static void sessionFrame(ChatSession *s, uint8_t *frame, uint16_t len) {
+
+   uint8_t buf[MAXBUF];
+   uint8_t inflated[MAXBUF];
+   int inflatedLen = 0;
+   Frame f;
+
+   if(frame[0] == COMPRESSED_FLAG && s->codec == COMPRESS_DEFLATE) {
+      if((inflatedLen = decompressFrame(frame, len, inflated)) < 0) {
+         fprintf(stderr, "%s: server sent bad compressed packet\n", s->handle);
+         return;
+      }
+      frame = inflated;
+      len = inflatedLen;
+   }
+   if(frameDecode(frame, len, TO_CLIENT, &f) < 0) {
+      fprintf(stderr, "%s: server sent malformed packet (flag %u)\n", s->handle, frame[0]);
+      return;
+   }
+   switch(f.flag) {
+      case HEARTBEAT_FLAG:
+         makeChatHeader(buf, HEARTBEAT_ACK_FLAG, sizeof(ChatHeader));
+         engineSend(s, buf, sizeof(ChatHeader));
+         return;
+      case GOOD_HANDLE_FLAG:
+         s->state = SESSION_ACTIVE;
+         if(f.num_count == 2 && f.nums[0] == COMPRESS_DEFLATE && f.nums[1] == compressDictId())
+            s->codec = COMPRESS_DEFLATE;
+         break;
+      case HANDLE_EXISTS_FLAG:
+      case SERVER_FULL_FLAG:
+      case EXIT_ACK_FLAG:
+         s->closing = 1;
+         break;
+   }
+   s->handler(s, &f, s->arg);
+}
+
+static void sessionFlush(ChatSession *s) {
+
+   if(outQueueFlush(&s->out, s->socket) < 0) {
+      s->closing = 1;
+      return;
+   }
+   setPollOut(s->socket, !outQueueEmpty(&s->out));
+}
+
+static void flushDirty() {
+
+   ChatSession *s = NULL;
+   while((s = dirtySessions) != NULL) {
+      dirtySessions = s->next_dirty;
+      s->dirty = 0;
+      if(!s->closing)
+         sessionFlush(s);
+      if(s->closing)
+         sessionClose(s);
+   }
+}
+
+static void sessionClose(ChatSession *s) {
+
+   ChatSession **link = NULL;
+
+   // may still be waiting to be flushed
+   for(link = &dirtySessions; *link != NULL; link = &(*link)->next_dirty) {
+      if(*link == s) {
+         *link = s->next_dirty;
+         break;
+      }
+   }
+   sessions[s->socket] = NULL;
+   numSessions--;
+   removeFromPollSet(s->socket);
+   transportClose(s->socket);
+   close(s->socket);
+   outQueueFree(&s->out);
+   s->handler(s, NULL, s->arg);
+   free(s);
+}
@@ -0,0 +1,63 @@
+/* Multi-session client engine.
+ * Hosts any number of logged in handles in one process, on one poll()
+ * loop. A session's login is sent as soon as it is opened, without
+ * waiting for earlier sessions to be accepted. Every session's input is
+ * read into one shared buffer and split into frames in place; only a
+ * frame cut off by the end of a read is copied aside. Frames sent during
+ * a pass are gathered per session and written once at the end of it.
+ *
+ * Each session hands its frames, decoded, to the handler it was opened
+ * with, and a final NULL frame when it closes. Frames that don't decode
+ * are dropped, and heartbeats are answered, by the engine. Sessions ask
+ * for compression (compress.h) at login unless engineCompress(0) was
+ * called; frames are deflated and inflated by the engine when agreed.
+ */
+
+#ifndef CHATENGINE_H
+#define CHATENGINE_H
+
+#include <stdint.h>
+
+#include "networks.h"
+#include "outQueue.h"
+#include "protocol.h"
+
+#define ENGINE_READ_BYTES 262144 // shared by every session's reads
+#define ENGINE_MAX_WATCHES 8 // other descriptors served by the same loop
+
+/* Session states */
+#define SESSION_LOGIN 0 // flag 1 sent
+#define SESSION_ACTIVE 1 // flag 2 received
+#define SESSION_EXITING 2 // flag 8 sent
+
+typedef struct chatSession ChatSession;
+typedef void (*ChatHandler)(ChatSession *session, Frame *frame, void *arg);
+typedef void (*WatchHandler)(int fd, void *arg);
+
+struct chatSession {
+   int socket;
+   uint8_t state;
+   uint8_t closing; // close once the current frames are handled
+   uint8_t codec; // agreed in flag 2
+   char handle[MAX_HANDLE + 1];
+   ChatHandler handler;
+   void *arg;
+   ChatSession *next_dirty; // frames waiting for the end of the pass
+   uint8_t dirty;
+   uint16_t partial_len;
+   uint8_t partial[MAXBUF]; // frame cut off by the end of the last read
+   OutQueue out;
+};
+
+void engineSetup();
+void engineCompress(int enable);
+ChatSession *engineOpen(char *serverName, char *port, char *handle, ChatHandler handler, void *arg);
+void engineSend(ChatSession *s, uint8_t *frame, uint16_t len);
+int engineBroadcast(ChatSession *s, char *text);
+int engineMessage(ChatSession *s, char **dests, int numDests, char *text);
+void engineExit(ChatSession *s);
+void engineWatch(int fd, WatchHandler ready, void *arg);
+int enginePoll(int timeInMilliSeconds);
+int engineSessions();
+
+#endif
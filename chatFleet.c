@@ -0,0 +1,267 @@
+/* Hosts a fleet of chat users in one process (see chatEngine.h).
+ * Opens sessions <prefix>0 .. <prefix>N-1, then reads commands from
+ * stdin, one per line, each prefixed by the session to run it as, or *
+ * for every session:
+ *
+ *   <handle|*> %B [text]
+ *   <handle|*> %M num-handles destination-handle [destination-handle] [text]
+ *   <handle|*> %E
+ *
+ * Anything a session receives is printed as "<session> <- <from>: <text>".
+ * The end of input exits every session.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <ctype.h>
+#include <unistd.h>
+
+#include "chatEngine.h"
+#include "packets.h"
+#include "pollLib.h"
+#include "compress.h"
+#include "tlsSocket.h"
+
+#define FLEET_DEFAULT_SESSIONS 100
+#define FLEET_DEFAULT_PREFIX "bot"
+#define FLEET_IN_BYTES 65536 // stdin read at a time
+
+static ChatSession **fleet = NULL; // by session number, NULL once closed
+static int fleetSize = 0;
+static int loggedIn = 0;
+static char *prefix = FLEET_DEFAULT_PREFIX;
+
+void fleetHandler(ChatSession *s, Frame *frame, void *arg);
+void printMessage(ChatSession *s, Frame *frame);
+void readInput(int fd, void *arg);
+void runLine(char *line);
+void runCommand(ChatSession *s, char *cmd);
+ChatSession *findSession(char *handle);
+void usage(char *prog);
+
+int main(int argc, char *argv[]) {
+
+   char handle[MAX_HANDLE + 1];
+   int opt, i;
+
+   fleetSize = FLEET_DEFAULT_SESSIONS;
+   while((opt = getopt(argc, argv, "n:p:z:T:")) != -1) {
+      switch(opt) {
+         case 'n':
+            fleetSize = atoi(optarg);
+            break;
+         case 'p':
+            prefix = optarg;
+            break;
+         case 'z':
+            if(strcmp(optarg, "off") == 0)
+               engineCompress(0);
+            else if(compressLoadDict(optarg) < 0) {
+               perror(optarg);
+               usage(argv[0]);
+            }
+            break;
+         case 'T':
+            if(tlsClientInit(optarg) < 0)
+               exit(EXIT_FAILURE);
+            break;
+         default:
+            usage(argv[0]);
+      }
+   }
+   if(fleetSize < 1 || argc - optind < 1 || argc - optind > 2
+         || strlen(prefix) + 10 > MAX_HANDLE || !isalpha((unsigned char)prefix[0]))
+      usage(argv[0]);
+
+   engineSetup();
+   setvbuf(stdout, NULL, _IOFBF, FLEET_IN_BYTES);
+   fleet = sCalloc(fleetSize, sizeof(ChatSession *));
+   for(i = 0; i < fleetSize; i++) {
+      snprintf(handle, sizeof(handle), "%s%d", prefix, i);
+      fleet[i] = engineOpen(argv[optind], argc - optind > 1 ? argv[optind + 1] : NULL,
+         handle, fleetHandler, (void *)(intptr_t)i);
+   }
+   engineWatch(STDIN_FILENO, readInput, NULL);
+
+   while(engineSessions() > 0) {
+      fflush(stdout);
+      enginePoll(POLL_WAIT_FOREVER);
+   }
+   fflush(stdout);
+   return 0;
+}
+
+void fleetHandler(ChatSession *s, Frame *frame, void *arg) {
+
+   if(frame == NULL) { // closed
+      fleet[(intptr_t)arg] = NULL;
+      return;
+   }
+   switch(frame->flag) {
+      case GOOD_HANDLE_FLAG:
+         if(++loggedIn == fleetSize)
+            printf("all %d sessions logged in\n", fleetSize);
+         break;
+      case HANDLE_EXISTS_FLAG:
+         printf("%s: handle already exists\n", s->handle);
+         break;
+      case SERVER_FULL_FLAG:
+         printf("%s: server is full\n", s->handle);
+         break;
+      case BROADCAST_FLAG:
+      case MESSAGE_FLAG:
+         printMessage(s, frame);
+         break;
+      case NO_HANDLE_FLAG:
+         printf("%s: no such handle %.*s\n", s->handle, frame->handle_lens[0], frame->handles[0]);
+         break;
+      case BLOCKED_FLAG:
+         printf("%s: message blocked by the content filter\n", s->handle);
+         break;
+   }
+}
+
+void printMessage(ChatSession *s, Frame *frame) {
+   printf("%s <- %.*s: %s\n", s->handle, frame->handle_lens[0], frame->handles[0], frame->text);
+}
+
+/* Runs every whole line read, keeping a partial last line for next time */
+void readInput(int fd, void *arg) {
+
+   static char in[FLEET_IN_BYTES + 1];
+   static int inLen = 0;
+   char *start = in, *end = NULL;
+   ssize_t n = read(fd, in + inLen, FLEET_IN_BYTES - inLen);
+   int i;
+
+   if(n < 0 && errno == EINTR)
+      return;
+   if(n <= 0) {
+      if(inLen > 0) {
+         in[inLen] = '\0';
+         runLine(in);
+      }
+      engineWatch(fd, NULL, NULL);
+      for(i = 0; i < fleetSize; i++)
+         if(fleet[i] != NULL)
+            engineExit(fleet[i]);
+      return;
+   }
+
+   inLen += n;
+   while((end = memchr(start, '\n', in + inLen - start)) != NULL) {
+      *end = '\0';
+      runLine(start);
+      start = end + 1;
+   }
+   inLen -= start - in;
+   memmove(in, start, inLen);
+   if(inLen == FLEET_IN_BYTES) { // no newline in sight, drop it
+      fprintf(stderr, "input line too long\n");
+      inLen = 0;
+   }
+}
+
+void runLine(char *line) {
+
+   char *cmd = strchr(line, ' ');
+   ChatSession *s = NULL;
+   int i;
+
+   if(cmd == NULL) {
+      fprintf(stderr, "expected <handle> <command>: %s\n", line);
+      return;
+   }
+   *cmd++ = '\0';
+   if(strcmp(line, "*") == 0) {
+      for(i = 0; i < fleetSize; i++)
+         if(fleet[i] != NULL && fleet[i]->state == SESSION_ACTIVE)
+            runCommand(fleet[i], cmd);
+   }
+   else if((s = findSession(line)) != NULL)
+      runCommand(s, cmd);
+   else
+      fprintf(stderr, "no session %s\n", line);
+}
+
+/* cmd is left as it was, so it can be run for every session */
+void runCommand(ChatSession *s, char *cmd) {
+
+   char *dests[MAX_DEST_HANDLES];
+   char *p = cmd + 2;
+   int numDests = 0, i;
+
+   if(cmd[0] != '%' || cmd[1] == '\0') {
+      fprintf(stderr, "Invalid command\n");
+      return;
+   }
+   if(*p == ' ')
+      p++;
+
+   switch(toupper((unsigned char)cmd[1])) {
+      case 'B':
+         if(engineBroadcast(s, *p ? p : "\n") < 0)
+            fprintf(stderr, "message too long\n");
+         break;
+
+      case 'M':
+         numDests = strtol(p, &p, 10);
+         if(numDests < 1 || numDests > MAX_DEST_HANDLES) {
+            fprintf(stderr, "num handles must be [1-9]\n");
+            return;
+         }
+         {
+            char copy[MAXBUF];
+            char *q = copy;
+            strncpy(copy, p, sizeof(copy) - 1);
+            copy[sizeof(copy) - 1] = '\0';
+            for(i = 0; i < numDests; i++) {
+               while(*q == ' ')
+                  q++;
+               if(*q == '\0') {
+                  fprintf(stderr, "null token\n");
+                  return;
+               }
+               dests[i] = q;
+               while(*q != ' ' && *q != '\0')
+                  q++;
+               if(*q == ' ')
+                  *q++ = '\0';
+            }
+            if(engineMessage(s, dests, numDests, *q ? q : "\n") < 0)
+               fprintf(stderr, "bad %%M\n");
+         }
+         break;
+
+      case 'E':
+         engineExit(s);
+         break;
+
+      default:
+         fprintf(stderr, "Invalid command\n");
+   }
+}
+
+/* <prefix><number> -> its session */
+ChatSession *findSession(char *handle) {
+
+   size_t len = strlen(prefix);
+   char *end = NULL;
+   long i;
+
+   if(strncmp(handle, prefix, len) != 0 || !isdigit((unsigned char)handle[len]))
+      return NULL;
+   i = strtol(handle + len, &end, 10);
+   if(*end != '\0' || i >= fleetSize)
+      return NULL;
+   return fleet[i];
+}
+
+void usage(char *prog) {
+   fprintf(stderr, "Usage %s [-n sessions] [-p handle-prefix] [-z dict-file|off] [-T ca-file] [tls:]host-name port-number\n", prog);
+   fprintf(stderr, "      %s [-n sessions] [-p handle-prefix] [-z dict-file|off] unix:socket-path|shm:socket-path\n", prog);
+   exit(EXIT_FAILURE);
+}
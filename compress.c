@@ -0,0 +1,177 @@
+/* Frame compression: raw deflate with a preset dictionary, see compress.h.
+ * One stream each way is kept and reset per frame, so compressing costs no
+ * allocation. Deflate gets most out of the end of its dictionary, so the
+ * strings most often seen go last.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+#include "compress.h"
+#include "networks.h"
+#include "packets.h"
+
+/* Common words and phrases of short chat messages, for when no trained
+ * dictionary is loaded (dictTrain builds a better one from real traffic)
+ */
+static const char defaultDict[] =
+	"http://https://www..com/.org/.net/ .jpg .png .gif .pdf .txt "
+	"Monday Tuesday Wednesday Thursday Friday Saturday Sunday tomorrow yesterday tonight "
+	"morning afternoon evening weekend minutes hours o'clock "
+	"sorry about that, no problem, thank you so much, you're welcome, "
+	"congratulations, happy birthday, good luck, take care, see you later, "
+	"talk to you later, be right back, on my way, running late, "
+	"what do you think? I don't know, I'm not sure, let me check, "
+	"does anyone know how to fix this? it doesn't work, it works now, "
+	"the server is down again, can you restart it? the build is broken, "
+	"please review my pull request, I pushed a fix, merged, deployed, "
+	"meeting in five minutes, are you joining the call? I can't make it, "
+	"lunch anyone? coffee? I'll be there in ten minutes, "
+	"could you send me the link? here is the link: "
+	"did you see the message I sent you? I just sent it, "
+	"what time is it? what are you doing? where are you? "
+	"I think that's a good idea, that makes sense, sounds good to me, "
+	"let me know if you have any questions, "
+	"lol haha :) :( :D ;) <3 ok okay yes yeah yep no nope maybe thanks thx np "
+	"hello hi hey everyone, good morning everyone, good night, bye, "
+	"how are you? I'm fine, thanks, and you? "
+	"I have a question about the ";
+
+static const uint8_t *dict = (const uint8_t *) defaultDict;
+static size_t dictLen = sizeof(defaultDict) - 1;
+static uint8_t *loaded = NULL;
+static uint32_t dictId = 0;
+
+static z_stream deflater, inflater;
+static int deflaterReady = 0, inflaterReady = 0;
+
+/* Uses the dictionary in path from now on (its last COMPRESS_DICT_MAX
+ * bytes, if longer). 0, or -1 if it can't be read
+ */
+int compressLoadDict(const char *path)
+{
+	FILE *file = fopen(path, "rb");
+	uint8_t *data = NULL;
+	long size = 0;
+
+	if (file == NULL)
+		return -1;
+	if (fseek(file, 0, SEEK_END) < 0 || (size = ftell(file)) <= 0)
+	{
+		fclose(file);
+		return -1;
+	}
+	if (size > COMPRESS_DICT_MAX)
+		size = COMPRESS_DICT_MAX;
+	if ((data = malloc(size)) == NULL)
+	{
+		perror("compressLoadDict malloc");
+		exit(-1);
+	}
+	if (fseek(file, -size, SEEK_END) < 0 || fread(data, 1, size, file) != (size_t) size)
+	{
+		free(data);
+		fclose(file);
+		return -1;
+	}
+	fclose(file);
+	free(loaded);
+	loaded = data;
+	compressUseDict(data, size);
+	return 0;
+}
+
+/* dict is kept, not copied */
+void compressUseDict(const uint8_t *newDict, size_t len)
+{
+	if (len > COMPRESS_DICT_MAX)
+	{
+		newDict += len - COMPRESS_DICT_MAX;
+		len = COMPRESS_DICT_MAX;
+	}
+	dict = newDict;
+	dictLen = len;
+	dictId = 0;
+}
+
+const uint8_t *compressDict(size_t *len)
+{
+	*len = dictLen;
+	return dict;
+}
+
+/* Identifies the dictionary in flag 1 and 2, never 0 */
+uint32_t compressDictId()
+{
+	if (dictId == 0)
+		dictId = adler32(adler32(0L, Z_NULL, 0), dict, dictLen);
+	return dictId;
+}
+
+/* Deflates packet (header and all, len bytes) from its flag on into out,
+ * as a flag 27 frame. Its length, or 0 if it wouldn't come out smaller
+ */
+uint16_t compressPacket(const uint8_t *packet, uint16_t len, uint8_t *out)
+{
+	uint16_t outLen = 0;
+
+	if (len < COMPRESS_MIN)
+		return 0;
+	if (!deflaterReady)
+	{
+		// a smaller hash than the default, reset per frame, compresses these as well
+		if (deflateInit2(&deflater, COMPRESS_LEVEL, Z_DEFLATED, -15, 7, Z_DEFAULT_STRATEGY) != Z_OK)
+		{
+			fprintf(stderr, "deflateInit2 failed\n");
+			exit(-1);
+		}
+		deflaterReady = 1;
+	}
+	deflateReset(&deflater);
+	if (dictLen > 0)
+		deflateSetDictionary(&deflater, dict, dictLen);
+	deflater.next_in = (uint8_t *) packet + PKT_LEN;
+	deflater.avail_in = len - PKT_LEN;
+	deflater.next_out = out + sizeof(ChatHeader);
+	deflater.avail_out = len - sizeof(ChatHeader) - 1; // at least a byte saved
+	if (deflate(&deflater, Z_FINISH) != Z_STREAM_END)
+		return 0;
+	outLen = sizeof(ChatHeader) + deflater.total_out;
+	makeChatHeader(out, COMPRESSED_FLAG, outLen);
+	return outLen;
+}
+
+/* Inflates a flag 27 frame (buf at its flag, as sRecv() leaves it) into out,
+ * which holds MAXBUF bytes, from the inner flag on. The inner frame's
+ * pkt_len, as sRecv() would have returned it, or -1 if it isn't valid
+ */
+int decompressFrame(const uint8_t *buf, uint16_t pkt_len, uint8_t *out)
+{
+	int ret = 0;
+
+	if (pkt_len <= sizeof(ChatHeader))
+		return -1;
+	if (!inflaterReady)
+	{
+		if (inflateInit2(&inflater, -15) != Z_OK)
+		{
+			fprintf(stderr, "inflateInit2 failed\n");
+			exit(-1);
+		}
+		inflaterReady = 1;
+	}
+	inflateReset(&inflater);
+	if (dictLen > 0 && inflateSetDictionary(&inflater, dict, dictLen) != Z_OK)
+		return -1;
+	inflater.next_in = (uint8_t *) buf + FLAG_LEN;
+	inflater.avail_in = pkt_len - sizeof(ChatHeader);
+	inflater.next_out = out;
+	inflater.avail_out = MAXBUF - PKT_LEN;
+	ret = inflate(&inflater, Z_FINISH);
+	if (ret != Z_STREAM_END || inflater.avail_in != 0 || inflater.total_out < FLAG_LEN
+		|| out[0] == COMPRESSED_FLAG)
+		return -1;
+	return inflater.total_out + PKT_LEN;
+}
@@ -0,0 +1,32 @@
+/* Frame compression.
+ * Frames are deflated one at a time (raw deflate) against a preset
+ * dictionary both ends share, so each compressed frame stands alone: a
+ * broadcast is deflated once and the same bytes go to every client that
+ * negotiated it, and frames can still be dropped, stored or resent one
+ * by one. The dictionary is built in, or trained from sample messages
+ * with dictTrain and loaded by both ends with compressLoadDict(). Its id
+ * is checked at login, so ends with different dictionaries don't compress.
+ */
+
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* Codecs, offered in flag 1 and agreed to in flag 2 */
+#define COMPRESS_NONE 0
+#define COMPRESS_DEFLATE 1
+
+#define COMPRESS_MIN 40 // smaller frames aren't worth deflating
+#define COMPRESS_LEVEL 9 // bandwidth over CPU
+#define COMPRESS_DICT_MAX 32768 // deflate's window, a longer file's tail is used
+
+int compressLoadDict(const char *path);
+void compressUseDict(const uint8_t *dict, size_t len);
+const uint8_t *compressDict(size_t *len);
+uint32_t compressDictId();
+uint16_t compressPacket(const uint8_t *packet, uint16_t len, uint8_t *out);
+int decompressFrame(const uint8_t *buf, uint16_t pkt_len, uint8_t *out);
+
+#endif
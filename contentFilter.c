@@ -0,0 +1,522 @@
+/* Content filter, see contentFilter.h.
+ * Bytes are mapped to classes first: one for each byte (ASCII case
+ * folded) that occurs in some term and one for all the others, so a
+ * transition row is only as wide as the terms' alphabet. The states
+ * nearest the start, as many as FILTER_DENSE_BYTES of rows hold, have a
+ * full row already following failure links, and most bytes of ordinary
+ * text are read there with a single lookup. Deeper states keep just
+ * their own edges, sorted by class, and fall back along their failure
+ * links.
+ *
+ * The automaton is built in one go from the sorted terms and never
+ * changed afterwards, so a reload builds a whole new one off the
+ * caller's thread and swapping it in is a pointer.
+ */
+
+#define _GNU_SOURCE // SCHED_IDLE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <sys/stat.h>
+
+#include "contentFilter.h"
+
+#define FILTER_DENSE_BYTES (4 << 20) // full rows of transitions, for the states nearest the start
+#define NO_ROW UINT32_MAX
+
+/* What a byte's step looks at, together in one cache line */
+typedef struct {
+	uint32_t row; // dense row, NO_ROW for deeper states
+	uint32_t fail; // longest proper suffix that is also a state
+	uint32_t first; // edges are first to (this + 1)->first - 1
+	uint8_t action; // strongest action of a term ending here, itself or through fail
+} State;
+
+typedef struct {
+	uint8_t classes[256]; // byte -> class, 0 = in no term
+	uint32_t num_classes;
+	uint32_t num_terms;
+	uint32_t num_states; // 0 is the start
+	State *states; // and one past the last, for its first
+	const char **term; // the term a state's action is for, for the caller's log
+	uint8_t *edge_class; // sorted within a state
+	uint32_t *edge_state;
+	uint32_t *rows; // num_classes transitions each
+	uint32_t num_rows;
+	char *file; // the term file, the terms point into it
+	size_t bytes;
+} ContentFilter;
+
+/* A term while the automaton is built */
+typedef struct {
+	const char *text;
+	const uint8_t *key; // text mapped to classes
+	uint32_t len;
+	uint8_t action;
+} Term;
+
+typedef struct {
+	ContentFilter *result; // NULL if the file couldn't be compiled
+	int done;
+} CompileJob;
+
+static char filterPath[PATH_MAX];
+static ContentFilter *current = NULL;
+static CompileJob *job = NULL;
+static pthread_t compileThread;
+static uint64_t reloads = 0;
+static uint64_t reloadFailures = 0;
+
+static ContentFilter *compile(const char *path);
+static char *readTerms(const char *path, Term **terms, uint32_t *count, size_t *total);
+static void mapClasses(ContentFilter *f, Term *terms, uint32_t count, uint8_t *keys);
+static int buildTrie(ContentFilter *f, Term *terms, uint32_t count, size_t total);
+static int linkStates(ContentFilter *f, const uint32_t *parent, const uint8_t *cls, const uint32_t *depth,
+	uint32_t maxDepth);
+static uint32_t step(const ContentFilter *f, uint32_t s, uint8_t c);
+static uint32_t child(const ContentFilter *f, uint32_t s, uint8_t c);
+static int compareTerms(const void *a, const void *b);
+static void freeFilter(ContentFilter *f);
+static void *compileTerms(void *arg);
+
+/* Compiles the term file, and remembers it for filterReload(). -1 with
+ * the old terms (if any) kept if it can't be read or holds a bad line
+ */
+int filterLoad(const char *path)
+{
+	ContentFilter *f = NULL;
+
+	if (job != NULL)
+		return -1;
+	snprintf(filterPath, sizeof(filterPath), "%s", path);
+	if ((f = compile(filterPath)) == NULL)
+		return -1;
+	freeFilter(current);
+	current = f;
+	return 0;
+}
+
+/* Starts compiling the term file again in the background, for
+ * filterPoll() to swap in. -1 if one is already being compiled
+ */
+int filterReload()
+{
+	sigset_t all, old;
+	int error = 0;
+
+	if (job != NULL || filterPath[0] == '\0')
+		return -1;
+	job = calloc(1, sizeof(CompileJob));
+	if (job == NULL)
+		return -1;
+	// signals stay with the caller's thread
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+	error = pthread_create(&compileThread, NULL, compileTerms, job);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (error != 0)
+	{
+		fprintf(stderr, "pthread_create content filter: %s\n", strerror(error));
+		free(job);
+		job = NULL;
+		return -1;
+	}
+	return 0;
+}
+
+/* Swaps a finished reload in. FILTER_RELOAD_RUNNING until then, and
+ * FILTER_RELOAD_NONE once there's nothing left to wait for
+ */
+int filterPoll()
+{
+	int result = FILTER_RELOAD_NONE;
+
+	if (job == NULL)
+		return FILTER_RELOAD_NONE;
+	if (!__atomic_load_n(&job->done, __ATOMIC_ACQUIRE))
+		return FILTER_RELOAD_RUNNING;
+	pthread_join(compileThread, NULL);
+	if (job->result != NULL)
+	{
+		freeFilter(current);
+		current = job->result;
+		reloads++;
+		result = FILTER_RELOAD_DONE;
+	}
+	else
+	{
+		reloadFailures++;
+		result = FILTER_RELOAD_FAILED;
+	}
+	free(job);
+	job = NULL;
+	return result;
+}
+
+/* The strongest action of the terms in text, FILTER_PASS if none (or
+ * no terms are loaded). Stops at the first term to block. *term is set
+ * to the term acted on, until the next swap
+ */
+int filterScan(const uint8_t *text, size_t len, const char **term)
+{
+	const ContentFilter *f = current;
+	uint32_t s = 0;
+	size_t i = 0;
+	int best = FILTER_PASS;
+
+	if (f == NULL)
+		return FILTER_PASS;
+	for (i = 0; i < len; i++)
+	{
+		s = step(f, s, f->classes[text[i]]);
+		if (f->states[s].action > best)
+		{
+			best = f->states[s].action;
+			if (term != NULL)
+				*term = f->term[s];
+			if (best == FILTER_BLOCK)
+				break;
+		}
+	}
+	return best;
+}
+
+void filterInfo(FilterInfo *info)
+{
+	memset(info, 0, sizeof(FilterInfo));
+	if (current != NULL)
+	{
+		info->terms = current->num_terms;
+		info->states = current->num_states;
+		info->bytes = current->bytes;
+	}
+	info->reloads = reloads;
+	info->reload_failures = reloadFailures;
+}
+
+static ContentFilter *compile(const char *path)
+{
+	ContentFilter *f = calloc(1, sizeof(ContentFilter));
+	Term *terms = NULL;
+	uint8_t *keys = NULL;
+	uint32_t count = 0;
+	size_t total = 0;
+
+	if (f == NULL || (f->file = readTerms(path, &terms, &count, &total)) == NULL)
+	{
+		free(f);
+		return NULL;
+	}
+	if ((keys = malloc(total + 1)) == NULL)
+	{
+		perror("content filter");
+		free(terms);
+		freeFilter(f);
+		return NULL;
+	}
+	mapClasses(f, terms, count, keys);
+	qsort(terms, count, sizeof(Term), compareTerms);
+	if (buildTrie(f, terms, count, total) < 0)
+	{
+		perror("content filter");
+		freeFilter(f);
+		f = NULL;
+	}
+	free(keys);
+	free(terms);
+	return f;
+}
+
+/* Reads the whole file and splits it into terms in place */
+static char *readTerms(const char *path, Term **terms, uint32_t *count, size_t *total)
+{
+	FILE *fp = fopen(path, "r");
+	struct stat st;
+	char *file = NULL, *line = NULL, *end = NULL, *text = NULL;
+	uint32_t lines = 1, n = 0, number = 0;
+	size_t i = 0;
+
+	if (fp == NULL || fstat(fileno(fp), &st) < 0 || (file = malloc(st.st_size + 1)) == NULL
+		|| fread(file, 1, st.st_size, fp) != (size_t) st.st_size)
+	{
+		perror(path);
+		if (fp != NULL)
+			fclose(fp);
+		free(file);
+		return NULL;
+	}
+	fclose(fp);
+	file[st.st_size] = '\0';
+	for (i = 0; i < (size_t) st.st_size; i++)
+		lines += file[i] == '\n';
+	if ((*terms = malloc(lines * sizeof(Term))) == NULL)
+	{
+		perror(path);
+		free(file);
+		return NULL;
+	}
+
+	*total = 0;
+	for (line = file; line != NULL; line = end)
+	{
+		number++;
+		if ((end = strchr(line, '\n')) != NULL)
+			*end++ = '\0';
+		if (strlen(line) > 0 && line[strlen(line) - 1] == '\r')
+			line[strlen(line) - 1] = '\0';
+		if (line[0] == '\0' || line[0] == '#')
+			continue;
+		if (strncmp(line, "block ", 6) == 0)
+			(*terms)[n].action = FILTER_BLOCK;
+		else if (strncmp(line, "flag ", 5) == 0)
+			(*terms)[n].action = FILTER_FLAG;
+		else
+			(*terms)[n].action = FILTER_PASS;
+		text = strchr(line, ' ');
+		if ((*terms)[n].action == FILTER_PASS || text[1] == '\0')
+		{
+			fprintf(stderr, "%s:%u: expected block or flag and a term\n", path, number);
+			free(*terms);
+			free(file);
+			return NULL;
+		}
+		(*terms)[n].text = text + 1;
+		(*terms)[n].len = strlen(text + 1);
+		*total += (*terms)[n].len;
+		n++;
+	}
+	*count = n;
+	return file;
+}
+
+/* Numbers the bytes the terms use and writes each term's key */
+static void mapClasses(ContentFilter *f, Term *terms, uint32_t count, uint8_t *keys)
+{
+	uint32_t i = 0, j = 0;
+	uint8_t b = 0;
+
+	memset(f->classes, 0, sizeof(f->classes));
+	f->num_classes = 1;
+	for (i = 0; i < count; i++)
+	{
+		for (j = 0; j < terms[i].len; j++)
+		{
+			b = terms[i].text[j];
+			if (b >= 'A' && b <= 'Z')
+				b += 'a' - 'A';
+			if (f->classes[b] == 0)
+				f->classes[b] = f->num_classes++;
+			keys[j] = f->classes[b];
+		}
+		terms[i].key = keys;
+		keys += terms[i].len;
+	}
+	for (b = 'A'; b <= 'Z'; b++)
+		f->classes[b] = f->classes[b + 'a' - 'A'];
+}
+
+/* Sorted terms share their prefixes with the one before, so each one
+ * only adds states past that and never has to look up an edge
+ */
+static int buildTrie(ContentFilter *f, Term *terms, uint32_t count, size_t total)
+{
+	uint32_t maxStates = total + 1, maxDepth = 0, s = 0, i = 0, d = 0, common = 0;
+	uint32_t *parent = calloc(maxStates, sizeof(uint32_t));
+	uint32_t *depth = calloc(maxStates, sizeof(uint32_t));
+	uint8_t *cls = calloc(maxStates, sizeof(uint8_t));
+	uint32_t *path = NULL;
+	int ok = 0;
+
+	for (i = 0; i < count; i++)
+		if (terms[i].len > maxDepth)
+			maxDepth = terms[i].len;
+	path = calloc(maxDepth + 1, sizeof(uint32_t));
+	f->states = calloc(maxStates + 1, sizeof(State));
+	f->term = calloc(maxStates, sizeof(char *));
+	f->edge_class = calloc(maxStates, sizeof(uint8_t));
+	f->edge_state = calloc(maxStates, sizeof(uint32_t));
+	ok = parent != NULL && depth != NULL && cls != NULL && path != NULL && f->states != NULL
+		&& f->term != NULL && f->edge_class != NULL && f->edge_state != NULL;
+
+	f->num_states = 1;
+	for (i = 0; ok && i < count; i++)
+	{
+		// the key shared with the term before, whose states are on path
+		common = 0;
+		if (i > 0)
+			while (common < terms[i].len && common < terms[i - 1].len
+				&& terms[i].key[common] == terms[i - 1].key[common])
+				common++;
+		for (d = common; d < terms[i].len; d++)
+		{
+			s = f->num_states++;
+			parent[s] = path[d];
+			cls[s] = terms[i].key[d];
+			depth[s] = d + 1;
+			path[d + 1] = s;
+		}
+		// a duplicate (up to case) keeps the stronger action
+		s = path[terms[i].len];
+		if (terms[i].action > f->states[s].action)
+		{
+			if (f->states[s].action == FILTER_PASS)
+				f->num_terms++;
+			f->states[s].action = terms[i].action;
+			f->term[s] = terms[i].text;
+		}
+	}
+
+	if (ok)
+	{
+		// states were made in key order, so each one's edges come out sorted
+		for (s = 1; s < f->num_states; s++)
+			f->states[parent[s] + 2].first++;
+		for (s = 1; s <= f->num_states; s++)
+			f->states[s].first += f->states[s - 1].first;
+		for (s = 1; s < f->num_states; s++)
+		{
+			d = f->states[parent[s] + 1].first++;
+			f->edge_class[d] = cls[s];
+			f->edge_state[d] = s;
+		}
+		f->num_rows = FILTER_DENSE_BYTES / sizeof(uint32_t) / f->num_classes;
+		if (f->num_rows > f->num_states)
+			f->num_rows = f->num_states;
+		f->rows = calloc((size_t) f->num_rows * f->num_classes, sizeof(uint32_t));
+		ok = f->rows != NULL;
+	}
+	ok = ok && linkStates(f, parent, cls, depth, maxDepth) == 0;
+	// the arrays are sized for every term byte to be a state of its own
+	f->bytes = sizeof(ContentFilter) + total + (size_t) maxStates * (sizeof(State) + sizeof(char *)
+		+ sizeof(uint8_t) + sizeof(uint32_t)) + (size_t) f->num_rows * f->num_classes * sizeof(uint32_t);
+	free(parent);
+	free(depth);
+	free(cls);
+	free(path);
+	return ok ? 0 : -1;
+}
+
+/* Failure links, inherited actions and the dense rows, a depth at a
+ * time: everything a state's link depends on is shallower
+ */
+static int linkStates(ContentFilter *f, const uint32_t *parent, const uint8_t *cls, const uint32_t *depth,
+	uint32_t maxDepth)
+{
+	uint32_t *order = malloc(f->num_states * sizeof(uint32_t));
+	uint32_t *start = calloc(maxDepth + 2, sizeof(uint32_t));
+	uint32_t i = 0, s = 0, t = 0;
+	uint32_t c = 0;
+
+	if (order == NULL || start == NULL)
+	{
+		free(order);
+		free(start);
+		return -1;
+	}
+	// by depth, start first
+	for (s = 0; s < f->num_states; s++)
+		start[depth[s] + 1]++;
+	for (i = 1; i <= maxDepth + 1; i++)
+		start[i] += start[i - 1];
+	for (s = 0; s < f->num_states; s++)
+		order[start[depth[s]]++] = s;
+	// rows go to the shallowest states, the start's first
+	for (i = 0; i < f->num_states; i++)
+		f->states[order[i]].row = i < f->num_rows ? i : NO_ROW;
+
+	for (i = 0; i < f->num_states; i++)
+	{
+		s = order[i];
+		if (depth[s] > 1)
+			f->states[s].fail = step(f, f->states[parent[s]].fail, cls[s]);
+		if (f->states[f->states[s].fail].action > f->states[s].action)
+		{
+			f->states[s].action = f->states[f->states[s].fail].action;
+			f->term[s] = f->term[f->states[s].fail];
+		}
+		if (f->states[s].row == NO_ROW)
+			continue;
+		for (c = 0; c < f->num_classes; c++)
+		{
+			if ((t = child(f, s, c)) == 0 && s != 0)
+				t = step(f, f->states[s].fail, c);
+			f->rows[(size_t) f->states[s].row * f->num_classes + c] = t;
+		}
+	}
+	free(order);
+	free(start);
+	return 0;
+}
+
+/* The state after reading a byte of class c in state s */
+static uint32_t step(const ContentFilter *f, uint32_t s, uint8_t c)
+{
+	uint32_t t = 0;
+
+	// the start state has a row, so this ends there at the latest
+	while (f->states[s].row == NO_ROW)
+	{
+		if ((t = child(f, s, c)) != 0)
+			return t;
+		s = f->states[s].fail;
+	}
+	return f->rows[(size_t) f->states[s].row * f->num_classes + c];
+}
+
+static uint32_t child(const ContentFilter *f, uint32_t s, uint8_t c)
+{
+	uint32_t low = f->states[s].first, high = f->states[s + 1].first, mid = 0;
+
+	while (low < high)
+	{
+		mid = (low + high) / 2;
+		if (f->edge_class[mid] < c)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+	return low < f->states[s + 1].first && f->edge_class[low] == c ? f->edge_state[low] : 0;
+}
+
+static int compareTerms(const void *a, const void *b)
+{
+	const Term *ta = a, *tb = b;
+	int cmp = memcmp(ta->key, tb->key, ta->len < tb->len ? ta->len : tb->len);
+
+	if (cmp != 0)
+		return cmp;
+	return ta->len < tb->len ? -1 : ta->len > tb->len;
+}
+
+static void freeFilter(ContentFilter *f)
+{
+	if (f == NULL)
+		return;
+	free(f->states);
+	free(f->term);
+	free(f->edge_class);
+	free(f->edge_state);
+	free(f->rows);
+	free(f->file);
+	free(f);
+}
+
+/* Compile thread - only reads the file and the path, the caller's
+ * thread swaps the result in when done is set. It inherits the caller's
+ * CPU (see -c), so it only runs when the caller has nothing to do
+ */
+static void *compileTerms(void *arg)
+{
+	CompileJob *compileJob = (CompileJob *) arg;
+	struct sched_param param = { 0 };
+
+	pthread_setschedparam(pthread_self(), SCHED_IDLE, &param);
+	compileJob->result = compile(filterPath);
+	__atomic_store_n(&compileJob->done, 1, __ATOMIC_RELEASE);
+	return NULL;
+}
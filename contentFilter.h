@@ -0,0 +1,49 @@
+/* Content filter.
+ * Checks message text against a list of terms, each one to be blocked or
+ * flagged, in a single pass however many terms there are: the terms are
+ * compiled into an Aho-Corasick automaton, which moves one state per
+ * byte of text and is in a state marked with a term's action whenever
+ * that term has just been read. Terms are matched without regard to
+ * ASCII case, anywhere in the text (inside words too).
+ *
+ * The term file has one term per line, after "block " or "flag ";
+ * blank lines and lines starting with # are skipped.
+ *
+ * filterReload() compiles the file again on a thread of its own, while
+ * the caller's thread keeps scanning with the terms it has, and
+ * filterPoll() swaps the new automaton in once it's ready. Everything
+ * else is only for the caller's thread.
+ */
+
+#ifndef CONTENTFILTER_H
+#define CONTENTFILTER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* filterScan() results, the strongest action of any term found */
+#define FILTER_PASS 0
+#define FILTER_FLAG 1
+#define FILTER_BLOCK 2
+
+/* filterPoll() results */
+#define FILTER_RELOAD_NONE 0 // nothing being compiled
+#define FILTER_RELOAD_RUNNING 1 // still compiling, poll again
+#define FILTER_RELOAD_DONE 2 // the new terms are in use
+#define FILTER_RELOAD_FAILED 3 // the old ones still are, the reason was printed
+
+typedef struct {
+	uint32_t terms;
+	uint32_t states;
+	size_t bytes; // the automaton's memory
+	uint64_t reloads; // swapped in by filterPoll()
+	uint64_t reload_failures; // the old terms kept
+} FilterInfo;
+
+int filterLoad(const char *path);
+int filterReload();
+int filterPoll();
+int filterScan(const uint8_t *text, size_t len, const char **term);
+void filterInfo(FilterInfo *info);
+
+#endif
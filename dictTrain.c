@@ -0,0 +1,241 @@
+/* Builds a compression dictionary (compress.h) from sample messages.
+ * Reads one message per line, counts every run of 1 to DICT_MAX_WORDS
+ * words and keeps the runs worth most to deflate - seen often, and long
+ * enough to be matched - until the dictionary is full, the most valuable
+ * last where deflate reaches them cheapest. Every DICT_HOLDOUT-th line is
+ * left out of the counts and used to compare, as %B frames, no dictionary,
+ * the built in one and the new one:
+ *
+ *   $ ./dictTrain [-s dict-bytes] samples.txt chat.dict
+ *   $ ./server -z chat.dict ...; ./cclient -z chat.dict ...
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "networks.h"
+#include "packets.h"
+#include "pollLib.h"
+#include "compress.h"
+
+#define DICT_DEFAULT_BYTES 8192
+#define DICT_MAX_WORDS 4 // longest run of words counted
+#define DICT_HOLDOUT 5 // every 5th line is kept for testing
+#define DICT_TABLE (1 << 20) // distinct runs counted, at most
+#define DICT_MIN_MATCH 3 // deflate's shortest match
+
+typedef struct {
+   char *text; // NULL if unused
+   uint16_t len;
+   uint32_t count;
+} Run;
+
+typedef struct {
+   char **lines;
+   int count;
+} Samples;
+
+static Run *runs = NULL;
+static int numRuns = 0;
+
+void countRuns(char *line);
+void countRun(char *text, uint16_t len);
+int byValue(const void *a, const void *b);
+size_t buildDict(uint8_t *dict, size_t size);
+void evaluate(char *name, Samples *test);
+uint64_t nowNs();
+void usage(char *prog);
+
+int main(int argc, char *argv[]) {
+
+   static char line[MAXBUF];
+   Samples test = { NULL, 0 };
+   size_t size = DICT_DEFAULT_BYTES, dictLen = 0, len = 0;
+   const uint8_t *builtin = NULL;
+   uint8_t *dict = NULL;
+   FILE *in = NULL, *out = NULL;
+   int opt, lineNum = 0;
+
+   while((opt = getopt(argc, argv, "s:")) != -1) {
+      switch(opt) {
+         case 's':
+            size = atoi(optarg);
+            break;
+         default:
+            usage(argv[0]);
+      }
+   }
+   if(argc - optind != 2 || size < 1 || size > COMPRESS_DICT_MAX)
+      usage(argv[0]);
+   if((in = fopen(argv[optind], "r")) == NULL) {
+      perror(argv[optind]);
+      exit(EXIT_FAILURE);
+   }
+
+   runs = sCalloc(DICT_TABLE, sizeof(Run));
+   while(fgets(line, sizeof(line), in) != NULL) {
+      len = strcspn(line, "\r\n");
+      line[len] = '\0';
+      if(len == 0 || len >= MAX_MESSAGE)
+         continue;
+      if(++lineNum % DICT_HOLDOUT == 0) {
+         test.lines = srealloc(test.lines, sizeof(char *) * (test.count + 1));
+         test.lines[test.count++] = strdup(line);
+      }
+      else
+         countRuns(line);
+   }
+   fclose(in);
+
+   dict = sCalloc(size, 1);
+   dictLen = buildDict(dict, size);
+   if((out = fopen(argv[optind + 1], "wb")) == NULL || fwrite(dict, 1, dictLen, out) != dictLen
+         || fclose(out) != 0) {
+      perror(argv[optind + 1]);
+      exit(EXIT_FAILURE);
+   }
+   printf("%d messages, %d distinct runs of words, %zu byte dictionary written to %s\n",
+      lineNum, numRuns, dictLen, argv[optind + 1]);
+
+   if(test.count == 0)
+      return 0;
+   printf("%d held out messages as %%B frames:\n", test.count);
+   builtin = compressDict(&len);
+   compressUseDict(NULL, 0);
+   evaluate("no dictionary", &test);
+   compressUseDict(builtin, len);
+   evaluate("built in", &test);
+   compressUseDict(dict, dictLen);
+   evaluate("trained", &test);
+   return 0;
+}
+
+/* every run of 1 to DICT_MAX_WORDS words in line, with the space after it */
+void countRuns(char *line) {
+
+   char *start = line, *end = NULL;
+   int words;
+
+   while(*start != '\0') {
+      end = start;
+      for(words = 0; words < DICT_MAX_WORDS && *end != '\0'; words++) {
+         end += strcspn(end, " ");
+         if(*end == ' ')
+            end++;
+         countRun(start, end - start);
+      }
+      start += strcspn(start, " ");
+      start += strspn(start, " ");
+   }
+}
+
+void countRun(char *text, uint16_t len) {
+
+   uint32_t hash = 2166136261u; // FNV-1a
+   uint32_t i;
+
+   if(len < DICT_MIN_MATCH)
+      return;
+   for(i = 0; i < len; i++)
+      hash = (hash ^ (uint8_t)text[i]) * 16777619u;
+   for(i = hash & (DICT_TABLE - 1); runs[i].text != NULL; i = (i + 1) & (DICT_TABLE - 1)) {
+      if(runs[i].len == len && memcmp(runs[i].text, text, len) == 0) {
+         runs[i].count++;
+         return;
+      }
+   }
+   if(numRuns == DICT_TABLE * 3 / 4)
+      return; // full enough, the rarest runs are left out
+   runs[i].text = sCalloc(len + 1, 1);
+   memcpy(runs[i].text, text, len);
+   runs[i].len = len;
+   runs[i].count = 1;
+   numRuns++;
+}
+
+// the bytes a run saves if every occurrence is matched, most first
+int byValue(const void *a, const void *b) {
+
+   const Run *x = a, *y = b;
+   uint64_t vx = x->text == NULL ? 0 : (uint64_t)x->count * (x->len - DICT_MIN_MATCH + 1);
+   uint64_t vy = y->text == NULL ? 0 : (uint64_t)y->count * (y->len - DICT_MIN_MATCH + 1);
+   return vx < vy ? 1 : vx > vy ? -1 : 0;
+}
+
+/* Picks runs by value, skipping any already in what's picked, then lays
+ * them out in reverse so the most valuable end up last
+ */
+size_t buildDict(uint8_t *dict, size_t size) {
+
+   char *picked = sCalloc(size + 1, 1);
+   size_t used = 0, at = size;
+   int i;
+
+   qsort(runs, DICT_TABLE, sizeof(Run), byValue);
+   for(i = 0; i < DICT_TABLE && runs[i].text != NULL && runs[i].count > 1 && used < size; i++) {
+      if(runs[i].len > size - used || strstr(picked, runs[i].text) != NULL)
+         continue;
+      memcpy(picked + used, runs[i].text, runs[i].len);
+      used += runs[i].len;
+      at -= runs[i].len;
+      memcpy(dict + at, runs[i].text, runs[i].len);
+   }
+   memmove(dict, dict + at, used);
+   free(picked);
+   return used;
+}
+
+/* Deflates each test message as a %B frame from "user" and checks it
+ * inflates back
+ */
+void evaluate(char *name, Samples *test) {
+
+   uint8_t plain[MAXBUF], packed[MAXBUF], back[MAXBUF];
+   uint64_t plainBytes = 0, packedBytes = 0, start = 0, elapsed = 0;
+   uint16_t plainLen = 0, packedLen = 0;
+   Frame f;
+   int i, compressed = 0;
+
+   for(i = 0; i < test->count; i++) {
+      frameInit(&f, BROADCAST_FLAG);
+      frameHandle(&f, "user", 4);
+      frameText(&f, test->lines[i], strlen(test->lines[i]));
+      if((plainLen = frameEncode(plain, TO_CLIENT, &f)) == 0)
+         continue;
+      start = nowNs();
+      packedLen = compressPacket(plain, plainLen, packed);
+      elapsed += nowNs() - start;
+      plainBytes += plainLen;
+      if(packedLen == 0) {
+         packedBytes += plainLen;
+         continue;
+      }
+      if(decompressFrame(packed + PKT_LEN, packedLen, back) != plainLen
+            || memcmp(back, plain + PKT_LEN, plainLen - PKT_LEN) != 0) {
+         fprintf(stderr, "%s: message %d didn't inflate back\n", name, i);
+         exit(EXIT_FAILURE);
+      }
+      packedBytes += packedLen;
+      compressed++;
+   }
+   printf("  %-14s %8llu -> %8llu bytes (%5.1f%%), %d frames smaller, %.2f us per frame\n",
+      name, (unsigned long long)plainBytes, (unsigned long long)packedBytes,
+      plainBytes ? 100.0 * packedBytes / plainBytes : 0.0, compressed,
+      elapsed / 1000.0 / test->count);
+}
+
+uint64_t nowNs() {
+
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void usage(char *prog) {
+   fprintf(stderr, "Usage %s [-s dict-bytes] samples-file dict-file\n", prog);
+   exit(EXIT_FAILURE);
+}
@@ -0,0 +1,145 @@
+/* Fan-out worker pool, see fanoutPool.h.
+ * One batch at a time: chunks are handed out under the lock, written
+ * without it, and the caller waits until the last one is finished.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/socket.h>
+
+#include "fanoutPool.h"
+#include "packets.h"
+#include "affinity.h"
+
+static pthread_t threads[FANOUT_MAX_WORKERS];
+static int numWorkers = 0;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t workReady = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t workDone = PTHREAD_COND_INITIALIZER;
+static FanoutSend *batch = NULL;
+static int batchCount = 0;
+static int nextChunk = 0; // next to hand out
+static int chunksLeft = 0; // not finished yet
+static uint64_t generation = 0; // batches started
+static int pinCpus[AFFINITY_MAX_CPUS]; // workers started from now on run on these, in turn
+static int numPinCpus = 0;
+
+static void *worker(void *arg);
+static void runChunks();
+static void sendChunk(FanoutSend *sends, int count);
+
+/* Workers started after this each keep to one of cpus, in turn */
+void fanoutPoolPin(const int *cpus, int count)
+{
+	int i = 0;
+
+	for (i = 0; i < count && i < AFFINITY_MAX_CPUS; i++)
+		pinCpus[i] = cpus[i];
+	numPinCpus = i;
+}
+
+/* Starts up to FANOUT_MAX_WORKERS threads, returns how many there are */
+int fanoutPoolStart(int workers)
+{
+	sigset_t all, old;
+
+	if (workers > FANOUT_MAX_WORKERS)
+		workers = FANOUT_MAX_WORKERS;
+	// signals stay with the event loop, where they interrupt poll()
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+	for (; numWorkers < workers; numWorkers++)
+	{
+		if (pthread_create(&threads[numWorkers], NULL, worker, (void *) (intptr_t) numWorkers) != 0)
+		{
+			perror("pthread_create fan-out worker");
+			exit(-1);
+		}
+	}
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	return numWorkers;
+}
+
+int fanoutPoolWorkers()
+{
+	return numWorkers;
+}
+
+/* Writes every send in the batch, in parallel when it's more than a
+ * chunk, and returns when all of them are done
+ */
+void fanoutPoolRun(FanoutSend *sends, int count)
+{
+	if (numWorkers == 0 || count <= FANOUT_CHUNK)
+	{
+		sendChunk(sends, count);
+		return;
+	}
+	pthread_mutex_lock(&lock);
+	batch = sends;
+	batchCount = count;
+	nextChunk = 0;
+	chunksLeft = (count + FANOUT_CHUNK - 1) / FANOUT_CHUNK;
+	generation++;
+	pthread_cond_broadcast(&workReady);
+	runChunks();
+	while (chunksLeft > 0)
+		pthread_cond_wait(&workDone, &lock);
+	batch = NULL;
+	batchCount = 0;
+	pthread_mutex_unlock(&lock);
+}
+
+static void *worker(void *arg)
+{
+	uint64_t seen = 0;
+	int cpu = 0;
+
+	// pinned first, so what it faults in from here on is on its own node
+	if (numPinCpus > 0)
+	{
+		cpu = pinCpus[(intptr_t) arg % numPinCpus];
+		if (affinityPin(cpu) < 0)
+			fprintf(stderr, "fan-out worker can't run on cpu %d\n", cpu);
+		affinityLocalMemory();
+	}
+	pthread_mutex_lock(&lock);
+	while (1)
+	{
+		while (generation == seen)
+			pthread_cond_wait(&workReady, &lock);
+		seen = generation;
+		runChunks();
+	}
+	return NULL;
+}
+
+// takes chunks until there are none left - called and returns with the lock held
+static void runChunks()
+{
+	int start = 0;
+
+	while ((start = nextChunk * FANOUT_CHUNK) < batchCount)
+	{
+		nextChunk++;
+		pthread_mutex_unlock(&lock);
+		sendChunk(batch + start, batchCount - start < FANOUT_CHUNK ? batchCount - start : FANOUT_CHUNK);
+		pthread_mutex_lock(&lock);
+		if (--chunksLeft == 0)
+			pthread_cond_signal(&workDone);
+	}
+}
+
+static void sendChunk(FanoutSend *sends, int count)
+{
+	int i = 0;
+
+	for (i = 0; i < count; i++)
+	{
+		sends[i].sent = transportSend(sends[i].socket, sends[i].buf, sends[i].len, MSG_DONTWAIT | MSG_NOSIGNAL);
+		sends[i].error = sends[i].sent < 0 ? errno : 0;
+	}
+}
@@ -0,0 +1,35 @@
+/* Fan-out worker pool.
+ * A broadcast to many clients is one send() each, which on the event loop
+ * thread alone keeps every other client waiting until the last is done.
+ * fanoutPoolRun() splits such a batch of sends into chunks of
+ * FANOUT_CHUNK, written by the pool's threads and the caller together,
+ * and returns once all of them are. Each socket is only written by one
+ * thread, and only the write itself happens on a worker: what the
+ * results mean for queues and counters is left to the caller, back on
+ * its own thread.
+ */
+
+#ifndef FANOUTPOOL_H
+#define FANOUTPOOL_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#define FANOUT_MAX_WORKERS 64
+#define FANOUT_CHUNK 128 // sends a thread takes at a time
+
+typedef struct {
+	int socket;
+	const uint8_t *buf;
+	uint16_t len;
+	uint8_t flags; // the caller's, not looked at
+	ssize_t sent; // result of transportSend(), with MSG_DONTWAIT
+	int error; // errno if sent < 0
+} FanoutSend;
+
+void fanoutPoolPin(const int *cpus, int count);
+int fanoutPoolStart(int workers);
+int fanoutPoolWorkers();
+void fanoutPoolRun(FanoutSend *sends, int count);
+
+#endif
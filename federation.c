@@ -0,0 +1,382 @@
+/* Server to server federation.
+ * Peer table, non blocking connects, hello proofs and per link batches.
+ * The event loop side (hello, gossip, relaying chat frames) lives in
+ * server.c with the rest of the packet handling.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+
+#include "federation.h"
+#include "memAccount.h"
+#include "pollLib.h"
+
+// Federation global variables
+static int enabled = 0;
+static uint16_t localId = 0;
+static Peer peers[MAX_PEERS];
+static int peerTotal = 0;
+static uint8_t key[1024]; // shared by every node, proves a hello
+static size_t keyLen = 0;
+
+static Peer *newPeer(uint16_t id);
+static void helloMac(uint16_t from, uint16_t to, const uint8_t *sent, uint8_t *mac);
+static const uint8_t *hostBytes(struct sockaddr_storage *addr, int *len);
+
+void setupFederation(uint16_t nodeId)
+{
+	enabled = 1;
+	localId = nodeId;
+}
+
+int federationEnabled()
+{
+	return enabled;
+}
+
+uint16_t localNodeId()
+{
+	return localId;
+}
+
+/* Reads the key shared by all nodes, the whole file as is. -1 if it
+ * can't be read or is shorter than PEER_KEY_MIN
+ */
+int federationKey(char *path)
+{
+	FILE *f = fopen(path, "r");
+	int extra = 0;
+
+	if (f == NULL)
+	{
+		perror(path);
+		return -1;
+	}
+	keyLen = fread(key, 1, sizeof(key), f);
+	extra = fgetc(f) != EOF;
+	fclose(f);
+	if (keyLen < PEER_KEY_MIN || extra)
+	{
+		fprintf(stderr, "%s: node key must be %d to %zu bytes\n", path, PEER_KEY_MIN, sizeof(key));
+		keyLen = 0;
+		return -1;
+	}
+	return 0;
+}
+
+/* Adds a configured peer from "id@host:port", -1 if malformed */
+int addPeer(char *spec)
+{
+	char *at = strchr(spec, '@');
+	char *colon = strrchr(spec, ':');
+	Peer *p = NULL;
+	long id = 0;
+
+	if (at == NULL || colon == NULL || colon < at || colon - at - 1 >= sizeof(p->host)
+		|| strlen(colon + 1) >= sizeof(p->port))
+		return -1;
+	id = strtol(spec, NULL, 10);
+	if (id < 0 || id > UINT16_MAX || peerById(id) != NULL || (p = newPeer(id)) == NULL)
+		return -1;
+
+	memcpy(p->host, at + 1, colon - at - 1);
+	p->host[colon - at - 1] = '\0';
+	strcpy(p->port, colon + 1);
+	return 0;
+}
+
+int numPeers()
+{
+	return peerTotal;
+}
+
+Peer *peerAt(int i)
+{
+	return &peers[i];
+}
+
+Peer *peerById(uint16_t id)
+{
+	int i = 0;
+	for (i = 0; i < peerTotal; i++)
+	{
+		if (peers[i].id == id)
+			return &peers[i];
+	}
+	return NULL;
+}
+
+Peer *peerBySocket(int socket)
+{
+	int i = 0;
+	if (socket < 0)
+		return NULL;
+	for (i = 0; i < peerTotal; i++)
+	{
+		if (peers[i].socket == socket)
+			return &peers[i];
+	}
+	return NULL;
+}
+
+/* Looks a configured peer's host up without blocking - the event loop
+ * calls it again until the answer is in. 1 once the addresses are
+ * known (they're kept from then on), 0 while the lookup runs, -1 if it
+ * failed and should be started again later
+ */
+int peerResolve(Peer *p)
+{
+	struct pollfd pfd;
+	int error = 0;
+
+	if (p->addrs.count > 0)
+		return 1;
+	if (p->query == NULL && (p->query = resolveStart(p->host, p->port)) == NULL)
+		return -1;
+	if ((pfd.fd = resolveFd(p->query)) >= 0)
+	{
+		pfd.events = POLLIN;
+		if (poll(&pfd, 1, 0) <= 0)
+			return 0;
+	}
+	error = resolveFinish(p->query, &p->addrs);
+	p->query = NULL;
+	if (error != 0 || p->addrs.count == 0)
+	{
+		fprintf(stderr, "node %u: %s: %s\n", p->id, p->host, gai_strerror(error));
+		p->addrs.count = 0;
+		return -1;
+	}
+	return 1;
+}
+
+/* Starts a non blocking connect to a configured peer whose address
+ * peerResolve() has found. Returns the socket (writable once connected,
+ * see peerConnectResult) or -1
+ */
+int peerConnect(Peer *p)
+{
+	struct sockaddr_storage *addr = &p->addrs.addrs[0];
+	int sock = -1;
+
+	if (p->addrs.count == 0)
+		return -1;
+	if ((sock = socket(addr->ss_family, SOCK_STREAM, 0)) < 0)
+	{
+		perror("socket call");
+		return -1;
+	}
+	fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+	if (connect(sock, (struct sockaddr *)addr, p->addrs.lens[0]) < 0 && errno != EINPROGRESS)
+	{
+		close(sock);
+		return -1;
+	}
+	fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) & ~O_NONBLOCK);
+
+	p->socket = sock;
+	p->state = PEER_CONNECTING;
+	p->batch_len = 0;
+	return sock;
+}
+
+/* connect() finished - 0 if it connected (the link is up once the
+ * node's hello checks out, see peerAccepted), -1 if it failed
+ */
+int peerConnectResult(Peer *p)
+{
+	int error = 0;
+	socklen_t len = sizeof(error);
+
+	if (getsockopt(p->socket, SOL_SOCKET, SO_ERROR, &error, &len) < 0 || error != 0)
+		return -1;
+	return 0;
+}
+
+/* Fills in the proof for a hello to p: its id, our clock, and a MAC over
+ * both ids and the time keyed with the shared key. Returns its length
+ */
+uint16_t peerHelloAuth(Peer *p, uint8_t *auth)
+{
+	struct timespec ts;
+	uint64_t now = 0;
+	int i = 0;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	now = (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+	auth[0] = p->id >> 8;
+	auth[1] = p->id & 0xff;
+	for (i = 0; i < 8; i++)
+		auth[2 + i] = now >> (56 - 8 * i);
+	helloMac(localId, p->id, auth + 2, auth + 10);
+	return PEER_HELLO_AUTH;
+}
+
+/* Checks the proof in a hello p sent on socket: addressed to us, with
+ * the shared key, recent and newer than the last one taken (so a
+ * recorded hello can't be played back), and from one of the addresses
+ * p is configured at. 0 if it holds, -1 (and why, printed) if not
+ */
+int peerHelloCheck(Peer *p, const uint8_t *auth, uint16_t len, int socket)
+{
+	struct sockaddr_storage from;
+	socklen_t fromLen = sizeof(from);
+	const uint8_t *host = NULL, *known = NULL;
+	int hostLen = 0, knownLen = 0;
+	uint8_t mac[EVP_MAX_MD_SIZE];
+	struct timespec ts;
+	uint64_t now = 0, sent = 0;
+	int i = 0;
+
+	if (len != PEER_HELLO_AUTH || (auth[0] << 8 | auth[1]) != localId)
+	{
+		fprintf(stderr, "node %u: hello not meant for us\n", p->id);
+		return -1;
+	}
+	helloMac(p->id, localId, auth + 2, mac);
+	if (CRYPTO_memcmp(mac, auth + 10, PEER_HELLO_AUTH - 10) != 0)
+	{
+		fprintf(stderr, "node %u: hello with the wrong key\n", p->id);
+		return -1;
+	}
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	now = (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+	for (i = 0; i < 8; i++)
+		sent = sent << 8 | auth[2 + i];
+	if (sent + PEER_HELLO_WINDOW < now || sent > now + PEER_HELLO_WINDOW || sent <= p->last_hello)
+	{
+		fprintf(stderr, "node %u: stale or replayed hello\n", p->id);
+		return -1;
+	}
+
+	if (getpeername(socket, (struct sockaddr *)&from, &fromLen) < 0
+		|| (host = hostBytes(&from, &hostLen)) == NULL)
+		return -1;
+	for (i = 0; i < p->addrs.count; i++)
+	{
+		known = hostBytes(&p->addrs.addrs[i], &knownLen);
+		if (known != NULL && knownLen == hostLen && memcmp(known, host, hostLen) == 0)
+			break;
+	}
+	if (i == p->addrs.count)
+	{
+		fprintf(stderr, "node %u: hello from an address %s isn't at\n", p->id, p->host);
+		return -1;
+	}
+
+	p->last_hello = sent;
+	return 0;
+}
+
+/* A configured node's hello checked out on socket - the link is up */
+Peer *peerAccepted(uint16_t id, int socket)
+{
+	Peer *p = peerById(id);
+
+	if (p == NULL)
+		return NULL;
+	p->socket = socket;
+	p->state = PEER_UP;
+	p->batch_len = 0;
+	return p;
+}
+
+/* Link closed - its users are unreachable until it comes back */
+void peerDown(Peer *p)
+{
+	p->socket = -1;
+	p->state = PEER_DOWN;
+	p->batch_len = 0;
+}
+
+int peerBatchFits(Peer *p, uint16_t len)
+{
+	return p->batch_len + len <= PEER_BATCH_BYTES;
+}
+
+int peerBatchesPending()
+{
+	int i = 0;
+	for (i = 0; i < peerTotal; i++)
+	{
+		if (peers[i].state == PEER_UP && peers[i].batch_len > 0)
+			return 1;
+	}
+	return 0;
+}
+
+void peerBatchAppend(Peer *p, uint8_t *frame, uint16_t len)
+{
+	memcpy(p->batch + p->batch_len, frame, len);
+	p->batch_len += len;
+}
+
+/* HMAC-SHA256 over "chat node hello", both ids and the 8 byte time */
+static void helloMac(uint16_t from, uint16_t to, const uint8_t *sent, uint8_t *mac)
+{
+	uint8_t msg[sizeof("chat node hello") + 4 + 8];
+	size_t label = sizeof("chat node hello");
+	unsigned int macLen = 0;
+
+	memcpy(msg, "chat node hello", label);
+	msg[label] = from >> 8;
+	msg[label + 1] = from & 0xff;
+	msg[label + 2] = to >> 8;
+	msg[label + 3] = to & 0xff;
+	memcpy(msg + label + 4, sent, 8);
+	HMAC(EVP_sha256(), key, keyLen, msg, sizeof(msg), mac, &macLen);
+}
+
+/* The host part of an address, IPv4 mapped IPv6 ones as plain IPv4 so
+ * either form of the same host compares equal. NULL if not IP
+ */
+static const uint8_t *hostBytes(struct sockaddr_storage *addr, int *len)
+{
+	struct sockaddr_in6 *in6 = (struct sockaddr_in6 *)addr;
+
+	if (addr->ss_family == AF_INET)
+	{
+		*len = 4;
+		return (uint8_t *)&((struct sockaddr_in *)addr)->sin_addr;
+	}
+	if (addr->ss_family != AF_INET6)
+		return NULL;
+	if (IN6_IS_ADDR_V4MAPPED(&in6->sin6_addr))
+	{
+		*len = 4;
+		return in6->sin6_addr.s6_addr + 12;
+	}
+	*len = 16;
+	return in6->sin6_addr.s6_addr;
+}
+
+static Peer *newPeer(uint16_t id)
+{
+	Peer *p = NULL;
+
+	if (peerTotal == MAX_PEERS)
+	{
+		fprintf(stderr, "too many peers, ignoring node %u\n", id);
+		return NULL;
+	}
+	p = &peers[peerTotal++];
+	memset(p, 0, sizeof(Peer));
+	p->id = id;
+	p->socket = -1;
+	p->state = PEER_DOWN;
+	p->batch = sCalloc(PEER_BATCH_BYTES, 1);
+	memCharge(MEM_PEERS, PEER_BATCH_BYTES);
+	return p;
+}
@@ -0,0 +1,64 @@
+/* Server to server federation.
+ * Every node keeps one TCP link to every other node it is configured
+ * with (the node with the lower id connects). Which node each user is
+ * logged in to is replicated over these links (see presence.h). Frames for a node are
+ * appended to that link's batch, written with one send once the event
+ * loop runs out of input. All users' traffic to a node shares the one
+ * link, and a broadcast crosses it once however many users are behind it.
+ * Only configured nodes are linked with, each proving itself in its hello
+ * with the key all nodes share.
+ */
+
+#ifndef FEDERATION_H
+#define FEDERATION_H
+
+#include <stdint.h>
+
+#include "networks.h"
+
+#define MAX_PEERS 32
+#define PEER_BATCH_BYTES 32768 // frames batched per link before an early flush
+#define PEER_RETRY_INTERVAL 1000 // ms between connect attempts to a down peer
+#define PEER_KEY_MIN 16 // bytes, shortest shared key (-k) taken
+#define PEER_HELLO_AUTH 42 // hello proof: to id(2), sent at ms(8), HMAC-SHA256(32)
+#define PEER_HELLO_WINDOW 30000 // ms a hello's clock may be off from ours
+
+/* Peer link states */
+#define PEER_DOWN 0
+#define PEER_CONNECTING 1 // connect() or the hellos in progress
+#define PEER_UP 2 // hellos exchanged and checked
+
+typedef struct {
+   uint16_t id;
+   char host[256];
+   char port[8];
+   AddrList addrs; // host's, count 0 until peerResolve() has them
+   ResolveQuery *query; // lookup in flight
+   int socket; // -1 while down
+   uint8_t state;
+   uint8_t *batch; // frames waiting for the end of the loop pass
+   uint32_t batch_len;
+   uint64_t last_hello; // sent at time of the newest hello taken, older ones are replays
+} Peer;
+
+void setupFederation(uint16_t nodeId);
+int federationEnabled();
+uint16_t localNodeId();
+int federationKey(char *path);
+int addPeer(char *spec);
+int numPeers();
+Peer *peerAt(int i);
+Peer *peerById(uint16_t id);
+Peer *peerBySocket(int socket);
+int peerResolve(Peer *p);
+int peerConnect(Peer *p);
+int peerConnectResult(Peer *p);
+uint16_t peerHelloAuth(Peer *p, uint8_t *auth);
+int peerHelloCheck(Peer *p, const uint8_t *auth, uint16_t len, int socket);
+Peer *peerAccepted(uint16_t id, int socket);
+void peerDown(Peer *p);
+int peerBatchFits(Peer *p, uint16_t len);
+void peerBatchAppend(Peer *p, uint8_t *frame, uint16_t len);
+int peerBatchesPending();
+
+#endif
@@ -0,0 +1,210 @@
+/* Live upgrade handoff.
+ * Transport only - what goes in the snapshot is up to server.c.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#include "handoff.h"
+
+static int handoffAddress(char *path, struct sockaddr_un *addr);
+
+/* Listens for a replacement process at path, -1 on failure */
+int handoffListen(char *path)
+{
+	struct sockaddr_un addr;
+	int sock = -1;
+
+	if (handoffAddress(path, &addr) < 0)
+		return -1;
+	if ((sock = socket(AF_UNIX, SOCK_SEQPACKET, 0)) < 0)
+	{
+		perror("upgrade socket call");
+		return -1;
+	}
+
+	unlink(path); // left by a previous server, nobody is listening on it
+	if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(sock, 1) < 0)
+	{
+		perror("upgrade socket bind/listen");
+		close(sock);
+		return -1;
+	}
+	return sock;
+}
+
+/* Accepts a replacement process from the listening socket. It has to
+ * run as the same user as this one, and its first message is waited
+ * for HANDOFF_HELLO_TIMEOUT at most. -1 if it couldn't be accepted or
+ * isn't trusted
+ */
+int handoffAccept(int listenSock)
+{
+	struct ucred cred;
+	socklen_t len = sizeof(cred);
+	int sock = -1;
+
+	if ((sock = accept(listenSock, NULL, NULL)) < 0)
+		return -1;
+	if (getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0 || cred.uid != getuid())
+	{
+		fprintf(stderr, "refusing upgrade from another user\n");
+		close(sock);
+		return -1;
+	}
+	if (handoffTimeout(sock, HANDOFF_HELLO_TIMEOUT) < 0)
+	{
+		close(sock);
+		return -1;
+	}
+	return sock;
+}
+
+/* Sets how long handoffRecv() waits on sock, 0 = for ever */
+int handoffTimeout(int sock, int ms)
+{
+	struct timeval tv;
+
+	tv.tv_sec = ms / 1000;
+	tv.tv_usec = (ms % 1000) * 1000;
+	if (setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0)
+	{
+		perror("upgrade setsockopt");
+		return -1;
+	}
+	return 0;
+}
+
+/* Connects to a running server to take over from it. -1 if there
+ * isn't one, in which case this process starts from scratch
+ */
+int handoffConnect(char *path)
+{
+	struct sockaddr_un addr;
+	int sock = -1;
+
+	if (handoffAddress(path, &addr) < 0)
+		return -1;
+	if ((sock = socket(AF_UNIX, SOCK_SEQPACKET, 0)) < 0)
+	{
+		perror("upgrade socket call");
+		return -1;
+	}
+	if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+	{
+		close(sock);
+		return -1;
+	}
+	return sock;
+}
+
+/* Sends one message, blocking. Returns 0 or -1 */
+int handoffSend(int sock, uint8_t type, void *data, uint32_t len, int *fds, int numFds)
+{
+	struct msghdr msg;
+	struct iovec iov[2];
+	struct cmsghdr *cmsg = NULL;
+	union {
+		char buf[CMSG_SPACE(sizeof(int) * HANDOFF_MAX_FDS)];
+		struct cmsghdr align;
+	} control;
+
+	iov[0].iov_base = &type;
+	iov[0].iov_len = 1;
+	iov[1].iov_base = data;
+	iov[1].iov_len = len;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = 2;
+	if (numFds > 0)
+	{
+		memset(&control, 0, sizeof(control));
+		msg.msg_control = control.buf;
+		msg.msg_controllen = CMSG_SPACE(sizeof(int) * numFds);
+		cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int) * numFds);
+		memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * numFds);
+	}
+
+	while (sendmsg(sock, &msg, MSG_NOSIGNAL) < 0)
+	{
+		if (errno != EINTR)
+		{
+			perror("upgrade sendmsg");
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* Receives one message, blocking (up to any handoffTimeout()). Returns
+ * the payload length (type and any descriptors filled in), or -1 if the
+ * other side went away or timed out
+ */
+int handoffRecv(int sock, uint8_t *type, void *data, uint32_t max, int *fds, int *numFds)
+{
+	struct msghdr msg;
+	struct iovec iov[2];
+	struct cmsghdr *cmsg = NULL;
+	union {
+		char buf[CMSG_SPACE(sizeof(int) * HANDOFF_MAX_FDS)];
+		struct cmsghdr align;
+	} control;
+	ssize_t got = 0;
+
+	iov[0].iov_base = type;
+	iov[0].iov_len = 1;
+	iov[1].iov_base = data;
+	iov[1].iov_len = max;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = 2;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = sizeof(control.buf);
+
+	while ((got = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC)) < 0)
+	{
+		if (errno != EINTR)
+		{
+			perror("upgrade recvmsg");
+			return -1;
+		}
+	}
+	if (got == 0 || (msg.msg_flags & MSG_TRUNC))
+		return -1;
+
+	*numFds = 0;
+	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg))
+	{
+		if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+		{
+			*numFds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+			memcpy(fds, CMSG_DATA(cmsg), sizeof(int) * *numFds);
+		}
+	}
+	return got - 1;
+}
+
+static int handoffAddress(char *path, struct sockaddr_un *addr)
+{
+	memset(addr, 0, sizeof(struct sockaddr_un));
+	addr->sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr->sun_path))
+	{
+		fprintf(stderr, "upgrade socket path too long: %s\n", path);
+		return -1;
+	}
+	strcpy(addr->sun_path, path);
+	return 0;
+}
@@ -0,0 +1,38 @@
+/* Live upgrade handoff.
+ * A running server listens on a Unix socket for its replacement. The
+ * new process connects, and the old one sends it the listening socket,
+ * every client socket (with SCM_RIGHTS) and a snapshot of the state
+ * that goes with them, then exits. Clients stay connected throughout.
+ *
+ * Messages are SOCK_SEQPACKET datagrams: a type byte then the payload,
+ * with any file descriptors attached.
+ */
+
+#ifndef HANDOFF_H
+#define HANDOFF_H
+
+#include <stdint.h>
+
+#define HANDOFF_VERSION 4 // bumped whenever the snapshot layout changes
+#define HANDOFF_CHUNK 65536 // largest payload per message
+#define HANDOFF_MAX_FDS 4 // descriptors per message
+#define HANDOFF_HELLO_TIMEOUT 1000 // ms the new process has to send HANDOFF_HELLO
+
+/* Message types */
+#define HANDOFF_HELLO 1 // new -> old: uint32 HANDOFF_VERSION
+#define HANDOFF_SERVER 2 // old -> new: server wide state, listening socket(s) attached
+#define HANDOFF_CONN 3 // old -> new: one connection, its socket (and spill file) attached
+#define HANDOFF_FRAME 4 // old -> new: a frame queued for the last connection
+#define HANDOFF_HISTORY 5 // old -> new: a chunk of a history ring
+#define HANDOFF_END 6 // old -> new: snapshot complete
+#define HANDOFF_ACK 7 // new -> old: everything received, old may exit
+#define HANDOFF_SESSION 8 // old -> new: a resumable session, the last connection's or one waiting for its client
+
+int handoffListen(char *path);
+int handoffAccept(int listenSock);
+int handoffTimeout(int sock, int ms);
+int handoffConnect(char *path);
+int handoffSend(int sock, uint8_t type, void *data, uint32_t len, int *fds, int numFds);
+int handoffRecv(int sock, uint8_t *type, void *data, uint32_t max, int *fds, int *numFds);
+
+#endif
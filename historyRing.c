@@ -0,0 +1,130 @@
+/* Bounded message history.
+ * Packets are written one after another through the arena. A packet
+ * that doesn't fit before the end wraps to offset 0, and whatever older
+ * packets it would overwrite (or that sit in the skipped tail) are
+ * evicted first. Entries are in sequence order, so lookups by sequence
+ * number are a binary search.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "historyRing.h"
+#include "pollLib.h"
+
+static void historyEvictOldest(HistoryRing *r);
+
+void historyInit(HistoryRing *r, uint32_t arena_size, uint32_t max_entries)
+{
+	r->arena = sCalloc(arena_size, 1);
+	r->arena_size = arena_size;
+	r->write = 0;
+	r->entries = sCalloc(max_entries, sizeof(HistoryEntry));
+	r->max_entries = max_entries;
+	r->first = 0;
+	r->count = 0;
+}
+
+void historyFree(HistoryRing *r)
+{
+	free(r->arena);
+	free(r->entries);
+	r->arena = NULL;
+	r->entries = NULL;
+	r->count = 0;
+}
+
+// bytes allocated for the ring, arena and index
+size_t historySize(HistoryRing *r)
+{
+	return r->arena_size + (size_t) r->max_entries * sizeof(HistoryEntry);
+}
+
+/* i-th oldest entry, 0 <= i < count */
+HistoryEntry *historyEntry(HistoryRing *r, uint32_t i)
+{
+	return &r->entries[(r->first + i) % r->max_entries];
+}
+
+uint8_t *historyData(HistoryRing *r, HistoryEntry *e)
+{
+	return r->arena + e->offset;
+}
+
+/* 0 if the position and every entry lie within the ring, -1 if not -
+ * for a ring filled in from outside, like a live upgrade's snapshot
+ */
+int historyCheck(HistoryRing *r)
+{
+	HistoryEntry *e = NULL;
+	uint32_t i = 0;
+
+	if (r->write > r->arena_size || r->first >= r->max_entries || r->count > r->max_entries)
+		return -1;
+	for (i = 0; i < r->count; i++)
+	{
+		e = historyEntry(r, i);
+		if (e->offset > r->arena_size || e->len > r->arena_size - e->offset)
+			return -1;
+	}
+	return 0;
+}
+
+void historyAppend(HistoryRing *r, uint32_t seq, uint8_t *packet, uint16_t len)
+{
+	uint32_t start = r->write;
+	HistoryEntry *e = NULL;
+
+	if (len > r->arena_size)
+		return;
+
+	if (start + len > r->arena_size)
+	{
+		// wrapping - everything left in the skipped tail is older than
+		// what sits at the start of the arena, so it goes first
+		while (r->count > 0 && historyEntry(r, 0)->offset >= start)
+			historyEvictOldest(r);
+		start = 0;
+	}
+
+	while (r->count > 0)
+	{
+		e = historyEntry(r, 0);
+		if (r->count < r->max_entries && (e->offset >= start + len || e->offset + e->len <= start))
+			break;
+		historyEvictOldest(r);
+	}
+
+	memcpy(r->arena + start, packet, len);
+	e = &r->entries[(r->first + r->count) % r->max_entries];
+	e->seq = seq;
+	e->offset = start;
+	e->len = len;
+	r->count++;
+	r->write = start + len;
+}
+
+/* index of the oldest entry with a sequence number above seq (count if none) */
+uint32_t historyFindAfter(HistoryRing *r, uint32_t seq)
+{
+	uint32_t low = 0;
+	uint32_t high = r->count;
+	uint32_t mid = 0;
+
+	while (low < high)
+	{
+		mid = low + (high - low) / 2;
+		if (historyEntry(r, mid)->seq <= seq)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+	return low;
+}
+
+static void historyEvictOldest(HistoryRing *r)
+{
+	r->first = (r->first + 1) % r->max_entries;
+	r->count--;
+}
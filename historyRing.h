@@ -0,0 +1,39 @@
+/* Bounded message history.
+ * A ring of already encoded packets in a fixed size byte arena, indexed
+ * by sequence number. Appending evicts the oldest packets, so memory
+ * use never grows however long the server runs, and a replay is just a
+ * list of pointers into the arena for one vectored write.
+ */
+
+#ifndef HISTORYRING_H
+#define HISTORYRING_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+typedef struct {
+   uint32_t seq;
+   uint32_t offset; // into the arena
+   uint16_t len;
+} HistoryEntry;
+
+typedef struct {
+   uint8_t *arena;
+   uint32_t arena_size;
+   uint32_t write; // where the next packet goes
+   HistoryEntry *entries; // circular, oldest at first
+   uint32_t max_entries;
+   uint32_t first;
+   uint32_t count;
+} HistoryRing;
+
+void historyInit(HistoryRing *r, uint32_t arena_size, uint32_t max_entries);
+void historyFree(HistoryRing *r);
+size_t historySize(HistoryRing *r);
+void historyAppend(HistoryRing *r, uint32_t seq, uint8_t *packet, uint16_t len);
+HistoryEntry *historyEntry(HistoryRing *r, uint32_t i);
+uint8_t *historyData(HistoryRing *r, HistoryEntry *e);
+int historyCheck(HistoryRing *r);
+uint32_t historyFindAfter(HistoryRing *r, uint32_t seq);
+
+#endif
@@ -0,0 +1,68 @@
+/* Memory accounting, see memAccount.h.
+ * Plain counters, only ever touched from the event loop thread.
+ */
+
+#include "memAccount.h"
+
+static size_t used[MEM_KINDS];
+static size_t total = 0;
+static size_t peak = 0;
+static size_t limit = 0; // 0 = no limit
+
+static const char *kindNames[MEM_KINDS] = {
+	"connections", "handles", "input", "output", "history", "sessions", "filter",
+	"index", "presence", "offline", "peers"
+};
+
+/* Counts bytes allocated for kind, or released if negative */
+void memCharge(int kind, ssize_t bytes)
+{
+	used[kind] += bytes;
+	total += bytes;
+	if (total > peak)
+		peak = total;
+}
+
+size_t memUsed(int kind)
+{
+	return used[kind];
+}
+
+size_t memTotal()
+{
+	return total;
+}
+
+size_t memPeak()
+{
+	return peak;
+}
+
+void memSetLimit(size_t bytes)
+{
+	limit = bytes;
+}
+
+size_t memLimit()
+{
+	return limit;
+}
+
+/* How close to the limit the server would be after allocating extra
+ * more bytes: MEM_OK, MEM_SHED or MEM_FULL. Always MEM_OK without a limit
+ */
+int memPressure(size_t extra)
+{
+	if (limit == 0)
+		return MEM_OK;
+	if (total + extra > limit)
+		return MEM_FULL;
+	if (total + extra > limit / 100 * MEM_SHED_PERCENT)
+		return MEM_SHED;
+	return MEM_OK;
+}
+
+const char *memKindName(int kind)
+{
+	return kindNames[kind];
+}
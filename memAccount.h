@@ -0,0 +1,49 @@
+/* Memory accounting.
+ * The server charges what it allocates for each kind of state here and
+ * releases it again when freed, so it always knows how much it holds.
+ * With a limit set (memSetLimit()), memPressure() tells the caller when
+ * to start shedding work and when to stop taking more on, well before
+ * the kernel runs out and kills the whole process.
+ *
+ * The state the server keeps is counted. Short lived working memory
+ * (a search's postings, the index flush and merge threads), kernel
+ * socket buffers, mapped files and library internals are not.
+ */
+
+#ifndef MEMACCOUNT_H
+#define MEMACCOUNT_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/* What the memory is held for */
+#define MEM_CONNECTIONS 0 // per socket state and the connection table
+#define MEM_HANDLES 1 // the handle table
+#define MEM_INPUT 2 // received frames waiting to be dispatched
+#define MEM_OUTPUT 3 // frames waiting for a slow socket
+#define MEM_HISTORY 4 // the history rings
+#define MEM_SESSIONS 5 // resumable sessions and the frames they keep
+#define MEM_FILTER 6 // the content filter's compiled terms
+#define MEM_INDEX 7 // search index postings not yet flushed to a segment
+#define MEM_PRESENCE 8 // which node each user is on
+#define MEM_OFFLINE 9 // the offline store's handle table
+#define MEM_PEERS 10 // per node link batches
+#define MEM_KINDS 11
+
+/* memPressure() levels */
+#define MEM_OK 0
+#define MEM_SHED 1 // over MEM_SHED_PERCENT of the limit - drop what can be dropped
+#define MEM_FULL 2 // at the limit - take nothing new on
+
+#define MEM_SHED_PERCENT 90
+
+void memCharge(int kind, ssize_t bytes);
+size_t memUsed(int kind);
+size_t memTotal();
+size_t memPeak();
+void memSetLimit(size_t bytes);
+size_t memLimit();
+int memPressure(size_t extra);
+const char *memKindName(int kind);
+
+#endif
@@ -16,12 +16,16 @@
 #include <string.h>
 #include <strings.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <netinet/in.h>
 #include <netdb.h>
 #include <poll.h>
+#include <errno.h>
 
 #include "networks.h"
 #include "gethostbyname6.h"
+#include "shmRing.h"
+#include "tlsSocket.h"
 
 
 // This function creates the server socket.  The function
@@ -97,38 +101,217 @@ int tcpAccept(int server_socket, int debugFlag)
 	return(client_socket);
 }
 
+// Has the kernel spin on the device queue for up to microseconds when a
+// read (or poll(), with net.core.busy_poll set) finds the socket empty,
+// rather than sleep until an interrupt. -1 where that isn't allowed
+
+int socketBusyPoll(int socketNum, int microseconds)
+{
+#ifdef SO_BUSY_POLL
+	return setsockopt(socketNum, SOL_SOCKET, SO_BUSY_POLL, &microseconds, sizeof(microseconds));
+#else
+	errno = ENOPROTOOPT;
+	return -1;
+#endif
+}
+
 int tcpClientSetup(char * serverName, char * port, int debugFlag)
 {
 	// This is used by the client to connect to a server using TCP
 
 	int socket_num;
-	uint8_t * ipAddress = NULL;
-	struct sockaddr_in6 server;
+	int error = 0;
+	AddrList addrs;
 
-	// create the socket
-	if ((socket_num = socket(AF_INET6, SOCK_STREAM, 0)) < 0)
+	if (debugFlag)
 	{
-		perror("socket call");
+		printf("Connecting to server on port number %s\n", port);
+	}
+
+	// get the IP addresses of the server (DNS lookup, cached)
+	if ((error = resolveWait(serverName, port, &addrs, RESOLVE_TIMEOUT)) != 0)
+	{
+		fprintf(stderr, "Error getaddrinfo (host: %s): %s\n", serverName, gai_strerror(error));
+		exit(-1);
+	}
+
+	if ((socket_num = tcpClientConnectList(&addrs, CONNECT_TIMEOUT)) < 0)
+	{
+		perror("connect call");
 		exit(-1);
 	}
+	resolvePrefer(serverName, port, &addrs);
 
 	if (debugFlag)
 	{
-		printf("Connecting to server on port number %s\n", port);
+		printf("Connected to %s Port Number: %d\n", serverName, atoi(port));
+	}
+
+	return socket_num;
+}
+
+// Connects to whichever of the addresses answers first. Each attempt
+// gets CONNECT_STAGGER ms (less if it fails) before the next starts
+// alongside it, so a dead address costs a fraction of a second rather
+// than a TCP timeout. Returns a blocking socket, or -1 with errno set
+// once every address failed or timeoutMs passed
+
+int tcpClientConnectList(AddrList * addrs, int timeoutMs)
+{
+	struct pollfd attempts[RESOLVE_MAX_ADDRS];
+	int tried[RESOLVE_MAX_ADDRS]; // attempts[i] is to addrs[tried[i]]
+	struct sockaddr_storage first;
+	socklen_t firstLen = 0;
+	int pending = 0;
+	int next = 0;
+	int winner = -1;
+	int error = ETIMEDOUT;
+	int wait = 0;
+	int ready = 0;
+	int sock, i;
+	socklen_t len = sizeof(error);
+
+	while (winner < 0 && timeoutMs > 0 && (pending > 0 || next < addrs->count))
+	{
+		if (next < addrs->count)
+		{
+			sock = socket(addrs->addrs[next].ss_family, SOCK_STREAM, 0);
+			if (sock >= 0)
+			{
+				fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK);
+				tried[pending] = next;
+				attempts[pending].fd = sock;
+				attempts[pending].events = POLLOUT;
+				if (connect(sock, (struct sockaddr *)&addrs->addrs[next], addrs->lens[next]) == 0)
+					winner = pending++;
+				else if (errno == EINPROGRESS)
+					pending++;
+				else
+				{
+					error = errno;
+					close(sock);
+				}
+			}
+			next++;
+			if (winner >= 0 || pending == 0)
+				continue;
+		}
+
+		wait = next < addrs->count && timeoutMs > CONNECT_STAGGER ? CONNECT_STAGGER : timeoutMs;
+		ready = poll(attempts, pending, wait);
+		timeoutMs -= wait; // a little short after an early wakeup, never over
+		if (ready < 0 && errno != EINTR)
+		{
+			error = errno;
+			break;
+		}
+		for (i = 0; i < pending && winner < 0 && ready > 0; i++)
+		{
+			if (attempts[i].revents == 0)
+				continue;
+			len = sizeof(error);
+			if (getsockopt(attempts[i].fd, SOL_SOCKET, SO_ERROR, &error, &len) == 0 && error == 0)
+			{
+				winner = i;
+				break;
+			}
+			close(attempts[i].fd);
+			attempts[i] = attempts[--pending];
+			tried[i--] = tried[pending];
+		}
 	}
 
-	// setup the server structure
-	server.sin6_family = AF_INET6;
-	server.sin6_port = htons(atoi(port));
+	if (winner < 0)
+	{
+		for (i = 0; i < pending; i++)
+			close(attempts[i].fd);
+		errno = error;
+		return -1;
+	}
+	sock = attempts[winner].fd;
+	for (i = 0; i < pending; i++)
+		if (i != winner)
+			close(attempts[i].fd);
+	fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) & ~O_NONBLOCK);
+
+	// the address that answered goes first next time
+	first = addrs->addrs[tried[winner]];
+	firstLen = addrs->lens[tried[winner]];
+	for (i = tried[winner]; i > 0; i--)
+	{
+		addrs->addrs[i] = addrs->addrs[i - 1];
+		addrs->lens[i] = addrs->lens[i - 1];
+	}
+	addrs->addrs[0] = first;
+	addrs->lens[0] = firstLen;
+	return sock;
+}
+
+// This function creates a server socket on a Unix domain path, for
+// clients on the same host. Any file left at the path is replaced.
 
-	// get the IP address of the server (DNS lockup)
-	if ((ipAddress = getIPAddress6(serverName, &server)) == NULL)
+int unixServerSetup(char * path)
+{
+	int server_socket = 0;
+	struct sockaddr_un server;
+
+	if (strlen(path) >= sizeof(server.sun_path))
 	{
+		fprintf(stderr, "unix socket path too long: %s\n", path);
 		exit(-1);
 	}
 
-	if (debugFlag)
-		printf("server ip address: %s\n", getIPAddressString(ipAddress));
+	server_socket = socket(AF_UNIX, SOCK_STREAM, 0);
+	if(server_socket < 0)
+	{
+		perror("socket call");
+		exit(1);
+	}
+
+	memset(&server, 0, sizeof(server));
+	server.sun_family = AF_UNIX;
+	strcpy(server.sun_path, path);
+	unlink(path);
+
+	if (bind(server_socket, (struct sockaddr *) &server, sizeof(server)) < 0)
+	{
+		perror("bind call");
+		exit(-1);
+	}
+
+	if (listen(server_socket, BACKLOG) < 0)
+	{
+		perror("listen call");
+		exit(-1);
+	}
+
+	printf("Server Unix Socket %s \n", path);
+
+	return server_socket;
+}
+
+int unixClientSetup(char * path, int debugFlag)
+{
+	// This is used by the client to connect to a server on the same host
+
+	int socket_num;
+	struct sockaddr_un server;
+
+	if (strlen(path) >= sizeof(server.sun_path))
+	{
+		fprintf(stderr, "unix socket path too long: %s\n", path);
+		exit(-1);
+	}
+
+	if ((socket_num = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+	{
+		perror("socket call");
+		exit(-1);
+	}
+
+	memset(&server, 0, sizeof(server));
+	server.sun_family = AF_UNIX;
+	strcpy(server.sun_path, path);
 
 	if(connect(socket_num, (struct sockaddr*)&server, sizeof(server)) < 0)
 	{
@@ -138,9 +321,85 @@ int tcpClientSetup(char * serverName, char * port, int debugFlag)
 
 	if (debugFlag)
 	{
-		printf("Connected to %s IP: %s Port Number: %d\n", serverName, getIPAddressString(ipAddress), atoi(port));
+		printf("Connected to %s\n", path);
+	}
+
+	return socket_num;
+}
+
+// Connects to serverName:port, or to the Unix socket when serverName
+// is unix:/path or shm:/path (port is then ignored), over TLS when it
+// is tls:host
+
+int clientSetup(char * serverName, char * port, int debugFlag)
+{
+	int socket_num = 0;
+
+	if (strncmp(serverName, SHM_PREFIX, strlen(SHM_PREFIX)) == 0)
+	{
+		socket_num = unixClientSetup(serverName + strlen(SHM_PREFIX), debugFlag);
+		if (shmConnect(socket_num) < 0)
+			fprintf(stderr, "shared memory refused, staying on the socket\n");
+		return socket_num;
+	}
+	if (strncmp(serverName, UNIX_PREFIX, strlen(UNIX_PREFIX)) == 0)
+		return unixClientSetup(serverName + strlen(UNIX_PREFIX), debugFlag);
+	if (strncmp(serverName, TLS_PREFIX, strlen(TLS_PREFIX)) == 0)
+	{
+		serverName += strlen(TLS_PREFIX);
+		socket_num = tcpClientSetup(serverName, port, debugFlag);
+		if (tlsConnect(socket_num, serverName) < 0)
+			exit(-1);
+		return socket_num;
 	}
+	return tcpClientSetup(serverName, port, debugFlag);
+}
+
+// Like clientSetup(), but returns -1 rather than exiting when the server
+// can't be reached, for clients that retry
 
+int clientTrySetup(char * serverName, char * port)
+{
+	int socket_num = -1;
+	AddrList addrs;
+	struct sockaddr_un local;
+	char * path = NULL;
+	int shm = strncmp(serverName, SHM_PREFIX, strlen(SHM_PREFIX)) == 0;
+	int tls = strncmp(serverName, TLS_PREFIX, strlen(TLS_PREFIX)) == 0;
+
+	if (shm)
+		path = serverName + strlen(SHM_PREFIX);
+	else if (strncmp(serverName, UNIX_PREFIX, strlen(UNIX_PREFIX)) == 0)
+		path = serverName + strlen(UNIX_PREFIX);
+
+	if (path != NULL)
+	{
+		if (strlen(path) >= sizeof(local.sun_path) || (socket_num = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+			return -1;
+		memset(&local, 0, sizeof(local));
+		local.sun_family = AF_UNIX;
+		strcpy(local.sun_path, path);
+		if (connect(socket_num, (struct sockaddr*)&local, sizeof(local)) < 0)
+		{
+			close(socket_num);
+			return -1;
+		}
+		if (shm && shmConnect(socket_num) < 0)
+			fprintf(stderr, "shared memory refused, staying on the socket\n");
+		return socket_num;
+	}
+
+	if (tls)
+		serverName += strlen(TLS_PREFIX);
+	if (resolveWait(serverName, port, &addrs, RESOLVE_TIMEOUT) != 0
+		|| (socket_num = tcpClientConnectList(&addrs, CONNECT_TIMEOUT)) < 0)
+		return -1;
+	resolvePrefer(serverName, port, &addrs);
+	if (tls && tlsConnect(socket_num, serverName) < 0)
+	{
+		close(socket_num);
+		return -1;
+	}
 	return socket_num;
 }
 
@@ -8,11 +8,20 @@
 #ifndef __NETWORKS_H__
 #define __NETWORKS_H__
 
+#include <netinet/in.h>
+
+#include "resolver.h"
+
 /* Client and Server scope macros */
-#define BACKLOG 10
+#define BACKLOG SOMAXCONN // a fleet client (chatFleet) connects hundreds at once
 #define MAXBUF 1400
 #define MAX_HANDLE 100
 #define PORT 55555
+#define UNIX_PREFIX "unix:" // server names starting with this are AF_UNIX paths
+#define SHM_PREFIX "shm:" // same, then moved to shared memory rings (shmRing.h)
+#define TLS_PREFIX "tls:" // a TCP server name, over TLS (tlsSocket.h)
+#define CONNECT_STAGGER 250 // ms before the next address is tried alongside (RFC 8305)
+#define CONNECT_TIMEOUT 10000 // ms for a client to connect at all
 
 
 #define TIME_IS_NULL 1
@@ -21,9 +30,15 @@
 // for the server side
 int tcpServerSetup(int portNumber);
 int tcpAccept(int server_socket, int debugFlag);
+int unixServerSetup(char * path);
+int socketBusyPoll(int socketNum, int microseconds);
 
 // for the client side
 int tcpClientSetup(char * serverName, char * port, int debugFlag);
+int tcpClientConnectList(AddrList * addrs, int timeoutMs);
+int unixClientSetup(char * path, int debugFlag);
+int clientSetup(char * serverName, char * port, int debugFlag);
+int clientTrySetup(char * serverName, char * port);
 
 int selectCall(int socketNumber, int seconds, int microseconds, int timeIsNotNull);
 
@@ -0,0 +1,465 @@
+/* Offline message store.
+ * Log segments are fixed size files mapped MAP_SHARED and only ever
+ * appended to. A record is written payload first and length last, and
+ * carries a checksum so a record torn by a crash ends recovery of its
+ * segment. Appends are made durable in groups by offlineCommit(), which
+ * the server calls on a short timer rather than once per message.
+ * Delivery just flags the record; a segment is deleted once every
+ * record in it has been delivered.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "offlineStore.h"
+#include "memAccount.h"
+#include "pollLib.h"
+
+#define RECORD_ALIGN 8
+#define INIT_TABLE_SIZE 1024
+
+/* On disk record header, followed by the handle and then the packet */
+typedef struct {
+   uint32_t len; // whole record incl. padding, 0 = no more records in segment
+   uint32_t checksum; // FNV-1a of handle + packet
+   uint32_t next_segment; // next record queued for the same handle
+   uint32_t next_offset;
+   uint16_t packet_len;
+   uint8_t handle_len;
+   uint8_t delivered;
+} __attribute__((packed)) OfflineRecord;
+
+/* One per known handle - the only per user state kept on the heap */
+typedef struct handleEntry {
+   struct handleEntry *next; // hash chain
+   uint32_t head_segment; // oldest undelivered message
+   uint32_t head_offset;
+   uint32_t tail_segment; // newest message
+   uint32_t tail_offset;
+   uint32_t count;
+   char handle[MAX_HANDLE + 1];
+} HandleEntry;
+
+typedef struct {
+   int fd;
+   uint8_t *map;
+   uint32_t used; // bytes of records written
+   uint32_t live; // records not yet delivered
+   uint32_t synced; // bytes already made durable
+} Segment;
+
+// Offline store global variables
+static char *storeDir = NULL;
+static Segment **segments = NULL; // indexed by segment number, NULL once deleted
+static uint32_t numSegments = 0; // the last one is the active segment
+static HandleEntry **handleTable = NULL;
+static uint32_t handleTableSize = 0;
+static uint32_t numHandles = 0;
+static FILE *registry = NULL; // every handle that ever logged in, one per line
+static int dirty = 0;
+
+static HandleEntry *findHandle(char *handle);
+static HandleEntry *addHandle(char *handle);
+static uint32_t hashBytes(uint32_t hash, uint8_t *bytes, int len);
+static Segment *openSegment(uint32_t id, int create);
+static void recoverSegment(uint32_t id);
+static void removeSegment(uint32_t id);
+static void linkRecord(HandleEntry *e, uint32_t segment, uint32_t offset);
+static OfflineRecord *recordAt(uint32_t segment, uint32_t offset);
+
+/* Opens (or creates) the store in dir and rebuilds every handle's
+ * queue from the log segments found there
+ */
+void setupOfflineStore(char *dir)
+{
+	char path[1024];
+	char line[MAX_HANDLE + 2];
+	struct dirent *entry = NULL;
+	DIR *d = NULL;
+	uint32_t id = 0;
+	uint32_t maxId = 0;
+	int found = 0;
+
+	storeDir = dir;
+	if (mkdir(dir, 0700) < 0 && errno != EEXIST)
+	{
+		perror("mkdir offline store");
+		exit(EXIT_FAILURE);
+	}
+
+	handleTableSize = INIT_TABLE_SIZE;
+	handleTable = sCalloc(handleTableSize, sizeof(HandleEntry *));
+	memCharge(MEM_OFFLINE, handleTableSize * sizeof(HandleEntry *));
+
+	// known handles
+	snprintf(path, sizeof(path), "%s/handles", dir);
+	if ((registry = fopen(path, "a+")) == NULL)
+	{
+		perror("fopen offline handle registry");
+		exit(EXIT_FAILURE);
+	}
+	rewind(registry);
+	while (fgets(line, sizeof(line), registry) != NULL)
+	{
+		line[strcspn(line, "\n")] = '\0';
+		if (line[0] != '\0' && findHandle(line) == NULL)
+			addHandle(line);
+	}
+
+	// find the segment numbers on disk
+	if ((d = opendir(dir)) == NULL)
+	{
+		perror("opendir offline store");
+		exit(EXIT_FAILURE);
+	}
+	while ((entry = readdir(d)) != NULL)
+	{
+		if (sscanf(entry->d_name, "seg-%08u.log", &id) == 1)
+		{
+			if (!found || id > maxId)
+				maxId = id;
+			found = 1;
+		}
+	}
+	closedir(d);
+
+	numSegments = found ? maxId + 1 : 1;
+	segments = sCalloc(numSegments, sizeof(Segment *));
+	for (id = 0; found && id < numSegments; id++)
+		recoverSegment(id);
+
+	if (segments[numSegments - 1] == NULL)
+		segments[numSegments - 1] = openSegment(numSegments - 1, 1);
+}
+
+int offlineKnownHandle(char *handle)
+{
+	return storeDir != NULL && findHandle(handle) != NULL;
+}
+
+/* remembers a handle that logged in so messages to it are kept later */
+void offlineRegisterHandle(char *handle)
+{
+	if (storeDir == NULL || findHandle(handle) != NULL)
+		return;
+	addHandle(handle);
+	fprintf(registry, "%s\n", handle);
+	fflush(registry);
+	dirty = 1;
+}
+
+/* Appends a packet to handle's queue. Returns -1 if it couldn't be stored */
+int offlineStoreMessage(char *handle, uint8_t *packet, uint16_t len)
+{
+	HandleEntry *e = findHandle(handle);
+	Segment *seg = segments[numSegments - 1];
+	OfflineRecord *rec = NULL;
+	uint8_t handle_len = strlen(handle);
+	uint32_t reclen = sizeof(OfflineRecord) + handle_len + len;
+	uint32_t offset = 0;
+
+	if (e == NULL)
+		return -1;
+	reclen = (reclen + RECORD_ALIGN - 1) & ~(RECORD_ALIGN - 1);
+
+	// roll over to a new segment (leaving room for the 0 length end marker)
+	if (seg->used + reclen + sizeof(uint32_t) > OFFLINE_SEGMENT_SIZE)
+	{
+		offlineCommit();
+		segments = srealloc(segments, sizeof(Segment *) * (numSegments + 1));
+		if ((segments[numSegments] = openSegment(numSegments, 1)) == NULL)
+			return -1;
+		numSegments++;
+		if (seg->live == 0)
+			removeSegment(numSegments - 2);
+		seg = segments[numSegments - 1];
+	}
+
+	offset = seg->used;
+	rec = (OfflineRecord *)(seg->map + offset);
+	memcpy((uint8_t *)rec + sizeof(OfflineRecord), handle, handle_len);
+	memcpy((uint8_t *)rec + sizeof(OfflineRecord) + handle_len, packet, len);
+	rec->checksum = hashBytes(hashBytes(2166136261u, (uint8_t *)handle, handle_len), packet, len);
+	rec->next_segment = OFFLINE_NONE;
+	rec->next_offset = OFFLINE_NONE;
+	rec->packet_len = len;
+	rec->handle_len = handle_len;
+	rec->delivered = 0;
+	rec->len = reclen; // written last, marks the record complete
+
+	seg->used += reclen;
+	seg->live++;
+	linkRecord(e, numSegments - 1, offset);
+	dirty = 1;
+	return 0;
+}
+
+int offlinePending(char *handle)
+{
+	HandleEntry *e = NULL;
+	if (storeDir == NULL || (e = findHandle(handle)) == NULL)
+		return 0;
+	return e->count;
+}
+
+/* Oldest undelivered packet for handle, pointing into the mapped log.
+ * NULL if nothing is queued
+ */
+uint8_t *offlinePeek(char *handle, uint16_t *len)
+{
+	HandleEntry *e = findHandle(handle);
+	OfflineRecord *rec = NULL;
+
+	if (e == NULL || e->count == 0)
+		return NULL;
+	rec = recordAt(e->head_segment, e->head_offset);
+	*len = rec->packet_len;
+	return (uint8_t *)rec + sizeof(OfflineRecord) + rec->handle_len;
+}
+
+/* marks the packet returned by offlinePeek() as delivered */
+void offlinePop(char *handle)
+{
+	HandleEntry *e = findHandle(handle);
+	OfflineRecord *rec = NULL;
+	uint32_t segment = 0;
+
+	if (e == NULL || e->count == 0)
+		return;
+
+	segment = e->head_segment;
+	rec = recordAt(segment, e->head_offset);
+	rec->delivered = 1;
+	e->head_segment = rec->next_segment;
+	e->head_offset = rec->next_offset;
+	if (--e->count == 0)
+	{
+		e->head_segment = e->tail_segment = OFFLINE_NONE;
+		e->head_offset = e->tail_offset = OFFLINE_NONE;
+	}
+
+	if (--segments[segment]->live == 0 && segment != numSegments - 1)
+		removeSegment(segment);
+}
+
+/* Group commit - makes every append since the last call durable with
+ * one msync() per touched segment
+ */
+void offlineCommit()
+{
+	uint32_t id = 0;
+	uint32_t start = 0;
+	long page = sysconf(_SC_PAGESIZE);
+	Segment *seg = NULL;
+
+	if (!dirty)
+		return;
+
+	for (id = 0; id < numSegments; id++)
+	{
+		if ((seg = segments[id]) == NULL || seg->synced == seg->used)
+			continue;
+		start = seg->synced & ~(page - 1);
+		if (msync(seg->map + start, seg->used - start, MS_SYNC) < 0)
+			perror("msync offline segment");
+		seg->synced = seg->used;
+	}
+	if (fdatasync(fileno(registry)) < 0)
+		perror("fdatasync offline handle registry");
+	dirty = 0;
+}
+
+int offlineDirty()
+{
+	return dirty;
+}
+
+static OfflineRecord *recordAt(uint32_t segment, uint32_t offset)
+{
+	return (OfflineRecord *)(segments[segment]->map + offset);
+}
+
+/* appends the record at segment/offset to the end of e's list */
+static void linkRecord(HandleEntry *e, uint32_t segment, uint32_t offset)
+{
+	OfflineRecord *tail = NULL;
+
+	if (e->count == 0)
+	{
+		e->head_segment = segment;
+		e->head_offset = offset;
+	}
+	else
+	{
+		tail = recordAt(e->tail_segment, e->tail_offset);
+		tail->next_segment = segment;
+		tail->next_offset = offset;
+	}
+	e->tail_segment = segment;
+	e->tail_offset = offset;
+	e->count++;
+}
+
+static Segment *openSegment(uint32_t id, int create)
+{
+	char path[1024];
+	Segment *seg = sCalloc(1, sizeof(Segment));
+
+	snprintf(path, sizeof(path), "%s/seg-%08u.log", storeDir, id);
+	if ((seg->fd = open(path, O_RDWR | (create ? O_CREAT : 0), 0600)) < 0)
+	{
+		free(seg);
+		return NULL;
+	}
+	if (ftruncate(seg->fd, OFFLINE_SEGMENT_SIZE) < 0)
+	{
+		perror("ftruncate offline segment");
+		exit(EXIT_FAILURE);
+	}
+	seg->map = mmap(NULL, OFFLINE_SEGMENT_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, seg->fd, 0);
+	if (seg->map == MAP_FAILED)
+	{
+		perror("mmap offline segment");
+		exit(EXIT_FAILURE);
+	}
+	return seg;
+}
+
+/* Walks a segment's records, requeueing the undelivered ones. The next
+ * pointers are rewritten as records are relinked, so a crash between an
+ * append and the update of the previous tail loses nothing
+ */
+static void recoverSegment(uint32_t id)
+{
+	Segment *seg = NULL;
+	OfflineRecord *rec = NULL;
+	HandleEntry *e = NULL;
+	char handle[MAX_HANDLE + 1];
+	uint32_t offset = 0;
+	uint8_t *payload = NULL;
+
+	if ((seg = openSegment(id, 0)) == NULL)
+		return;
+	segments[id] = seg;
+
+	while (offset + sizeof(OfflineRecord) <= OFFLINE_SEGMENT_SIZE)
+	{
+		rec = (OfflineRecord *)(seg->map + offset);
+		payload = (uint8_t *)rec + sizeof(OfflineRecord);
+		if (rec->len == 0)
+			break;
+		if (rec->len < sizeof(OfflineRecord) + rec->handle_len + rec->packet_len
+			|| offset + rec->len > OFFLINE_SEGMENT_SIZE
+			|| rec->handle_len > MAX_HANDLE
+			|| rec->checksum != hashBytes(hashBytes(2166136261u, payload, rec->handle_len),
+				payload + rec->handle_len, rec->packet_len))
+		{
+			// torn write - everything from here on is discarded
+			fprintf(stderr, "offline segment %u truncated at %u\n", id, offset);
+			memset(rec, 0, sizeof(OfflineRecord));
+			break;
+		}
+
+		if (!rec->delivered)
+		{
+			memcpy(handle, payload, rec->handle_len);
+			handle[rec->handle_len] = '\0';
+			if ((e = findHandle(handle)) == NULL)
+				e = addHandle(handle);
+			rec->next_segment = OFFLINE_NONE;
+			rec->next_offset = OFFLINE_NONE;
+			linkRecord(e, id, offset);
+			seg->live++;
+		}
+		offset += rec->len;
+	}
+	seg->used = offset;
+	seg->synced = offset;
+
+	if (seg->live == 0 && id != numSegments - 1)
+		removeSegment(id);
+}
+
+static void removeSegment(uint32_t id)
+{
+	char path[1024];
+	Segment *seg = segments[id];
+
+	munmap(seg->map, OFFLINE_SEGMENT_SIZE);
+	close(seg->fd);
+	snprintf(path, sizeof(path), "%s/seg-%08u.log", storeDir, id);
+	unlink(path);
+	free(seg);
+	segments[id] = NULL;
+}
+
+static uint32_t hashBytes(uint32_t hash, uint8_t *bytes, int len)
+{
+	int i = 0;
+	for (i = 0; i < len; i++)
+	{
+		hash ^= bytes[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+static HandleEntry *findHandle(char *handle)
+{
+	uint32_t index = hashBytes(2166136261u, (uint8_t *)handle, strlen(handle)) & (handleTableSize - 1);
+	HandleEntry *e = NULL;
+
+	for (e = handleTable[index]; e != NULL; e = e->next)
+	{
+		if (strcmp(e->handle, handle) == 0)
+			return e;
+	}
+	return NULL;
+}
+
+static HandleEntry *addHandle(char *handle)
+{
+	HandleEntry *e = NULL;
+	HandleEntry *next = NULL;
+	HandleEntry **oldTable = handleTable;
+	uint32_t oldSize = handleTableSize;
+	uint32_t i = 0;
+	uint32_t index = 0;
+
+	// keep chains short - double the table past one entry per bucket
+	if (numHandles >= handleTableSize)
+	{
+		handleTableSize *= 2;
+		handleTable = sCalloc(handleTableSize, sizeof(HandleEntry *));
+		for (i = 0; i < oldSize; i++)
+		{
+			for (e = oldTable[i]; e != NULL; e = next)
+			{
+				next = e->next;
+				index = hashBytes(2166136261u, (uint8_t *)e->handle, strlen(e->handle)) & (handleTableSize - 1);
+				e->next = handleTable[index];
+				handleTable[index] = e;
+			}
+		}
+		free(oldTable);
+		memCharge(MEM_OFFLINE, (handleTableSize - oldSize) * sizeof(HandleEntry *));
+	}
+
+	e = sCalloc(1, sizeof(HandleEntry));
+	memCharge(MEM_OFFLINE, sizeof(HandleEntry));
+	strncpy(e->handle, handle, MAX_HANDLE);
+	e->head_segment = e->tail_segment = OFFLINE_NONE;
+	e->head_offset = e->tail_offset = OFFLINE_NONE;
+	index = hashBytes(2166136261u, (uint8_t *)handle, strlen(handle)) & (handleTableSize - 1);
+	e->next = handleTable[index];
+	handleTable[index] = e;
+	numHandles++;
+	return e;
+}
@@ -0,0 +1,26 @@
+/* Offline message store.
+ * Direct messages for handles that have logged in before but are not
+ * online are appended to segmented, memory mapped log files. Each
+ * handle's messages form a linked list through the log, so the heap only
+ * holds one small entry per handle, never the messages themselves.
+ */
+
+#ifndef OFFLINESTORE_H
+#define OFFLINESTORE_H
+
+#include <stdint.h>
+
+#define OFFLINE_SEGMENT_SIZE (64 * 1024 * 1024) // bytes mapped per log file
+#define OFFLINE_NONE 0xffffffff // end of a handle's list
+
+void setupOfflineStore(char *dir);
+int offlineKnownHandle(char *handle);
+void offlineRegisterHandle(char *handle);
+int offlineStoreMessage(char *handle, uint8_t *packet, uint16_t len);
+int offlinePending(char *handle);
+uint8_t *offlinePeek(char *handle, uint16_t *len);
+void offlinePop(char *handle);
+void offlineCommit();
+int offlineDirty();
+
+#endif
@@ -0,0 +1,261 @@
+/* Per connection outbound frame queue.
+ * Frames are kept in order in a singly linked list. Once a queue has
+ * spilled, every new frame goes to the spill file until it has been
+ * read back, so ordering is preserved across memory and disk.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <arpa/inet.h>
+
+#include "outQueue.h"
+#include "pollLib.h"
+#include "memAccount.h"
+#include "slabPool.h"
+
+#define OUT_MAX_IOV 64 // frames gathered into one sendmsg()
+
+static int outQueueRefill(OutQueue *q);
+static void outQueueDropSpill(OutQueue *q);
+static void outQueueRelease(OutQueue *q, OutFrame *f);
+
+void outQueueInit(OutQueue *q)
+{
+	q->head = NULL;
+	q->tail = NULL;
+	q->bytes = 0;
+	q->frames = 0;
+	q->mem = 0;
+	q->spill_fd = -1;
+	q->spill_read = 0;
+	q->spill_write = 0;
+}
+
+/* copies the unsent part of a frame (sent bytes already written) onto the tail */
+void outQueuePush(OutQueue *q, uint8_t *buf, uint16_t len, uint16_t sent, uint8_t flags)
+{
+	OutFrame *f = (OutFrame *) chunkAlloc(sizeof(OutFrame) + len);
+	memcpy(f->data, buf, len);
+	f->len = len;
+	f->sent = sent;
+	f->flags = flags;
+	f->next = NULL;
+
+	if (q->tail == NULL)
+		q->head = f;
+	else
+		q->tail->next = f;
+	q->tail = f;
+	q->bytes += len - sent;
+	q->frames++;
+	q->mem += sizeof(OutFrame) + len;
+	memCharge(MEM_OUTPUT, sizeof(OutFrame) + len);
+}
+
+/* Drops the oldest droppable frame that hasn't started going out
+ * (a partly written frame must be finished to keep the stream framed).
+ * Returns the number of bytes freed, 0 if nothing could be dropped
+ */
+int outQueueDropOldest(OutQueue *q)
+{
+	OutFrame *prev = NULL;
+	OutFrame *f = q->head;
+	int freed = 0;
+
+	while (f != NULL && (f->sent > 0 || !(f->flags & OUT_DROPPABLE)))
+	{
+		prev = f;
+		f = f->next;
+	}
+	if (f == NULL)
+		return 0;
+
+	if (prev == NULL)
+		q->head = f->next;
+	else
+		prev->next = f->next;
+	if (q->tail == f)
+		q->tail = prev;
+
+	freed = f->len;
+	q->bytes -= freed;
+	q->frames--;
+	outQueueRelease(q, f);
+	return freed;
+}
+
+/* Appends a whole frame to the spill file, creating it on first use.
+ * The file is unlinked straight away so it disappears with the process.
+ * Returns -1 if the frame could not be written
+ */
+int outQueueSpill(OutQueue *q, uint8_t *buf, uint16_t len, char *spillDir)
+{
+	char path[1024];
+
+	if (q->spill_fd < 0)
+	{
+		snprintf(path, sizeof(path), "%s/chatspillXXXXXX", spillDir);
+		if ((q->spill_fd = mkstemp(path)) < 0)
+		{
+			perror("mkstemp spill file");
+			return -1;
+		}
+		unlink(path);
+	}
+
+	if (pwrite(q->spill_fd, buf, len, q->spill_write) != len)
+	{
+		perror("pwrite spill file");
+		return -1;
+	}
+	q->spill_write += len;
+	return 0;
+}
+
+int outQueueSpilled(OutQueue *q)
+{
+	return q->spill_write > q->spill_read;
+}
+
+int outQueueEmpty(OutQueue *q)
+{
+	return q->head == NULL && !outQueueSpilled(q);
+}
+
+/* Writes as much of the queue as the socket accepts without blocking.
+ * Returns -1 if the socket failed, OUT_SPILL_LOST if the spill file
+ * did, 0 otherwise (check outQueueEmpty)
+ */
+int outQueueFlush(OutQueue *q, int socketNum)
+{
+	struct iovec iov[OUT_MAX_IOV];
+	struct msghdr msg;
+	OutFrame *f = NULL;
+	ssize_t sent = 0;
+	int count = 0;
+
+	while (q->head != NULL || outQueueSpilled(q))
+	{
+		if (q->head == NULL && outQueueRefill(q) < 0)
+			return OUT_SPILL_LOST;
+
+		// gather the queued frames into one write
+		count = 0;
+		for (f = q->head; f != NULL && count < OUT_MAX_IOV; f = f->next)
+		{
+			iov[count].iov_base = f->data + f->sent;
+			iov[count].iov_len = f->len - f->sent;
+			count++;
+		}
+
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = iov;
+		msg.msg_iovlen = count;
+		if ((sent = transportSendmsg(socketNum, &msg, MSG_DONTWAIT | MSG_NOSIGNAL)) < 0)
+		{
+			if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+				return 0;
+			return -1;
+		}
+
+		// release fully written frames, note progress on a partial one
+		while (sent > 0)
+		{
+			f = q->head;
+			if (sent < f->len - f->sent)
+			{
+				f->sent += sent;
+				q->bytes -= sent;
+				return 0; // socket buffer is full
+			}
+			sent -= f->len - f->sent;
+			q->bytes -= f->len - f->sent;
+			q->head = f->next;
+			if (q->head == NULL)
+				q->tail = NULL;
+			q->frames--;
+			outQueueRelease(q, f);
+		}
+	}
+	return 0;
+}
+
+/* Reads the next chunk of whole frames back from the spill file. If
+ * nothing can be read back the file is dropped, and -1 returned
+ */
+static int outQueueRefill(OutQueue *q)
+{
+	static uint8_t chunk[OUT_SPILL_CHUNK];
+	ssize_t got = 0;
+	ssize_t offset = 0;
+	uint16_t len = 0;
+
+	if ((got = pread(q->spill_fd, chunk, sizeof(chunk), q->spill_read)) <= 0)
+	{
+		perror("pread spill file");
+		outQueueDropSpill(q);
+		return -1;
+	}
+
+	while (offset + PKT_LEN <= got)
+	{
+		memcpy(&len, chunk + offset, PKT_LEN);
+		len = ntohs(len);
+		if (len < PKT_LEN || offset + len > got)
+			break;
+		outQueuePush(q, chunk + offset, len, 0, 0);
+		offset += len;
+	}
+	if (offset == 0)
+	{
+		// not even one frame - the file is corrupt, and retrying wouldn't change that
+		fprintf(stderr, "corrupt spill file\n");
+		outQueueDropSpill(q);
+		return -1;
+	}
+	q->spill_read += offset;
+
+	// fully drained - reuse the file from the start
+	if (q->spill_read == q->spill_write)
+	{
+		if (ftruncate(q->spill_fd, 0) < 0)
+			perror("ftruncate spill file");
+		q->spill_read = 0;
+		q->spill_write = 0;
+	}
+	return 0;
+}
+
+void outQueueFree(OutQueue *q)
+{
+	OutFrame *f = NULL;
+	while ((f = q->head) != NULL)
+	{
+		q->head = f->next;
+		outQueueRelease(q, f);
+	}
+	if (q->spill_fd >= 0)
+		close(q->spill_fd);
+	outQueueInit(q);
+}
+
+static void outQueueDropSpill(OutQueue *q)
+{
+	close(q->spill_fd);
+	q->spill_fd = -1;
+	q->spill_read = 0;
+	q->spill_write = 0;
+}
+
+// frees a frame already unlinked from the queue
+static void outQueueRelease(OutQueue *q, OutFrame *f)
+{
+	q->mem -= sizeof(OutFrame) + f->len;
+	memCharge(MEM_OUTPUT, -(ssize_t) (sizeof(OutFrame) + f->len));
+	chunkFree(f, sizeof(OutFrame) + f->len);
+}
@@ -0,0 +1,47 @@
+/* Per connection outbound frame queue.
+ * Frames that can't be written to a socket right away are queued here
+ * and flushed when poll() reports the socket writable. A queue may
+ * overflow to an unlinked temp file on disk (spill) so a slow reader
+ * costs disk space instead of server memory. Frames in memory are
+ * slabPool.h chunks, charged to memAccount.h's MEM_OUTPUT.
+ */
+
+#ifndef OUTQUEUE_H
+#define OUTQUEUE_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#define OUT_DROPPABLE 1 // frame may be discarded under the drop oldest policy
+#define OUT_SPILL_CHUNK 65536 // bytes read back from the spill file at a time
+#define OUT_SPILL_LOST -2 // outQueueFlush(): the spill file couldn't be read back and was dropped
+
+typedef struct outFrame {
+   struct outFrame *next;
+   uint16_t len; // whole frame including the chat header
+   uint16_t sent; // bytes of this frame already written
+   uint8_t flags; // OUT_DROPPABLE
+   uint8_t data[];
+} OutFrame;
+
+typedef struct {
+   OutFrame *head;
+   OutFrame *tail;
+   size_t bytes; // unsent bytes held in memory
+   int frames; // frames held in memory
+   size_t mem; // allocated for them, charged as MEM_OUTPUT
+   int spill_fd; // -1 until the queue first spills
+   off_t spill_read; // next byte to read back from the spill file
+   off_t spill_write; // end of the spill file
+} OutQueue;
+
+void outQueueInit(OutQueue *q);
+void outQueuePush(OutQueue *q, uint8_t *buf, uint16_t len, uint16_t sent, uint8_t flags);
+int outQueueDropOldest(OutQueue *q);
+int outQueueSpill(OutQueue *q, uint8_t *buf, uint16_t len, char *spillDir);
+int outQueueSpilled(OutQueue *q);
+int outQueueEmpty(OutQueue *q);
+int outQueueFlush(OutQueue *q, int socketNum);
+void outQueueFree(OutQueue *q);
+
+#endif
@@ -6,6 +6,14 @@
 #include "networks.h"
 #include "gethostbyname6.h"
 #include "packets.h"
+#include "pollLib.h"
+
+#include <errno.h>
+
+static Transport **transports = NULL; // indexed by socket, NULL = plain socket
+static int transportTableSize = 0;
+static uint8_t *buffered = NULL; // per socket: its transport holds input poll() can't see
+static int numBuffered = 0;
 
 /* returns the new socket number on success */
 int safeSocket() {
@@ -17,6 +25,14 @@ int safeSocket() {
    return socket_num;
 }
 
+/* Frames numbered by a resumable session, in both directions: everything
+ * but the connection's own keepalives and the session setup itself
+ */
+int sessionCounted(uint8_t flag) {
+   return flag != HEARTBEAT_FLAG && flag != HEARTBEAT_ACK_FLAG
+      && flag != SESSION_FLAG && flag != RESUME_FLAG;
+}
+
 /* Fills the chat Header structure with the fields from buf */
 void getChatHeader(struct chatHeader *chatHdr, uint8_t buf[MAXBUF]) {
    //fprintf(stderr, "getChatHeader() pkt_len (N): %u\n", (uint16_t *)buf);
@@ -41,18 +57,56 @@ int sRecv(uint8_t buf[MAXBUF], int socketNum) {
    uint16_t pkt_len = getPktLen(socketNum);
    int messageLen = 0;
 
-   // means 0 byte packet sent
-   if(pkt_len == 0)
+   // means 0 byte packet sent (or a length that can't be a chat packet)
+   if(pkt_len < sizeof(ChatHeader) || pkt_len > MAXBUF)
       return -1;
 
    /* reads the rest of the packet into the buf (offset by 2 from pkt_len) */
-   if ((messageLen = recv(socketNum, buf, pkt_len-PKT_LEN, 0)) < 0) {
+   /* MSG_WAITALL so a packet split across segments isn't read short */
+   if ((messageLen = transportRecv(socketNum, buf, pkt_len-PKT_LEN, MSG_WAITALL)) < 0) {
       perror("recv call in sRecv()");
-      exit(EXIT_FAILURE);
+      return -1; // e.g. connection reset - the peer is gone
    }
+   if(messageLen < pkt_len-PKT_LEN)
+      return -1; // peer closed mid packet
    return pkt_len;
 }
 
+/* sRecv() for a socket that mustn't be waited on: reads what has arrived
+ * of the next packet onto the *have bytes of it already in buf (the whole
+ * packet, pkt_len first), and returns pkt_len (Host Order) once it's all
+ * there, 0 while more is to come, -1 if the peer closed or sent a length
+ * that can't be a chat packet
+ */
+int sRecvPartial(uint8_t buf[MAXBUF], uint16_t *have, int socketNum) {
+   uint16_t pkt_len = 0;
+   size_t want = 0;
+   ssize_t n = 0;
+
+   while(1) {
+      if(*have < PKT_LEN)
+         want = PKT_LEN - *have;
+      else {
+         memcpy(&pkt_len, buf, PKT_LEN);
+         pkt_len = ntohs(pkt_len);
+         if(pkt_len < sizeof(ChatHeader) || pkt_len > MAXBUF)
+            return -1;
+         if(*have == pkt_len)
+            return pkt_len;
+         want = pkt_len - *have;
+      }
+      if((n = transportRecv(socketNum, buf + *have, want, MSG_DONTWAIT)) < 0) {
+         if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+            return 0; // the rest on a later poll
+         perror("recv call in sRecvPartial()");
+         return -1;
+      }
+      if(n == 0)
+         return -1; // peer closed, maybe mid packet
+      *have += n;
+   }
+}
+
 /* Gets the packet length from the user level chat header */
 /* so you can recv the exact amount of bytes */
 /* helper function for sRecv() */
@@ -61,17 +115,19 @@ uint16_t getPktLen(int socketNum) {
    int messageLen = 0; // should be 2 unless client/server ctrl+C (0 bytes)
 
    // read first 2 bytes - packet length
-   if ((messageLen = recv(socketNum, &pkt_len, PKT_LEN, 0)) < 0) {
+   if ((messageLen = transportRecv(socketNum, &pkt_len, PKT_LEN, MSG_WAITALL)) < 0) {
       perror("recv call in getPktLen()");
-      exit(EXIT_FAILURE);
+      return 0; // treated like a closed connection by sRecv()
    }
+   if(messageLen < PKT_LEN)
+      return 0;
    return ntohs(pkt_len);
 }
 
 /* Sends the packet pointed to at buf as is. len = # bytes */
 void sendPacket(int socketNum, uint8_t buf[MAXBUF], uint16_t len) {
 	int sent = 0;
-	if((sent = send(socketNum, buf, len, 0) < 0)) {
+	if((sent = transportSend(socketNum, buf, len, 0) < 0)) {
 		perror("sending packet call\n");
 		exit(EXIT_FAILURE);
 	}
@@ -83,3 +139,114 @@ void makeChatHeader(uint8_t buf[MAXBUF], uint8_t flag, uint16_t pkt_len) {
    memcpy(buf, &pkt_len, PKT_LEN);
    memcpy(buf+PKT_LEN, &flag, FLAG_LEN);
 }
+
+/* Routes a socket's frames through t from now on (NULL = back to the
+ * socket itself). t must stay valid until transportClose()
+ */
+void setTransport(int socketNum, Transport *t) {
+   int i;
+   if(socketNum >= transportTableSize) {
+      int newSize = socketNum + 64;
+      transports = srealloc(transports, sizeof(Transport *) * newSize);
+      buffered = srealloc(buffered, newSize);
+      for(i = transportTableSize; i < newSize; i++) {
+         transports[i] = NULL;
+         buffered[i] = 0;
+      }
+      transportTableSize = newSize;
+   }
+   transports[socketNum] = t;
+}
+
+Transport *getTransport(int socketNum) {
+   if(socketNum < 0 || socketNum >= transportTableSize)
+      return NULL;
+   return transports[socketNum];
+}
+
+/* The descriptor poll() should watch for socketNum */
+int transportWakeFd(int socketNum) {
+   Transport *t = getTransport(socketNum);
+   return t == NULL ? socketNum : t->wake_fd;
+}
+
+short transportRevents(int socketNum, short events) {
+   Transport *t = getTransport(socketNum);
+   return t == NULL ? events : t->revents(t->ctx, events);
+}
+
+ssize_t transportRecv(int socketNum, void *buf, size_t len, int flags) {
+   Transport *t = getTransport(socketNum);
+   if(t == NULL)
+      return recv(socketNum, buf, len, flags);
+   return t->recv(t->ctx, buf, len, flags);
+}
+
+ssize_t transportSend(int socketNum, const void *buf, size_t len, int flags) {
+   struct iovec iov;
+   struct msghdr msg;
+   Transport *t = getTransport(socketNum);
+   if(t == NULL)
+      return send(socketNum, buf, len, flags);
+   iov.iov_base = (void *)buf;
+   iov.iov_len = len;
+   memset(&msg, 0, sizeof(msg));
+   msg.msg_iov = &iov;
+   msg.msg_iovlen = 1;
+   return t->sendmsg(t->ctx, &msg, flags);
+}
+
+ssize_t transportSendmsg(int socketNum, const struct msghdr *msg, int flags) {
+   Transport *t = getTransport(socketNum);
+   if(t == NULL)
+      return sendmsg(socketNum, msg, flags);
+   return t->sendmsg(t->ctx, msg, flags);
+}
+
+/* Tears down the socket's transport, if any. The socket itself is
+ * left for the caller to close
+ */
+void transportClose(int socketNum) {
+   Transport *t = getTransport(socketNum);
+   if(t == NULL)
+      return;
+   transportSetBuffered(socketNum, 0);
+   transports[socketNum] = NULL;
+   t->close(t->ctx);
+}
+
+/* from was dup2()ed onto to, and is about to be closed: its transport
+ * carries on as to's
+ */
+void transportMove(int from, int to) {
+   Transport *t = getTransport(from);
+   int wasBuffered = transportBuffered(from);
+   if(t == NULL)
+      return;
+   transportSetBuffered(from, 0);
+   transports[from] = NULL;
+   setTransport(to, t);
+   transportSetBuffered(to, wasBuffered);
+   if(t->moved != NULL)
+      t->moved(t->ctx, to);
+}
+
+/* For transports that read ahead (TLS): input is waiting in the transport
+ * rather than the socket, so pollCall() reports the socket readable
+ */
+void transportSetBuffered(int socketNum, int on) {
+   on = on != 0;
+   if(getTransport(socketNum) == NULL || buffered[socketNum] == on)
+      return;
+   buffered[socketNum] = on;
+   numBuffered += on ? 1 : -1;
+}
+
+int transportBuffered(int socketNum) {
+   return getTransport(socketNum) != NULL && buffered[socketNum];
+}
+
+/* Whether any socket is, so pollCall() knows not to wait */
+int transportAnyBuffered() {
+   return numBuffered > 0;
+}
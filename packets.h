@@ -21,29 +21,63 @@
 #include <arpa/inet.h>
 
 #include "networks.h"
+#include "protocol.h"
 
 #define PKT_LEN 2 // 2 bytes packet length field
 #define FLAG_LEN 1
-#define MESSAGE_FLAG 5
-#define BROADCAST_FLAG 4
-#define MAX_DEST_HANDLES 9
-#define MAX_MESSAGE 200
+
+/* flag 26 status */
+#define RESUME_OK 0 // missed frames follow, then the session carries on
+#define RESUME_REFUSED 1 // unknown, expired or too far behind - log in again
+
+/* flag 16 modes */
+#define HISTORY_LAST 0 // value = number of packets
+#define HISTORY_SINCE 1 // value = last seq the client has seen
 
 /* Fixed size handle */
 typedef struct {
    uint8_t handle[MAX_HANDLE+1]; // null term
 } __attribute__((packed)) Handle;
 
-struct chatHeader {
+/* Per socket transport hook. A socket with one set has its frames
+ * moved by these calls instead of the socket's own, and is polled
+ * through wake_fd. revents() reports which of the wanted events are
+ * really ready when wake_fd fires
+ */
+typedef struct {
+   ssize_t (*recv)(void *ctx, void *buf, size_t len, int flags);
+   ssize_t (*sendmsg)(void *ctx, const struct msghdr *msg, int flags);
+   short (*revents)(void *ctx, short events);
+   void (*close)(void *ctx);
+   void (*moved)(void *ctx, int socketNum); // optional, see transportMove()
+   int wake_fd;
+   void *ctx;
+} Transport;
+
+typedef struct chatHeader {
 	uint16_t pkt_len;
 	uint8_t flag;
 } __attribute__((packed)) ChatHeader;
 
 void getChatHeader(struct chatHeader *chatHdr, uint8_t buf[MAXBUF]);
 int sRecv(uint8_t buf[MAXBUF], int socketNum);
+int sRecvPartial(uint8_t buf[MAXBUF], uint16_t *have, int socketNum);
 uint16_t getPktLen(int socketNum);
 void sendPacket(int socketNum, uint8_t buf[MAXBUF], uint16_t len);
 void makeChatHeader(uint8_t buf[MAXBUF], uint8_t flag, uint16_t pkt_len);
 int safeSocket();
+int sessionCounted(uint8_t flag);
+void setTransport(int socketNum, Transport *t);
+Transport *getTransport(int socketNum);
+int transportWakeFd(int socketNum);
+short transportRevents(int socketNum, short events);
+ssize_t transportRecv(int socketNum, void *buf, size_t len, int flags);
+ssize_t transportSend(int socketNum, const void *buf, size_t len, int flags);
+ssize_t transportSendmsg(int socketNum, const struct msghdr *msg, int flags);
+void transportClose(int socketNum);
+void transportMove(int from, int to);
+void transportSetBuffered(int socketNum, int on);
+int transportBuffered(int socketNum);
+int transportAnyBuffered();
 
 #endif
@@ -7,6 +7,8 @@
 #include <poll.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <errno.h>
+#include <time.h>
 
 #include "pollLib.h"
 
@@ -15,14 +17,35 @@
 static struct pollfd * pollFileDescriptors;
 static int maxFileDescriptor = 0;
 static int currentPollSetSize = 0;
+static int nextReadyIndex = 0; // where pollNextReady() resumes its scan
+static short * wantedEvents; // per socket, what the caller asked for
+static uint64_t heapAllocs = 0; // srealloc() and sCalloc() calls
+static int busyPollUs = 0; // spin this long before poll() sleeps, 0 = never spin
+static uint64_t spunCalls = 0; // pollCall()s that found a socket ready while spinning
+static uint64_t sleptCalls = 0; // and that went on to sleep in poll()
 
 static void growPollSet(int newSetSize);
+static void updateEvents(int socketNumber);
+static int markBuffered();
+static int spinPoll(int *timeInMilliSeconds);
+static uint64_t nowUs();
 
 // Poll functions (setup, add, remove, call)
 void setupPollSet()
 {
+	int i = 0;
 	currentPollSetSize = POLL_SET_SIZE;
 	pollFileDescriptors = (struct pollfd *) sCalloc(POLL_SET_SIZE, sizeof(struct pollfd));
+	wantedEvents = (short *) sCalloc(POLL_SET_SIZE, sizeof(short));
+	for (i = 0; i < POLL_SET_SIZE; i++)
+		pollFileDescriptors[i].fd = -1;
+}
+
+// grows the set for sockets up to setSize now, rather than as they're added
+void reservePollSet(int setSize)
+{
+	if (setSize > currentPollSetSize)
+		growPollSet(setSize);
 }
 
 void addToPollSet(int socketNumber)
@@ -41,14 +64,74 @@ void addToPollSet(int socketNumber)
 		maxFileDescriptor = socketNumber + 1;
 	}
 
-	pollFileDescriptors[socketNumber].fd = socketNumber;
-	pollFileDescriptors[socketNumber].events = POLLIN;
+	// a socket with a transport hook (see packets.h) is woken through
+	// another descriptor, but still handed out as socketNumber
+	pollFileDescriptors[socketNumber].fd = transportWakeFd(socketNumber);
+	pollFileDescriptors[socketNumber].revents = 0;
+	wantedEvents[socketNumber] = POLLIN;
+	updateEvents(socketNumber);
 }
 
 void removeFromPollSet(int socketNumber)
 {
-	pollFileDescriptors[socketNumber].fd = 0;
+	// negative fds are ignored by poll() (fd 0 would be stdin)
+	pollFileDescriptors[socketNumber].fd = -1;
 	pollFileDescriptors[socketNumber].events = 0;
+	pollFileDescriptors[socketNumber].revents = 0;
+	wantedEvents[socketNumber] = 0;
+}
+
+// stop (or resume) reading from a socket without dropping it from the set
+void setPollIn(int socketNumber, int enable)
+{
+	if (enable)
+		wantedEvents[socketNumber] |= POLLIN;
+	else
+		wantedEvents[socketNumber] &= ~POLLIN;
+	updateEvents(socketNumber);
+}
+
+// also wait for the socket to become writable (queued output pending)
+void setPollOut(int socketNumber, int enable)
+{
+	if (enable)
+		wantedEvents[socketNumber] |= POLLOUT;
+	else
+		wantedEvents[socketNumber] &= ~POLLOUT;
+	updateEvents(socketNumber);
+}
+
+// events reported for the socket by the last pollCall()
+short pollRevents(int socketNumber)
+{
+	short revents = pollFileDescriptors[socketNumber].revents;
+	if (revents && pollFileDescriptors[socketNumber].fd != socketNumber)
+		return transportRevents(socketNumber, wantedEvents[socketNumber]);
+	return revents;
+}
+
+// a wake descriptor only ever becomes readable, whatever is wanted
+static void updateEvents(int socketNumber)
+{
+	short events = wantedEvents[socketNumber];
+	if (pollFileDescriptors[socketNumber].fd != socketNumber && events)
+		events = POLLIN;
+	pollFileDescriptors[socketNumber].events = events;
+}
+
+// reports sockets with buffered input readable, if reading is wanted
+static int markBuffered()
+{
+	int i = 0, marked = 0;
+	for (i = 0; i < maxFileDescriptor; i++)
+	{
+		if ((wantedEvents[i] & POLLIN) && transportBuffered(i))
+		{
+			pollFileDescriptors[i].revents |= POLLIN;
+			marked++;
+		}
+	}
+	return marked;
 }
 
 int pollCall(int timeInMilliSeconds)
@@ -62,11 +145,25 @@ int pollCall(int timeInMilliSeconds)
 	int returnValue = -1;
 	int pollValue = 0;
 
-	if ((pollValue = poll(pollFileDescriptors, maxFileDescriptor, timeInMilliSeconds)) < 0)
+	nextReadyIndex = maxFileDescriptor;
+	// input a transport already read (see packets.h) is ready now
+	if (transportAnyBuffered())
+		timeInMilliSeconds = 0;
+	// a wakeup from poll() costs more than checking for a while first
+	if (busyPollUs > 0 && timeInMilliSeconds != 0)
+		pollValue = spinPoll(&timeInMilliSeconds);
+	if (pollValue == 0)
+		pollValue = poll(pollFileDescriptors, maxFileDescriptor, timeInMilliSeconds);
+	if (pollValue < 0)
 	{
+		// a signal (e.g. a stats dump request) is treated like a timeout
+		if (errno == EINTR)
+			return -1;
 		perror("pollCall");
 		exit(-1);
 	}
+	if (transportAnyBuffered())
+		pollValue += markBuffered();
 
 	// check to see if timeout occurred (poll returned 0)
 	if (pollValue > 0)
@@ -81,6 +178,7 @@ int pollCall(int timeInMilliSeconds)
 			{
 				//printf("for socket %d poll revents: %d\n", i, pollFileDescriptors[i].revents);
 				returnValue = i;
+				nextReadyIndex = i + 1;
 				break;
 			}
 		}
@@ -92,6 +190,75 @@ int pollCall(int timeInMilliSeconds)
 	return returnValue;
 }
 
+/* Low latency mode: pollCall() checks without blocking for up to
+ * microseconds before it sleeps in poll(), so a frame arriving within
+ * that time is picked up without a wakeup (at the cost of a busy CPU)
+ */
+void setBusyPoll(int microseconds)
+{
+	busyPollUs = microseconds;
+}
+
+void busyPollCounts(uint64_t *spun, uint64_t *slept)
+{
+	*spun = spunCalls;
+	*slept = sleptCalls;
+}
+
+/* poll()s without blocking until a socket is ready or the spin (or the
+ * timeout, which is reduced by the time spent) runs out. What poll()
+ * returned last, 0 if the caller is to sleep
+ */
+static int spinPoll(int *timeInMilliSeconds)
+{
+	uint64_t start = nowUs();
+	uint64_t until = start + busyPollUs;
+	int pollValue = 0;
+
+	if (*timeInMilliSeconds > 0 && *timeInMilliSeconds * 1000ull < (uint64_t) busyPollUs)
+		until = start + *timeInMilliSeconds * 1000ull;
+	while ((pollValue = poll(pollFileDescriptors, maxFileDescriptor, 0)) == 0 && nowUs() < until)
+		;
+	if (pollValue > 0)
+		spunCalls++;
+	else if (pollValue == 0)
+		sleptCalls++;
+	if (*timeInMilliSeconds > 0)
+	{
+		*timeInMilliSeconds -= (nowUs() - start) / 1000;
+		if (*timeInMilliSeconds < 0)
+			*timeInMilliSeconds = 0;
+	}
+	return pollValue;
+}
+
+static uint64_t nowUs()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Returns the next socket that was ready in the last pollCall(),
+ * or -1 once all of them have been handed out. Lets the caller service
+ * every ready socket per poll() instead of favouring the lowest one
+ */
+int pollNextReady()
+{
+	int i = 0;
+	for (i = nextReadyIndex; i < maxFileDescriptor; i++)
+	{
+		if (pollFileDescriptors[i].revents > 0)
+		{
+			nextReadyIndex = i + 1;
+			return i;
+		}
+	}
+	nextReadyIndex = maxFileDescriptor;
+	return -1;
+}
+
 static void growPollSet(int newSetSize)
 {
 	int i = 0;
@@ -106,12 +273,15 @@ static void growPollSet(int newSetSize)
 
 	printf("Increasing poll set from: %d to %d\n", currentPollSetSize, newSetSize);
 	pollFileDescriptors = srealloc(pollFileDescriptors, newSetSize * sizeof(struct pollfd));
+	wantedEvents = srealloc(wantedEvents, newSetSize * sizeof(short));
 
 	// zero out the new poll set elements
 	for (i = currentPollSetSize; i < newSetSize; i++)
 	{
-		pollFileDescriptors[i].fd = 0;
+		pollFileDescriptors[i].fd = -1;
 		pollFileDescriptors[i].events = 0;
+		pollFileDescriptors[i].revents = 0;
+		wantedEvents[i] = 0;
 	}
 
 	currentPollSetSize = newSetSize;
@@ -121,6 +291,7 @@ void * srealloc(void *ptr, size_t size)
 {
 	void * returnValue = NULL;
 
+	heapAllocs++;
 	if ((returnValue = realloc(ptr, size)) == NULL)
 	{
 		printf("Error on realloc (tried for size: %d\n", (int) size);
@@ -133,6 +304,7 @@ void * srealloc(void *ptr, size_t size)
 void * sCalloc(size_t nmemb, size_t size)
 {
 	void * returnValue = NULL;
+	heapAllocs++;
 	if ((returnValue = calloc(nmemb, size)) == NULL)
 	{
 		perror("calloc");
@@ -140,3 +312,9 @@ void * sCalloc(size_t nmemb, size_t size)
 	}
 	return returnValue;
 }
+
+// how many times the two above were called, to tell a steady state from one that isn't
+uint64_t heapAllocations()
+{
+	return heapAllocs;
+}
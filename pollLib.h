@@ -9,16 +9,26 @@
 #ifndef __POLLLIB_H__
 #define __POLLLIB_H__
 
+#include <stdint.h>
+
 #include "packets.h"
 
 #define POLL_SET_SIZE 10
 #define POLL_WAIT_FOREVER -1
 
 void setupPollSet();
+void reservePollSet(int setSize);
 void addToPollSet(int socketNumber);
 void removeFromPollSet(int socketNumber);
 int pollCall(int timeInMilliSeconds);
+int pollNextReady();
+void setPollIn(int socketNumber, int enable);
+void setPollOut(int socketNumber, int enable);
+short pollRevents(int socketNumber);
+void setBusyPoll(int microseconds);
+void busyPollCounts(uint64_t *spun, uint64_t *slept);
 void * srealloc(void *ptr, size_t size);
 void * sCalloc(size_t nmemb, size_t size);
+uint64_t heapAllocations();
 
 #endif
@@ -0,0 +1,523 @@
+/* Cluster wide handle ownership and presence.
+ * Frame layouts (from the flag on, multi byte fields in network order):
+ *   digest: count(1) then count x [node(2) epoch(8) version(4)]
+ *   delta:  origin(2) epoch(8) base(4) upto(4) count(1) then count x
+ *           [version(4) claim(4) online(1) handle len(1) handle]
+ * A delta carries every current record of origin with a version in
+ * (base, upto], so a node holding everything up to base holds everything
+ * up to upto once it's applied. Larger deltas are split into frames
+ * that each continue from the previous one's upto.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <endian.h>
+#include <sys/time.h>
+
+#include "presence.h"
+#include "federation.h"
+#include "memAccount.h"
+#include "packets.h"
+#include "pollLib.h"
+
+#define INIT_PRESENCE 1024
+#define MAX_ORIGINS (MAX_PEERS * 2)
+#define DIGEST_ENTRY 14 // node(2) epoch(8) version(4)
+#define DELTA_HEADER 22 // chat header(3) + origin(2) epoch(8) base(4) upto(4) count(1)
+#define DELTA_COUNT 19 // offset of count from the flag, the last header byte
+#define RECORD_HEADER 10 // version(4) claim(4) online(1) handle len(1)
+
+/* What this node holds of one node's records */
+typedef struct {
+   uint16_t node;
+   uint64_t epoch; // node's start time in ms
+   uint32_t known; // holds every change up to this version
+} Origin;
+
+// Presence global variables
+static uint16_t localId = 0;
+static uint32_t lamportClock = 0; // for login claims
+static Origin origins[MAX_ORIGINS]; // origins[0] is this node
+static int numOrigins = 0;
+static PresenceRecord **records = NULL;
+static uint32_t recordTableSize = 0;
+static uint32_t numRecords = 0;
+
+static Origin *findOrigin(uint16_t node, int create);
+static void dropOrigin(Origin *o);
+static int reachable(uint16_t node);
+static PresenceRecord *findRecord(char *handle, uint16_t origin);
+static PresenceRecord *addRecord(char *handle, uint16_t origin);
+static uint32_t hashHandle(char *handle);
+static int beats(uint32_t claimA, uint16_t nodeA, uint32_t claimB, uint16_t nodeB);
+static int compareVersions(const void *a, const void *b);
+static int encodeRecord(uint8_t *p, PresenceRecord *r);
+static void putDeltaHeader(uint8_t *frame, Origin *o, uint32_t base, uint32_t upto, uint8_t count, uint16_t len);
+
+void setupPresence(uint16_t nodeId)
+{
+	struct timeval now;
+
+	localId = nodeId;
+	recordTableSize = INIT_PRESENCE;
+	records = sCalloc(recordTableSize, sizeof(PresenceRecord *));
+	memCharge(MEM_PRESENCE, recordTableSize * sizeof(PresenceRecord *));
+
+	gettimeofday(&now, NULL);
+	origins[0].node = nodeId;
+	origins[0].epoch = (uint64_t)now.tv_sec * 1000 + now.tv_usec / 1000;
+	origins[0].known = 0;
+	numOrigins = 1;
+}
+
+/* A local login (online = 1) or logout. Returns the length of the delta
+ * frame written to frame, for pushing to every linked node
+ */
+int presenceLocalChange(char *handle, int online, uint8_t *frame)
+{
+	Origin *self = &origins[0];
+	PresenceRecord *r = findRecord(handle, localId);
+	int len = DELTA_HEADER;
+
+	if (r == NULL)
+		r = addRecord(handle, localId);
+	r->version = ++self->known;
+	r->online = online;
+	if (online)
+		r->claim = ++lamportClock;
+
+	len += encodeRecord(frame + len, r);
+	putDeltaHeader(frame, self, r->version - 1, r->version, 1, len);
+	return len;
+}
+
+/* Node handle is logged in to, -1 if none. Of several (a conflict not
+ * yet resolved) the lowest claim wins
+ */
+int presenceOwner(char *handle)
+{
+	PresenceRecord *r = NULL;
+	PresenceRecord *best = NULL;
+
+	if (records == NULL)
+		return -1; // not federated
+	for (r = records[hashHandle(handle) & (recordTableSize - 1)]; r != NULL; r = r->next)
+	{
+		if (r->online && strcmp(r->handle, handle) == 0 && reachable(r->origin)
+			&& (best == NULL || beats(r->claim, r->origin, best->claim, best->origin)))
+			best = r;
+	}
+	return best != NULL ? best->origin : -1;
+}
+
+/* flag 22 - the highest version held of every node's records */
+int presenceDigest(uint8_t *frame)
+{
+	uint8_t *p = frame + 4;
+	uint16_t node_NetW;
+	uint64_t epoch_NetW;
+	uint32_t version_NetW;
+	int i = 0;
+
+	frame[3] = numOrigins;
+	for (i = 0; i < numOrigins; i++)
+	{
+		node_NetW = htons(origins[i].node);
+		epoch_NetW = htobe64(origins[i].epoch);
+		version_NetW = htonl(origins[i].known);
+		memcpy(p, &node_NetW, 2);
+		memcpy(p + 2, &epoch_NetW, 8);
+		memcpy(p + 10, &version_NetW, 4);
+		p += DIGEST_ENTRY;
+	}
+	makeChatHeader(frame, PEER_DIGEST_FLAG, p - frame);
+	return p - frame;
+}
+
+/* Answers a digest (from its flag on) by passing send() the delta frames
+ * the other node is missing. Returns 1 if the digest shows it holds
+ * changes this node doesn't, i.e. it should be sent our digest back
+ */
+int presenceDeltas(uint8_t *digest, uint16_t len, void (*send)(uint8_t *frame, uint16_t len, void *arg), void *arg)
+{
+	uint8_t frame[MAXBUF];
+	int count = digest[1];
+	uint8_t *entry = NULL;
+	uint16_t node = 0;
+	uint64_t epoch = 0;
+	uint32_t version = 0, base = 0, frameBase = 0;
+	PresenceRecord **picked = NULL;
+	PresenceRecord *r = NULL;
+	Origin *o = NULL;
+	int wantsOurs = 0;
+	int i = 0, j = 0, n = 0, inFrame = 0, frameLen = 0;
+	uint32_t b = 0;
+
+	if (2 + count * DIGEST_ENTRY > len)
+		return 0;
+
+	for (i = 0; i < numOrigins; i++)
+	{
+		o = &origins[i];
+		if (o->known == 0)
+			continue;
+
+		// what the other node holds of o
+		base = 0;
+		for (j = 0; j < count; j++)
+		{
+			entry = digest + 2 + j * DIGEST_ENTRY;
+			memcpy(&node, entry, 2);
+			if (ntohs(node) != o->node)
+				continue;
+			memcpy(&epoch, entry + 2, 8);
+			memcpy(&version, entry + 10, 4);
+			if (be64toh(epoch) == o->epoch)
+				base = ntohl(version);
+			else if (be64toh(epoch) > o->epoch)
+				base = o->known; // ours is outdated, nothing to send
+		}
+		if (base >= o->known)
+			continue;
+
+		// every current record of o changed after base, oldest change first -
+		// sized once for every record held, which no origin can exceed
+		if (picked == NULL)
+			picked = srealloc(NULL, sizeof(PresenceRecord *) * (numRecords + 1));
+		n = 0;
+		for (b = 0; b < recordTableSize; b++)
+		{
+			for (r = records[b]; r != NULL; r = r->next)
+			{
+				if (r->origin == o->node && r->version > base)
+					picked[n++] = r;
+			}
+		}
+		qsort(picked, n, sizeof(PresenceRecord *), compareVersions);
+
+		frameBase = base;
+		frameLen = DELTA_HEADER;
+		inFrame = 0;
+		for (j = 0; j < n; j++)
+		{
+			if (frameLen + RECORD_HEADER + strlen(picked[j]->handle) > MAXBUF || inFrame == UINT8_MAX)
+			{
+				putDeltaHeader(frame, o, frameBase, picked[j - 1]->version, inFrame, frameLen);
+				send(frame, frameLen, arg);
+				frameBase = picked[j - 1]->version;
+				frameLen = DELTA_HEADER;
+				inFrame = 0;
+			}
+			frameLen += encodeRecord(frame + frameLen, picked[j]);
+			inFrame++;
+		}
+		putDeltaHeader(frame, o, frameBase, o->known, inFrame, frameLen);
+		send(frame, frameLen, arg);
+	}
+	free(picked);
+
+	// anything the other node holds that we don't?
+	for (j = 0; j < count; j++)
+	{
+		entry = digest + 2 + j * DIGEST_ENTRY;
+		memcpy(&node, entry, 2);
+		memcpy(&epoch, entry + 2, 8);
+		memcpy(&version, entry + 10, 4);
+		if (ntohs(node) == localId || ntohl(version) == 0)
+			continue;
+		o = findOrigin(ntohs(node), 0);
+		if (o == NULL || be64toh(epoch) > o->epoch
+			|| (be64toh(epoch) == o->epoch && ntohl(version) > o->known))
+			wantsOurs = 1;
+	}
+	return wantsOurs;
+}
+
+/* Applies a delta frame (from its flag on). Local users who lost their
+ * handle to an earlier login on another node are copied to lost, and
+ * the count returned - the caller disconnects them
+ */
+int presenceApply(uint8_t *delta, uint16_t len, char lost[][MAX_HANDLE + 1])
+{
+	uint8_t *p = delta + DELTA_HEADER - PKT_LEN;
+	uint8_t *end = delta + len;
+	uint16_t node = 0;
+	uint64_t epoch = 0;
+	uint32_t base = 0, upto = 0, version = 0, claim = 0;
+	uint8_t count = 0, online = 0, handle_len = 0;
+	char handle[MAX_HANDLE + 1];
+	PresenceRecord *r = NULL;
+	PresenceRecord *mine = NULL;
+	Origin *o = NULL;
+	int i = 0, numLost = 0;
+
+	if (len < DELTA_COUNT + 1) // the whole header, count included
+		return 0;
+	memcpy(&node, delta + 1, 2);
+	memcpy(&epoch, delta + 3, 8);
+	memcpy(&base, delta + 11, 4);
+	memcpy(&upto, delta + 15, 4);
+	count = delta[DELTA_COUNT];
+	node = ntohs(node);
+	epoch = be64toh(epoch);
+	base = ntohl(base);
+	upto = ntohl(upto);
+
+	if (node == localId || (o = findOrigin(node, 1)) == NULL || epoch < o->epoch)
+		return 0; // our own, or from before the node restarted
+	if (epoch > o->epoch)
+	{
+		dropOrigin(o); // node restarted, its old records are gone
+		o->epoch = epoch;
+	}
+
+	for (i = 0; i < count; i++)
+	{
+		if (p + RECORD_HEADER > end || p[9] > MAX_HANDLE || p + RECORD_HEADER + p[9] > end)
+			return numLost;
+		memcpy(&version, p, 4);
+		memcpy(&claim, p + 4, 4);
+		version = ntohl(version);
+		claim = ntohl(claim);
+		online = p[8];
+		handle_len = p[9];
+		memcpy(handle, p + RECORD_HEADER, handle_len);
+		handle[handle_len] = '\0';
+		p += RECORD_HEADER + handle_len;
+
+		if (claim > lamportClock)
+			lamportClock = claim;
+		if ((r = findRecord(handle, node)) == NULL)
+			r = addRecord(handle, node);
+		if (version < r->version)
+			continue; // already have a later change
+		r->version = version;
+		r->claim = claim;
+		r->online = online;
+
+		mine = findRecord(handle, localId);
+		if (online && mine != NULL && mine->online && reachable(node)
+			&& beats(claim, node, mine->claim, localId) && numLost < PRESENCE_MAX_LOST)
+			strcpy(lost[numLost++], handle);
+	}
+
+	if (o->known >= base && upto > o->known)
+		o->known = upto;
+	return numLost;
+}
+
+/* Local users whose handle is owned elsewhere, e.g. a conflict that
+ * was ignored while the link to the other node was down
+ */
+int presenceLocalLosers(char lost[][MAX_HANDLE + 1], int maxLost)
+{
+	PresenceRecord *r = NULL;
+	uint32_t b = 0;
+	int numLost = 0;
+
+	for (b = 0; b < recordTableSize && numLost < maxLost; b++)
+	{
+		for (r = records[b]; r != NULL && numLost < maxLost; r = r->next)
+		{
+			if (r->origin == localId && r->online && presenceOwner(r->handle) != localId)
+				strcpy(lost[numLost++], r->handle);
+		}
+	}
+	return numLost;
+}
+
+void presenceRewind(PresenceCursor *cur)
+{
+	cur->bucket = 0;
+	cur->record = NULL;
+}
+
+/* Next handle logged in to another (linked) node, NULL at the end */
+char *presenceNextRemote(PresenceCursor *cur)
+{
+	PresenceRecord *r = NULL;
+
+	if (records == NULL)
+		return NULL;
+	r = cur->record != NULL ? cur->record->next : records[0];
+
+	while (cur->bucket < recordTableSize)
+	{
+		for (; r != NULL; r = r->next)
+		{
+			if (r->origin != localId && r->online && presenceOwner(r->handle) == r->origin)
+			{
+				cur->record = r;
+				return r->handle;
+			}
+		}
+		if (++cur->bucket < recordTableSize)
+			r = records[cur->bucket];
+	}
+	return NULL;
+}
+
+int presenceRemoteCount()
+{
+	PresenceCursor cur;
+	int count = 0;
+
+	presenceRewind(&cur);
+	while (presenceNextRemote(&cur) != NULL)
+		count++;
+	return count;
+}
+
+static Origin *findOrigin(uint16_t node, int create)
+{
+	int i = 0;
+
+	for (i = 0; i < numOrigins; i++)
+	{
+		if (origins[i].node == node)
+			return &origins[i];
+	}
+	if (!create || numOrigins == MAX_ORIGINS)
+		return NULL;
+	memset(&origins[numOrigins], 0, sizeof(Origin));
+	origins[numOrigins].node = node;
+	return &origins[numOrigins++];
+}
+
+static void dropOrigin(Origin *o)
+{
+	PresenceRecord **link = NULL;
+	PresenceRecord *r = NULL;
+	uint32_t b = 0;
+
+	for (b = 0; b < recordTableSize; b++)
+	{
+		link = &records[b];
+		while ((r = *link) != NULL)
+		{
+			if (r->origin == o->node)
+			{
+				*link = r->next;
+				free(r);
+				memCharge(MEM_PRESENCE, -(ssize_t)sizeof(PresenceRecord));
+				numRecords--;
+			}
+			else
+				link = &r->next;
+		}
+	}
+	o->known = 0;
+}
+
+static int reachable(uint16_t node)
+{
+	Peer *p = NULL;
+
+	if (node == localId)
+		return 1;
+	p = peerById(node);
+	return p != NULL && p->state == PEER_UP;
+}
+
+static PresenceRecord *findRecord(char *handle, uint16_t origin)
+{
+	PresenceRecord *r = NULL;
+	for (r = records[hashHandle(handle) & (recordTableSize - 1)]; r != NULL; r = r->next)
+	{
+		if (r->origin == origin && strcmp(r->handle, handle) == 0)
+			return r;
+	}
+	return NULL;
+}
+
+static PresenceRecord *addRecord(char *handle, uint16_t origin)
+{
+	PresenceRecord *r = NULL;
+	PresenceRecord *next = NULL;
+	PresenceRecord **oldTable = records;
+	uint32_t oldSize = recordTableSize;
+	uint32_t i = 0;
+	uint32_t index = 0;
+
+	if (numRecords >= recordTableSize)
+	{
+		recordTableSize *= 2;
+		records = sCalloc(recordTableSize, sizeof(PresenceRecord *));
+		for (i = 0; i < oldSize; i++)
+		{
+			for (r = oldTable[i]; r != NULL; r = next)
+			{
+				next = r->next;
+				index = hashHandle(r->handle) & (recordTableSize - 1);
+				r->next = records[index];
+				records[index] = r;
+			}
+		}
+		free(oldTable);
+		memCharge(MEM_PRESENCE, (recordTableSize - oldSize) * sizeof(PresenceRecord *));
+	}
+
+	r = sCalloc(1, sizeof(PresenceRecord));
+	memCharge(MEM_PRESENCE, sizeof(PresenceRecord));
+	strncpy(r->handle, handle, MAX_HANDLE);
+	r->origin = origin;
+	index = hashHandle(handle) & (recordTableSize - 1);
+	r->next = records[index];
+	records[index] = r;
+	numRecords++;
+	return r;
+}
+
+static uint32_t hashHandle(char *handle)
+{
+	uint32_t hash = 2166136261u;
+	for (; *handle != '\0'; handle++)
+	{
+		hash ^= (uint8_t)*handle;
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+// login A came first - lower claim, ties to the lower node id
+static int beats(uint32_t claimA, uint16_t nodeA, uint32_t claimB, uint16_t nodeB)
+{
+	return claimA < claimB || (claimA == claimB && nodeA < nodeB);
+}
+
+static int compareVersions(const void *a, const void *b)
+{
+	uint32_t va = (*(PresenceRecord **)a)->version;
+	uint32_t vb = (*(PresenceRecord **)b)->version;
+	return va < vb ? -1 : va > vb;
+}
+
+static int encodeRecord(uint8_t *p, PresenceRecord *r)
+{
+	uint32_t version_NetW = htonl(r->version);
+	uint32_t claim_NetW = htonl(r->claim);
+	uint8_t handle_len = strlen(r->handle);
+
+	memcpy(p, &version_NetW, 4);
+	memcpy(p + 4, &claim_NetW, 4);
+	p[8] = r->online;
+	p[9] = handle_len;
+	memcpy(p + RECORD_HEADER, r->handle, handle_len);
+	return RECORD_HEADER + handle_len;
+}
+
+static void putDeltaHeader(uint8_t *frame, Origin *o, uint32_t base, uint32_t upto, uint8_t count, uint16_t len)
+{
+	uint16_t node_NetW = htons(o->node);
+	uint64_t epoch_NetW = htobe64(o->epoch);
+	uint32_t base_NetW = htonl(base);
+	uint32_t upto_NetW = htonl(upto);
+
+	makeChatHeader(frame, PEER_DELTA_FLAG, len);
+	memcpy(frame + 3, &node_NetW, 2);
+	memcpy(frame + 5, &epoch_NetW, 8);
+	memcpy(frame + 13, &base_NetW, 4);
+	memcpy(frame + 17, &upto_NetW, 4);
+	frame[21] = count;
+}
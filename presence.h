@@ -0,0 +1,51 @@
+/* Cluster wide handle ownership and presence.
+ * Every node is the only writer of its own users' records, each change
+ * getting the next version number of that node (within an epoch - the
+ * node's start time, so a restarted node's records replace the old
+ * ones). Changes are pushed to every linked node as they happen, and
+ * anti-entropy rounds exchange digests (highest version held per node)
+ * so anything missed while a link was down is sent as a delta.
+ *
+ * Logins are accepted locally, without asking the other nodes. If two
+ * nodes accept the same handle before hearing of each other, the login
+ * with the lower Lamport claim (then node id) keeps it everywhere, and
+ * the other node disconnects its user. Records from a node whose link
+ * is down are kept but ignored until the link comes back.
+ */
+
+#ifndef PRESENCE_H
+#define PRESENCE_H
+
+#include <stdint.h>
+
+#include "networks.h"
+
+#define GOSSIP_INTERVAL 500 // ms between anti-entropy rounds
+#define PRESENCE_MAX_LOST 128 // conflicts reported per delta frame (> records per frame)
+
+typedef struct presenceRecord {
+   struct presenceRecord *next; // hash chain
+   uint16_t origin; // node the user logged in to
+   uint32_t version; // origin's version counter at the change
+   uint32_t claim; // Lamport time of the login
+   uint8_t online;
+   char handle[MAX_HANDLE + 1];
+} PresenceRecord;
+
+typedef struct {
+   uint32_t bucket;
+   PresenceRecord *record;
+} PresenceCursor;
+
+void setupPresence(uint16_t nodeId);
+int presenceLocalChange(char *handle, int online, uint8_t *frame);
+int presenceOwner(char *handle);
+int presenceDigest(uint8_t *frame);
+int presenceDeltas(uint8_t *digest, uint16_t len, void (*send)(uint8_t *frame, uint16_t len, void *arg), void *arg);
+int presenceApply(uint8_t *delta, uint16_t len, char lost[][MAX_HANDLE + 1]);
+int presenceLocalLosers(char lost[][MAX_HANDLE + 1], int maxLost);
+void presenceRewind(PresenceCursor *cur);
+char *presenceNextRemote(PresenceCursor *cur);
+int presenceRemoteCount();
+
+#endif
@@ -0,0 +1,287 @@
+/* Frame codec, driven by the layouts in protocol.def.
+ * Decoding checks every length against the end of the frame before it is
+ * used, and handles and text with validate.c, so a handler can take a
+ * decoded frame as well formed. Encoding writes the same layout back out,
+ * header and all, checking only that it fits.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#include "protocol.h"
+#include "packets.h"
+#include "validate.h"
+
+typedef struct {
+   const char *name;
+   const char *layout[2]; // by direction
+} FrameSpec;
+
+#define FRAME(name, flag, up, down, about) [flag] = { #name, { up, down } },
+static const FrameSpec specs[256] = {
+#include "protocol.def"
+};
+#undef FRAME
+
+static const char *layoutOf(uint8_t flag, int dir);
+static int takeHandle(Frame *f, const uint8_t **p, const uint8_t *end);
+static uint8_t *putHandle(uint8_t *p, const uint8_t *end, const Frame *f, int i);
+
+/* buf points to the flag, as sRecv() leaves it. 0, or -1 if the frame
+ * isn't one the layout for this direction allows
+ */
+int frameDecode(const uint8_t *buf, uint16_t pkt_len, int dir, Frame *f)
+{
+	const char *field = layoutOf(buf[0], dir);
+	const uint8_t *end = buf + pkt_len - PKT_LEN;
+	const uint8_t *p = buf + FLAG_LEN;
+	uint16_t value16 = 0;
+	uint32_t value32 = 0;
+	int count = 0;
+
+	if (field == NULL || pkt_len < sizeof(ChatHeader))
+		return -1;
+	frameInit(f, buf[0]);
+	for (; *field != '\0'; field++)
+	{
+		switch (*field)
+		{
+			case 'h':
+				if (takeHandle(f, &p, end) < 0)
+					return -1;
+				break;
+
+			case 'H':
+				if (p >= end || *p < 1 || *p > MAX_DEST_HANDLES)
+					return -1;
+				for (count = *p++; f->num_dests < count; f->num_dests++)
+					if (takeHandle(f, &p, end) < 0)
+						return -1;
+				break;
+
+			case 't':
+			case 'w':
+				if (p >= end || end[-1] != '\0' || (*field == 't' && end - p > MAX_MESSAGE)
+					|| !validText(p, end - p - 1))
+					return -1;
+				f->text = p;
+				f->text_len = end - p - 1;
+				p = end;
+				break;
+
+			case 'b':
+				if (end - p < 1 || f->num_count == FRAME_MAX_NUMS)
+					return -1;
+				f->nums[f->num_count++] = *p++;
+				break;
+
+			case 's':
+				if (end - p < 2 || f->num_count == FRAME_MAX_NUMS)
+					return -1;
+				memcpy(&value16, p, 2);
+				f->nums[f->num_count++] = ntohs(value16);
+				p += 2;
+				break;
+
+			case 'l':
+				if (end - p < 4 || f->num_count == FRAME_MAX_NUMS)
+					return -1;
+				memcpy(&value32, p, 4);
+				f->nums[f->num_count++] = ntohl(value32);
+				p += 4;
+				break;
+
+			case 'k':
+				if (end - p < RESUME_TOKEN_LEN)
+					return -1;
+				f->token = p;
+				p += RESUME_TOKEN_LEN;
+				break;
+
+			case 'r':
+				f->text = p;
+				f->text_len = end - p;
+				p = end;
+				break;
+
+			case '?':
+				if (p == end)
+					return 0;
+				break;
+		}
+	}
+	return p == end ? 0 : -1;
+}
+
+/* Writes f (header included) into buf, which holds MAXBUF bytes. The
+ * frame's length, or 0 if f doesn't fill its layout or won't fit
+ */
+uint16_t frameEncode(uint8_t *buf, int dir, const Frame *f)
+{
+	const char *field = layoutOf(f->flag, dir);
+	const uint8_t *end = buf + MAXBUF;
+	uint8_t *p = buf + sizeof(ChatHeader);
+	uint16_t value16 = 0;
+	uint32_t value32 = 0;
+	int handle = 0, num = 0, count = 0;
+
+	if (field == NULL)
+		return 0;
+	for (; *field != '\0' && p != NULL; field++)
+	{
+		if (*field == '?' && handle == f->num_handles && num == f->num_count && f->text == NULL
+			&& f->token == NULL)
+			break; // nothing left to go after it
+		switch (*field)
+		{
+			case 'h':
+				p = putHandle(p, end, f, handle++);
+				break;
+
+			case 'H': // every handle left
+				count = f->num_handles - handle;
+				if (count < 1 || count > MAX_DEST_HANDLES || p >= end)
+					return 0;
+				*p++ = count;
+				while (p != NULL && handle < f->num_handles)
+					p = putHandle(p, end, f, handle++);
+				break;
+
+			case 't':
+			case 'w':
+				if (f->text_len + 1 > end - p || (*field == 't' && f->text_len + 1 > MAX_MESSAGE))
+					return 0;
+				memcpy(p, f->text, f->text_len);
+				p += f->text_len;
+				*p++ = '\0';
+				break;
+
+			case 'b':
+				if (end - p < 1 || num == f->num_count)
+					return 0;
+				*p++ = f->nums[num++];
+				break;
+
+			case 's':
+				if (end - p < 2 || num == f->num_count)
+					return 0;
+				value16 = htons(f->nums[num++]);
+				memcpy(p, &value16, 2);
+				p += 2;
+				break;
+
+			case 'l':
+				if (end - p < 4 || num == f->num_count)
+					return 0;
+				value32 = htonl(f->nums[num++]);
+				memcpy(p, &value32, 4);
+				p += 4;
+				break;
+
+			case 'k':
+				if (end - p < RESUME_TOKEN_LEN || f->token == NULL)
+					return 0;
+				memcpy(p, f->token, RESUME_TOKEN_LEN);
+				p += RESUME_TOKEN_LEN;
+				break;
+
+			case 'r':
+				if (f->text_len > end - p)
+					return 0;
+				memcpy(p, f->text, f->text_len);
+				p += f->text_len;
+				break;
+		}
+	}
+	if (p == NULL)
+		return 0;
+	makeChatHeader(buf, f->flag, p - buf);
+	return p - buf;
+}
+
+/* an empty frame to fill in with the calls below and frameEncode() */
+void frameInit(Frame *f, uint8_t flag)
+{
+	f->flag = flag;
+	f->num_handles = 0;
+	f->num_dests = 0;
+	f->text = NULL;
+	f->text_len = 0;
+	f->num_count = 0;
+	f->token = NULL;
+}
+
+/* the next h field, or the next destination of an H list */
+void frameHandle(Frame *f, const void *handle, uint8_t len)
+{
+	if (f->num_handles == FRAME_MAX_HANDLES)
+		return; // frameEncode() refuses an H list this long anyway
+	f->handles[f->num_handles] = handle;
+	f->handle_lens[f->num_handles++] = len;
+}
+
+/* the t, w or r field, without a null */
+void frameText(Frame *f, const void *text, uint16_t len)
+{
+	f->text = text;
+	f->text_len = len;
+}
+
+/* the next b, s or l field */
+void frameNum(Frame *f, uint32_t value)
+{
+	if (f->num_count < FRAME_MAX_NUMS)
+		f->nums[f->num_count++] = value;
+}
+
+/* The frame was decoded from from and copied to to */
+void frameMove(Frame *f, const uint8_t *from, const uint8_t *to)
+{
+	int i;
+
+	for (i = 0; i < f->num_handles; i++)
+		f->handles[i] = to + (f->handles[i] - from);
+	if (f->text != NULL)
+		f->text = to + (f->text - from);
+	if (f->token != NULL)
+		f->token = to + (f->token - from);
+}
+
+/* whether flag is ever sent in direction dir */
+int frameKnown(uint8_t flag, int dir)
+{
+	return layoutOf(flag, dir) != NULL;
+}
+
+const char *frameName(uint8_t flag)
+{
+	return specs[flag].name != NULL ? specs[flag].name : "unknown";
+}
+
+static const char *layoutOf(uint8_t flag, int dir)
+{
+	const char *layout = specs[flag].layout[dir];
+	return layout == NULL || layout[0] == '-' ? NULL : layout;
+}
+
+static int takeHandle(Frame *f, const uint8_t **p, const uint8_t *end)
+{
+	const uint8_t *h = *p;
+
+	if (h >= end || h + 1 + h[0] > end || f->num_handles == FRAME_MAX_HANDLES || !validHandle(h + 1, h[0]))
+		return -1;
+	f->handles[f->num_handles] = h + 1;
+	f->handle_lens[f->num_handles++] = h[0];
+	*p = h + 1 + h[0];
+	return 0;
+}
+
+static uint8_t *putHandle(uint8_t *p, const uint8_t *end, const Frame *f, int i)
+{
+	if (i >= f->num_handles || 1 + f->handle_lens[i] > end - p)
+		return NULL;
+	*p++ = f->handle_lens[i];
+	memcpy(p, f->handles[i], f->handle_lens[i]);
+	return p + f->handle_lens[i];
+}
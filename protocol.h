@@ -0,0 +1,55 @@
+/* Frame layouts and the codec built from them.
+ * protocol.def lists every frame type once. Here it becomes the flag
+ * names; in protocol.c, the table of layouts frameDecode() and
+ * frameEncode() walk, so a new frame type is one line there and a
+ * handler. A decoded Frame points into the packet it came from.
+ */
+
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <stdint.h>
+
+#include "networks.h"
+
+#define FRAME(name, flag, up, down, about) name = flag,
+enum {
+#include "protocol.def"
+};
+#undef FRAME
+
+#define MAX_DEST_HANDLES 9
+#define MAX_MESSAGE 200 // text bytes in a frame, with the null
+#define RESUME_TOKEN_LEN 8
+
+/* which way a frame goes, picks its layout */
+#define TO_SERVER 0 // from a client, or from another node
+#define TO_CLIENT 1
+
+#define FRAME_MAX_HANDLES (MAX_DEST_HANDLES + 1) // sender and destinations
+#define FRAME_MAX_NUMS 2
+
+typedef struct {
+   uint8_t flag;
+   uint8_t num_handles; // h fields, then an H list's handles
+   uint8_t num_dests; // how many of those came from the H list
+   const uint8_t *handles[FRAME_MAX_HANDLES]; // not null terminated
+   uint8_t handle_lens[FRAME_MAX_HANDLES];
+   const uint8_t *text; // t and w without the null (which is there), or r
+   uint16_t text_len;
+   uint32_t nums[FRAME_MAX_NUMS]; // b, s and l fields in order, host order
+   uint8_t num_count;
+   const uint8_t *token;
+} Frame;
+
+int frameDecode(const uint8_t *buf, uint16_t pkt_len, int dir, Frame *f);
+uint16_t frameEncode(uint8_t *buf, int dir, const Frame *f);
+void frameInit(Frame *f, uint8_t flag);
+void frameHandle(Frame *f, const void *handle, uint8_t len);
+void frameText(Frame *f, const void *text, uint16_t len);
+void frameNum(Frame *f, uint32_t value);
+void frameMove(Frame *f, const uint8_t *from, const uint8_t *to);
+int frameKnown(uint8_t flag, int dir);
+const char *frameName(uint8_t flag);
+
+#endif
@@ -0,0 +1,274 @@
+/* Cached, asynchronous name lookup.
+ * A lookup thread only fills in its query and writes a byte to the
+ * query's pipe; the cache is only ever touched by the caller's thread.
+ * A query given up on before its answer came is freed by its thread
+ * instead.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "resolver.h"
+#include "pollLib.h"
+
+struct resolveQuery {
+   char host[NI_MAXHOST];
+   char port[NI_MAXSERV];
+   AddrList list;
+   int error; // getaddrinfo()'s, 0 = list holds the answer
+   int answered; // from the cache, no thread
+   int pipe[2]; // readable once the thread is done
+   pthread_mutex_t lock;
+   int done;
+   int abandoned;
+};
+
+typedef struct {
+   char host[NI_MAXHOST];
+   char port[NI_MAXSERV];
+   AddrList list;
+   uint64_t expires; // ms, 0 = unused
+} CacheEntry;
+
+static CacheEntry cache[RESOLVE_CACHE_SIZE];
+
+static void *lookup(void *arg);
+static void interleave(struct addrinfo *info, AddrList *list);
+static CacheEntry *cacheFind(const char *host, const char *port);
+static void cacheStore(ResolveQuery *q);
+static void freeQuery(ResolveQuery *q);
+static uint64_t nowMs();
+
+/* Starts looking host up, or answers at once from the cache. NULL only
+ * if the thread can't be started
+ */
+ResolveQuery *resolveStart(const char *host, const char *port)
+{
+	ResolveQuery *q = sCalloc(1, sizeof(ResolveQuery));
+	CacheEntry *e = cacheFind(host, port);
+	pthread_t thread;
+
+	snprintf(q->host, sizeof(q->host), "%s", host);
+	snprintf(q->port, sizeof(q->port), "%s", port);
+	q->pipe[0] = q->pipe[1] = -1;
+	if (e != NULL && e->expires > nowMs())
+	{
+		q->list = e->list;
+		q->answered = 1;
+		return q;
+	}
+
+	pthread_mutex_init(&q->lock, NULL);
+	if (pipe(q->pipe) < 0)
+	{
+		perror("pipe call");
+		free(q);
+		return NULL;
+	}
+	if (pthread_create(&thread, NULL, lookup, q) != 0)
+	{
+		perror("pthread_create resolver");
+		freeQuery(q);
+		return NULL;
+	}
+	pthread_detach(thread);
+	return q;
+}
+
+/* readable once the answer is in, -1 if it already is */
+int resolveFd(ResolveQuery *q)
+{
+	return q->answered ? -1 : q->pipe[0];
+}
+
+/* Collects the answer (once resolveFd() is readable) and frees q.
+ * Returns 0, or getaddrinfo()'s error. A failed refresh of an expired
+ * entry falls back on the old addresses
+ */
+int resolveFinish(ResolveQuery *q, AddrList *list)
+{
+	CacheEntry *e = NULL;
+	int error = q->error;
+
+	if (!q->answered && error == 0)
+		cacheStore(q);
+	else if (error != 0 && (e = cacheFind(q->host, q->port)) != NULL)
+	{
+		q->list = e->list;
+		error = 0;
+	}
+	if (error == 0)
+		*list = q->list;
+	if (q->answered)
+		free(q);
+	else
+	{
+		// the thread's write comes before it lets go of the lock
+		pthread_mutex_lock(&q->lock);
+		pthread_mutex_unlock(&q->lock);
+		freeQuery(q);
+	}
+	return error;
+}
+
+/* Gives up on q. Its thread frees it when getaddrinfo() returns */
+void resolveCancel(ResolveQuery *q)
+{
+	int done = 0;
+
+	if (q->answered)
+	{
+		free(q);
+		return;
+	}
+	pthread_mutex_lock(&q->lock);
+	q->abandoned = 1;
+	done = q->done;
+	pthread_mutex_unlock(&q->lock);
+	if (done)
+		freeQuery(q);
+}
+
+/* Keeps list's order (see tcpClientConnectList()) for the next lookup
+ * of the same name, while its entry lasts
+ */
+void resolvePrefer(const char *host, const char *port, AddrList *list)
+{
+	CacheEntry *e = cacheFind(host, port);
+
+	if (e != NULL)
+		e->list = *list;
+}
+
+/* For callers with nothing else to do meanwhile. EAI_AGAIN if the
+ * lookup takes longer than timeoutMs
+ */
+int resolveWait(const char *host, const char *port, AddrList *list, int timeoutMs)
+{
+	ResolveQuery *q = resolveStart(host, port);
+	struct pollfd p;
+	int ready = 0;
+
+	if (q == NULL)
+		return EAI_SYSTEM;
+	if (resolveFd(q) >= 0)
+	{
+		p.fd = resolveFd(q);
+		p.events = POLLIN;
+		while ((ready = poll(&p, 1, timeoutMs)) < 0 && errno == EINTR)
+			;
+		if (ready <= 0)
+		{
+			resolveCancel(q);
+			return EAI_AGAIN;
+		}
+	}
+	return resolveFinish(q, list);
+}
+
+static void *lookup(void *arg)
+{
+	ResolveQuery *q = arg;
+	struct addrinfo hints;
+	struct addrinfo *info = NULL;
+	int abandoned = 0;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_ADDRCONFIG;
+	if ((q->error = getaddrinfo(q->host, q->port, &hints, &info)) == 0)
+	{
+		interleave(info, &q->list);
+		freeaddrinfo(info);
+	}
+
+	pthread_mutex_lock(&q->lock);
+	q->done = 1;
+	abandoned = q->abandoned;
+	if (!abandoned && write(q->pipe[1], "", 1) < 0)
+		perror("resolver write");
+	pthread_mutex_unlock(&q->lock);
+	if (abandoned)
+		freeQuery(q);
+	return NULL;
+}
+
+/* getaddrinfo()'s order (RFC 6724), alternating between the families
+ * starting with the first's, so a broken IPv6 or IPv4 path costs one
+ * connect stagger rather than one per address of that family
+ */
+static void interleave(struct addrinfo *info, AddrList *list)
+{
+	struct addrinfo *next[2] = { info, info };
+	struct addrinfo *a = NULL;
+	int family = info->ai_family;
+	int turn = 0;
+
+	list->count = 0;
+	while (list->count < RESOLVE_MAX_ADDRS && (next[0] != NULL || next[1] != NULL))
+	{
+		// next[0] walks the first family, next[1] every other one
+		for (a = next[turn]; a != NULL && (a->ai_family == family) != (turn == 0); a = a->ai_next)
+			;
+		if (a != NULL && a->ai_addrlen <= sizeof(struct sockaddr_storage))
+		{
+			memcpy(&list->addrs[list->count], a->ai_addr, a->ai_addrlen);
+			list->lens[list->count++] = a->ai_addrlen;
+		}
+		next[turn] = a != NULL ? a->ai_next : NULL;
+		if (next[!turn] != NULL)
+			turn = !turn;
+	}
+}
+
+static CacheEntry *cacheFind(const char *host, const char *port)
+{
+	int i;
+
+	for (i = 0; i < RESOLVE_CACHE_SIZE; i++)
+		if (cache[i].expires != 0 && strcmp(cache[i].host, host) == 0 && strcmp(cache[i].port, port) == 0)
+			return &cache[i];
+	return NULL;
+}
+
+/* replaces the same name's entry, or else the one closest to expiring */
+static void cacheStore(ResolveQuery *q)
+{
+	CacheEntry *e = cacheFind(q->host, q->port);
+	int i;
+
+	if (e == NULL)
+	{
+		e = &cache[0];
+		for (i = 1; i < RESOLVE_CACHE_SIZE; i++)
+			if (cache[i].expires < e->expires)
+				e = &cache[i];
+	}
+	snprintf(e->host, sizeof(e->host), "%s", q->host);
+	snprintf(e->port, sizeof(e->port), "%s", q->port);
+	e->list = q->list;
+	e->expires = nowMs() + RESOLVE_TTL;
+}
+
+static void freeQuery(ResolveQuery *q)
+{
+	close(q->pipe[0]);
+	close(q->pipe[1]);
+	pthread_mutex_destroy(&q->lock);
+	free(q);
+}
+
+static uint64_t nowMs()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
@@ -0,0 +1,36 @@
+/* Cached, asynchronous name lookup.
+ * resolveStart() answers from the cache when it can. Otherwise
+ * getaddrinfo() runs on a thread of its own and the query's fd turns
+ * readable when it returns, so a poll() loop never waits on DNS. The
+ * addresses come back with the two families interleaved (RFC 8305), to
+ * be tried in order by tcpClientConnectList(), and whichever answered is
+ * put first in the cache with resolvePrefer().
+ */
+
+#ifndef RESOLVER_H
+#define RESOLVER_H
+
+#include <sys/socket.h>
+#include <netdb.h>
+
+#define RESOLVE_MAX_ADDRS 8
+#define RESOLVE_CACHE_SIZE 16
+#define RESOLVE_TTL 60000 // ms an answer is reused for
+#define RESOLVE_TIMEOUT 10000 // ms resolveWait() gives a lookup
+
+typedef struct {
+   struct sockaddr_storage addrs[RESOLVE_MAX_ADDRS];
+   socklen_t lens[RESOLVE_MAX_ADDRS];
+   int count;
+} AddrList;
+
+typedef struct resolveQuery ResolveQuery;
+
+ResolveQuery *resolveStart(const char *host, const char *port);
+int resolveFd(ResolveQuery *q);
+int resolveFinish(ResolveQuery *q, AddrList *list);
+void resolveCancel(ResolveQuery *q);
+void resolvePrefer(const char *host, const char *port, AddrList *list);
+int resolveWait(const char *host, const char *port, AddrList *list, int timeoutMs);
+
+#endif
@@ -0,0 +1,1020 @@
+/* Full text search over message history.
+ * Segment file layout (host byte order, the file is used as mapped):
+ *   IndexHeader
+ *   postings - per term, delta encoded varints in ascending seq order
+ *   term strings
+ *   IndexTerm dictionary, sorted by term for binary search
+ * Segments cover disjoint, increasing seq ranges, named by that range.
+ * A merge combines two adjacent segments into one covering both, so a
+ * term's postings across segments are always in seq order. A merged
+ * file is renamed into place before its inputs are removed, and on
+ * startup any segment inside another's range is a leftover and deleted.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <ctype.h>
+
+#include "searchIndex.h"
+#include "memAccount.h"
+#include "networks.h"
+#include "pollLib.h"
+#include "packets.h"
+#include "timerWheel.h"
+
+#define INDEX_MAGIC "CHIX"
+#define INDEX_PATH 1024
+#define INDEX_MAX_KEY (MAX_HANDLE + 1 + INDEX_MAX_TERM)
+#define INIT_TERM_TABLE 4096
+#define SCOPE_SEPARATOR '\x01' // between handle and term in a direct message key
+
+typedef struct {
+   char magic[4];
+   uint32_t num_terms;
+   uint32_t min_seq;
+   uint32_t max_seq;
+   uint64_t strings_offset;
+   uint64_t dict_offset;
+} IndexHeader;
+
+typedef struct {
+   uint64_t postings_offset;
+   uint32_t postings_count;
+   uint32_t postings_bytes;
+   uint32_t term_offset; // from strings_offset
+   uint16_t term_len;
+   uint16_t pad;
+} IndexTerm;
+
+typedef struct {
+   char path[INDEX_PATH];
+   uint8_t *map;
+   size_t size;
+   IndexHeader *header;
+   IndexTerm *dict;
+} IndexSegment;
+
+/* In memory postings for one key */
+typedef struct termEntry {
+   struct termEntry *next; // hash chain
+   uint32_t *postings;
+   uint32_t count;
+   uint32_t cap;
+   uint16_t len;
+   char key[];
+} TermEntry;
+
+/* Growable list of seq numbers */
+typedef struct {
+   uint32_t *seqs;
+   uint32_t count;
+   uint32_t cap;
+} Postings;
+
+typedef struct {
+   FILE *f;
+   char tmp[INDEX_PATH];
+   uint64_t offset;
+   uint8_t *strings;
+   uint32_t strings_len;
+   uint32_t strings_cap;
+   IndexTerm *dict;
+   uint32_t num_terms;
+   uint32_t dict_cap;
+} SegmentWriter;
+
+/* A background flush of a memory index that filled up (or sat long
+ * enough). The table isn't added to any more, but is still searched
+ * until its segment is swapped in
+ */
+typedef struct {
+	TermEntry **table;
+	uint32_t table_size;
+	uint32_t num_terms;
+	uint32_t min_seq;
+	uint32_t max_seq;
+	char path[INDEX_PATH];
+	int running; // thread started and not yet joined
+	int ok;
+	volatile int done;
+} FlushJob;
+
+/* A background merge of segments[first] and segments[first+1] */
+typedef struct {
+   IndexSegment *older;
+   IndexSegment *newer;
+   char path[INDEX_PATH];
+   int first;
+   int ok;
+   volatile int done;
+} MergeJob;
+
+// Search index global variables
+static char *indexDir = NULL;
+static IndexSegment **segments = NULL; // oldest first
+static int numSegments = 0;
+static TermEntry **termTable = NULL;
+static uint32_t termTableSize = 0;
+static uint32_t numTerms = 0;
+static uint32_t memPostings = 0;
+static uint32_t memMinSeq = 0;
+static uint32_t memMaxSeq = 0;
+static uint64_t lastFlush = 0;
+static pthread_t mergeThread;
+static MergeJob *merge = NULL; // non NULL while a merge runs
+static pthread_t flushThread;
+static FlushJob *flush = NULL; // non NULL until the flushed segment is in, retried if it failed
+
+static int nextTerm(uint8_t **p, uint8_t *end, char *term);
+static void addPosting(char *key, int len, uint32_t seq);
+static TermEntry *findTerm(TermEntry **table, uint32_t size, char *key, int len);
+static uint32_t hashKey(char *key, int len);
+static void startFlush();
+static void runFlush();
+static void *flushSegment(void *arg);
+static void finishFlush();
+static void freeTable(TermEntry **table, uint32_t size);
+static IndexSegment *openIndexSegment(char *path);
+static void closeIndexSegment(IndexSegment *seg, int removeFile);
+static IndexTerm *segmentLookup(IndexSegment *seg, char *key, int len);
+static void decodePostings(IndexSegment *seg, IndexTerm *t, Postings *out, uint32_t base);
+static void sourcePostings(int src, char *key, int len, Postings *out);
+static TermEntry *sourceTerm(int src, char *key, int len);
+static uint32_t sourceCount(int src, char *key, int len);
+static void matchSource(int src, char keys[][INDEX_MAX_KEY], int *lens, int numKeys, Postings *out, Postings *next);
+static uint32_t estimateSource(int src, char keys[][INDEX_MAX_KEY], int *lens, int numKeys);
+static void intersect(Postings *a, Postings *b);
+static void appendSeq(Postings *p, uint32_t seq);
+static void writerBegin(SegmentWriter *w, char *path);
+static void writerAdd(SegmentWriter *w, char *key, int len, uint32_t *seqs, uint32_t count);
+static int writerFinish(SegmentWriter *w, uint32_t minSeq, uint32_t maxSeq, char *path);
+static void *mergeSegments(void *arg);
+static void startMerge();
+static void finishMerge();
+static int compareSegments(const void *a, const void *b);
+static int compareEntries(const void *a, const void *b);
+static int compareKeys(char *a, int alen, char *b, int blen);
+
+/* Opens the segments found in dir, removing leftovers of an
+ * interrupted merge or flush
+ */
+void setupSearchIndex(char *dir)
+{
+	char path[INDEX_PATH];
+	struct dirent *entry = NULL;
+	DIR *d = NULL;
+	IndexSegment *seg = NULL;
+	uint32_t maxSeq = 0;
+	int i = 0, kept = 0;
+
+	indexDir = dir;
+	if (mkdir(dir, 0700) < 0 && errno != EEXIST)
+	{
+		perror("mkdir search index");
+		exit(EXIT_FAILURE);
+	}
+
+	termTableSize = INIT_TERM_TABLE;
+	termTable = sCalloc(termTableSize, sizeof(TermEntry *));
+	memCharge(MEM_INDEX, termTableSize * sizeof(TermEntry *));
+	lastFlush = timerNowMs();
+
+	if ((d = opendir(dir)) == NULL)
+	{
+		perror("opendir search index");
+		exit(EXIT_FAILURE);
+	}
+	while ((entry = readdir(d)) != NULL)
+	{
+		snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+		if (strstr(entry->d_name, ".tmp") != NULL)
+			unlink(path);
+		else if (strncmp(entry->d_name, "idx-", 4) == 0 && (seg = openIndexSegment(path)) != NULL)
+		{
+			segments = srealloc(segments, sizeof(IndexSegment *) * (numSegments + 1));
+			segments[numSegments++] = seg;
+		}
+	}
+	closedir(d);
+
+	// oldest first, a merged segment ahead of the inputs it covers
+	qsort(segments, numSegments, sizeof(IndexSegment *), compareSegments);
+	for (i = 0; i < numSegments; i++)
+	{
+		if (kept > 0 && segments[i]->header->max_seq <= maxSeq)
+		{
+			closeIndexSegment(segments[i], 1);
+			continue;
+		}
+		maxSeq = segments[i]->header->max_seq;
+		segments[kept++] = segments[i];
+	}
+	numSegments = kept;
+}
+
+uint32_t indexMaxSeq()
+{
+	uint32_t maxSeq = memMaxSeq;
+	if (numSegments > 0 && segments[numSegments - 1]->header->max_seq > maxSeq)
+		maxSeq = segments[numSegments - 1]->header->max_seq;
+	return maxSeq;
+}
+
+/* Indexes the text of a decoded flag 4 or 5 packet */
+void indexMessage(uint32_t seq, const Frame *f)
+{
+	uint8_t *p = (uint8_t *)f->text;
+	uint8_t *end = p + f->text_len;
+	int i = 0, termLen = 0, handleLen = 0;
+	char term[INDEX_MAX_TERM + 1];
+	char key[INDEX_MAX_KEY];
+
+	if (indexDir == NULL)
+		return;
+
+	while ((termLen = nextTerm(&p, end, term)) > 0)
+	{
+		if (f->flag != MESSAGE_FLAG)
+		{
+			addPosting(term, termLen, seq);
+			continue;
+		}
+		for (i = 0; i < f->num_handles; i++) // sender and recipients
+		{
+			handleLen = f->handle_lens[i];
+			memcpy(key, f->handles[i], handleLen);
+			key[handleLen] = SCOPE_SEPARATOR;
+			memcpy(key + handleLen + 1, term, termLen);
+			addPosting(key, handleLen + 1 + termLen, seq);
+		}
+	}
+
+	if (memMinSeq == 0)
+		memMinSeq = seq;
+	memMaxSeq = seq;
+	if (memPostings >= INDEX_FLUSH_POSTINGS)
+		startFlush();
+}
+
+/* Finds the messages containing every word of query that handle could
+ * see. Fills results newest first (up to maxResults) and returns how
+ * many were filled. Only the newest segments are read for them: total
+ * counts the matches in those exactly, and adds an upper bound from the
+ * dictionaries (the rarest word's count) for the older ones
+ */
+int searchIndex(char *query, char *handle, uint32_t *results, int maxResults, uint32_t *total)
+{
+	char terms[INDEX_MAX_QUERY_TERMS][INDEX_MAX_TERM + 1];
+	char keys[2][INDEX_MAX_QUERY_TERMS][INDEX_MAX_KEY]; // broadcasts, then handle's direct messages
+	int lens[2][INDEX_MAX_QUERY_TERMS];
+	int numQueryTerms = 0;
+	uint8_t *p = (uint8_t *)query;
+	uint8_t *end = p + strlen(query);
+	int handleLen = strlen(handle);
+	Postings scope[2];
+	Postings next;
+	uint32_t ia = 0, ib = 0, seq = 0;
+	int n = 0, len = 0, src = 0;
+
+	*total = 0;
+	if (indexDir == NULL)
+		return 0;
+	while (numQueryTerms < INDEX_MAX_QUERY_TERMS
+		&& (len = nextTerm(&p, end, terms[numQueryTerms])) > 0)
+	{
+		memcpy(keys[0][numQueryTerms], terms[numQueryTerms], len);
+		lens[0][numQueryTerms] = len;
+		memcpy(keys[1][numQueryTerms], handle, handleLen);
+		keys[1][numQueryTerms][handleLen] = SCOPE_SEPARATOR;
+		memcpy(keys[1][numQueryTerms] + handleLen + 1, terms[numQueryTerms], len);
+		lens[1][numQueryTerms] = handleLen + 1 + len;
+		numQueryTerms++;
+	}
+	if (numQueryTerms == 0)
+		return 0;
+
+	memset(scope, 0, sizeof(scope));
+	memset(&next, 0, sizeof(next));
+	// sources cover disjoint seq ranges, so newest first is in seq order
+	for (src = numSegments + 1; src >= 0; src--)
+	{
+		if (n >= maxResults)
+		{
+			*total += estimateSource(src, keys[0], lens[0], numQueryTerms)
+				+ estimateSource(src, keys[1], lens[1], numQueryTerms);
+			continue;
+		}
+		matchSource(src, keys[0], lens[0], numQueryTerms, &scope[0], &next);
+		matchSource(src, keys[1], lens[1], numQueryTerms, &scope[1], &next);
+
+		// union of both scopes, walked from the newest end
+		ia = scope[0].count;
+		ib = scope[1].count;
+		while (ia > 0 || ib > 0)
+		{
+			if (ib == 0 || (ia > 0 && scope[0].seqs[ia - 1] > scope[1].seqs[ib - 1]))
+				seq = scope[0].seqs[--ia];
+			else
+			{
+				seq = scope[1].seqs[--ib];
+				if (ia > 0 && scope[0].seqs[ia - 1] == seq)
+					ia--;
+			}
+			if (n < maxResults)
+				results[n++] = seq;
+			(*total)++;
+		}
+	}
+
+	free(scope[0].seqs);
+	free(scope[1].seqs);
+	free(next.seqs);
+	return n;
+}
+
+/* Called periodically by the server - flushes the memory index once it
+ * has been sitting long enough, and starts/finishes background merges
+ */
+void indexMaintenance()
+{
+	if (indexDir == NULL)
+		return;
+
+	if (merge != NULL && merge->done)
+		finishMerge();
+	if (flush != NULL && flush->running && flush->done)
+		finishFlush();
+
+	if ((memPostings > 0 || flush != NULL) && timerNowMs() - lastFlush >= INDEX_FLUSH_INTERVAL)
+		startFlush();
+
+	if (merge == NULL && numSegments > INDEX_MAX_SEGMENTS)
+		startMerge();
+}
+
+/* Before another process takes the index over - waits for a running
+ * merge or flush and writes out the memory index
+ */
+void indexFlush()
+{
+	int pass = 0;
+
+	if (indexDir == NULL)
+		return;
+	if (merge != NULL)
+		finishMerge(); // joins the merge thread
+	if (flush != NULL && flush->running)
+		finishFlush(); // joins the flush thread
+	// one that failed is tried again first, then the rest
+	for (pass = 0; pass < 2; pass++)
+	{
+		startFlush();
+		if (flush == NULL)
+			break; // nothing left
+		if (flush->running)
+			finishFlush();
+		if (flush != NULL)
+			break; // failed again
+	}
+}
+
+/* Splits text into lower cased words. Bytes >= 0x80 count as letters so
+ * UTF-8 words are indexed whole. Returns the word length, 0 at the end
+ */
+static int nextTerm(uint8_t **p, uint8_t *end, char *term)
+{
+	int len = 0;
+	uint8_t *q = *p;
+
+	while (q < end)
+	{
+		len = 0;
+		while (q < end && !(isalnum(*q) || *q >= 0x80))
+			q++;
+		while (q < end && (isalnum(*q) || *q >= 0x80))
+		{
+			if (len < INDEX_MAX_TERM)
+				term[len++] = tolower(*q);
+			q++;
+		}
+		if (len >= 2) // skip single letters
+		{
+			term[len] = '\0';
+			*p = q;
+			return len;
+		}
+	}
+	*p = q;
+	return 0;
+}
+
+static void addPosting(char *key, int len, uint32_t seq)
+{
+	TermEntry *e = findTerm(termTable, termTableSize, key, len);
+	TermEntry *next = NULL;
+	TermEntry **oldTable = NULL;
+	uint32_t oldSize = 0, i = 0, index = 0;
+
+	if (e == NULL)
+	{
+		if (numTerms >= termTableSize)
+		{
+			oldTable = termTable;
+			oldSize = termTableSize;
+			termTableSize *= 2;
+			termTable = sCalloc(termTableSize, sizeof(TermEntry *));
+			for (i = 0; i < oldSize; i++)
+			{
+				for (e = oldTable[i]; e != NULL; e = next)
+				{
+					next = e->next;
+					index = hashKey(e->key, e->len) & (termTableSize - 1);
+					e->next = termTable[index];
+					termTable[index] = e;
+				}
+			}
+			free(oldTable);
+			memCharge(MEM_INDEX, (termTableSize - oldSize) * sizeof(TermEntry *));
+		}
+		e = sCalloc(1, sizeof(TermEntry) + len);
+		memCharge(MEM_INDEX, sizeof(TermEntry) + len);
+		memcpy(e->key, key, len);
+		e->len = len;
+		index = hashKey(key, len) & (termTableSize - 1);
+		e->next = termTable[index];
+		termTable[index] = e;
+		numTerms++;
+	}
+
+	if (e->count > 0 && e->postings[e->count - 1] == seq)
+		return; // word repeated in the same message
+	if (e->count == e->cap)
+	{
+		memCharge(MEM_INDEX, sizeof(uint32_t) * (e->cap ? e->cap : 4));
+		e->cap = e->cap ? e->cap * 2 : 4;
+		e->postings = srealloc(e->postings, sizeof(uint32_t) * e->cap);
+	}
+	e->postings[e->count++] = seq;
+	memPostings++;
+}
+
+static TermEntry *findTerm(TermEntry **table, uint32_t size, char *key, int len)
+{
+	TermEntry *e = NULL;
+	for (e = table[hashKey(key, len) & (size - 1)]; e != NULL; e = e->next)
+	{
+		if (e->len == len && memcmp(e->key, key, len) == 0)
+			return e;
+	}
+	return NULL;
+}
+
+static uint32_t hashKey(char *key, int len)
+{
+	uint32_t hash = 2166136261u;
+	int i = 0;
+	for (i = 0; i < len; i++)
+	{
+		hash ^= (uint8_t)key[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+/* Hands the memory index to a flush thread and starts a new one, or
+ * retries a flush that failed. Only one runs at a time, so segments
+ * are added in seq order
+ */
+static void startFlush()
+{
+	lastFlush = timerNowMs();
+	if (flush != NULL)
+	{
+		if (!flush->running)
+			runFlush();
+		return;
+	}
+	if (memPostings == 0)
+		return;
+
+	flush = sCalloc(1, sizeof(FlushJob));
+	flush->table = termTable;
+	flush->table_size = termTableSize;
+	flush->num_terms = numTerms;
+	flush->min_seq = memMinSeq;
+	flush->max_seq = memMaxSeq;
+	snprintf(flush->path, sizeof(flush->path), "%s/idx-%010u-%010u.seg", indexDir, memMinSeq, memMaxSeq);
+
+	termTableSize = INIT_TERM_TABLE;
+	termTable = sCalloc(termTableSize, sizeof(TermEntry *));
+	memCharge(MEM_INDEX, termTableSize * sizeof(TermEntry *));
+	numTerms = 0;
+	memPostings = 0;
+	memMinSeq = 0;
+	runFlush();
+}
+
+static void runFlush()
+{
+	flush->done = 0;
+	flush->running = pthread_create(&flushThread, NULL, flushSegment, flush) == 0;
+	if (!flush->running)
+		perror("pthread_create search index flush");
+}
+
+/* Flush thread - only reads the table, which nothing adds to any more,
+ * and writes a new file; the event loop swaps it in when done is set
+ */
+static void *flushSegment(void *arg)
+{
+	FlushJob *job = (FlushJob *)arg;
+	SegmentWriter w;
+	TermEntry **sorted = NULL;
+	TermEntry *e = NULL;
+	uint32_t i = 0, n = 0;
+
+	sorted = srealloc(NULL, sizeof(TermEntry *) * job->num_terms);
+	for (i = 0; i < job->table_size; i++)
+		for (e = job->table[i]; e != NULL; e = e->next)
+			sorted[n++] = e;
+	qsort(sorted, n, sizeof(TermEntry *), compareEntries);
+
+	writerBegin(&w, job->path);
+	for (i = 0; i < n; i++)
+		writerAdd(&w, sorted[i]->key, sorted[i]->len, sorted[i]->postings, sorted[i]->count);
+	free(sorted);
+
+	job->ok = writerFinish(&w, job->min_seq, job->max_seq, job->path) == 0;
+	__atomic_store_n(&job->done, 1, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+/* swaps the flushed segment in for the table it was written from */
+static void finishFlush()
+{
+	IndexSegment *seg = NULL;
+
+	pthread_join(flushThread, NULL);
+	flush->running = 0;
+	if (!flush->ok || (seg = openIndexSegment(flush->path)) == NULL)
+	{
+		fprintf(stderr, "search index flush failed, keeping postings in memory\n");
+		return;
+	}
+	segments = srealloc(segments, sizeof(IndexSegment *) * (numSegments + 1));
+	segments[numSegments++] = seg;
+	freeTable(flush->table, flush->table_size);
+	free(flush->table);
+	memCharge(MEM_INDEX, -(ssize_t)(flush->table_size * sizeof(TermEntry *)));
+	free(flush);
+	flush = NULL;
+}
+
+static void freeTable(TermEntry **table, uint32_t size)
+{
+	TermEntry *e = NULL;
+	TermEntry *next = NULL;
+	uint32_t i = 0;
+
+	for (i = 0; i < size; i++)
+	{
+		for (e = table[i]; e != NULL; e = next)
+		{
+			next = e->next;
+			memCharge(MEM_INDEX, -(ssize_t)(sizeof(TermEntry) + e->len + sizeof(uint32_t) * e->cap));
+			free(e->postings);
+			free(e);
+		}
+	}
+}
+
+static IndexSegment *openIndexSegment(char *path)
+{
+	IndexSegment *seg = NULL;
+	struct stat st;
+	int fd = -1;
+
+	if ((fd = open(path, O_RDONLY)) < 0)
+		return NULL;
+	if (fstat(fd, &st) < 0 || st.st_size < sizeof(IndexHeader))
+	{
+		close(fd);
+		return NULL;
+	}
+
+	seg = sCalloc(1, sizeof(IndexSegment));
+	snprintf(seg->path, sizeof(seg->path), "%s", path);
+	seg->size = st.st_size;
+	seg->map = mmap(NULL, seg->size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (seg->map == MAP_FAILED)
+	{
+		free(seg);
+		return NULL;
+	}
+
+	seg->header = (IndexHeader *)seg->map;
+	seg->dict = (IndexTerm *)(seg->map + seg->header->dict_offset);
+	if (memcmp(seg->header->magic, INDEX_MAGIC, 4) != 0
+		|| seg->header->dict_offset + (uint64_t)seg->header->num_terms * sizeof(IndexTerm) > seg->size)
+	{
+		fprintf(stderr, "ignoring corrupt search index segment %s\n", path);
+		munmap(seg->map, seg->size);
+		free(seg);
+		return NULL;
+	}
+	return seg;
+}
+
+static void closeIndexSegment(IndexSegment *seg, int removeFile)
+{
+	munmap(seg->map, seg->size);
+	if (removeFile)
+		unlink(seg->path);
+	free(seg);
+}
+
+static IndexTerm *segmentLookup(IndexSegment *seg, char *key, int len)
+{
+	uint32_t low = 0;
+	uint32_t high = seg->header->num_terms;
+	uint32_t mid = 0;
+	IndexTerm *t = NULL;
+	int cmp = 0;
+
+	while (low < high)
+	{
+		mid = low + (high - low) / 2;
+		t = &seg->dict[mid];
+		cmp = compareKeys((char *)seg->map + seg->header->strings_offset + t->term_offset,
+			t->term_len, key, len);
+		if (cmp == 0)
+			return t;
+		if (cmp < 0)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+	return NULL;
+}
+
+/* appends t's postings to out, deltas start from base */
+static void decodePostings(IndexSegment *seg, IndexTerm *t, Postings *out, uint32_t base)
+{
+	uint8_t *p = seg->map + t->postings_offset;
+	uint32_t i = 0, value = 0;
+	int shift = 0;
+
+	for (i = 0; i < t->postings_count; i++)
+	{
+		value = 0;
+		shift = 0;
+		while (*p & 0x80)
+		{
+			value |= (uint32_t)(*p++ & 0x7f) << shift;
+			shift += 7;
+		}
+		value |= (uint32_t)*p++ << shift;
+		base += value;
+		appendSeq(out, base);
+	}
+}
+
+/* Sources, oldest first: segments[0 .. numSegments-1], then the table
+ * being flushed, then the memory index
+ */
+static TermEntry *sourceTerm(int src, char *key, int len)
+{
+	if (src == numSegments)
+		return flush != NULL ? findTerm(flush->table, flush->table_size, key, len) : NULL;
+	return findTerm(termTable, termTableSize, key, len);
+}
+
+/* key's postings in one source, ascending */
+static void sourcePostings(int src, char *key, int len, Postings *out)
+{
+	IndexTerm *t = NULL;
+	TermEntry *e = NULL;
+	uint32_t i = 0;
+
+	if (src < numSegments)
+	{
+		if ((t = segmentLookup(segments[src], key, len)) != NULL)
+			decodePostings(segments[src], t, out, 0);
+	}
+	else if ((e = sourceTerm(src, key, len)) != NULL)
+	{
+		for (i = 0; i < e->count; i++)
+			appendSeq(out, e->postings[i]);
+	}
+}
+
+static uint32_t sourceCount(int src, char *key, int len)
+{
+	IndexTerm *t = NULL;
+	TermEntry *e = NULL;
+
+	if (src < numSegments)
+		return (t = segmentLookup(segments[src], key, len)) != NULL ? t->postings_count : 0;
+	return (e = sourceTerm(src, key, len)) != NULL ? e->count : 0;
+}
+
+/* the messages in one source with every key, ascending */
+static void matchSource(int src, char keys[][INDEX_MAX_KEY], int *lens, int numKeys, Postings *out, Postings *next)
+{
+	int i = 0;
+
+	out->count = 0;
+	for (i = 0; i < numKeys; i++)
+	{
+		next->count = 0;
+		sourcePostings(src, keys[i], lens[i], i == 0 ? out : next);
+		if (i > 0)
+			intersect(out, next);
+		if (out->count == 0)
+			break;
+	}
+}
+
+/* at most how many messages in one source have every key, without
+ * decoding any postings
+ */
+static uint32_t estimateSource(int src, char keys[][INDEX_MAX_KEY], int *lens, int numKeys)
+{
+	uint32_t least = 0, count = 0;
+	int i = 0;
+
+	for (i = 0; i < numKeys; i++)
+	{
+		count = sourceCount(src, keys[i], lens[i]);
+		if (i == 0 || count < least)
+			least = count;
+		if (least == 0)
+			break;
+	}
+	return least;
+}
+
+/* a = a AND b, both ascending */
+static void intersect(Postings *a, Postings *b)
+{
+	uint32_t i = 0, j = 0, n = 0;
+	while (i < a->count && j < b->count)
+	{
+		if (a->seqs[i] < b->seqs[j])
+			i++;
+		else if (a->seqs[i] > b->seqs[j])
+			j++;
+		else
+		{
+			a->seqs[n++] = a->seqs[i];
+			i++;
+			j++;
+		}
+	}
+	a->count = n;
+}
+
+static void appendSeq(Postings *p, uint32_t seq)
+{
+	if (p->count == p->cap)
+	{
+		p->cap = p->cap ? p->cap * 2 : 64;
+		p->seqs = srealloc(p->seqs, sizeof(uint32_t) * p->cap);
+	}
+	p->seqs[p->count++] = seq;
+}
+
+static void writerBegin(SegmentWriter *w, char *path)
+{
+	IndexHeader header;
+
+	memset(w, 0, sizeof(SegmentWriter));
+	snprintf(w->tmp, sizeof(w->tmp), "%s.tmp", path);
+	if ((w->f = fopen(w->tmp, "w")) == NULL)
+	{
+		perror("fopen search index segment");
+		return;
+	}
+	memset(&header, 0, sizeof(header));
+	fwrite(&header, sizeof(header), 1, w->f); // filled in by writerFinish
+	w->offset = sizeof(header);
+}
+
+/* adds a term (in sorted order) with its ascending postings */
+static void writerAdd(SegmentWriter *w, char *key, int len, uint32_t *seqs, uint32_t count)
+{
+	uint8_t varint[5];
+	uint32_t i = 0, prev = 0, delta = 0;
+	int n = 0;
+	IndexTerm *t = NULL;
+
+	if (w->f == NULL)
+		return;
+
+	if (w->num_terms == w->dict_cap)
+	{
+		w->dict_cap = w->dict_cap ? w->dict_cap * 2 : 1024;
+		w->dict = srealloc(w->dict, sizeof(IndexTerm) * w->dict_cap);
+	}
+	if (w->strings_len + len > w->strings_cap)
+	{
+		w->strings_cap = (w->strings_cap + len) * 2;
+		w->strings = srealloc(w->strings, w->strings_cap);
+	}
+
+	t = &w->dict[w->num_terms++];
+	memset(t, 0, sizeof(IndexTerm));
+	t->postings_offset = w->offset;
+	t->postings_count = count;
+	t->term_offset = w->strings_len;
+	t->term_len = len;
+	memcpy(w->strings + w->strings_len, key, len);
+	w->strings_len += len;
+
+	for (i = 0; i < count; i++)
+	{
+		delta = seqs[i] - prev;
+		prev = seqs[i];
+		n = 0;
+		while (delta >= 0x80)
+		{
+			varint[n++] = (delta & 0x7f) | 0x80;
+			delta >>= 7;
+		}
+		varint[n++] = delta;
+		fwrite(varint, 1, n, w->f);
+		t->postings_bytes += n;
+	}
+	w->offset += t->postings_bytes;
+}
+
+/* writes the strings, dictionary and header, then renames into place */
+static int writerFinish(SegmentWriter *w, uint32_t minSeq, uint32_t maxSeq, char *path)
+{
+	IndexHeader header;
+	uint8_t pad[8] = {0};
+	int ok = w->f != NULL;
+
+	if (ok)
+	{
+		memcpy(header.magic, INDEX_MAGIC, 4);
+		header.num_terms = w->num_terms;
+		header.min_seq = minSeq;
+		header.max_seq = maxSeq;
+		header.strings_offset = w->offset;
+		fwrite(w->strings, 1, w->strings_len, w->f);
+		w->offset += w->strings_len;
+		// dictionary is read in place - keep it aligned
+		fwrite(pad, 1, (8 - w->offset % 8) % 8, w->f);
+		w->offset += (8 - w->offset % 8) % 8;
+		header.dict_offset = w->offset;
+		fwrite(w->dict, sizeof(IndexTerm), w->num_terms, w->f);
+
+		fseek(w->f, 0, SEEK_SET);
+		fwrite(&header, sizeof(header), 1, w->f);
+		ok = fflush(w->f) == 0 && fsync(fileno(w->f)) == 0;
+		ok = fclose(w->f) == 0 && ok;
+		ok = ok && rename(w->tmp, path) == 0;
+		if (!ok)
+			unlink(w->tmp);
+	}
+	free(w->strings);
+	free(w->dict);
+	return ok ? 0 : -1;
+}
+
+/* Merge thread - only reads the two (immutable) input segments and
+ * writes a new file, the event loop swaps it in when done is set
+ */
+static void *mergeSegments(void *arg)
+{
+	MergeJob *job = (MergeJob *)arg;
+	IndexSegment *a = job->older;
+	IndexSegment *b = job->newer;
+	IndexTerm *ta = NULL, *tb = NULL;
+	char *ka = NULL, *kb = NULL;
+	uint32_t ia = 0, ib = 0;
+	int cmp = 0;
+	Postings merged;
+	SegmentWriter w;
+
+	memset(&merged, 0, sizeof(merged));
+	writerBegin(&w, job->path);
+	while (ia < a->header->num_terms || ib < b->header->num_terms)
+	{
+		ta = ia < a->header->num_terms ? &a->dict[ia] : NULL;
+		tb = ib < b->header->num_terms ? &b->dict[ib] : NULL;
+		ka = ta ? (char *)a->map + a->header->strings_offset + ta->term_offset : NULL;
+		kb = tb ? (char *)b->map + b->header->strings_offset + tb->term_offset : NULL;
+		if (ta == NULL)
+			cmp = 1;
+		else if (tb == NULL)
+			cmp = -1;
+		else
+			cmp = compareKeys(ka, ta->term_len, kb, tb->term_len);
+
+		merged.count = 0;
+		if (cmp <= 0)
+			decodePostings(a, ta, &merged, 0);
+		if (cmp >= 0)
+			decodePostings(b, tb, &merged, 0); // newer segment - larger seqs
+		if (cmp <= 0)
+			writerAdd(&w, ka, ta->term_len, merged.seqs, merged.count);
+		else
+			writerAdd(&w, kb, tb->term_len, merged.seqs, merged.count);
+		ia += cmp <= 0;
+		ib += cmp >= 0;
+	}
+	free(merged.seqs);
+
+	job->ok = writerFinish(&w, a->header->min_seq, b->header->max_seq, job->path) == 0;
+	__atomic_store_n(&job->done, 1, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+/* merges the adjacent pair of segments with the smallest combined size */
+static void startMerge()
+{
+	int i = 0, best = 0;
+	size_t size = 0, bestSize = 0;
+
+	for (i = 0; i + 1 < numSegments; i++)
+	{
+		size = segments[i]->size + segments[i + 1]->size;
+		if (i == 0 || size < bestSize)
+		{
+			best = i;
+			bestSize = size;
+		}
+	}
+
+	merge = sCalloc(1, sizeof(MergeJob));
+	merge->older = segments[best];
+	merge->newer = segments[best + 1];
+	merge->first = best;
+	snprintf(merge->path, sizeof(merge->path), "%s/idx-%010u-%010u.seg", indexDir,
+		merge->older->header->min_seq, merge->newer->header->max_seq);
+	if (pthread_create(&mergeThread, NULL, mergeSegments, merge) != 0)
+	{
+		perror("pthread_create search index merge");
+		free(merge);
+		merge = NULL;
+	}
+}
+
+/* swaps the merged segment in for its two inputs */
+static void finishMerge()
+{
+	IndexSegment *seg = NULL;
+	int i = 0;
+
+	pthread_join(mergeThread, NULL);
+	if (merge->ok && (seg = openIndexSegment(merge->path)) != NULL)
+	{
+		closeIndexSegment(merge->older, 1);
+		closeIndexSegment(merge->newer, 1);
+		segments[merge->first] = seg;
+		for (i = merge->first + 1; i + 1 < numSegments; i++)
+			segments[i] = segments[i + 1];
+		numSegments--;
+	}
+	else
+		fprintf(stderr, "search index merge failed\n");
+	free(merge);
+	merge = NULL;
+}
+
+static int compareSegments(const void *a, const void *b)
+{
+	IndexHeader *ha = (*(IndexSegment **)a)->header;
+	IndexHeader *hb = (*(IndexSegment **)b)->header;
+	if (ha->min_seq != hb->min_seq)
+		return ha->min_seq < hb->min_seq ? -1 : 1;
+	if (ha->max_seq != hb->max_seq)
+		return ha->max_seq > hb->max_seq ? -1 : 1;
+	return 0;
+}
+
+static int compareEntries(const void *a, const void *b)
+{
+	TermEntry *ea = *(TermEntry **)a;
+	TermEntry *eb = *(TermEntry **)b;
+	return compareKeys(ea->key, ea->len, eb->key, eb->len);
+}
+
+static int compareKeys(char *a, int alen, char *b, int blen)
+{
+	int cmp = memcmp(a, b, alen < blen ? alen : blen);
+	if (cmp != 0)
+		return cmp;
+	return alen - blen;
+}
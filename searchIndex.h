@@ -0,0 +1,33 @@
+/* Full text search over message history.
+ * An incremental inverted index from term to the sequence numbers of
+ * the messages containing it. New postings collect in memory and are
+ * flushed to immutable, mmap-able segment files, which background
+ * threads write and merge so the event loop never waits on the disk,
+ * and the number of segments per query stays small.
+ *
+ * Broadcast text is indexed under the plain term, direct message text
+ * under "<handle>\x01<term>" for the sender and each recipient, so a
+ * query only ever sees messages the asking user could see.
+ */
+
+#ifndef SEARCHINDEX_H
+#define SEARCHINDEX_H
+
+#include <stdint.h>
+
+#include "protocol.h"
+
+#define INDEX_MAX_TERM 32 // longer words are truncated
+#define INDEX_MAX_QUERY_TERMS 8
+#define INDEX_FLUSH_POSTINGS 262144 // in memory postings before a flush
+#define INDEX_MAX_SEGMENTS 8 // segments before a background merge starts
+#define INDEX_FLUSH_INTERVAL 10000 // ms before a non empty memory index is flushed anyway
+
+void setupSearchIndex(char *dir);
+void indexMessage(uint32_t seq, const Frame *f);
+int searchIndex(char *query, char *handle, uint32_t *results, int maxResults, uint32_t *total);
+void indexMaintenance();
+void indexFlush();
+uint32_t indexMaxSeq();
+
+#endif
@@ -6,6 +6,30 @@
 #include "networks.h"
 #include "pollLib.h"
 #include "packets.h"
+#include "timerWheel.h"
+#include "outQueue.h"
+#include "tokenBucket.h"
+#include "offlineStore.h"
+#include "historyRing.h"
+#include "searchIndex.h"
+#include "federation.h"
+#include "presence.h"
+#include "handoff.h"
+#include "shmRing.h"
+#include "validate.h"
+#include "compress.h"
+#include "tlsSocket.h"
+#include "fanoutPool.h"
+#include "memAccount.h"
+#include "slabPool.h"
+#include "affinity.h"
+#include "contentFilter.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/random.h>
+#include <time.h>
 
 /* Server scope MACROS */
 #define DEBUG_FLAG 1
@@ -15,51 +39,513 @@
 #define OPEN 1
 
 #define INIT_CLIENTS 10
-#define GOOD_HANDLE 2
-#define HANDLE_EXISTS 3
+
+/* Connection states */
+#define CONN_LOGIN 0 // accepted, waiting for flag 1
+#define CONN_ACTIVE 1 // handle accepted
+#define CONN_PEER_CONNECTING 2 // outgoing link to another node, connect() pending
+#define CONN_PEER 3 // link to another node, hello received
+#define CONN_PEER_HELLO 4 // outgoing link to another node, waiting for its hello
+
+/* Connection timeouts (ms) */
+#define LOGIN_TIMEOUT 10000 // time allowed to send flag 1 after accept
+#define HEARTBEAT_INTERVAL 30000 // silence before probing with flag 14
+#define MAX_MISSED_HEARTBEATS 2 // unanswered probes before eviction
+#define IDLE_TIMEOUT 1800000 // no chat traffic for 30 minutes
+
+/* Slow consumer policies - applied when a connection's outbound
+ * queue grows past config.out_limit bytes
+ */
+#define SLOW_DROP_OLDEST 0 // discard the oldest queued broadcasts
+#define SLOW_DISCONNECT 1 // disconnect if still over after config.slow_grace
+#define SLOW_SPILL 2 // queue the overflow in a temp file on disk
+
+#define DEFAULT_OUT_LIMIT 262144
+#define DEFAULT_SLOW_GRACE 10000
+#define DEFAULT_SPILL_DIR "/tmp"
+#define OUT_HARD_LIMIT 4 // x out_limit held in memory before any policy disconnects
+
+/* Per client rate limits (0 = unlimited), bursts are twice the rate */
+#define DEFAULT_FRAME_RATE 100 // packets per second
+#define DEFAULT_BYTE_RATE 65536 // bytes per second
+
+/* Dispatch priority classes */
+#define PRIO_NOW -1 // control frames - handled as soon as they're read
+#define PRIO_DIRECT 0 // flag 5 - always dispatched first
+#define PRIO_BULK 1 // flag 4 broadcasts, flag 10 %L (and flag 8 behind them)
+#define BULK_PER_PASS 32 // bulk frames dispatched per pass of the event loop
+#define BULK_BACKLOG_LIMIT 4096 // queued bulk frames before the budget is lifted
+
+/* Offline store (enabled with -O) */
+#define OFFLINE_BATCH 256 // stored messages sent to a returning user per timer tick
+#define OFFLINE_COMMIT_INTERVAL 10 // ms between group commits of the log
+
+/* Message history */
+#define HISTORY_ARENA 1048576 // bytes of encoded packets kept per scope
+#define HISTORY_ENTRIES 16384 // packets kept per scope
+#define HISTORY_MAX_REPLAY 1024 // packets per replay - one sendmsg()
+
+/* Resumable sessions (flag 25) */
+#define DEFAULT_SESSION_GRACE 30000 // ms a dropped session waits for its client (-S)
+#define SESSION_RETAIN_BYTES 32768 // last frames kept per session for a resume
+#define SESSION_RETAIN_FRAMES 512
+
+/* Federation (enabled with -n) */
+#define PEER_MAX_BATCH_PASSES 16 // busy loop passes a relayed frame can wait for its batch
+
+/* Parallel fan-out (enabled with -W) */
+#define DEFAULT_FANOUT_MIN 1024 // logged in handles before a broadcast is spread over the workers
+
+/* Content filter (enabled with -f) */
+#define FILTER_POLL_INTERVAL 50 // ms between checks on a reload compiling
+#define FILTER_COST_BUCKETS 32 // scan times counted by power of two ns
+
+/* Memory limits (enabled with -M and -m) */
+#define SLOT_BYTES (sizeof(Handle) + sizeof(int) + sizeof(uint8_t) + sizeof(struct session *)) // per handle table entry
+
+/* Slab pools, sized with -N and -B */
+#define DEFAULT_POOL_CONNECTIONS 1024 // connections allocated for at startup
+#define DEFAULT_POOL_FRAMES 4096 // small frame chunks, see chunkSetup()
+
+/* Search index (enabled with -I) */
+#define SEARCH_MAX_RESULTS 100 // seq numbers returned per query, newest first
+#define INDEX_MAINTENANCE_INTERVAL 1000 // ms between flush/merge checks
 
 /* Server scope structures */
 typedef struct {
    int num_allocations; // max # allocations for server
    int num_handles; // # of clients in server database
    uint8_t *socket_status; // array of socket_status - malloc
-   uint8_t *socket_numbers; // array of socket numbers - malloc/realloc
+   int *socket_numbers; // array of socket numbers - malloc/realloc
    Handle *clients; // pointer to array of Handle structs
+   struct session **sessions; // per slot, NULL unless resumable
    //socket_handles; // pointer to array of char pointers - malloc
 } __attribute__((packed)) Server;
 
+/* A resumable login (flag 25). Holds its slot for config.session_grace
+ * after the connection drops, and the last frames sent, so a client
+ * coming back with flag 26 is sent only what it missed. Frames are
+ * numbered implicitly: the n-th counted frame either way is number n
+ */
+typedef struct session {
+   uint8_t token[RESUME_TOKEN_LEN];
+   int slot; // in the Server table
+   int socket; // -1 while waiting for the client to come back
+   uint32_t sent; // counted frames sent to the client
+   uint32_t received; // counted frames dispatched from the client
+   uint8_t codec; // agreed at login, kept for the frames sent while away
+   HistoryRing retained; // the latest frames sent, by number
+   Timer grace_timer;
+   Server *server;
+} Session;
+
+/* Per socket state, kept from accept() until the socket is closed */
+typedef struct {
+   int socket;
+   uint8_t state; // CONN_LOGIN or CONN_ACTIVE
+   uint8_t missed_heartbeats; // flag 14 probes sent without a reply
+   uint8_t closing; // close once timer fires (or output is flushed)
+   uint64_t last_activity; // ms of last chat frame (heartbeats excluded)
+   Timer timer; // login deadline, then heartbeat/idle timer
+   Timer slow_timer; // SLOW_DISCONNECT grace period
+   Timer throttle_timer; // resumes reading once the buckets refill
+   TokenBucket frame_bucket; // packets per second
+   TokenBucket byte_bucket; // bytes per second
+   uint64_t id; // unique per accept(), socket numbers get reused
+   int slot; // index in the Server table once CONN_ACTIVE
+   uint8_t codec; // COMPRESS_NONE or agreed in flag 1/2
+   uint8_t tls_handshake; // accepted over TLS, handshake not finished
+   Timer offline_timer; // streams stored messages after login
+   OutQueue out; // frames the socket couldn't take yet
+   size_t in_bytes; // its received frames still waiting to be dispatched
+   uint8_t mem_paused; // not read until those are dispatched (-m)
+   uint16_t partial_len;
+   uint8_t partial[MAXBUF]; // packet read in part, pkt_len first
+   Session *session; // resumable, NULL otherwise
+   Server *server;
+} Connection;
+
+/* Command line configuration */
+typedef struct {
+   uint8_t slow_policy; // SLOW_DROP_OLDEST, SLOW_DISCONNECT or SLOW_SPILL
+   int out_limit; // bytes queued per connection before the policy applies
+   int slow_grace; // ms over the limit before SLOW_DISCONNECT closes
+   char *spill_dir; // where SLOW_SPILL files are created
+   int frame_rate; // packets per second per client, 0 = unlimited
+   int byte_rate; // bytes per second per client, 0 = unlimited
+   char *offline_dir; // offline store directory, NULL = disabled
+   char *index_dir; // search index directory, NULL = disabled
+   int node_id; // federation node id, -1 = not federated
+   char *node_key; // file with the key every node shares, needed with -P
+   char *unix_path; // also listen on this AF_UNIX socket, NULL = TCP only
+   char *upgrade_path; // Unix socket a replacement process takes over through, NULL = disabled
+   int session_grace; // ms a dropped resumable session is held, 0 = no resumable sessions
+   int compress; // offer compression to the clients that ask for it
+   char *tls_cert; // TCP port is TLS only with this certificate, NULL = plaintext
+   char *tls_key;
+   int fanout_workers; // threads writing large broadcasts, 0 = all on the event loop
+   int fanout_min; // handles logged in before broadcasts use them
+   size_t mem_limit; // bytes the server may hold in all, 0 = no limit
+   size_t conn_memory; // bytes one connection may hold, 0 = only -q's limits
+   int pool_connections; // preallocated connection state, handle slots and poll set
+   int pool_frames; // preallocated frame chunks for queued input and output
+   int huge_pages; // slabs on huge pages where the kernel has them
+   int cpus[AFFINITY_MAX_CPUS]; // event loop on the first, fan-out workers on the rest
+   int num_cpus; // 0 = left to the scheduler
+   int busy_poll; // microseconds poll() spins before it sleeps, 0 = never
+   char *filter_path; // terms %M and %B are checked for, NULL = no filter
+} ServerConfig;
+
+/* A received packet waiting in a priority queue */
+typedef struct queuedFrame {
+   struct queuedFrame *next;
+   int socket;
+   uint64_t conn_id; // sender's Connection id, checked at dispatch
+   uint16_t pkt_len; // host order
+   Frame frame; // decoded, pointing into data
+   uint8_t data[]; // packet from the flag on, as sRecv() returns it
+} QueuedFrame;
+
+typedef struct {
+   QueuedFrame *head;
+   QueuedFrame *tail;
+   int count;
+} FrameQueue;
+
+/* Live upgrade snapshot records, sent in this order after HANDOFF_SERVER:
+ * HANDOFF_CONN (each followed by its queued HANDOFF_FRAMEs, then its
+ * HANDOFF_SESSION if it has one), the HANDOFF_SESSIONs waiting for a
+ * client, then HANDOFF_HISTORY chunks, then HANDOFF_END. A session's
+ * retained frames follow it as HANDOFF_HISTORY chunks of ring 2
+ */
+typedef struct {
+   uint32_t history_seq;
+   uint32_t history_arena; // ring sizes, the rings aren't passed on if they differ
+   uint32_t history_entries;
+   uint32_t session_arena; // likewise for the sessions' retained frames
+   uint32_t session_entries;
+} HandoffServer;
+
+typedef struct {
+   uint8_t state; // CONN_LOGIN or CONN_ACTIVE
+   uint8_t spilled; // spill file attached after the socket
+   int64_t spill_read;
+   int64_t spill_write;
+   uint64_t idle; // ms since last chat frame
+   uint8_t codec;
+   char handle[MAX_HANDLE + 1]; // CONN_ACTIVE only
+   uint16_t partial_len;
+   uint8_t partial[MAXBUF]; // the rest of it is still on the socket
+} HandoffConn;
+
+typedef struct {
+   uint8_t token[RESUME_TOKEN_LEN];
+   uint32_t sent;
+   uint32_t received;
+   uint8_t codec;
+   uint8_t waiting; // no connection - the client hasn't come back (or wasn't handed over)
+   uint32_t grace; // ms left for it to, waiting ones only
+   char handle[MAX_HANDLE + 1]; // waiting ones only
+} HandoffSession;
+
+typedef struct {
+   uint16_t sent;
+   uint8_t flags;
+   uint8_t data[]; // the frame
+} HandoffFrame;
+
+typedef struct {
+   uint8_t ring; // 0 broadcastHistory, 1 directHistory, 2 the last session's retained frames
+   uint8_t part; // HISTORY_PART_*
+   uint32_t offset; // into the arena or entries
+   uint8_t data[];
+} HandoffHistory;
+
+#define HISTORY_PART_ARENA 0
+#define HISTORY_PART_ENTRIES 1
+#define HISTORY_PART_POSITION 2 // write, first, count
+
+/* Counters for every slow consumer action - printed on SIGUSR1 */
+typedef struct {
+   uint64_t frames_queued; // frames that couldn't be sent immediately
+   uint64_t frames_dropped; // SLOW_DROP_OLDEST
+   uint64_t bytes_dropped;
+   uint64_t slow_disconnects; // grace period expired or hard limit hit
+   uint64_t frames_spilled; // SLOW_SPILL
+   uint64_t bytes_spilled;
+   uint64_t send_errors; // sockets closed after a failed send
+   uint64_t throttled; // times a client was paused by its rate limits
+   uint64_t bulk_deferred; // bulk frames left for a later pass (summed per pass)
+   uint64_t offline_stored; // direct messages kept for offline handles
+   uint64_t offline_delivered; // stored messages sent after login
+   uint64_t peer_frames; // frames relayed to other nodes
+   uint64_t peer_batches; // sends those frames took
+   uint64_t malformed; // frames frameDecode() or the route table turned away, or sent as someone else
+   uint64_t inflated; // flag 27 frames received
+   uint64_t compressed; // frames fanned out (once each) deflated
+   uint64_t compressed_sends; // sends of those, one per capable client
+   uint64_t bytes_saved; // by those sends
+   uint64_t tls_handshakes; // finished, client and node links
+   uint64_t tls_failures; // handshakes that didn't
+   uint64_t tls_kernel_tx; // handshakes the kernel took over sending for (kTLS)
+   uint64_t tls_kernel_rx; // and receiving
+   uint64_t parallel_fanouts; // broadcasts written by the fan-out workers
+   uint64_t parallel_sends; // sends they made
+   uint64_t accepts_refused; // closed at accept(), memory full
+   uint64_t logins_refused; // flag 28 sent instead of flag 2
+   uint64_t sessions_refused; // flag 25 ignored
+   uint64_t broadcasts_refused; // received flag 4 dropped, memory full
+   uint64_t frames_shed; // broadcasts not queued for a slow socket
+   uint64_t bytes_shed;
+   uint64_t mem_pauses; // connections left unread over -m
+   uint64_t mem_disconnects; // output over -m
+   uint64_t busy_poll_unset; // accepted sockets the kernel wouldn't busy poll
+   uint64_t filter_scans; // %M and %B checked by the content filter
+   uint64_t filter_bytes; // text they held
+   uint64_t filter_ns; // time the checks took
+   uint64_t filter_max_ns;
+   uint64_t filter_costs[FILTER_COST_BUCKETS]; // checks taking from 2^k up to 2^(k+1) ns
+   uint64_t filter_flagged; // delivered and logged
+   uint64_t filter_blocked; // flag 29 sent instead
+} ServerStats;
+
+/* A chat frame being fanned out, deflated the first time a client
+ * that agreed to compression needs it and sent that way to all of them
+ */
+typedef struct {
+   uint8_t *plain; // the packet, header included
+   uint16_t plain_len;
+   uint8_t packed[MAXBUF];
+   int16_t packed_len; // 0 not yet tried, -1 didn't come out smaller
+} Fanout;
+
+static ServerConfig config;
+static ServerStats stats;
+static volatile sig_atomic_t statsRequested = 0;
+static volatile sig_atomic_t reloadRequested = 0; // SIGHUP, content filter terms
+static FrameQueue readyFrames[PRIO_BULK + 1];
+static uint64_t nextConnectionId = 1;
+static Timer commitTimer; // group commit of the offline store
+static HistoryRing broadcastHistory; // flag 4 packets
+static HistoryRing directHistory; // flag 5 packets, replayed only to sender and recipients
+static uint32_t historySeq = 0; // shared by both scopes
+static Timer indexTimer; // search index flushes and merges
+static Timer peerTimer; // reconnects links to other nodes
+static Timer gossipTimer; // anti-entropy rounds with other nodes
+static Timer filterTimer; // waits for a content filter reload to compile
+static int upgradeSocket = -1; // listening for a replacement process
+static int unixServerSocket = -1; // local clients, with -s
+static int takeoverHistory = 0; // the old process's history rings fit ours
+static int takeoverRetained = 0; // and its sessions' retained frames
+
+/* Connection table indexed by socket number - grows like the poll set */
+static Connection **connections = NULL;
+static int connectionTableSize = 0;
+static SlabPool connectionPool;
+
 /* Function prototypes */
-void processSockets(int mainServerSocket);
+void processSockets(int mainServerSocket, int takeoverSocket);
 void recvFromClient(int clientSocket, Server *s);
-void acceptNewClient(int mainServerSocket);
+void dispatchFrame(Frame *f, uint8_t *buf, Server *s, uint16_t pkt_len, int clientSocket);
+void acceptNewClient(int mainServerSocket, Server *s);
 void removeClient(int clientSocket, Server *s);
 int checkArgs(int argc, char *argv[]);
 void serverSetup(Server *s);
-void ackNewClient(uint8_t *buf, Server *s, int clientSocket);
+void ackNewClient(Frame *f, uint8_t *buf, Server *s, uint16_t pkt_len, int clientSocket);
 int lookupClient(Server *s, Handle handle);
 void addNewClient(Server *s, uint8_t *handle, uint8_t len, int clientSocket);
 void removeClientFromServer(int clientSocket, Server *s);
-void clientRequestingHandles(int clientSocket, Server *s);
+void clientRequestingHandles(Frame *f, uint8_t *buf, Server *s, uint16_t pkt_len, int clientSocket);
 void sendHandles(int clientSocket, Server *s);
 void sendNumHandles(int clientSocket, int num_handles);
-void clientExiting(int clientSocket, Server *s);
-void forwardMessage(uint8_t buf[MAXBUF], Server *s, uint16_t pkt_len, int clientSocket);
-void sendInvalidClient(Handle handle, int clientSocket);
-void broadcast(uint8_t *buf, Server *s, uint16_t pkt_len, int clientSocket);
+void clientExiting(Frame *f, uint8_t *buf, Server *s, uint16_t pkt_len, int clientSocket);
+void forwardMessage(Frame *f, uint8_t *buf, Server *s, uint16_t pkt_len, int clientSocket);
+void sendInvalidClient(const uint8_t *handle, uint8_t len, int clientSocket);
+void broadcast(Frame *f, uint8_t *buf, Server *s, uint16_t pkt_len, int clientSocket);
+Connection *newConnection(int clientSocket, Server *s);
+void freeConnection(int clientSocket);
+void activateConnection(int clientSocket, int slot);
+void connectionActivity(int clientSocket, uint8_t flag);
+void connectionTimeout(void *arg);
+void sendHeartbeat(int clientSocket);
+void connSend(int clientSocket, uint8_t *buf, uint16_t len, uint8_t flags);
+void connSendRest(Connection *c, uint8_t *buf, uint16_t len, uint8_t flags, ssize_t sent, int error);
+void flushConnection(int clientSocket);
+void enforceOutLimit(Connection *c);
+void connMemoryLimit(Connection *c);
+void slowConsumerTimeout(void *arg);
+void scheduleClose(Connection *c, int timeInMilliSeconds);
+void requestStats(int signum);
+void requestReload(int signum);
+void reloadFilter();
+void filterTimeout(void *arg);
+int filterBlocks(Frame *f, int clientSocket);
+int notSender(Frame *f, Server *s, int clientSocket);
+uint64_t nowNs();
+void printStats();
+void printFilter();
+void printPlacement();
+void printPool(SlabPool *p);
+void countTls(int socketNum);
+void usage(char *prog);
+void queueFrame(int prio, Frame *f, uint8_t *buf, uint16_t pkt_len, Connection *c);
+int framesPending();
+void dispatchQueuedFrames(Server *s);
+void throttleConnection(Connection *c);
+void throttleTimeout(void *arg);
+void setupPools();
+void setupPlacement();
+size_t connMemory(Connection *c);
+size_t loginCost(Server *s);
+int shedFrame(uint16_t len, uint8_t flags);
+void storeOffline(char *handle, uint8_t *packet, uint16_t len);
+void streamOffline(void *arg);
+void commitOffline(void *arg);
+void connSendv(int clientSocket, struct iovec *iov, int count);
+void recordHistory(HistoryRing *r, Frame *f, uint8_t *buf, uint16_t pkt_len);
+void replayHistory(Frame *f, uint8_t *buf, Server *s, uint16_t pkt_len, int clientSocket);
+int historyVisible(uint8_t *packet, char *handle);
+void replySearch(Frame *f, uint8_t *buf, Server *s, uint16_t pkt_len, int clientSocket);
+void indexTimeout(void *arg);
+int fromPeer(int clientSocket);
+void connectPeer(Peer *p, Server *s);
+void peerConnected(Connection *c);
+void peerRetry(void *arg);
+void peerHello(Frame *f, uint8_t *buf, Server *s, uint16_t pkt_len, int clientSocket);
+void peerHelloReply(Frame *f, uint8_t *buf, Server *s, uint16_t pkt_len, int clientSocket);
+void peerLinked(Peer *p, Connection *c);
+void peerDigest(Frame *f, uint8_t *buf, Server *s, uint16_t pkt_len, int clientSocket);
+void peerDelta(Frame *f, uint8_t *buf, Server *s, uint16_t pkt_len, int clientSocket);
+void peerHeartbeat(Frame *f, uint8_t *buf, Server *s, uint16_t pkt_len, int clientSocket);
+void sendPeerHello(Peer *p);
+void sendDigest(Peer *p);
+void sendToPeer(uint8_t *frame, uint16_t len, void *arg);
+void gossipTimeout(void *arg);
+void announceHandle(char *handle, int online);
+void evictHandles(Server *s, char lost[][MAX_HANDLE + 1], int count);
+int startTakeover(char *path, int *mainServerSocket);
+void finishTakeover(int takeoverSocket, Server *s);
+int takeoverRecordFits(uint8_t type, uint8_t *buf, int len, int numFds, Server *s);
+void abandonTakeover(uint8_t type);
+void handOff(Server *s, int mainServerSocket);
+void sendHistoryRing(int sock, uint8_t ring, HistoryRing *r);
+int sendSession(int sock, Session *ss, int waiting);
+int handedOver(Connection *c);
+void peerSend(Peer *p, uint8_t *buf, uint16_t len);
+void flushPeers();
+void slotSend(Server *s, int slot, uint8_t *buf, uint16_t len, uint8_t flags);
+void closeSlot(Server *s, int slot);
+void openSession(Frame *f, uint8_t *buf, Server *s, uint16_t pkt_len, int clientSocket);
+void resumeSession(Frame *f, uint8_t *buf, Server *s, uint16_t pkt_len, int clientSocket);
+Session *newSession(Server *s, int slot, int socket, uint8_t codec);
+Session *findSession(Server *s, const uint8_t *token);
+void retainFrame(Session *ss, uint8_t *buf, uint16_t len);
+void detachSession(Connection *c);
+void endSession(Session *ss);
+void sessionExpire(void *arg);
+void shmSetup(Frame *f, uint8_t *buf, Server *s, uint16_t pkt_len, int clientSocket);
+void fanoutSend(Server *s, int slot, Fanout *o, uint8_t flags);
+uint8_t *fanoutBytes(Server *s, int slot, Fanout *o, uint16_t *len);
+void parallelFanout(Server *s, Fanout *o, int except);
+uint8_t slotCodec(Server *s, int slot);
+void ignoreFrame(Frame *f, uint8_t *buf, Server *s, uint16_t pkt_len, int clientSocket);
+void sendEmpty(int clientSocket, uint8_t flag);
+
+/* What each flag is handed to, and when. A flag without a handler here,
+ * or sent in any other connection state, is turned away like a malformed
+ * frame. Every handler gets the frame already decoded (and checked) by
+ * frameDecode()
+ */
+typedef void (*FrameHandler)(Frame *f, uint8_t *buf, Server *s, uint16_t pkt_len, int clientSocket);
+
+typedef struct {
+   int prio; // PRIO_NOW, or the ready queue it waits in
+   FrameHandler handler;
+   uint8_t state; // the connection state it's accepted in
+} FrameRoute;
+
+static const FrameRoute clientRoutes[256] = {
+   [LOGIN_FLAG] = { PRIO_NOW, ackNewClient, CONN_LOGIN }, // once - a second one doesn't take another handle
+   [BROADCAST_FLAG] = { PRIO_BULK, broadcast, CONN_ACTIVE },
+   [MESSAGE_FLAG] = { PRIO_DIRECT, forwardMessage, CONN_ACTIVE },
+   [EXIT_FLAG] = { PRIO_BULK, clientExiting, CONN_ACTIVE }, // behind the client's broadcasts so they go out first
+   [LIST_REQ_FLAG] = { PRIO_BULK, clientRequestingHandles, CONN_ACTIVE },
+   [HEARTBEAT_ACK_FLAG] = { PRIO_NOW, ignoreFrame, CONN_ACTIVE }, // liveness already noted in recvFromClient
+   [HISTORY_REQ_FLAG] = { PRIO_BULK, replayHistory, CONN_ACTIVE },
+   [SEARCH_REQ_FLAG] = { PRIO_BULK, replySearch, CONN_ACTIVE },
+   [PEER_HELLO_FLAG] = { PRIO_NOW, peerHello, CONN_LOGIN },
+   [SHM_SETUP_FLAG] = { PRIO_NOW, shmSetup, CONN_LOGIN },
+   [SESSION_FLAG] = { PRIO_NOW, openSession, CONN_ACTIVE },
+   [RESUME_FLAG] = { PRIO_NOW, resumeSession, CONN_LOGIN },
+};
+
+/* Links from other nodes. Chat packets arrive unaltered and are only
+ * delivered to this node's users, never relayed again
+ */
+static const FrameRoute peerRoutes[256] = {
+   [BROADCAST_FLAG] = { PRIO_BULK, broadcast, CONN_PEER },
+   [MESSAGE_FLAG] = { PRIO_DIRECT, forwardMessage, CONN_PEER },
+   [HEARTBEAT_FLAG] = { PRIO_NOW, peerHeartbeat, CONN_PEER },
+   [HEARTBEAT_ACK_FLAG] = { PRIO_NOW, ignoreFrame, CONN_PEER },
+   [PEER_HELLO_FLAG] = { PRIO_NOW, peerHelloReply, CONN_PEER_HELLO }, // answer to ours
+   [PEER_DIGEST_FLAG] = { PRIO_NOW, peerDigest, CONN_PEER },
+   [PEER_DELTA_FLAG] = { PRIO_NOW, peerDelta, CONN_PEER },
+};
+
+// a node link still waiting on its hello already takes node frames
+static const FrameRoute *routesFor(Connection *c) {
+   return c->state == CONN_PEER || c->state == CONN_PEER_HELLO ? peerRoutes : clientRoutes;
+}
 
 int main(int argc, char *argv[]) {
 
 	int mainServerSocket = 0;   //socket descriptor for the server socket
+	int takeoverSocket = -1; // from the server this one is replacing
 	int portNumber = 0;
 
 	setupPollSet();
+	setupTimerWheel();
 	portNumber = checkArgs(argc, argv);
+	setupPlacement();
+	setupPools();
+	signal(SIGPIPE, SIG_IGN);
+	signal(SIGUSR1, requestStats);
+	signal(SIGHUP, requestReload);
+	timerInit(&filterTimer, filterTimeout, NULL);
+	if (config.fanout_workers > 0)
+		fanoutPoolStart(config.fanout_workers);
+	// a server already running with the same -U hands its clients over,
+	// after it has written out the offline store and search index
+	if (config.upgrade_path != NULL)
+		takeoverSocket = startTakeover(config.upgrade_path, &mainServerSocket);
+	if (config.offline_dir != NULL)
+		setupOfflineStore(config.offline_dir);
+	timerInit(&commitTimer, commitOffline, NULL);
+	historyInit(&broadcastHistory, HISTORY_ARENA, HISTORY_ENTRIES);
+	historyInit(&directHistory, HISTORY_ARENA, HISTORY_ENTRIES);
+	memCharge(MEM_HISTORY, historySize(&broadcastHistory) + historySize(&directHistory));
+	if (config.node_id >= 0)
+	{
+		setupFederation(config.node_id);
+		setupPresence(config.node_id);
+	}
+	if (config.index_dir != NULL)
+	{
+		setupSearchIndex(config.index_dir);
+		if (indexMaxSeq() > historySeq)
+			historySeq = indexMaxSeq(); // seq numbers stay unique across restarts
+		timerInit(&indexTimer, indexTimeout, NULL);
+		timerAdd(&indexTimer, INDEX_MAINTENANCE_INTERVAL);
+	}
 
 	//create the server socket
-	mainServerSocket = tcpServerSetup(portNumber);
+	if (takeoverSocket < 0)
+		mainServerSocket = tcpServerSetup(portNumber);
+	if (config.unix_path != NULL && unixServerSocket < 0)
+		unixServerSocket = unixServerSetup(config.unix_path);
 
 	// Main control process (clients and accept())
-	processSockets(mainServerSocket);
+	processSockets(mainServerSocket, takeoverSocket);
 
 	// close the socket - never gets here but nice thought
 	close(mainServerSocket);
@@ -69,43 +555,100 @@ int main(int argc, char *argv[]) {
 /* Sets up the server allocating space for the servers database */
 void serverSetup(Server *s) {
    int i;
-   s->socket_status = malloc(sizeof(uint8_t) * INIT_CLIENTS);
+   // room for as many handles as connections were allocated for
+   int slots = config.pool_connections > INIT_CLIENTS ? config.pool_connections : INIT_CLIENTS;
+   s->socket_status = malloc(sizeof(uint8_t) * slots);
    if(s->socket_status == NULL) {
       perror("malloc socket_status failure");
       exit(EXIT_FAILURE);
    }
 
-   s->socket_numbers = malloc(sizeof(uint8_t) * INIT_CLIENTS);
+   s->socket_numbers = malloc(sizeof(int) * slots);
    if(s->socket_numbers == NULL) {
       perror("malloc socket_numbers failure");
       exit(EXIT_FAILURE);
    }
 
    // just call calloc before instead?
-   for(i = 0; i < INIT_CLIENTS; i++) {
+   for(i = 0; i < slots; i++) {
       s->socket_status[i] = CLOSED;
       s->socket_numbers[i] = 0;
    }
 
-   s->clients = malloc(sizeof(Handle) * INIT_CLIENTS);
+   s->clients = malloc(sizeof(Handle) * slots);
    if(s->clients == NULL) {
       perror("malloc clients failure");
       exit(EXIT_FAILURE);
    }
+   s->sessions = sCalloc(slots, sizeof(Session *));
+   memCharge(MEM_HANDLES, SLOT_BYTES * slots);
    // need to zero or null client handles ?
    s->num_handles = 0;
-   s->num_allocations = INIT_CLIENTS;
+   s->num_allocations = slots;
+}
+
+/* Preallocates what connections and queued frames are made of, so a
+ * server within its -N and -B capacity makes no heap allocations
+ * per connection or per frame
+ */
+void setupPools() {
+
+   int tableSize = config.pool_connections + INIT_CLIENTS; // listening sockets etc. come first
+
+   slabUseHugePages(config.huge_pages);
+   poolInit(&connectionPool, "connections", sizeof(Connection), config.pool_connections);
+   chunkSetup(config.pool_frames);
+   reservePollSet(tableSize);
+   connections = sCalloc(tableSize, sizeof(Connection *));
+   connectionTableSize = tableSize;
+   memCharge(MEM_CONNECTIONS, sizeof(Connection *) * tableSize);
+}
+
+/* Pins the event loop (and with it everything it allocates, the pools
+ * included) to the first -c CPU and its NUMA node, and the fan-out
+ * workers to the rest. Runs before setupPools() so the slabs are faulted
+ * in there rather than wherever the first message happens to be handled
+ */
+void setupPlacement() {
+
+   if(config.num_cpus > 0) {
+      if(affinityPin(config.cpus[0]) < 0) {
+         fprintf(stderr, "can't run on cpu %d\n", config.cpus[0]);
+         exit(EXIT_FAILURE);
+      }
+      affinityLocalMemory();
+      slabPrefault(1);
+      // with a single CPU the workers share it with the event loop
+      if(config.num_cpus > 1)
+         fanoutPoolPin(config.cpus + 1, config.num_cpus - 1);
+      else
+         fanoutPoolPin(config.cpus, 1);
+   }
+   setBusyPoll(config.busy_poll);
 }
 
 /* Main loop processing packets from clients.
  * Polls on accepting a new client and receiving a packet from an existing client
  */
-void processSockets(int mainServerSocket) {
+void processSockets(int mainServerSocket, int takeoverSocket) {
 
 	int socketToProcess = 0;
+	int batchedPasses = 0;
 	addToPollSet(mainServerSocket);
+	if (unixServerSocket >= 0)
+		addToPollSet(unixServerSocket);
 	Server server;
 	serverSetup(&server);
+	if (takeoverSocket >= 0)
+		finishTakeover(takeoverSocket, &server);
+	if (config.upgrade_path != NULL && (upgradeSocket = handoffListen(config.upgrade_path)) >= 0)
+		addToPollSet(upgradeSocket);
+	if (federationEnabled()) {
+		timerInit(&peerTimer, peerRetry, &server);
+		timerAdd(&peerTimer, 0);
+		timerInit(&gossipTimer, gossipTimeout, NULL);
+		timerAdd(&gossipTimer, GOSSIP_INTERVAL);
+	}
    /* Note:
     * poll () actually returns socket number that is Ready
     * no need to check which fd in the fd_set is ready for reading
@@ -114,65 +657,296 @@ void processSockets(int mainServerSocket) {
     * you want to poll on before every select call
     */
 	while(1) {
-		if ((socketToProcess = pollCall(POLL_WAIT_FOREVER)) != -1) {
+		// sleep only until the next timer is due, not at all if frames are waiting
+		int timeout = (framesPending() || peerBatchesPending()) ? 0 : timerNextTimeout();
+		socketToProcess = pollCall(timeout);
+		int idle = socketToProcess == -1;
+		// service every ready socket before dispatching, so a pass sees
+		// all the direct messages that arrived alongside bulk traffic
+		while (socketToProcess != -1) {
 			if (socketToProcess == mainServerSocket)
-				acceptNewClient(mainServerSocket);
-			else
-				recvFromClient(socketToProcess, &server);
+				acceptNewClient(mainServerSocket, &server);
+			else if (socketToProcess == unixServerSocket)
+				acceptNewClient(unixServerSocket, &server);
+			else if (socketToProcess == upgradeSocket)
+				handOff(&server, mainServerSocket);
+			else {
+				short revents = pollRevents(socketToProcess);
+				if (revents & POLLOUT)
+					flushConnection(socketToProcess);
+				if ((revents & ~POLLOUT) && connections[socketToProcess] != NULL) {
+					if (connections[socketToProcess]->closing)
+						removeClient(socketToProcess, &server);
+					else
+						recvFromClient(socketToProcess, &server);
+				}
+			}
+			socketToProcess = pollNextReady();
+		}
+		dispatchQueuedFrames(&server);
+		timerRunExpired();
+		// relayed frames keep batching while there's more input to read
+		if (idle || ++batchedPasses >= PEER_MAX_BATCH_PASSES) {
+			flushPeers();
+			batchedPasses = 0;
+		}
+		if (statsRequested) {
+			statsRequested = 0;
+			printStats();
+		}
+		if (reloadRequested) {
+			reloadRequested = 0;
+			reloadFilter();
 		}
-		else // Just printing here to let me know what is going on
-			printf("Poll timed out waiting for client to send data\n");
 	}
 }
 
-// all flag packets sent from client processed here
+/* Reads what has arrived of a client's next packet, after checking its
+ * rate limits, and handles the packet once it's all there.
+ * Control packets are handled right away, chat packets are queued by
+ * priority class and handled by dispatchQueuedFrames()
+ */
 void recvFromClient(int clientSocket, Server *s) {
 
 	uint8_t buf[MAXBUF];
+   uint8_t packed[MAXBUF];
    uint8_t flag = 0;
 	int pkt_len = 0;
-   // doesn't put pkt_len in buf
-	if((pkt_len = sRecv(buf, clientSocket)) < 0) {
+   Connection *c = connections[clientSocket];
+   const FrameRoute *routes = NULL;
+   Frame f;
+   uint64_t now = timerNowMs();
+   int ready = 0;
+
+   // the TLS handshake is carried on until the first frame can be read
+   if(c->tls_handshake) {
+      if((ready = tlsHandshake(clientSocket)) < 0) {
+         printf("TLS handshake failed\n");
+         stats.tls_failures++;
+         removeClient(clientSocket, s);
+         return;
+      }
+      if(ready == 0)
+         return;
+      c->tls_handshake = 0;
+      countTls(clientSocket);
+   }
+
+   // limits are checked before reading - a throttled client is left
+   // unread so TCP pushes back on it instead of the server queueing
+   if(!bucketReady(&c->frame_bucket, now) || !bucketReady(&c->byte_bucket, now)) {
+      if(pollRevents(clientSocket) & (POLLHUP | POLLERR)) {
+         printf("client died\n");
+         removeClient(clientSocket, s);
+      }
+      else
+         throttleConnection(c);
+      return;
+   }
+
+   // never waits for the rest of a packet - it's kept for the next poll
+	if((pkt_len = sRecvPartial(c->partial, &c->partial_len, clientSocket)) < 0) {
 		printf("client died\n");
 		removeClient(clientSocket, s);
 	}
 
-   else { // ready to parse client message!
+   else if(pkt_len > 0) { // ready to parse client message!
+      // doesn't put pkt_len in buf
+      memcpy(buf, c->partial + PKT_LEN, pkt_len - PKT_LEN);
+      c->partial_len = 0;
       memcpy(&flag, buf, 1); // or just flag = buf[0] ?
-      // set data to point to first byte after flag
-      // no longer need chat header after this point?
-      uint8_t *data = buf + 1;
-   	// now can switch based on flag
-      switch(flag) {
-         case 1: // initial packet, f = 2,3 response
-            ackNewClient(data, s, clientSocket);
-            break;
+      connectionActivity(clientSocket, flag);
+      bucketCharge(&c->frame_bucket, 1);
+      bucketCharge(&c->byte_bucket, pkt_len);
+
+      // inflated in place of the frame it holds, which must be one the
+      // session counts - the client counted the flag 27 it sent
+      if(flag == COMPRESSED_FLAG && c->codec == COMPRESS_DEFLATE) {
+         memcpy(packed, buf, pkt_len - PKT_LEN);
+         if((pkt_len = decompressFrame(packed, pkt_len, buf)) < 0 || !sessionCounted(buf[0])) {
+            pkt_len = PKT_LEN + FLAG_LEN; // fails the route lookup below
+            buf[0] = COMPRESSED_FLAG;
+         }
+         else
+            stats.inflated++;
+         flag = buf[0];
+      }
 
-         case 4:
-            broadcast(buf, s, pkt_len, clientSocket);
-            break;
+      // decoded once here, so nothing past this point reads a bad length
+      routes = routesFor(c);
+      if(frameDecode(buf, pkt_len, TO_SERVER, &f) < 0 || routes[flag].handler == NULL
+            || routes[flag].state != c->state) {
+         fprintf(stderr, "%s sent malformed packet (flag %u)\n",
+            routes == peerRoutes ? "node" : "client", flag);
+         stats.malformed++;
+         // still counted, or a resume would have the client resend the rest
+         if(c->session != NULL && sessionCounted(flag))
+            c->session->received++;
+         return;
+      }
 
-         case 5:
-            forwardMessage(buf, s, pkt_len, clientSocket); // need whole packet to forward
-            break;
+      // out of memory, a broadcast is the first thing to go - counted as
+      // handled, so a resume doesn't send it again
+      if(flag == BROADCAST_FLAG && memPressure(sizeof(QueuedFrame) + pkt_len) == MEM_FULL) {
+         stats.broadcasts_refused++;
+         if(c->session != NULL)
+            c->session->received++;
+         return;
+      }
 
-         case 8:
-            clientExiting(clientSocket, s);
-            break;
+      if(routes[flag].prio == PRIO_NOW)
+         dispatchFrame(&f, buf, s, pkt_len, clientSocket);
+      else
+         queueFrame(routes[flag].prio, &f, buf, pkt_len, c);
+
+      // holding more than -m allows - read nothing more until its frames are dispatched
+      if(config.conn_memory > 0 && c->in_bytes > 0 && !c->mem_paused
+            && connMemory(c) > config.conn_memory) {
+         c->mem_paused = 1;
+         setPollIn(clientSocket, 0);
+         stats.mem_pauses++;
+      }
+   } // end else
+}
 
-         case 10:
-            clientRequestingHandles(clientSocket, s);
-            break;
+// all flag packets sent from client processed here
+// buf points to flag, pkt_len host order
+void dispatchFrame(Frame *f, uint8_t *buf, Server *s, uint16_t pkt_len, int clientSocket) {
+
+   Connection *c = connections[clientSocket];
+   const FrameRoute *route = &routesFor(c)[f->flag];
+
+   // counted once handled, so frames lost with a dropped connection are resent
+   if(c->session != NULL && sessionCounted(f->flag))
+      c->session->received++;
+   // not if the connection changed state while it was queued
+   if(route->handler != NULL && route->state == c->state)
+      route->handler(f, buf, s, pkt_len, clientSocket);
+}
 
-         default:
-            fprintf(stderr, "client sent bad packet (wrong flag): %u\n", flag);
-      } // end switch
-   } // end else
+// copies a received packet onto the ready queue of its priority class
+void queueFrame(int prio, Frame *frame, uint8_t *buf, uint16_t pkt_len, Connection *c) {
+
+   FrameQueue *q = &readyFrames[prio];
+   QueuedFrame *f = chunkAlloc(sizeof(QueuedFrame) + pkt_len);
+   memcpy(f->data, buf, pkt_len - PKT_LEN);
+   f->frame = *frame;
+   frameMove(&f->frame, buf, f->data);
+   f->pkt_len = pkt_len;
+   f->socket = c->socket;
+   f->conn_id = c->id;
+   f->next = NULL;
+   memCharge(MEM_INPUT, sizeof(QueuedFrame) + pkt_len);
+   c->in_bytes += sizeof(QueuedFrame) + pkt_len;
+
+   if(q->tail == NULL)
+      q->head = f;
+   else
+      q->tail->next = f;
+   q->tail = f;
+   q->count++;
+}
+
+static QueuedFrame *popFrame(FrameQueue *q) {
+
+   QueuedFrame *f = q->head;
+   if(f != NULL) {
+      q->head = f->next;
+      if(q->head == NULL)
+         q->tail = NULL;
+      q->count--;
+   }
+   return f;
+}
+
+int framesPending() {
+   return readyFrames[PRIO_DIRECT].count + readyFrames[PRIO_BULK].count > 0;
+}
+
+/* Runs queued frames, every direct message first, then at most
+ * BULK_PER_PASS broadcasts/%L requests. What's left waits for the next
+ * pass so direct messages arriving meanwhile jump ahead of it.
+ * Frames whose sender has since disconnected are discarded
+ */
+void dispatchQueuedFrames(Server *s) {
+
+   QueuedFrame *f = NULL;
+   Connection *c = NULL;
+   int budget = BULK_PER_PASS;
+   int prio;
+
+   // a backlog this deep means bulk is starving - drain it all
+   if(readyFrames[PRIO_BULK].count > BULK_BACKLOG_LIMIT)
+      budget = readyFrames[PRIO_BULK].count;
+
+   for(prio = PRIO_DIRECT; prio <= PRIO_BULK; prio++) {
+      while((prio == PRIO_DIRECT || budget-- > 0) && (f = popFrame(&readyFrames[prio])) != NULL) {
+         c = f->socket < connectionTableSize ? connections[f->socket] : NULL;
+         if(c != NULL && c->id == f->conn_id && !c->closing)
+            dispatchFrame(&f->frame, f->data, s, f->pkt_len, f->socket);
+         memCharge(MEM_INPUT, -(ssize_t)(sizeof(QueuedFrame) + f->pkt_len));
+         // the handler may have closed it
+         c = f->socket < connectionTableSize ? connections[f->socket] : NULL;
+         if(c != NULL && c->id == f->conn_id) {
+            c->in_bytes -= sizeof(QueuedFrame) + f->pkt_len;
+            if(c->mem_paused && (c->in_bytes == 0 || connMemory(c) <= config.conn_memory)) {
+               c->mem_paused = 0;
+               if(!timerPending(&c->throttle_timer))
+                  setPollIn(c->socket, 1);
+            }
+         }
+         chunkFree(f, sizeof(QueuedFrame) + f->pkt_len);
+      }
+   }
+   if(readyFrames[PRIO_BULK].count > 0)
+      stats.bulk_deferred += readyFrames[PRIO_BULK].count;
+}
+
+// out of tokens - stop reading the client until its buckets refill
+void throttleConnection(Connection *c) {
+
+   int wait = bucketWaitTime(&c->frame_bucket);
+   if(bucketWaitTime(&c->byte_bucket) > wait)
+      wait = bucketWaitTime(&c->byte_bucket);
+
+   setPollIn(c->socket, 0);
+   timerAdd(&c->throttle_timer, wait);
+   stats.throttled++;
+}
+
+void throttleTimeout(void *arg) {
+
+   Connection *c = (Connection *)arg;
+   if(!c->mem_paused)
+      setPollIn(c->socket, 1);
+}
+
+// what a connection holds: its state, queued output and undispatched input
+size_t connMemory(Connection *c) {
+   return sizeof(Connection) + c->out.mem + c->in_bytes;
+}
+
+// memory a login takes from the handle table - all of it if the table has to double
+size_t loginCost(Server *s) {
+   return s->num_handles == s->num_allocations ? SLOT_BYTES * s->num_allocations : SLOT_BYTES;
+}
+
+/* Under memory pressure a broadcast that would have to be queued for
+ * a slow socket is dropped instead. Returns 1 if it was
+ */
+int shedFrame(uint16_t len, uint8_t flags) {
+
+   if(!(flags & OUT_DROPPABLE) || memPressure(sizeof(OutFrame) + len) == MEM_OK)
+      return 0;
+   stats.frames_shed++;
+   stats.bytes_shed += len;
+   return 1;
 }
 
-void clientRequestingHandles(int clientSocket, Server *s) {
+void clientRequestingHandles(Frame *f, uint8_t *buf, Server *s, uint16_t pkt_len, int clientSocket) {
 
-   sendNumHandles(clientSocket, s->num_handles);
+   // users on every linked node, not just this one
+   sendNumHandles(clientSocket, s->num_handles + presenceRemoteCount());
    sendHandles(clientSocket, s);
 
 }
@@ -181,252 +955,2153 @@ void sendHandles(int clientSocket, Server *s) {
 
    uint8_t buf[MAXBUF];
    uint16_t pkt_len;
-   uint8_t handle_len = 0;
+   Frame f;
+   PresenceCursor cur;
+   char *remote = NULL;
    int i;
 
    // need num_allocations in case clients were removed
    for(i = 0; i < s->num_allocations; i++) {
-      pkt_len = 4; // 4 minimum + handle len
       if(s->socket_status[i] == OPEN) { // valid client
-         handle_len = strlen((char *)s->clients[i].handle); // strlen doesnt count \0
-         pkt_len += handle_len;
-         makeChatHeader(buf, 12, pkt_len);
-         memcpy(buf+3, &handle_len, 1);
-         memcpy(buf+4, s->clients[i].handle, handle_len); // doesnt copy \0
-         sendPacket(clientSocket, buf, pkt_len);
+         frameInit(&f, LIST_HANDLE_FLAG);
+         frameHandle(&f, s->clients[i].handle, strlen((char *)s->clients[i].handle));
+         pkt_len = frameEncode(buf, TO_CLIENT, &f);
+         connSend(clientSocket, buf, pkt_len, 0);
       }
    }
+   presenceRewind(&cur);
+   while((remote = presenceNextRemote(&cur)) != NULL) {
+      frameInit(&f, LIST_HANDLE_FLAG);
+      frameHandle(&f, remote, strlen(remote));
+      pkt_len = frameEncode(buf, TO_CLIENT, &f);
+      connSend(clientSocket, buf, pkt_len, 0);
+   }
    // finished sending handles - send f = 13
-   pkt_len = 3;
-   makeChatHeader(buf, 13, pkt_len);
-   sendPacket(clientSocket, buf, pkt_len);
+   sendEmpty(clientSocket, LIST_END_FLAG);
 }
 
 void sendNumHandles(int clientSocket, int num_handles) {
 
    uint8_t buf[MAXBUF];
-   uint16_t pkt_len = 7; // 3 + 4 byte int
-   makeChatHeader(buf, 11, pkt_len);
-   num_handles = htonl(num_handles);
-   memcpy(buf+3, &num_handles, sizeof(uint32_t)); // 64 vs 32 bit int?
-   sendPacket(clientSocket, buf, pkt_len);
+   Frame f;
+
+   frameInit(&f, LIST_COUNT_FLAG);
+   frameNum(&f, num_handles);
+   connSend(clientSocket, buf, frameEncode(buf, TO_CLIENT, &f), 0);
 }
 
 // send flag = 9 ACK and remove client from server database
-void clientExiting(int clientSocket, Server *s) {
+void clientExiting(Frame *f, uint8_t *buf, Server *s, uint16_t pkt_len, int clientSocket) {
 
-   uint8_t buf[MAXBUF];
-   uint16_t pkt_len = 3;
-   makeChatHeader(buf, 9, pkt_len);
-   sendPacket(clientSocket, buf, pkt_len);
-   removeClient(clientSocket, s);
+   if(connections[clientSocket]->session != NULL)
+      endSession(connections[clientSocket]->session); // logging out for good
+   sendEmpty(clientSocket, EXIT_ACK_FLAG);
+   if(connections[clientSocket] == NULL || outQueueEmpty(&connections[clientSocket]->out))
+      removeClient(clientSocket, s);
+   else {
+      // handle is free right away, socket closes once the ACK is out
+      removeClientFromServer(clientSocket, s);
+      scheduleClose(connections[clientSocket], LOGIN_TIMEOUT);
+   }
 
 }
 
 // fowards messages to the appropriate clients
 // buf points to flag (buf offest by 2)
-void forwardMessage(uint8_t buf[MAXBUF], Server *s, uint16_t pkt_len, int clientSocket) {
+void forwardMessage(Frame *f, uint8_t *buf, Server *s, uint16_t pkt_len, int clientSocket) {
 
    uint8_t sendbuf[MAXBUF];
    uint16_t pkt_len_NetW;
-   int i, offset = 1;
-   uint8_t src_handle_len, num_dest_handles;
+   int i;
    Handle handle;
+   Peer *nodes[MAX_DEST_HANDLES]; // other nodes with a dest, sent the packet once each
+   Peer *p = NULL;
+   int num_nodes = 0, j, node;
+   Fanout out = { sendbuf, pkt_len, {0}, 0 };
+
+   if(notSender(f, s, clientSocket) || filterBlocks(f, clientSocket))
+      return;
+   // packet is forwarded unaltered - rebuild it once for every dest
+   memcpy(sendbuf+2, buf, pkt_len-2);
+   pkt_len_NetW = htons(pkt_len);
+   memcpy(sendbuf, &pkt_len_NetW, PKT_LEN);
+   recordHistory(&directHistory, f, buf, pkt_len);
 
-   memcpy(&src_handle_len, buf+offset, 1);
-   offset += src_handle_len + 1;
-   memcpy(&num_dest_handles, buf+offset, 1);
-   offset++; // now points to first dest handle
-
-   int handle_len = 0;
    int socketToSend;
 
-   // for each pair of <handle length, handle>
-   for(i = 0; i < num_dest_handles; i++) {
-      memcpy(&handle_len, buf+offset, 1);
-      offset++;
-      memcpy(handle.handle, buf+offset, handle_len * sizeof(uint8_t));
+   // handles[0] is the sender, the destinations follow
+   for(i = 1; i < f->num_handles; i++) {
+      memcpy(handle.handle, f->handles[i], f->handle_lens[i]);
       // append null term to handle  for lookup
-      handle.handle[handle_len] = '\0';
-      // set offset to next dest_handle, or msg if last dest
-      offset += handle_len;
+      handle.handle[f->handle_lens[i]] = '\0';
 
       if((socketToSend = lookupClient(s, handle)) < 0) {
-         // handle doesnt exist in server (bad handle)
-         // dont foward, send flag = 7 packet
-         // printf("client doesn't exist!\n");
-         sendInvalidClient(handle, clientSocket);
+         if(fromPeer(clientSocket)) {
+            // relayed by the sender's node, which handled everyone else
+         }
+         else if((node = presenceOwner((char *)handle.handle)) >= 0 && node != localNodeId()) {
+            // logged in to another node
+            p = peerById(node);
+            for(j = 0; j < num_nodes && nodes[j] != p; j++)
+               ;
+            if(j == num_nodes && num_nodes < MAX_DEST_HANDLES)
+               nodes[num_nodes++] = p;
+         }
+         else if(offlineKnownHandle((char *)handle.handle)) {
+            // known user, just not online - keep it for their next login
+            storeOffline((char *)handle.handle, sendbuf, pkt_len);
+         }
+         else {
+            // handle doesnt exist in server (bad handle)
+            // dont foward, send flag = 7 packet
+            // printf("client doesn't exist!\n");
+            sendInvalidClient(f->handles[i], f->handle_lens[i], clientSocket);
+         }
+      }
+      else if(offlinePending((char *)handle.handle)) {
+         // still catching up on stored messages - queue behind them
+         storeOffline((char *)handle.handle, sendbuf, pkt_len);
       }
       else { //valid handle - socketToSend = index of socket
-         socketToSend = s->socket_numbers[socketToSend];
-         memcpy(sendbuf+2, buf, pkt_len-2);
-         pkt_len_NetW = htons(pkt_len);
-         memcpy(sendbuf, &pkt_len_NetW, PKT_LEN);
          // now foward packet
-         sendPacket(socketToSend, sendbuf, pkt_len);
+         fanoutSend(s, socketToSend, &out, 0);
       }
    }
+
+   for(j = 0; j < num_nodes; j++)
+      peerSend(nodes[j], sendbuf, pkt_len);
 }
 
 // flag = 7 invalid client
-void sendInvalidClient(Handle handle, int clientSocket) {
+void sendInvalidClient(const uint8_t *handle, uint8_t len, int clientSocket) {
 
    uint8_t buf[MAXBUF];
-   uint16_t pkt_len = 0;
-   uint8_t handle_len;
-   handle_len = strlen((char *)handle.handle); // strlen doesnt include \0
-   pkt_len = 4 + handle_len;
-   makeChatHeader(buf, 7, pkt_len);
-   memcpy(buf+3, &handle_len, 1);
-   memcpy(buf+4, handle.handle, handle_len * sizeof(uint8_t));
-   sendPacket(clientSocket, buf, pkt_len);
+   Frame f;
+
+   frameInit(&f, NO_HANDLE_FLAG);
+   frameHandle(&f, handle, len);
+   connSend(clientSocket, buf, frameEncode(buf, TO_CLIENT, &f), 0);
 }
 
 //buf points to flag
 // pkt_len host order
 // forwards the message (packet unaltered) to each OPEN client
-void broadcast(uint8_t *buf, Server *s, uint16_t pkt_len, int clientSocket) {
+void broadcast(Frame *f, uint8_t *buf, Server *s, uint16_t pkt_len, int clientSocket) {
 
    //re-create packet to send to each valid client except clientSocket
    uint16_t pkt_len_NetW = htons(pkt_len);
    uint8_t sendbuf[MAXBUF];
+   Fanout out = { sendbuf, pkt_len, {0}, 0 };
+   if(notSender(f, s, clientSocket) || filterBlocks(f, clientSocket))
+      return;
    memcpy(sendbuf+PKT_LEN, buf, pkt_len-2);
    memcpy(sendbuf, &pkt_len_NetW, PKT_LEN);
    //sendbuf ready
+   recordHistory(&broadcastHistory, f, buf, pkt_len);
 
-   int socketToSend = 0;
    int i;
-   for(i = 0; i < s->num_allocations; i++) {
-      if(s->socket_status[i] == OPEN) {
-         //send this client the message
-         socketToSend = s->socket_numbers[i];
-         if(socketToSend != clientSocket) // dont send back to sender
-            sendPacket(socketToSend, sendbuf, pkt_len);
+   if(fanoutPoolWorkers() > 0 && s->num_handles >= config.fanout_min)
+      parallelFanout(s, &out, clientSocket);
+   else {
+      for(i = 0; i < s->num_allocations; i++) {
+         if(s->socket_status[i] == OPEN) {
+            //send this client the message
+            if(s->socket_numbers[i] != clientSocket) // dont send back to sender
+               fanoutSend(s, i, &out, OUT_DROPPABLE);
+         }
       }
    }
+
+   // once per node, which fans it out to its own users
+   if(!fromPeer(clientSocket)) {
+      for(i = 0; i < numPeers(); i++)
+         peerSend(peerAt(i), sendbuf, pkt_len);
+   }
 }
 
-void acceptNewClient(int mainServerSocket) {
+void acceptNewClient(int mainServerSocket, Server *s) {
 
 	int clientSocket = tcpAccept(mainServerSocket, 0);
+	// with -C the TCP port is TLS only, local clients stay plaintext
+	int tls = config.tls_cert != NULL && mainServerSocket != unixServerSocket;
+
+	// not even the connection's own state fits - it couldn't be told why
+	if (memPressure(sizeof(Connection)) == MEM_FULL)
+	{
+		stats.accepts_refused++;
+		close(clientSocket);
+		return;
+	}
+
+	if (tls && tlsAccept(clientSocket) < 0)
+	{
+		close(clientSocket);
+		return;
+	}
+	// nothing on the event loop may wait for a client
+	fcntl(clientSocket, F_SETFL, fcntl(clientSocket, F_GETFL) | O_NONBLOCK);
+	if (config.busy_poll > 0 && mainServerSocket != unixServerSocket
+		&& socketBusyPoll(clientSocket, config.busy_poll) < 0)
+		stats.busy_poll_unset++;
 	addToPollSet(clientSocket);
+	newConnection(clientSocket, s)->tls_handshake = tls;
 
 }
 
-// Called if flag = 1 packet sent from client
-// check if handle exists in server table
-// respond with flag 2,3 on success/failure
-// buf points to source_handle_len of packet
-void ackNewClient(uint8_t *buf, Server *s, int clientSocket) {
+/* Allocates the connection state for a newly accepted socket
+ * and starts its login deadline
+ */
+Connection *newConnection(int clientSocket, Server *s) {
 
-   Handle handle;
-   uint8_t handle_len = buf[0];
-   buf[handle_len+1] = '\0'; // append null terminator to handle
-   // handle_len is now 1 less than total size
-   handle_len++;
-   memcpy(handle.handle, buf+1, handle_len * sizeof(uint8_t));
-
-   uint16_t pkt_len = sizeof(ChatHeader);
-   // buf + 1 points to actual handle
-   if(lookupClient(s, handle) < 0) {
-      //handle not found
-      //add client to server
-      addNewClient(s, buf+1, handle_len, clientSocket);
-      //send flag 2 (success)
-      // re-use buf now, dont need it anymore
-      makeChatHeader(buf, GOOD_HANDLE, pkt_len);
-      sendPacket(clientSocket, buf, pkt_len);
+   Connection *c = NULL;
+   int i;
+   if(clientSocket >= connectionTableSize) {
+      int newSize = clientSocket + INIT_CLIENTS;
+      connections = srealloc(connections, sizeof(Connection *) * newSize);
+      for(i = connectionTableSize; i < newSize; i++)
+         connections[i] = NULL;
+      memCharge(MEM_CONNECTIONS, sizeof(Connection *) * (newSize - connectionTableSize));
+      connectionTableSize = newSize;
+   }
+
+   c = poolAlloc(&connectionPool);
+   memset(c, 0, sizeof(Connection));
+   memCharge(MEM_CONNECTIONS, sizeof(Connection));
+   c->socket = clientSocket;
+   c->state = CONN_LOGIN;
+   c->last_activity = timerNowMs();
+   c->server = s;
+   timerInit(&c->timer, connectionTimeout, c);
+   timerInit(&c->slow_timer, slowConsumerTimeout, c);
+   timerInit(&c->throttle_timer, throttleTimeout, c);
+   timerInit(&c->offline_timer, streamOffline, c);
+   bucketInit(&c->frame_bucket, config.frame_rate, config.frame_rate * 2, c->last_activity);
+   bucketInit(&c->byte_bucket, config.byte_rate, config.byte_rate * 2, c->last_activity);
+   c->id = nextConnectionId++;
+   outQueueInit(&c->out);
+   timerAdd(&c->timer, LOGIN_TIMEOUT);
+   connections[clientSocket] = c;
+   return c;
+}
+
+void freeConnection(int clientSocket) {
+
+   Connection *c = NULL;
+   if(clientSocket >= connectionTableSize || connections[clientSocket] == NULL)
+      return;
+   c = connections[clientSocket];
+   timerCancel(&c->timer);
+   timerCancel(&c->slow_timer);
+   timerCancel(&c->throttle_timer);
+   timerCancel(&c->offline_timer);
+   outQueueFree(&c->out);
+   poolFree(&connectionPool, c);
+   memCharge(MEM_CONNECTIONS, -(ssize_t)sizeof(Connection));
+   connections[clientSocket] = NULL;
+}
+
+// login accepted - swap the login deadline for the heartbeat timer
+void activateConnection(int clientSocket, int slot) {
+
+   Connection *c = connections[clientSocket];
+   c->state = CONN_ACTIVE;
+   c->slot = slot;
+   c->last_activity = timerNowMs();
+   timerAdd(&c->timer, HEARTBEAT_INTERVAL);
+}
+
+// any frame proves the peer is alive, only chat frames count against idle
+void connectionActivity(int clientSocket, uint8_t flag) {
+
+   Connection *c = connections[clientSocket];
+   c->missed_heartbeats = 0;
+   if(flag != HEARTBEAT_ACK_FLAG)
+      c->last_activity = timerNowMs();
+   if(c->state == CONN_ACTIVE)
+      timerAdd(&c->timer, HEARTBEAT_INTERVAL);
+}
+
+/* Timer callback for a connection
+ * CONN_LOGIN: never sent flag 1 in time - drop it
+ * CONN_ACTIVE: evict if idle or unresponsive, otherwise probe with flag 14
+ */
+void connectionTimeout(void *arg) {
+
+   Connection *c = (Connection *)arg;
+   int clientSocket = c->socket;
+
+   if(c->closing) {
+      removeClient(clientSocket, c->server);
+   }
+   else if(c->state == CONN_LOGIN) {
+      printf("client on socket %d never logged in\n", clientSocket);
+      removeClient(clientSocket, c->server);
+   }
+   else if(c->state == CONN_PEER_CONNECTING) {
+      printf("connect to node on socket %d timed out\n", clientSocket);
+      removeClient(clientSocket, c->server);
+   }
+   else if(c->state == CONN_PEER_HELLO) {
+      printf("node on socket %d never said hello\n", clientSocket);
+      removeClient(clientSocket, c->server);
+   }
+   else if(c->state != CONN_PEER && timerNowMs() - c->last_activity >= IDLE_TIMEOUT) {
+      printf("client on socket %d idle, evicting\n", clientSocket);
+      if(c->session != NULL)
+         endSession(c->session); // not coming back
+      removeClient(clientSocket, c->server);
+   }
+   else if(c->missed_heartbeats >= MAX_MISSED_HEARTBEATS) {
+      printf("client on socket %d stopped answering heartbeats\n", clientSocket);
+      removeClient(clientSocket, c->server);
    }
    else {
-      //send flag 3 (failure: handle exists)
-      makeChatHeader(buf, HANDLE_EXISTS, pkt_len);
-      sendPacket(clientSocket, buf, pkt_len);
+      sendHeartbeat(clientSocket);
+      c->missed_heartbeats++;
+      timerAdd(&c->timer, HEARTBEAT_INTERVAL);
    }
 }
 
-//adds a new client to the server at the next available position
-//realloc the server if not enough room for new client
-void addNewClient(Server *s, uint8_t *handle, uint8_t len, int clientSocket) {
+// flag = 14 heartbeat probe, client answers with flag 15
+void sendHeartbeat(int clientSocket) {
+   sendEmpty(clientSocket, HEARTBEAT_FLAG);
+}
 
-   int i;
-   // check if need to increase server size
-   if(s->num_handles == s->num_allocations) {
-      // double allocation space ( * 2)
-      s->clients = srealloc(s->clients, sizeof(Handle) * s->num_allocations * 2);
-      s->num_allocations *= 2;
-      s->socket_numbers = srealloc(s->socket_numbers, sizeof(char) * s->num_allocations);
-      s->socket_status = srealloc(s->socket_status, sizeof(char) * s->num_allocations);
-      // need to memset the new arrays to 0?
+// a frame that is only its header (flags 2, 3, 9, 13, 14, 15)
+void sendEmpty(int clientSocket, uint8_t flag) {
+
+   uint8_t buf[MAXBUF];
+   makeChatHeader(buf, flag, sizeof(ChatHeader));
+   connSend(clientSocket, buf, sizeof(ChatHeader), 0);
+}
+
+/* Sends a frame to a client without ever blocking the event loop.
+ * Whatever the socket can't take now is queued and written when poll()
+ * reports it writable. flags = OUT_DROPPABLE for broadcasts
+ */
+void connSend(int clientSocket, uint8_t *buf, uint16_t len, uint8_t flags) {
+
+   Connection *c = NULL;
+   ssize_t sent = 0;
+
+   if(clientSocket >= connectionTableSize || (c = connections[clientSocket]) == NULL)
+      return;
+   if(c->session != NULL) {
+      // kept even if the connection is going, and never dropped - a
+      // gap would throw the numbering out
+      retainFrame(c->session, buf, len);
+      flags &= ~OUT_DROPPABLE;
    }
+   if(c->closing)
+      return;
 
-   // Ready to actualy add client to server
-   // loop through socket status to find first available socket CLOSED (0)
-   for(i = 0; i < s->num_allocations; i++) {
-      if(s->socket_status[i] == CLOSED) { //available to add
-         memcpy(s->clients[i].handle, handle, sizeof(char)*len);
-         //printf("added %s to server client list", s->clients[i].handle);
-         s->socket_numbers[i] = clientSocket;
-         s->socket_status[i] = OPEN;
-         s->num_handles++;
-         //printf(" with socket %d NumClients = %d\n", clientSocket, s->num_handles);
-         break;
+   if(outQueueEmpty(&c->out)) {
+      sent = transportSend(clientSocket, buf, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+      connSendRest(c, buf, len, flags, sent, errno);
+      return;
+   }
+   else if(config.slow_policy == SLOW_SPILL
+         && (outQueueSpilled(&c->out) || c->out.bytes + len > config.out_limit)) {
+      if(outQueueSpill(&c->out, buf, len, config.spill_dir) < 0) {
+         stats.slow_disconnects++;
+         scheduleClose(c, 0);
+         return;
       }
+      stats.frames_spilled++;
+      stats.bytes_spilled += len;
    }
+   else if(shedFrame(len, flags))
+      return;
+   else
+      outQueuePush(&c->out, buf, len, 0, flags);
+
+   stats.frames_queued++;
+   enforceOutLimit(c);
 }
 
-// looks up if the given handle name is in the server database
-// if so, return index in server table [0,num_handles-1]
-// else return -1 if not found
-// assume handle null terminated here
-int lookupClient(Server *s, Handle handle) {
+/* After a frame was written to an idle connection (sent bytes, or -1
+ * and error): queues whatever the socket didn't take
+ */
+void connSendRest(Connection *c, uint8_t *buf, uint16_t len, uint8_t flags, ssize_t sent, int error) {
+
+   if(sent == len)
+      return; // common case - nothing queued
+   if(sent < 0) {
+      if(error != EAGAIN && error != EWOULDBLOCK && error != EINTR) {
+         stats.send_errors++;
+         scheduleClose(c, 0);
+         return;
+      }
+      sent = 0;
+   }
+   if(sent == 0 && shedFrame(len, flags))
+      return;
+   outQueuePush(&c->out, buf, len, sent, flags);
+   setPollOut(c->socket, 1);
+   stats.frames_queued++;
+   enforceOutLimit(c);
+}
 
-   int i;
-   //loop allocations incase client was removed
-   for(i = 0; i < s->num_allocations; i++) {
-      if(strcmp((char *)handle.handle, (char *)s->clients[i].handle) == 0) { // equal - handle exists
-         if(s->socket_status[i] == OPEN) {
-            //make sure open handle (closed handles aren't nulled out)
-            //printf("Found matching client at index: %d!\n", i);
-            return i;
+// socket writable - push out queued frames
+void flushConnection(int clientSocket) {
+
+   Connection *c = connections[clientSocket];
+   int ret = 0;
+   if(c == NULL)
+      return;
+   if(c->state == CONN_PEER_CONNECTING) {
+      peerConnected(c);
+      return;
+   }
+
+   if((ret = outQueueFlush(&c->out, clientSocket)) < 0) {
+      // a lost spill file is lost output, like one that couldn't be written
+      if(ret == OUT_SPILL_LOST)
+         stats.slow_disconnects++;
+      else
+         stats.send_errors++;
+      removeClient(clientSocket, c->server);
+      return;
+   }
+   if(c->out.bytes <= config.out_limit)
+      timerCancel(&c->slow_timer);
+   if(outQueueEmpty(&c->out)) {
+      setPollOut(clientSocket, 0);
+      if(c->closing)
+         removeClient(clientSocket, c->server);
+   }
+}
+
+/* Applies the slow consumer policy once the in memory queue is over
+ * config.out_limit. Past OUT_HARD_LIMIT times the limit the client is
+ * disconnected whatever the policy (e.g. nothing left to drop)
+ */
+void enforceOutLimit(Connection *c) {
+
+   int freed = 0;
+
+   if(c->out.bytes <= config.out_limit) {
+      timerCancel(&c->slow_timer);
+      connMemoryLimit(c);
+      return;
+   }
+
+   switch(config.slow_policy) {
+      case SLOW_DROP_OLDEST:
+         while(c->out.bytes > config.out_limit && (freed = outQueueDropOldest(&c->out)) > 0) {
+            stats.frames_dropped++;
+            stats.bytes_dropped += freed;
          }
-      }
+         break;
+
+      case SLOW_DISCONNECT:
+         if(!timerPending(&c->slow_timer))
+            timerAdd(&c->slow_timer, config.slow_grace);
+         break;
+
+      default: // SLOW_SPILL - overflow already went to disk
+         break;
    }
-   // handle doesnt exist
-   return -1;
+
+   if(c->out.bytes > (size_t)config.out_limit * OUT_HARD_LIMIT) {
+      printf("client on socket %d over hard output limit, disconnecting\n", c->socket);
+      stats.slow_disconnects++;
+      scheduleClose(c, 0);
+   }
+   else
+      connMemoryLimit(c);
 }
 
-void removeClient(int clientSocket, Server *s) {
-	//printf("Client on socket %d terminted\n", clientSocket);
-	removeFromPollSet(clientSocket);
-   removeClientFromServer(clientSocket, s);
-	close(clientSocket);
+// -m: what the slow consumer policy left queued still has to fit
+void connMemoryLimit(Connection *c) {
+
+   if(config.conn_memory > 0 && connMemory(c) > config.conn_memory) {
+      printf("client on socket %d over its memory limit, disconnecting\n", c->socket);
+      stats.mem_disconnects++;
+      scheduleClose(c, 0);
+   }
 }
 
-/* helper function for removeClient - updates server */
-void removeClientFromServer(int clientSocket, Server *s) {
-   int i;
-   for(i = 0; i < s->num_allocations; i++) {
-      if(s->socket_numbers[i] == clientSocket) {
-         s->socket_status[i] = CLOSED;
-         s->num_handles--;
-      }
+// SLOW_DISCONNECT grace period ran out
+void slowConsumerTimeout(void *arg) {
+
+   Connection *c = (Connection *)arg;
+   if(c->out.bytes > config.out_limit) {
+      printf("client on socket %d too slow, disconnecting\n", c->socket);
+      stats.slow_disconnects++;
+      removeClient(c->socket, c->server);
    }
 }
 
-// Checks args and returns port number
-int checkArgs(int argc, char *argv[]) {
-	int portNumber = 0;
+/* Stops all output to c and closes it when its timer fires (or as soon
+ * as its queue drains). Used where closing right away would pull the
+ * socket out from under a caller, e.g. mid broadcast
+ */
+void scheduleClose(Connection *c, int timeInMilliSeconds) {
 
-	if (argc > 2)
-	{
-		fprintf(stderr, "Usage %s [optional port number]\n", argv[0]);
-		exit(EXIT_FAILURE);
-	}
+   c->closing = 1;
+   timerCancel(&c->slow_timer);
+   timerAdd(&c->timer, timeInMilliSeconds);
+}
 
-	if (argc == 2)
-	{
-		portNumber = atoi(argv[1]);
-	}
+/* connSend() to the handle in a Server slot. A resumable session
+ * waiting for its client keeps the frame for the resume instead
+ */
+void slotSend(Server *s, int slot, uint8_t *buf, uint16_t len, uint8_t flags) {
 
-	return portNumber;
+   if(s->socket_numbers[slot] >= 0)
+      connSend(s->socket_numbers[slot], buf, len, flags);
+   else if(s->sessions[slot] != NULL)
+      retainFrame(s->sessions[slot], buf, len);
+}
+
+/* slotSend() of a fanned out chat frame, deflated for a client that
+ * agreed to it. Deflated once, on the first such client
+ */
+void fanoutSend(Server *s, int slot, Fanout *o, uint8_t flags) {
+
+   uint16_t len = 0;
+   uint8_t *data = fanoutBytes(s, slot, o, &len);
+   slotSend(s, slot, data, len, flags);
+}
+
+// the frame as the handle in slot is sent it
+uint8_t *fanoutBytes(Server *s, int slot, Fanout *o, uint16_t *len) {
+
+   *len = o->plain_len;
+   if(slotCodec(s, slot) != COMPRESS_DEFLATE)
+      return o->plain;
+   if(o->packed_len == 0) {
+      if((o->packed_len = compressPacket(o->plain, o->plain_len, o->packed)) == 0)
+         o->packed_len = -1;
+      else
+         stats.compressed++;
+   }
+   if(o->packed_len < 0)
+      return o->plain;
+   stats.compressed_sends++;
+   stats.bytes_saved += o->plain_len - o->packed_len;
+   *len = o->packed_len;
+   return o->packed;
+}
+
+/* fanoutSend() to every logged in handle but except's, with the writes
+ * to idle connections spread over the fan-out workers. Everything else
+ * a send involves (sessions, queues, counters) stays on this thread,
+ * before the writes or after them
+ */
+void parallelFanout(Server *s, Fanout *o, int except) {
+
+   static FanoutSend *sends = NULL;
+   static int sendsSize = 0;
+   Connection *c = NULL;
+   FanoutSend *w = NULL;
+   uint8_t *data = NULL;
+   uint16_t len = 0;
+   int i, count = 0;
+
+   if(sendsSize < s->num_allocations) {
+      sendsSize = s->num_allocations;
+      sends = srealloc(sends, sizeof(FanoutSend) * sendsSize);
+   }
+   for(i = 0; i < s->num_allocations; i++) {
+      if(s->socket_status[i] != OPEN || s->socket_numbers[i] == except)
+         continue;
+      data = fanoutBytes(s, i, o, &len);
+      c = s->socket_numbers[i] >= 0 ? connections[s->socket_numbers[i]] : NULL;
+      if(c == NULL || c->closing || !outQueueEmpty(&c->out)) {
+         slotSend(s, i, data, len, OUT_DROPPABLE); // kept, queued behind, or dropped
+         continue;
+      }
+      w = &sends[count++];
+      w->socket = c->socket;
+      w->buf = data;
+      w->len = len;
+      w->flags = OUT_DROPPABLE;
+      if(c->session != NULL) {
+         retainFrame(c->session, data, len); // as connSend() would
+         w->flags = 0;
+      }
+   }
+
+   fanoutPoolRun(sends, count);
+   stats.parallel_fanouts++;
+   stats.parallel_sends += count;
+   for(i = 0; i < count; i++) {
+      w = &sends[i];
+      connSendRest(connections[w->socket], (uint8_t *)w->buf, w->len, w->flags, w->sent, w->error);
+   }
+}
+
+// the codec agreed with the handle in a Server slot, held by its session while away
+uint8_t slotCodec(Server *s, int slot) {
+
+   if(s->socket_numbers[slot] >= 0 && connections[s->socket_numbers[slot]] != NULL)
+      return connections[s->socket_numbers[slot]]->codec;
+   if(s->sessions[slot] != NULL)
+      return s->sessions[slot]->codec;
+   return COMPRESS_NONE;
+}
+
+/* flag 25 - makes a logged in connection resumable and hands the
+ * client its token. Frames are counted from here on
+ */
+void openSession(Frame *f, uint8_t *buf, Server *s, uint16_t pkt_len, int clientSocket) {
+
+   Connection *c = connections[clientSocket];
+   Session *ss = NULL;
+   uint8_t reply[MAXBUF];
+   Frame r;
+
+   if(config.session_grace == 0 || c->session != NULL)
+      return; // the client carries on without one
+   if(memPressure(sizeof(Session) + SESSION_RETAIN_BYTES + SESSION_RETAIN_FRAMES * sizeof(HistoryEntry)) != MEM_OK) {
+      stats.sessions_refused++;
+      return;
+   }
+   ss = newSession(s, c->slot, clientSocket, c->codec);
+   if(getrandom(ss->token, RESUME_TOKEN_LEN, 0) != RESUME_TOKEN_LEN) {
+      perror("getrandom");
+      endSession(ss);
+      return;
+   }
+   c->session = ss;
+
+   frameInit(&r, SESSION_FLAG);
+   r.token = ss->token;
+   frameNum(&r, config.session_grace);
+   connSend(clientSocket, reply, frameEncode(reply, TO_CLIENT, &r), 0);
+}
+
+/* flag 26 - a client back after losing its connection, in place of
+ * flag 1. Takes over the session (from its old connection too, if the
+ * server hasn't noticed that one is dead), says how many of the
+ * client's frames were handled and resends every frame after the last
+ * one it got. A session that can't be resumed is ended so the client
+ * can log in again
+ */
+void resumeSession(Frame *f, uint8_t *buf, Server *s, uint16_t pkt_len, int clientSocket) {
+
+   Connection *c = connections[clientSocket];
+   Session *ss = NULL;
+   HistoryEntry *e = NULL;
+   uint8_t reply[MAXBUF];
+   uint32_t got = f->nums[0];
+   uint32_t i = 0;
+   Frame r;
+
+   if((ss = findSession(s, f->token)) != NULL && ss->socket >= 0)
+      removeClient(ss->socket, s); // detaches it
+   if(ss != NULL)
+      i = historyFindAfter(&ss->retained, got);
+   frameInit(&r, RESUME_FLAG);
+   if(ss == NULL || got > ss->sent || (got < ss->sent
+         && (i == ss->retained.count || historyEntry(&ss->retained, i)->seq != got + 1))) {
+      if(ss != NULL)
+         closeSlot(s, ss->slot); // missed more than was kept
+      frameNum(&r, RESUME_REFUSED);
+      frameNum(&r, 0);
+      connSend(clientSocket, reply, frameEncode(reply, TO_CLIENT, &r), 0);
+      return;
+   }
+
+   timerCancel(&ss->grace_timer);
+   ss->socket = clientSocket;
+   s->socket_numbers[ss->slot] = clientSocket;
+   activateConnection(clientSocket, ss->slot);
+   c->codec = ss->codec; // the retained frames may be deflated
+   frameNum(&r, RESUME_OK);
+   frameNum(&r, ss->received);
+   connSend(clientSocket, reply, frameEncode(reply, TO_CLIENT, &r), 0);
+   // the replay goes out before c->session is set, so it isn't kept twice
+   for(; i < ss->retained.count; i++) {
+      e = historyEntry(&ss->retained, i);
+      connSend(clientSocket, historyData(&ss->retained, e), e->len, 0);
+   }
+   c->session = ss;
+}
+
+// a session holding slot, socket -1 if its client is away
+Session *newSession(Server *s, int slot, int socket, uint8_t codec) {
+
+   Session *ss = sCalloc(1, sizeof(Session));
+   ss->slot = slot;
+   ss->socket = socket;
+   ss->codec = codec;
+   ss->server = s;
+   historyInit(&ss->retained, SESSION_RETAIN_BYTES, SESSION_RETAIN_FRAMES);
+   memCharge(MEM_SESSIONS, sizeof(Session) + historySize(&ss->retained));
+   timerInit(&ss->grace_timer, sessionExpire, ss);
+   s->sessions[slot] = ss;
+   return ss;
+}
+
+Session *findSession(Server *s, const uint8_t *token) {
+
+   int i;
+   for(i = 0; i < s->num_allocations; i++) {
+      if(s->socket_status[i] == OPEN && s->sessions[i] != NULL
+            && memcmp(s->sessions[i]->token, token, RESUME_TOKEN_LEN) == 0)
+         return s->sessions[i];
+   }
+   return NULL;
+}
+
+// numbers a frame sent to the session and keeps it for a resume
+void retainFrame(Session *ss, uint8_t *buf, uint16_t len) {
+
+   if(sessionCounted(buf[PKT_LEN]))
+      historyAppend(&ss->retained, ++ss->sent, buf, len);
+}
+
+// the session's connection is closing - hold the handle for the grace period
+void detachSession(Connection *c) {
+
+   Session *ss = c->session;
+   c->session = NULL;
+   ss->socket = -1;
+   ss->server->socket_numbers[ss->slot] = -1;
+   timerAdd(&ss->grace_timer, config.session_grace);
+}
+
+void endSession(Session *ss) {
+
+   if(ss->socket >= 0 && connections[ss->socket] != NULL)
+      connections[ss->socket]->session = NULL;
+   ss->server->sessions[ss->slot] = NULL;
+   timerCancel(&ss->grace_timer);
+   memCharge(MEM_SESSIONS, -(ssize_t)(sizeof(Session) + historySize(&ss->retained)));
+   historyFree(&ss->retained);
+   free(ss);
+}
+
+// grace period over without a resume - the handle logs out
+void sessionExpire(void *arg) {
+
+   Session *ss = (Session *)arg;
+   Server *s = ss->server;
+   printf("%s did not come back, session closed\n", (char *)s->clients[ss->slot].handle);
+   closeSlot(s, ss->slot);
+}
+
+// flag = 24 - before login only, then poll its eventfd instead
+void shmSetup(Frame *f, uint8_t *buf, Server *s, uint16_t pkt_len, int clientSocket) {
+
+   if(getTransport(clientSocket) == NULL && shmAccept(clientSocket) == 0)
+      addToPollSet(clientSocket);
+}
+
+// flags with nothing left to do once they've been read
+void ignoreFrame(Frame *f, uint8_t *buf, Server *s, uint16_t pkt_len, int clientSocket) {
+}
+
+// appends a direct message to an offline handle's queue in the store
+void storeOffline(char *handle, uint8_t *packet, uint16_t len) {
+
+   if(offlineStoreMessage(handle, packet, len) < 0) {
+      fprintf(stderr, "offline store full, message for %s lost\n", handle);
+      return;
+   }
+   stats.offline_stored++;
+   if(!timerPending(&commitTimer))
+      timerAdd(&commitTimer, OFFLINE_COMMIT_INTERVAL);
+}
+
+/* Sends the next batch of stored messages to a user who just logged in.
+ * Stops early while their output queue is half full so the backlog
+ * streams at the rate the client reads it, then re-arms for the rest
+ */
+void streamOffline(void *arg) {
+
+   Connection *c = (Connection *)arg;
+   char *handle = (char *)c->server->clients[c->slot].handle;
+   uint8_t *packet = NULL;
+   uint16_t len = 0;
+   int sent = 0;
+
+   while(sent < OFFLINE_BATCH && !c->closing && c->out.bytes < config.out_limit / 2
+         && (packet = offlinePeek(handle, &len)) != NULL) {
+      connSend(c->socket, packet, len, 0);
+      offlinePop(handle);
+      sent++;
+   }
+   stats.offline_delivered += sent;
+
+   if(!c->closing && offlinePending(handle))
+      timerAdd(&c->offline_timer, 0);
+}
+
+// timer callback - one msync for every append since the last commit
+void commitOffline(void *arg) {
+   offlineCommit();
+}
+
+/* connSend() for several frames at once - one sendmsg() for all of
+ * them, with whatever the socket doesn't take queued frame by frame
+ */
+void connSendv(int clientSocket, struct iovec *iov, int count) {
+
+   Connection *c = NULL;
+   struct msghdr msg;
+   ssize_t sent = 0;
+   int i;
+
+   if(clientSocket >= connectionTableSize || (c = connections[clientSocket]) == NULL)
+      return;
+   for(i = 0; c->session != NULL && i < count; i++)
+      retainFrame(c->session, iov[i].iov_base, iov[i].iov_len);
+   if(c->closing || count == 0)
+      return;
+
+   if(outQueueEmpty(&c->out)) {
+      memset(&msg, 0, sizeof(msg));
+      msg.msg_iov = iov;
+      msg.msg_iovlen = count;
+      if((sent = transportSendmsg(clientSocket, &msg, MSG_DONTWAIT | MSG_NOSIGNAL)) < 0) {
+         if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            stats.send_errors++;
+            scheduleClose(c, 0);
+            return;
+         }
+         sent = 0;
+      }
+   }
+
+   for(i = 0; i < count; i++) {
+      if(sent >= (ssize_t)iov[i].iov_len) {
+         sent -= iov[i].iov_len;
+         continue;
+      }
+      // a replay can be dropped like a broadcast if the client lags
+      outQueuePush(&c->out, iov[i].iov_base, iov[i].iov_len, sent, c->session != NULL ? 0 : OUT_DROPPABLE);
+      sent = 0;
+      stats.frames_queued++;
+   }
+   if(!outQueueEmpty(&c->out)) {
+      setPollOut(clientSocket, 1);
+      enforceOutLimit(c);
+   }
+}
+
+/* Stores a chat packet (buf points to flag) in a history scope, encoded
+ * once as the flag 17 packet a replay will send
+ */
+void recordHistory(HistoryRing *r, Frame *f, uint8_t *buf, uint16_t pkt_len) {
+
+   uint8_t packet[MAXBUF];
+   uint16_t len;
+   Frame h;
+
+   if(config.index_dir != NULL)
+      indexMessage(historySeq + 1, f);
+   frameInit(&h, HISTORY_FLAG);
+   frameNum(&h, ++historySeq);
+   frameText(&h, buf, pkt_len - PKT_LEN);
+   if((len = frameEncode(packet, TO_CLIENT, &h)) == 0)
+      return; // wouldn't fit a client's receive buffer
+   historyAppend(r, historySeq, packet, len);
+}
+
+// checks if handle sent or was sent the flag 5 packet stored in a flag 17 packet
+int historyVisible(uint8_t *packet, char *handle) {
+
+   int handle_len = strlen(handle);
+   uint16_t len;
+   Frame h, m;
+   int i;
+
+   memcpy(&len, packet, PKT_LEN);
+   // both were checked on the way in, these only find the handles
+   if(frameDecode(packet + PKT_LEN, ntohs(len), TO_CLIENT, &h) < 0
+         || frameDecode(h.text, h.text_len + PKT_LEN, TO_SERVER, &m) < 0)
+      return 0;
+   for(i = 0; i < m.num_handles; i++) {
+      if(m.handle_lens[i] == handle_len && memcmp(m.handles[i], handle, handle_len) == 0)
+         return 1;
+   }
+   return 0;
+}
+
+/* flag 16 - replays the history the client asked for as one vectored
+ * write of the stored packets, merging both scopes in sequence order,
+ * then sends flag 18 with the latest sequence number
+ */
+void replayHistory(Frame *f, uint8_t *buf, Server *s, uint16_t pkt_len, int clientSocket) {
+
+   Connection *c = connections[clientSocket];
+   struct iovec iov[HISTORY_MAX_REPLAY];
+   HistoryEntry *picked[HISTORY_MAX_REPLAY];
+   HistoryRing *from[HISTORY_MAX_REPLAY];
+   HistoryEntry *b = NULL, *d = NULL;
+   HistoryRing *r = NULL;
+   HistoryEntry *e = NULL;
+   uint8_t mode = f->nums[0];
+   uint32_t value = f->nums[1];
+   uint32_t ib, id;
+   int n = 0, i;
+   char *handle = NULL;
+   uint8_t endbuf[MAXBUF];
+   Frame end;
+
+   // visibility of direct messages depends on the handle
+   handle = (char *)s->clients[c->slot].handle;
+
+   if(mode == HISTORY_LAST) {
+      if(value > HISTORY_MAX_REPLAY)
+         value = HISTORY_MAX_REPLAY;
+      // walk back from the newest entry of each scope
+      ib = broadcastHistory.count;
+      id = directHistory.count;
+      while(n < value && (ib > 0 || id > 0)) {
+         b = ib > 0 ? historyEntry(&broadcastHistory, ib-1) : NULL;
+         d = id > 0 ? historyEntry(&directHistory, id-1) : NULL;
+         if(d == NULL || (b != NULL && b->seq > d->seq)) {
+            r = &broadcastHistory; e = b; ib--;
+         }
+         else {
+            r = &directHistory; e = d; id--;
+         }
+         if(r == &directHistory && !historyVisible(historyData(r, e), handle))
+            continue;
+         picked[n] = e;
+         from[n] = r;
+         n++;
+      }
+      for(i = 0; i < n; i++) { // oldest first
+         iov[i].iov_base = historyData(from[n-1-i], picked[n-1-i]);
+         iov[i].iov_len = picked[n-1-i]->len;
+      }
+   }
+   else { // HISTORY_SINCE
+      ib = historyFindAfter(&broadcastHistory, value);
+      id = historyFindAfter(&directHistory, value);
+      while(n < HISTORY_MAX_REPLAY && (ib < broadcastHistory.count || id < directHistory.count)) {
+         b = ib < broadcastHistory.count ? historyEntry(&broadcastHistory, ib) : NULL;
+         d = id < directHistory.count ? historyEntry(&directHistory, id) : NULL;
+         if(d == NULL || (b != NULL && b->seq < d->seq)) {
+            r = &broadcastHistory; e = b; ib++;
+         }
+         else {
+            r = &directHistory; e = d; id++;
+         }
+         if(r == &directHistory && !historyVisible(historyData(r, e), handle))
+            continue;
+         iov[n].iov_base = historyData(r, e);
+         iov[n].iov_len = e->len;
+         n++;
+      }
+   }
+
+   connSendv(clientSocket, iov, n);
+
+   frameInit(&end, HISTORY_END_FLAG);
+   frameNum(&end, historySeq);
+   connSend(clientSocket, endbuf, frameEncode(endbuf, TO_CLIENT, &end), 0);
+}
+
+/* flag 19 - resends the matching messages still held in history as
+ * flag 17 packets, oldest first, then flag 20 with the match count and
+ * the newest matching seq numbers (older ones may no longer be replayable)
+ */
+void replySearch(Frame *f, uint8_t *buf, Server *s, uint16_t pkt_len, int clientSocket) {
+
+   Connection *c = connections[clientSocket];
+   uint32_t results[SEARCH_MAX_RESULTS];
+   uint32_t seqs_NetW[SEARCH_MAX_RESULTS];
+   struct iovec iov[SEARCH_MAX_RESULTS];
+   HistoryRing *r = NULL;
+   HistoryEntry *e = NULL;
+   uint8_t resbuf[MAXBUF];
+   uint32_t total, index;
+   Frame res;
+   int n, i, sent = 0;
+
+   // null terminated, frameDecode() made sure
+   n = searchIndex((char *)f->text, (char *)s->clients[c->slot].handle, results, SEARCH_MAX_RESULTS, &total);
+
+   for(i = n-1; i >= 0; i--) {
+      r = &broadcastHistory;
+      index = historyFindAfter(r, results[i] - 1);
+      if(index >= r->count || historyEntry(r, index)->seq != results[i]) {
+         r = &directHistory;
+         index = historyFindAfter(r, results[i] - 1);
+         if(index >= r->count || historyEntry(r, index)->seq != results[i])
+            continue; // evicted, only the seq number is returned
+      }
+      e = historyEntry(r, index);
+      iov[sent].iov_base = historyData(r, e);
+      iov[sent].iov_len = e->len;
+      sent++;
+   }
+   connSendv(clientSocket, iov, sent);
+
+   frameInit(&res, SEARCH_RESULT_FLAG);
+   frameNum(&res, total);
+   frameNum(&res, n);
+   for(i = 0; i < n; i++)
+      seqs_NetW[i] = htonl(results[i]);
+   frameText(&res, seqs_NetW, n * sizeof(uint32_t));
+   connSend(clientSocket, resbuf, frameEncode(resbuf, TO_CLIENT, &res), 0);
+}
+
+void indexTimeout(void *arg) {
+   indexMaintenance();
+   timerAdd(&indexTimer, INDEX_MAINTENANCE_INTERVAL);
+}
+
+// flag = 22 - send what it's missing, and ask for what we are
+void peerDigest(Frame *f, uint8_t *buf, Server *s, uint16_t pkt_len, int clientSocket) {
+
+   Peer *p = peerBySocket(clientSocket);
+   if(presenceDeltas(buf, pkt_len - PKT_LEN, sendToPeer, p))
+      sendDigest(p);
+}
+
+// flag = 23 - presence changes, users that lost their handle are disconnected
+void peerDelta(Frame *f, uint8_t *buf, Server *s, uint16_t pkt_len, int clientSocket) {
+
+   char lost[PRESENCE_MAX_LOST][MAX_HANDLE + 1];
+   evictHandles(s, lost, presenceApply(buf, pkt_len - PKT_LEN, lost));
+}
+
+// flag = 14 from another node, answered like a client would
+void peerHeartbeat(Frame *f, uint8_t *buf, Server *s, uint16_t pkt_len, int clientSocket) {
+   sendEmpty(clientSocket, HEARTBEAT_ACK_FLAG);
+}
+
+int fromPeer(int clientSocket) {
+   return clientSocket < connectionTableSize && connections[clientSocket] != NULL
+      && connections[clientSocket]->state == CONN_PEER;
+}
+
+// starts a link to a configured node - finished by peerConnected()
+void connectPeer(Peer *p, Server *s) {
+
+   Connection *c = NULL;
+   int peerSocket = peerConnect(p);
+
+   if(peerSocket < 0)
+      return;
+   addToPollSet(peerSocket);
+   c = newConnection(peerSocket, s);
+   c->state = CONN_PEER_CONNECTING;
+   setPollOut(peerSocket, 1);
+}
+
+// outgoing link writable - say hello if it connected, then wait for the node's
+void peerConnected(Connection *c) {
+
+   Peer *p = peerBySocket(c->socket);
+
+   setPollOut(c->socket, 0);
+   if(p == NULL || peerConnectResult(p) < 0) {
+      removeClient(c->socket, c->server);
+      return;
+   }
+   // the other node's port is TLS too, with a certificate ours vouches for
+   if(config.tls_cert != NULL) {
+      if(tlsConnect(c->socket, p->host) < 0) {
+         stats.tls_failures++;
+         removeClient(c->socket, c->server);
+         return;
+      }
+      countTls(c->socket);
+   }
+   c->state = CONN_PEER_HELLO;
+   timerAdd(&c->timer, LOGIN_TIMEOUT);
+   sendPeerHello(p);
+}
+
+// flag = 21 back on a link we opened - up once it proves it's the node we dialed
+void peerHelloReply(Frame *f, uint8_t *buf, Server *s, uint16_t pkt_len, int clientSocket) {
+
+   Peer *p = peerBySocket(clientSocket);
+
+   if(p == NULL || f->nums[0] != p->id || peerHelloCheck(p, f->text, f->text_len, clientSocket) < 0) {
+      fprintf(stderr, "node hello on socket %d refused\n", clientSocket);
+      removeClient(clientSocket, s);
+      return;
+   }
+   peerAccepted(p->id, clientSocket);
+   printf("link to node %u up\n", p->id);
+   peerLinked(p, connections[clientSocket]);
+}
+
+// hellos checked both ways - catch up on presence
+void peerLinked(Peer *p, Connection *c) {
+
+   char lost[PRESENCE_MAX_LOST][MAX_HANDLE + 1];
+
+   c->state = CONN_PEER;
+   bucketInit(&c->frame_bucket, 0, 0, timerNowMs()); // node traffic isn't rate limited
+   bucketInit(&c->byte_bucket, 0, 0, timerNowMs());
+   timerAdd(&c->timer, HEARTBEAT_INTERVAL);
+   sendDigest(p);
+   // users it had that were ignored while the link was down
+   evictHandles(c->server, lost, presenceLocalLosers(lost, PRESENCE_MAX_LOST));
+}
+
+/* Timer - the node with the lower id connects, so each pair of nodes
+ * has exactly one link. Retries every PEER_RETRY_INTERVAL while down
+ */
+void peerRetry(void *arg) {
+
+   Server *s = (Server *)arg;
+   Peer *p = NULL;
+   int i;
+
+   // looked up a pass at a time, the loop never waits on the resolver
+   for(i = 0; i < numPeers(); i++) {
+      p = peerAt(i);
+      if(p->host[0] != '\0' && peerResolve(p) == 1
+            && p->state == PEER_DOWN && p->id > localNodeId())
+         connectPeer(p, s);
+   }
+   timerAdd(&peerTimer, PEER_RETRY_INTERVAL);
+}
+
+/* flag = 21 on an accepted socket - a link from another node, taken
+ * only from a configured one that proves it with the shared key
+ */
+void peerHello(Frame *f, uint8_t *buf, Server *s, uint16_t pkt_len, int clientSocket) {
+
+   Connection *c = connections[clientSocket];
+   Peer *p = NULL;
+   uint16_t id = f->nums[0];
+
+   if(!federationEnabled() || id == localNodeId() || (p = peerById(id)) == NULL
+         || peerHelloCheck(p, f->text, f->text_len, clientSocket) < 0) {
+      fprintf(stderr, "node hello on socket %d refused\n", clientSocket);
+      scheduleClose(c, 0);
+      return;
+   }
+
+   // a node that restarted before we noticed the old link closing
+   if(p->socket >= 0)
+      removeClient(p->socket, s);
+   peerAccepted(id, clientSocket);
+   printf("link from node %u up\n", id);
+   sendPeerHello(p);
+   peerLinked(p, c);
+}
+
+// flag = 21, our node id and the proof - written ahead of anything batched
+void sendPeerHello(Peer *p) {
+
+   uint8_t buf[MAXBUF];
+   uint8_t auth[PEER_HELLO_AUTH];
+   Frame f;
+
+   frameInit(&f, PEER_HELLO_FLAG);
+   frameNum(&f, localNodeId());
+   frameText(&f, auth, peerHelloAuth(p, auth));
+   connSend(p->socket, buf, frameEncode(buf, TO_SERVER, &f), 0);
+}
+
+// flag = 22, how much of each node's presence we hold
+void sendDigest(Peer *p) {
+
+   uint8_t buf[MAXBUF];
+   peerSend(p, buf, presenceDigest(buf));
+}
+
+// presenceDeltas() output goes onto the link the digest came from
+void sendToPeer(uint8_t *frame, uint16_t len, void *arg) {
+   peerSend((Peer *)arg, frame, len);
+}
+
+/* Timer - an anti-entropy round with one linked node picked at random,
+ * repairing anything a dropped link or restart made it miss
+ */
+void gossipTimeout(void *arg) {
+
+   Peer *up[MAX_PEERS];
+   int n = 0, i;
+
+   for(i = 0; i < numPeers(); i++) {
+      if(peerAt(i)->state == PEER_UP)
+         up[n++] = peerAt(i);
+   }
+   if(n > 0)
+      sendDigest(up[rand() % n]);
+   timerAdd(&gossipTimer, GOSSIP_INTERVAL);
+}
+
+// flag = 23 to every node when a local user logs in or out
+void announceHandle(char *handle, int online) {
+
+   uint8_t buf[MAXBUF];
+   uint16_t len;
+   int i;
+
+   if(!federationEnabled())
+      return;
+   len = presenceLocalChange(handle, online, buf);
+   for(i = 0; i < numPeers(); i++)
+      peerSend(peerAt(i), buf, len);
+}
+
+/* Local users whose handle went to an earlier login on another node -
+ * told with flag 3 and disconnected
+ */
+void evictHandles(Server *s, char lost[][MAX_HANDLE + 1], int count) {
+
+   Handle handle;
+   int i, slot, clientSocket;
+
+   for(i = 0; i < count; i++) {
+      strcpy((char *)handle.handle, lost[i]);
+      if((slot = lookupClient(s, handle)) < 0)
+         continue;
+      clientSocket = s->socket_numbers[slot];
+      printf("%s logged in to another node first, disconnecting\n", lost[i]);
+      if(clientSocket < 0) { // resumable session, already disconnected
+         closeSlot(s, slot);
+         continue;
+      }
+      sendEmpty(clientSocket, HANDLE_EXISTS_FLAG);
+      removeClientFromServer(clientSocket, s);
+      // closes once flag 3 is out
+      scheduleClose(connections[clientSocket],
+         outQueueEmpty(&connections[clientSocket]->out) ? 0 : LOGIN_TIMEOUT);
+   }
+}
+
+// appends a frame to a node's batch, flushing first if it's full
+void peerSend(Peer *p, uint8_t *buf, uint16_t len) {
+
+   if(p == NULL || p->state != PEER_UP)
+      return;
+   if(!peerBatchFits(p, len)) {
+      connSend(p->socket, p->batch, p->batch_len, 0);
+      stats.peer_batches++;
+      p->batch_len = 0;
+   }
+   peerBatchAppend(p, buf, len);
+   stats.peer_frames++;
+}
+
+// input has gone quiet (or enough passes went by) - each link's batch goes out in one send
+void flushPeers() {
+
+   Peer *p = NULL;
+   int i;
+
+   for(i = 0; i < numPeers(); i++) {
+      p = peerAt(i);
+      if(p->state == PEER_UP && p->batch_len > 0) {
+         connSend(p->socket, p->batch, p->batch_len, 0);
+         stats.peer_batches++;
+         p->batch_len = 0;
+      }
+   }
+}
+
+/* Asks the server running at path to hand over. Returns the socket the
+ * rest of the snapshot arrives on (see finishTakeover()) and sets the
+ * listening socket, or -1 if no server is running there
+ */
+int startTakeover(char *path, int *mainServerSocket) {
+
+   uint8_t buf[HANDOFF_CHUNK];
+   HandoffServer *hs = (HandoffServer *)buf;
+   uint32_t version = HANDOFF_VERSION;
+   int sock, fds[HANDOFF_MAX_FDS], numFds = 0;
+   uint8_t type = 0;
+
+   if((sock = handoffConnect(path)) < 0)
+      return -1;
+   printf("taking over from the server at %s\n", path);
+   if(handoffSend(sock, HANDOFF_HELLO, &version, sizeof(version), NULL, 0) < 0
+         || handoffRecv(sock, &type, buf, sizeof(buf), fds, &numFds) < (int)sizeof(HandoffServer)
+         || type != HANDOFF_SERVER || numFds < 1) {
+      fprintf(stderr, "running server refused the upgrade\n");
+      exit(EXIT_FAILURE);
+   }
+   *mainServerSocket = fds[0];
+   if(numFds > 1 && config.unix_path != NULL)
+      unixServerSocket = fds[1];
+   else if(numFds > 1)
+      close(fds[1]);
+   takeoverHistory = hs->history_arena == HISTORY_ARENA && hs->history_entries == HISTORY_ENTRIES;
+   takeoverRetained = hs->session_arena == SESSION_RETAIN_BYTES && hs->session_entries == SESSION_RETAIN_FRAMES;
+   if(hs->history_seq > historySeq)
+      historySeq = hs->history_seq;
+   return sock;
+}
+
+/* Rebuilds the connections and Server table from the snapshot, then
+ * tells the old process it can exit. Socket numbers differ in this
+ * process, so users are added to the table afresh
+ */
+void finishTakeover(int takeoverSocket, Server *s) {
+
+   uint8_t buf[HANDOFF_CHUNK];
+   HandoffConn *hc = (HandoffConn *)buf;
+   HandoffFrame *hf = (HandoffFrame *)buf;
+   HandoffHistory *hh = (HandoffHistory *)buf;
+   HandoffSession *hss = (HandoffSession *)buf;
+   HistoryRing *r = NULL;
+   Connection *c = NULL;
+   Session *ss = NULL;
+   Handle handle;
+   int fds[HANDOFF_MAX_FDS], numFds = 0, len, clients = 0, sessions = 0;
+   uint32_t size;
+   uint8_t type = 0;
+
+   while((len = handoffRecv(takeoverSocket, &type, buf, sizeof(buf), fds, &numFds)) >= 0
+         && type != HANDOFF_END) {
+      if(!takeoverRecordFits(type, buf, len, numFds, s))
+         abandonTakeover(type);
+      switch(type) {
+         case HANDOFF_CONN:
+            addToPollSet(fds[0]);
+            c = newConnection(fds[0], s);
+            c->last_activity = timerNowMs() - hc->idle;
+            c->codec = hc->codec;
+            c->partial_len = hc->partial_len;
+            memcpy(c->partial, hc->partial, hc->partial_len);
+            if(hc->spilled && numFds > 1) {
+               c->out.spill_fd = fds[1];
+               c->out.spill_read = hc->spill_read;
+               c->out.spill_write = hc->spill_write;
+               setPollOut(c->socket, 1);
+            }
+            if(hc->state == CONN_ACTIVE) {
+               strcpy((char *)handle.handle, hc->handle);
+               addNewClient(s, handle.handle, strlen(hc->handle), c->socket);
+               activateConnection(c->socket, lookupClient(s, handle));
+               announceHandle(hc->handle, 1);
+               if(offlinePending(hc->handle))
+                  timerAdd(&c->offline_timer, 0);
+            }
+            clients++;
+            break;
+
+         case HANDOFF_FRAME:
+            if(c != NULL) {
+               outQueuePush(&c->out, hf->data, len - sizeof(HandoffFrame), hf->sent, hf->flags);
+               setPollOut(c->socket, 1);
+            }
+            break;
+
+         case HANDOFF_SESSION:
+            ss = NULL;
+            if(hss->waiting) {
+               // holds its handle until the client comes back, as it did
+               strcpy((char *)handle.handle, hss->handle);
+               addNewClient(s, handle.handle, strlen(hss->handle), -1);
+               announceHandle(hss->handle, 1);
+               ss = newSession(s, lookupClient(s, handle), -1, hss->codec);
+               timerAdd(&ss->grace_timer, hss->grace);
+            }
+            else if(c != NULL && c->state == CONN_ACTIVE && c->session == NULL) {
+               ss = newSession(s, c->slot, c->socket, hss->codec);
+               c->session = ss;
+            }
+            if(ss != NULL) {
+               memcpy(ss->token, hss->token, RESUME_TOKEN_LEN);
+               ss->sent = hss->sent;
+               ss->received = hss->received;
+               sessions++;
+            }
+            break;
+
+         case HANDOFF_HISTORY:
+            if(hh->ring == 2 ? ss == NULL || !takeoverRetained : !takeoverHistory)
+               break;
+            r = hh->ring == 0 ? &broadcastHistory : hh->ring == 1 ? &directHistory : &ss->retained;
+            len -= sizeof(HandoffHistory);
+            size = hh->part == HISTORY_PART_ARENA ? r->arena_size : r->max_entries * sizeof(HistoryEntry);
+            if(hh->part != HISTORY_PART_POSITION && (hh->offset > size || len > size - hh->offset))
+               abandonTakeover(type);
+            if(hh->part == HISTORY_PART_ARENA)
+               memcpy(r->arena + hh->offset, hh->data, len);
+            else if(hh->part == HISTORY_PART_ENTRIES)
+               memcpy((uint8_t *)r->entries + hh->offset, hh->data, len);
+            else {
+               // the last chunk of a ring - only now can its entries be checked
+               memcpy(&r->write, hh->data, sizeof(uint32_t));
+               memcpy(&r->first, hh->data + 4, sizeof(uint32_t));
+               memcpy(&r->count, hh->data + 8, sizeof(uint32_t));
+               if(historyCheck(r) < 0)
+                  abandonTakeover(type);
+            }
+            break;
+      }
+   }
+
+   if(len < 0) {
+      fprintf(stderr, "old server went away mid upgrade\n");
+      exit(EXIT_FAILURE);
+   }
+   handoffSend(takeoverSocket, HANDOFF_ACK, NULL, 0, NULL, 0);
+   close(takeoverSocket);
+   printf("took over %d clients, %d resumable sessions\n", clients, sessions);
+}
+
+/* Checks a snapshot record's length, descriptors and the fields used as
+ * sizes or lookups before finishTakeover() acts on it. History offsets
+ * depend on the ring and are checked there
+ */
+int takeoverRecordFits(uint8_t type, uint8_t *buf, int len, int numFds, Server *s) {
+
+   HandoffConn *hc = (HandoffConn *)buf;
+   HandoffFrame *hf = (HandoffFrame *)buf;
+   HandoffHistory *hh = (HandoffHistory *)buf;
+   HandoffSession *hss = (HandoffSession *)buf;
+   Handle handle;
+
+   switch(type) {
+      case HANDOFF_CONN:
+         if(len != sizeof(HandoffConn) || numFds < 1 || numFds > 1 + hc->spilled
+               || hc->partial_len > MAXBUF || hc->codec > COMPRESS_DEFLATE
+               || (hc->state != CONN_LOGIN && hc->state != CONN_ACTIVE)
+               || memchr(hc->handle, '\0', sizeof(hc->handle)) == NULL
+               || (hc->spilled && (hc->spill_read < 0 || hc->spill_read > hc->spill_write)))
+            return 0;
+         strcpy((char *)handle.handle, hc->handle);
+         return hc->state != CONN_ACTIVE || lookupClient(s, handle) < 0;
+
+      case HANDOFF_FRAME:
+         return numFds == 0 && len > (int)sizeof(HandoffFrame)
+            && len - sizeof(HandoffFrame) <= MAXBUF && hf->sent < len - sizeof(HandoffFrame);
+
+      case HANDOFF_SESSION:
+         if(numFds != 0 || len != sizeof(HandoffSession) || hss->codec > COMPRESS_DEFLATE
+               || memchr(hss->handle, '\0', sizeof(hss->handle)) == NULL)
+            return 0;
+         strcpy((char *)handle.handle, hss->handle);
+         return !hss->waiting || lookupClient(s, handle) < 0;
+
+      case HANDOFF_HISTORY:
+         return numFds == 0 && len >= (int)sizeof(HandoffHistory) && hh->ring <= 2
+            && hh->part <= HISTORY_PART_POSITION
+            && (hh->part != HISTORY_PART_POSITION || len >= (int)sizeof(HandoffHistory) + 12);
+   }
+   return numFds == 0; // skipped
+}
+
+// the new process gives up - the old one hears nothing back and carries on
+void abandonTakeover(uint8_t type) {
+   fprintf(stderr, "bad upgrade record (type %u) from the old server, giving up\n", type);
+   exit(EXIT_FAILURE);
+}
+
+/* A replacement process connected to the upgrade socket. Everything
+ * already read is dispatched and the stores are written out, then the
+ * listening socket, clients, their queued output and resumable sessions
+ * are sent over and this process exits. Links to other nodes aren't passed on - the new
+ * process makes its own - and shared memory clients are dropped
+ */
+void handOff(Server *s, int mainServerSocket) {
+
+   uint8_t buf[HANDOFF_CHUNK];
+   HandoffServer *hs = (HandoffServer *)buf;
+   HandoffConn *hc = (HandoffConn *)buf;
+   HandoffFrame *hf = (HandoffFrame *)buf;
+   Connection *c = NULL;
+   Session *ss = NULL;
+   OutFrame *f = NULL;
+   int sock, fds[HANDOFF_MAX_FDS], numFds = 0, i, ok;
+   uint32_t version = 0;
+   uint8_t type = 0;
+
+   if((sock = handoffAccept(upgradeSocket)) < 0)
+      return;
+   if(handoffRecv(sock, &type, &version, sizeof(version), fds, &numFds) != sizeof(version)
+         || type != HANDOFF_HELLO || version != HANDOFF_VERSION) {
+      fprintf(stderr, "refusing upgrade from an incompatible server\n");
+      close(sock);
+      return;
+   }
+   handoffTimeout(sock, 0); // the new process takes its time over the snapshot
+   printf("handing over to the new server\n");
+
+   while(framesPending())
+      dispatchQueuedFrames(s);
+   flushPeers();
+   offlineCommit();
+   indexFlush();
+
+   memset(buf, 0, sizeof(HandoffServer));
+   hs->history_seq = historySeq;
+   hs->history_arena = HISTORY_ARENA;
+   hs->history_entries = HISTORY_ENTRIES;
+   hs->session_arena = SESSION_RETAIN_BYTES;
+   hs->session_entries = SESSION_RETAIN_FRAMES;
+   fds[0] = mainServerSocket;
+   fds[1] = unixServerSocket;
+   ok = handoffSend(sock, HANDOFF_SERVER, hs, sizeof(HandoffServer), fds, unixServerSocket >= 0 ? 2 : 1) == 0;
+
+   for(i = 0; ok && i < connectionTableSize; i++) {
+      if((c = connections[i]) == NULL || !handedOver(c))
+         continue;
+      memset(hc, 0, sizeof(HandoffConn));
+      hc->state = c->state;
+      hc->idle = timerNowMs() - c->last_activity;
+      hc->codec = c->codec;
+      hc->partial_len = c->partial_len;
+      memcpy(hc->partial, c->partial, c->partial_len);
+      if(c->state == CONN_ACTIVE)
+         strcpy(hc->handle, (char *)s->clients[c->slot].handle);
+      fds[0] = c->socket;
+      numFds = 1;
+      if(outQueueSpilled(&c->out)) {
+         hc->spilled = 1;
+         hc->spill_read = c->out.spill_read;
+         hc->spill_write = c->out.spill_write;
+         fds[numFds++] = c->out.spill_fd;
+      }
+      ok = handoffSend(sock, HANDOFF_CONN, hc, sizeof(HandoffConn), fds, numFds) == 0;
+
+      for(f = c->out.head; ok && f != NULL; f = f->next) {
+         hf->sent = f->sent;
+         hf->flags = f->flags;
+         memcpy(hf->data, f->data, f->len);
+         ok = handoffSend(sock, HANDOFF_FRAME, hf, sizeof(HandoffFrame) + f->len, NULL, 0) == 0;
+      }
+      if(ok && c->session != NULL)
+         ok = sendSession(sock, c->session, 0) == 0;
+   }
+
+   // then the ones whose client is away, or on a connection that stays behind
+   for(i = 0; ok && i < s->num_allocations; i++) {
+      if(s->socket_status[i] == OPEN && (ss = s->sessions[i]) != NULL
+            && (ss->socket < 0 || !handedOver(connections[ss->socket])))
+         ok = sendSession(sock, ss, 1) == 0;
+   }
+
+   if(ok) {
+      sendHistoryRing(sock, 0, &broadcastHistory);
+      sendHistoryRing(sock, 1, &directHistory);
+      ok = handoffSend(sock, HANDOFF_END, NULL, 0, NULL, 0) == 0;
+   }
+   // once the new process has it all, this one must not touch the clients again
+   if(ok && handoffRecv(sock, &type, buf, sizeof(buf), fds, &numFds) >= 0 && type == HANDOFF_ACK) {
+      printf("handed over, exiting\n");
+      fflush(stdout);
+      exit(EXIT_SUCCESS);
+   }
+   fprintf(stderr, "upgrade failed, carrying on\n");
+   close(sock);
+}
+
+/* Client sockets the new process gets. TLS and shared memory ones stay
+ * behind and close with this process, as do node links
+ */
+int handedOver(Connection *c) {
+   return !c->closing && getTransport(c->socket) == NULL
+      && (c->state == CONN_LOGIN || c->state == CONN_ACTIVE);
+}
+
+/* A session and then its retained frames. A waiting one carries its
+ * handle and the grace it has left - one whose connection stays behind
+ * starts its grace now
+ */
+int sendSession(int sock, Session *ss, int waiting) {
+
+   HandoffSession hss;
+
+   memset(&hss, 0, sizeof(HandoffSession));
+   memcpy(hss.token, ss->token, RESUME_TOKEN_LEN);
+   hss.sent = ss->sent;
+   hss.received = ss->received;
+   hss.codec = ss->codec;
+   hss.waiting = waiting;
+   if(waiting) {
+      hss.grace = ss->socket < 0 ? timerRemaining(&ss->grace_timer) : config.session_grace;
+      strcpy(hss.handle, (char *)ss->server->clients[ss->slot].handle);
+   }
+   if(handoffSend(sock, HANDOFF_SESSION, &hss, sizeof(HandoffSession), NULL, 0) < 0)
+      return -1;
+   sendHistoryRing(sock, 2, &ss->retained);
+   return 0;
+}
+
+// a history ring's arena, index and position, in HANDOFF_CHUNK pieces
+void sendHistoryRing(int sock, uint8_t ring, HistoryRing *r) {
+
+   uint8_t buf[HANDOFF_CHUNK];
+   HandoffHistory *hh = (HandoffHistory *)buf;
+   uint32_t max = HANDOFF_CHUNK - sizeof(HandoffHistory);
+   uint32_t size, offset, n;
+   uint8_t *from;
+   int part;
+
+   hh->ring = ring;
+   for(part = HISTORY_PART_ARENA; part <= HISTORY_PART_ENTRIES; part++) {
+      from = part == HISTORY_PART_ARENA ? r->arena : (uint8_t *)r->entries;
+      size = part == HISTORY_PART_ARENA ? r->arena_size : r->max_entries * sizeof(HistoryEntry);
+      for(offset = 0; offset < size; offset += n) {
+         n = size - offset < max ? size - offset : max;
+         hh->part = part;
+         hh->offset = offset;
+         memcpy(hh->data, from + offset, n);
+         handoffSend(sock, HANDOFF_HISTORY, hh, sizeof(HandoffHistory) + n, NULL, 0);
+      }
+   }
+   hh->part = HISTORY_PART_POSITION;
+   hh->offset = 0;
+   memcpy(hh->data, &r->write, sizeof(uint32_t));
+   memcpy(hh->data + 4, &r->first, sizeof(uint32_t));
+   memcpy(hh->data + 8, &r->count, sizeof(uint32_t));
+   handoffSend(sock, HANDOFF_HISTORY, hh, sizeof(HandoffHistory) + 12, NULL, 0);
+}
+
+void requestStats(int signum) {
+   statsRequested = 1;
+}
+
+void requestReload(int signum) {
+   reloadRequested = 1;
+}
+
+/* Starts compiling the -f terms again. The loop carries on with the old
+ * ones until filterTimeout() sees the new ones are in
+ */
+void reloadFilter() {
+
+   if(config.filter_path == NULL)
+      fprintf(stderr, "SIGHUP: no content filter (-f) to reload\n");
+   else if(filterReload() < 0)
+      fprintf(stderr, "SIGHUP: content filter still reloading\n");
+   else
+      timerAdd(&filterTimer, FILTER_POLL_INTERVAL);
+}
+
+void filterTimeout(void *arg) {
+
+   FilterInfo info;
+
+   switch(filterPoll()) {
+      case FILTER_RELOAD_RUNNING:
+         timerAdd(&filterTimer, FILTER_POLL_INTERVAL);
+         break;
+      case FILTER_RELOAD_DONE:
+         filterInfo(&info);
+         memCharge(MEM_FILTER, (ssize_t)info.bytes - (ssize_t)memUsed(MEM_FILTER));
+         fprintf(stderr, "content filter reloaded: %u terms\n", info.terms);
+         break;
+      case FILTER_RELOAD_FAILED:
+         fprintf(stderr, "content filter reload failed, the old terms stay\n");
+         break;
+   }
+}
+
+/* Checks a client's %M or %B against the -f terms, in one pass over its
+ * text. A flagged one is logged and delivered; a blocked one is logged
+ * and the sender gets flag 29 instead. Frames relayed by other nodes
+ * were checked by the node they were sent to
+ */
+/* A %B or %M names its sender in handles[0] - from a client that has to
+ * be its own handle. Relayed ones were checked by the sender's node
+ */
+int notSender(Frame *f, Server *s, int clientSocket) {
+
+   char *own = NULL;
+
+   if(fromPeer(clientSocket))
+      return 0;
+   own = (char *)s->clients[connections[clientSocket]->slot].handle;
+   if(f->handle_lens[0] == strlen(own) && memcmp(f->handles[0], own, f->handle_lens[0]) == 0)
+      return 0;
+   fprintf(stderr, "%s sent %s as %.*s\n", own, f->flag == BROADCAST_FLAG ? "%B" : "%M",
+      f->handle_lens[0], f->handles[0]);
+   stats.malformed++;
+   return 1;
+}
+
+int filterBlocks(Frame *f, int clientSocket) {
+
+   const char *term = NULL;
+   uint64_t start, ns;
+   int action, k;
+
+   if(config.filter_path == NULL || fromPeer(clientSocket))
+      return 0;
+   start = nowNs();
+   action = filterScan(f->text, f->text_len, &term);
+   ns = nowNs() - start;
+   stats.filter_scans++;
+   stats.filter_bytes += f->text_len;
+   stats.filter_ns += ns;
+   if(ns > stats.filter_max_ns)
+      stats.filter_max_ns = ns;
+   for(k = 0; ns > 1 && k < FILTER_COST_BUCKETS - 1; ns >>= 1)
+      k++;
+   stats.filter_costs[k]++;
+   if(action == FILTER_PASS)
+      return 0;
+
+   fprintf(stderr, "content filter %s %s from %.*s: \"%s\"\n", action == FILTER_BLOCK ? "blocked" : "flagged",
+      f->flag == BROADCAST_FLAG ? "%B" : "%M", f->handle_lens[0], f->handles[0], term);
+   if(action == FILTER_FLAG) {
+      stats.filter_flagged++;
+      return 0;
+   }
+   stats.filter_blocked++;
+   sendEmpty(clientSocket, BLOCKED_FLAG);
+   return 1;
+}
+
+uint64_t nowNs() {
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+void printStats() {
+
+   int i;
+
+   printf("frames queued: %llu\n", (unsigned long long)stats.frames_queued);
+   printf("frames dropped: %llu (%llu bytes)\n",
+      (unsigned long long)stats.frames_dropped, (unsigned long long)stats.bytes_dropped);
+   printf("frames spilled: %llu (%llu bytes)\n",
+      (unsigned long long)stats.frames_spilled, (unsigned long long)stats.bytes_spilled);
+   printf("slow consumer disconnects: %llu\n", (unsigned long long)stats.slow_disconnects);
+   printf("send errors: %llu\n", (unsigned long long)stats.send_errors);
+   printf("rate limit pauses: %llu\n", (unsigned long long)stats.throttled);
+   printf("bulk frames deferred: %llu\n", (unsigned long long)stats.bulk_deferred);
+   printf("offline messages stored: %llu delivered: %llu\n",
+      (unsigned long long)stats.offline_stored, (unsigned long long)stats.offline_delivered);
+   printf("frames relayed to other nodes: %llu in %llu sends\n",
+      (unsigned long long)stats.peer_frames, (unsigned long long)stats.peer_batches);
+   printf("malformed frames discarded: %llu\n", (unsigned long long)stats.malformed);
+   printf("compressed frames received: %llu\n", (unsigned long long)stats.inflated);
+   printf("frames compressed: %llu, sent %llu times, %llu bytes saved\n",
+      (unsigned long long)stats.compressed, (unsigned long long)stats.compressed_sends,
+      (unsigned long long)stats.bytes_saved);
+   printf("TLS handshakes: %llu, failed %llu, kernel offload tx %llu rx %llu\n",
+      (unsigned long long)stats.tls_handshakes, (unsigned long long)stats.tls_failures,
+      (unsigned long long)stats.tls_kernel_tx, (unsigned long long)stats.tls_kernel_rx);
+   printf("broadcasts fanned out by %d workers: %llu (%llu sends)\n", fanoutPoolWorkers(),
+      (unsigned long long)stats.parallel_fanouts, (unsigned long long)stats.parallel_sends);
+   printf("memory:");
+   for(i = 0; i < MEM_KINDS; i++)
+      printf(" %s %zu", memKindName(i), memUsed(i));
+   printf("\nmemory total: %zu, peak %zu, limit %zu\n", memTotal(), memPeak(), memLimit());
+   printf("refused: %llu connections, %llu logins, %llu sessions, %llu broadcasts\n",
+      (unsigned long long)stats.accepts_refused, (unsigned long long)stats.logins_refused,
+      (unsigned long long)stats.sessions_refused, (unsigned long long)stats.broadcasts_refused);
+   printf("frames shed: %llu (%llu bytes), memory limit pauses: %llu, disconnects: %llu\n",
+      (unsigned long long)stats.frames_shed, (unsigned long long)stats.bytes_shed,
+      (unsigned long long)stats.mem_pauses, (unsigned long long)stats.mem_disconnects);
+   printPool(&connectionPool);
+   for(i = 0; i < CHUNK_CLASSES; i++)
+      printPool(chunkPool(i));
+   printf("heap allocations: %llu\n", (unsigned long long)heapAllocations());
+   printPlacement();
+   printFilter();
+   fflush(stdout);
+}
+
+void printPlacement() {
+
+   uint64_t spun = 0, slept = 0;
+
+   if(config.num_cpus > 0)
+      printf("event loop on cpu %d, node %d\n", config.cpus[0], affinityNode(config.cpus[0]));
+   else
+      printf("event loop on any cpu\n");
+   busyPollCounts(&spun, &slept);
+   printf("busy poll %d us: %llu polls answered spinning, %llu slept, %llu sockets not busy polled\n",
+      config.busy_poll, (unsigned long long)spun, (unsigned long long)slept,
+      (unsigned long long)stats.busy_poll_unset);
+}
+
+/* Per message cost of the content filter: mean, the bucket the 99th
+ * percentile falls in and the slowest
+ */
+void printFilter() {
+
+   FilterInfo info;
+   uint64_t seen = 0;
+   int k;
+
+   if(config.filter_path == NULL)
+      return;
+   filterInfo(&info);
+   printf("content filter: %u terms, %u states, %zu bytes, reloaded %llu times (%llu failed)\n",
+      info.terms, info.states, info.bytes, (unsigned long long)info.reloads,
+      (unsigned long long)info.reload_failures);
+   for(k = 0; k < FILTER_COST_BUCKETS - 1 && (seen += stats.filter_costs[k]) * 100 < stats.filter_scans * 99; k++)
+      ;
+   printf("content filter: %llu messages (%llu bytes) checked, %llu flagged, %llu blocked, "
+      "mean %llu ns, p99 under %llu ns, max %llu ns\n",
+      (unsigned long long)stats.filter_scans, (unsigned long long)stats.filter_bytes,
+      (unsigned long long)stats.filter_flagged, (unsigned long long)stats.filter_blocked,
+      (unsigned long long)(stats.filter_scans > 0 ? stats.filter_ns / stats.filter_scans : 0),
+      stats.filter_scans > 0 ? 2ull << k : 0, (unsigned long long)stats.filter_max_ns);
+}
+
+void printPool(SlabPool *p) {
+
+   static const char *pages[] = { "", ", huge pages", ", transparent huge pages" };
+
+   printf("pool %s: %zu in use (peak %zu) of %zu%s, %llu allocations, %llu slabs added\n",
+      p->name, p->in_use, p->peak, p->capacity, pages[p->huge],
+      (unsigned long long)p->allocs, (unsigned long long)p->grows);
+}
+
+// a finished TLS handshake, and what the kernel took over
+void countTls(int socketNum) {
+
+   int kernel = tlsKernel(socketNum);
+
+   stats.tls_handshakes++;
+   if(kernel > 0 && (kernel & TLS_KERNEL_TX))
+      stats.tls_kernel_tx++;
+   if(kernel > 0 && (kernel & TLS_KERNEL_RX))
+      stats.tls_kernel_rx++;
+}
+
+// Called if flag = 1 packet sent from client
+// check if handle exists in server table
+// respond with flag 2,3 on success/failure
+void ackNewClient(Frame *f, uint8_t *buf, Server *s, uint16_t pkt_len, int clientSocket) {
+
+   Handle handle;
+   uint8_t handle_len = f->handle_lens[0];
+   uint8_t reply[MAXBUF];
+   Frame r;
+   memcpy(handle.handle, f->handles[0], handle_len);
+   handle.handle[handle_len] = '\0'; // append null terminator to handle
+
+   // turned away while there's still room for the users already on
+   if(memPressure(loginCost(s)) != MEM_OK) {
+      printf("out of memory for %s, login refused\n", (char *)handle.handle);
+      stats.logins_refused++;
+      sendEmpty(clientSocket, SERVER_FULL_FLAG);
+      // closes once flag 28 is out
+      scheduleClose(connections[clientSocket],
+         outQueueEmpty(&connections[clientSocket]->out) ? 0 : LOGIN_TIMEOUT);
+      return;
+   }
+
+   // one the other nodes hold counts too
+   if(lookupClient(s, handle) < 0 && presenceOwner((char *)handle.handle) < 0) {
+      //handle not found
+      //add client to server
+      addNewClient(s, handle.handle, handle_len, clientSocket);
+      activateConnection(clientSocket, lookupClient(s, handle));
+      offlineRegisterHandle((char *)handle.handle);
+      if(!timerPending(&commitTimer) && offlineDirty())
+         timerAdd(&commitTimer, OFFLINE_COMMIT_INTERVAL);
+      announceHandle((char *)handle.handle, 1);
+      //send flag 2 (success), with the codec if one was offered - only
+      // deflate, and only with the same dictionary
+      frameInit(&r, GOOD_HANDLE_FLAG);
+      if(f->num_count == 2) {
+         if(config.compress && f->nums[0] == COMPRESS_DEFLATE && f->nums[1] == compressDictId())
+            connections[clientSocket]->codec = COMPRESS_DEFLATE;
+         frameNum(&r, connections[clientSocket]->codec);
+         frameNum(&r, compressDictId());
+      }
+      connSend(clientSocket, reply, frameEncode(reply, TO_CLIENT, &r), 0);
+      // then anything that arrived while they were away
+      if(offlinePending((char *)handle.handle))
+         timerAdd(&connections[clientSocket]->offline_timer, 0);
+   }
+   else {
+      //send flag 3 (failure: handle exists)
+      sendEmpty(clientSocket, HANDLE_EXISTS_FLAG);
+   }
+}
+
+//adds a new client to the server at the next available position
+//realloc the server if not enough room for new client
+// len without a null - the handle is copied and terminated
+void addNewClient(Server *s, uint8_t *handle, uint8_t len, int clientSocket) {
+
+   int i;
+   // check if need to increase server size
+   if(s->num_handles == s->num_allocations) {
+      // double allocation space ( * 2)
+      s->clients = srealloc(s->clients, sizeof(Handle) * s->num_allocations * 2);
+      s->socket_numbers = srealloc(s->socket_numbers, sizeof(int) * s->num_allocations * 2);
+      s->socket_status = srealloc(s->socket_status, sizeof(char) * s->num_allocations * 2);
+      s->sessions = srealloc(s->sessions, sizeof(Session *) * s->num_allocations * 2);
+      // the new half starts CLOSED, or stale bytes pass for open clients
+      memset(s->clients + s->num_allocations, 0, sizeof(Handle) * s->num_allocations);
+      memset(s->socket_numbers + s->num_allocations, 0, sizeof(int) * s->num_allocations);
+      memset(s->socket_status + s->num_allocations, CLOSED, s->num_allocations);
+      memset(s->sessions + s->num_allocations, 0, sizeof(Session *) * s->num_allocations);
+      memCharge(MEM_HANDLES, SLOT_BYTES * s->num_allocations);
+      s->num_allocations *= 2;
+   }
+
+   // Ready to actualy add client to server
+   // loop through socket status to find first available socket CLOSED (0)
+   for(i = 0; i < s->num_allocations; i++) {
+      if(s->socket_status[i] == CLOSED) { //available to add
+         memcpy(s->clients[i].handle, handle, sizeof(char)*len);
+         s->clients[i].handle[len] = '\0'; // the slot may have held a longer one
+         //printf("added %s to server client list", s->clients[i].handle);
+         s->socket_numbers[i] = clientSocket;
+         s->socket_status[i] = OPEN;
+         s->num_handles++;
+         //printf(" with socket %d NumClients = %d\n", clientSocket, s->num_handles);
+         break;
+      }
+   }
+}
+
+// looks up if the given handle name is in the server database
+// if so, return index in server table [0,num_handles-1]
+// else return -1 if not found
+// assume handle null terminated here
+int lookupClient(Server *s, Handle handle) {
+
+   int i;
+   //loop allocations incase client was removed
+   for(i = 0; i < s->num_allocations; i++) {
+      if(strcmp((char *)handle.handle, (char *)s->clients[i].handle) == 0) { // equal - handle exists
+         if(s->socket_status[i] == OPEN) {
+            //make sure open handle (closed handles aren't nulled out)
+            //printf("Found matching client at index: %d!\n", i);
+            return i;
+         }
+      }
+   }
+   // handle doesnt exist
+   return -1;
+}
+
+void removeClient(int clientSocket, Server *s) {
+	//printf("Client on socket %d terminted\n", clientSocket);
+	Peer *p = peerBySocket(clientSocket);
+	if (p != NULL) {
+		printf("link to node %u closed\n", p->id);
+		peerDown(p);
+	}
+	// a resumable session keeps the handle for its client to come back to
+	if (clientSocket < connectionTableSize && connections[clientSocket] != NULL
+			&& connections[clientSocket]->session != NULL)
+		detachSession(connections[clientSocket]);
+	removeFromPollSet(clientSocket);
+   removeClientFromServer(clientSocket, s);
+   freeConnection(clientSocket);
+   transportClose(clientSocket);
+	close(clientSocket);
+}
+
+/* helper function for removeClient - updates server */
+void removeClientFromServer(int clientSocket, Server *s) {
+   int i;
+   for(i = 0; i < s->num_allocations; i++) {
+      // closed slots keep their old socket number - skip them
+      if(s->socket_numbers[i] == clientSocket && s->socket_status[i] == OPEN)
+         closeSlot(s, i);
+   }
+}
+
+// the handle in slot logs out, ending its session if it had one
+void closeSlot(Server *s, int slot) {
+
+   if(s->sessions[slot] != NULL)
+      endSession(s->sessions[slot]);
+   s->socket_status[slot] = CLOSED;
+   s->num_handles--;
+   announceHandle((char *)s->clients[slot].handle, 0);
+}
+
+// Checks args, fills in config and returns port number
+int checkArgs(int argc, char *argv[]) {
+	int portNumber = 0;
+	int opt = 0;
+	FilterInfo info;
+
+	config.slow_policy = SLOW_DROP_OLDEST;
+	config.out_limit = DEFAULT_OUT_LIMIT;
+	config.slow_grace = DEFAULT_SLOW_GRACE;
+	config.spill_dir = DEFAULT_SPILL_DIR;
+	config.frame_rate = DEFAULT_FRAME_RATE;
+	config.byte_rate = DEFAULT_BYTE_RATE;
+	config.offline_dir = NULL;
+	config.index_dir = NULL;
+	config.node_id = -1;
+	config.node_key = NULL;
+	config.unix_path = NULL;
+	config.upgrade_path = NULL;
+	config.session_grace = DEFAULT_SESSION_GRACE;
+	config.compress = 1;
+	config.tls_cert = NULL;
+	config.tls_key = NULL;
+	config.fanout_workers = 0;
+	config.fanout_min = DEFAULT_FANOUT_MIN;
+	config.mem_limit = 0;
+	config.conn_memory = 0;
+	config.pool_connections = DEFAULT_POOL_CONNECTIONS;
+	config.pool_frames = DEFAULT_POOL_FRAMES;
+	config.huge_pages = 0;
+	config.num_cpus = 0;
+	config.busy_poll = 0;
+	config.filter_path = NULL;
+
+	while ((opt = getopt(argc, argv, "p:q:g:D:r:R:O:I:n:k:P:U:s:S:z:C:K:W:F:M:m:N:B:Hc:b:f:")) != -1)
+	{
+		switch (opt)
+		{
+			case 'p':
+				if (strcmp(optarg, "drop") == 0)
+					config.slow_policy = SLOW_DROP_OLDEST;
+				else if (strcmp(optarg, "disconnect") == 0)
+					config.slow_policy = SLOW_DISCONNECT;
+				else if (strcmp(optarg, "spill") == 0)
+					config.slow_policy = SLOW_SPILL;
+				else
+					usage(argv[0]);
+				break;
+			case 'q':
+				config.out_limit = atoi(optarg);
+				break;
+			case 'g':
+				config.slow_grace = atoi(optarg) * 1000;
+				break;
+			case 'D':
+				config.spill_dir = optarg;
+				break;
+			case 'r':
+				config.frame_rate = atoi(optarg);
+				break;
+			case 'R':
+				config.byte_rate = atoi(optarg);
+				break;
+			case 'O':
+				config.offline_dir = optarg;
+				break;
+			case 'I':
+				config.index_dir = optarg;
+				break;
+			case 'n':
+				config.node_id = atoi(optarg);
+				if (config.node_id < 0 || config.node_id > UINT16_MAX)
+					usage(argv[0]);
+				break;
+			case 'k':
+				config.node_key = optarg;
+				break;
+			case 's':
+				config.unix_path = optarg;
+				break;
+			case 'U':
+				config.upgrade_path = optarg;
+				break;
+			case 'S':
+				config.session_grace = atoi(optarg) * 1000;
+				break;
+			case 'z':
+				if (strcmp(optarg, "off") == 0)
+					config.compress = 0;
+				else if (compressLoadDict(optarg) < 0)
+				{
+					perror(optarg);
+					usage(argv[0]);
+				}
+				break;
+			case 'C':
+				config.tls_cert = optarg;
+				break;
+			case 'K':
+				config.tls_key = optarg;
+				break;
+			case 'W':
+				config.fanout_workers = atoi(optarg);
+				if (config.fanout_workers < 0 || config.fanout_workers > FANOUT_MAX_WORKERS)
+					usage(argv[0]);
+				break;
+			case 'F':
+				config.fanout_min = atoi(optarg);
+				break;
+			case 'M':
+				config.mem_limit = strtoull(optarg, NULL, 10) << 20;
+				break;
+			case 'm':
+				config.conn_memory = strtoull(optarg, NULL, 10) << 10;
+				break;
+			case 'N':
+				config.pool_connections = atoi(optarg);
+				if (config.pool_connections < 0)
+					usage(argv[0]);
+				break;
+			case 'B':
+				config.pool_frames = atoi(optarg);
+				if (config.pool_frames < 0)
+					usage(argv[0]);
+				break;
+			case 'H':
+				config.huge_pages = 1;
+				break;
+			case 'c':
+				if ((config.num_cpus = affinityParse(optarg, config.cpus, AFFINITY_MAX_CPUS)) <= 0)
+					usage(argv[0]);
+				break;
+			case 'b':
+				config.busy_poll = atoi(optarg);
+				if (config.busy_poll < 0)
+					usage(argv[0]);
+				break;
+			case 'f':
+				config.filter_path = optarg;
+				break;
+			case 'P':
+				if (addPeer(optarg) < 0)
+				{
+					fprintf(stderr, "bad peer %s, expected id@host:port\n", optarg);
+					usage(argv[0]);
+				}
+				break;
+			default:
+				usage(argv[0]);
+		}
+	}
+
+	if (argc - optind > 1 || (numPeers() > 0 && config.node_id < 0))
+		usage(argv[0]);
+	if (numPeers() > 0 && config.node_key == NULL)
+	{
+		fprintf(stderr, "-P needs the key file the nodes share (-k)\n");
+		usage(argv[0]);
+	}
+	if (config.node_key != NULL && federationKey(config.node_key) < 0)
+		exit(EXIT_FAILURE);
+	if (config.tls_cert != NULL || config.tls_key != NULL)
+	{
+		// the key may be in the certificate file; links to other nodes
+		// trust the same certificate (or the CA in that file)
+		if (config.tls_cert == NULL)
+			usage(argv[0]);
+		if (tlsServerInit(config.tls_cert, config.tls_key != NULL ? config.tls_key : config.tls_cert) < 0
+			|| (numPeers() > 0 && tlsClientInit(config.tls_cert) < 0))
+			exit(EXIT_FAILURE);
+	}
+
+	memSetLimit(config.mem_limit);
+	if (config.filter_path != NULL)
+	{
+		if (filterLoad(config.filter_path) < 0)
+			exit(EXIT_FAILURE);
+		filterInfo(&info);
+		memCharge(MEM_FILTER, info.bytes);
+	}
+
+	if (argc - optind == 1)
+	{
+		portNumber = atoi(argv[optind]);
+	}
+
+	return portNumber;
+}
+
+void usage(char *prog) {
+	fprintf(stderr, "Usage %s [-p drop|disconnect|spill] [-q queue-bytes] "
+		"[-g grace-seconds] [-D spill-dir] [-r packets-per-sec] [-R bytes-per-sec] "
+		"[-O offline-dir] [-I index-dir] [-n node-id [-k key-file -P id@host:port ...]] [-s unix-socket] [-U upgrade-socket] [-S resume-seconds] [-z dict-file|off] "
+		"[-C tls-cert [-K tls-key]] [-W fanout-workers [-F fanout-min-handles]] "
+		"[-M memory-megabytes] [-m connection-kilobytes] [-N connections] [-B frame-buffers] [-H] "
+		"[-c cpu-list] [-b busy-poll-microseconds] [-f filter-terms] "
+		"[optional port number]\n", prog);
+	exit(EXIT_FAILURE);
 }
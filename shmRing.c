@@ -0,0 +1,428 @@
+/* Shared memory transport.
+ * Each side's eventfd is kept readable while it has something to do (a
+ * frame to read, or room for output it was waiting on), so it works
+ * with the level triggered poll loops. It is only cleared once a side
+ * finds nothing to do, and rechecked after clearing in case the other
+ * side signalled in between. The server never blocks on a ring; the
+ * client blocks like it would on its socket, and only writes whole
+ * frames so the server never sees part of one.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+
+#include "shmRing.h"
+#include "packets.h"
+#include "pollLib.h"
+
+#define SHM_FDS 3 // memfd, client eventfd, server eventfd
+
+typedef struct {
+	Transport transport; // registered with setTransport()
+	ShmRegion *region;
+	ShmRing *rx; // the ring this side reads
+	ShmRing *tx;
+	int socket;
+	int memfd;
+	int wake; // this side's eventfd
+	int peer_wake;
+	int server; // never blocks
+	int blocked; // last send didn't fit, waiting for room
+} ShmConn;
+
+static ssize_t shmRecv(void *ctx, void *buf, size_t len, int flags);
+static ssize_t shmSendmsg(void *ctx, const struct msghdr *msg, int flags);
+static short shmRevents(void *ctx, short events);
+static void shmClose(void *ctx);
+static ShmConn *shmAttach(int socketNum, int memfd, int wake, int peerWake, int server);
+static int shmSetupReply(int socketNum, int *fds, int numFds);
+
+static void signalFd(int fd)
+{
+	uint64_t one = 1;
+	if (write(fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+		perror("eventfd write");
+}
+
+static void drainFd(int fd)
+{
+	uint64_t count = 0;
+	if (read(fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+		perror("eventfd read");
+}
+
+static uint32_t ringUsed(ShmRing *r)
+{
+	return atomic_load_explicit(&r->head, memory_order_acquire)
+		- atomic_load_explicit(&r->tail, memory_order_acquire);
+}
+
+static uint32_t ringFree(ShmRing *r)
+{
+	return SHM_RING_BYTES - ringUsed(r);
+}
+
+/* Appends up to len bytes, waking the consumer if the ring was empty */
+static uint32_t ringWrite(ShmRing *r, int peerWake, const uint8_t *src, uint32_t len)
+{
+	uint32_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+	uint32_t off = head & (SHM_RING_BYTES - 1);
+	uint32_t first = 0;
+
+	if (len > ringFree(r))
+		len = ringFree(r);
+	if (len == 0)
+		return 0;
+	first = len < SHM_RING_BYTES - off ? len : SHM_RING_BYTES - off;
+	memcpy(r->data + off, src, first);
+	memcpy(r->data, src + first, len - first);
+	atomic_store_explicit(&r->head, head + len, memory_order_release);
+
+	// the consumer had read everything before this - it may be asleep
+	atomic_thread_fence(memory_order_seq_cst);
+	if (atomic_load_explicit(&r->tail, memory_order_relaxed) == head)
+		signalFd(peerWake);
+	return len;
+}
+
+/* Takes up to len bytes, waking the producer if it was waiting for room */
+static uint32_t ringRead(ShmRing *r, int peerWake, uint8_t *dst, uint32_t len)
+{
+	uint32_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+	uint32_t off = tail & (SHM_RING_BYTES - 1);
+	uint32_t first = 0;
+
+	if (len > ringUsed(r))
+		len = ringUsed(r);
+	if (len == 0)
+		return 0;
+	first = len < SHM_RING_BYTES - off ? len : SHM_RING_BYTES - off;
+	memcpy(dst, r->data + off, first);
+	memcpy(dst + first, r->data, len - first);
+	atomic_store_explicit(&r->tail, tail + len, memory_order_release);
+
+	atomic_thread_fence(memory_order_seq_cst);
+	if (atomic_load_explicit(&r->waiting, memory_order_relaxed))
+	{
+		atomic_store_explicit(&r->waiting, 0, memory_order_relaxed);
+		signalFd(peerWake);
+	}
+	return len;
+}
+
+static int shmPending(ShmConn *c)
+{
+	return ringUsed(c->rx) > 0 || (c->blocked && ringFree(c->tx) > 0)
+		|| atomic_load(&c->region->closed);
+}
+
+/* Leaves the eventfd readable exactly when there's something to do.
+ * drained = it was cleared by a blocking wait since the last call
+ */
+static void shmSettle(ShmConn *c, int drained)
+{
+	if (shmPending(c))
+	{
+		if (drained)
+			signalFd(c->wake);
+		return;
+	}
+	drainFd(c->wake);
+	atomic_thread_fence(memory_order_seq_cst);
+	if (shmPending(c))
+		signalFd(c->wake);
+}
+
+/* Blocks (client only) until woken. -1 once the server has gone */
+static int shmWait(ShmConn *c)
+{
+	struct pollfd pfd;
+
+	if (atomic_load(&c->region->closed))
+		return -1;
+	pfd.fd = c->wake;
+	pfd.events = POLLIN;
+	while (poll(&pfd, 1, -1) < 0)
+	{
+		if (errno != EINTR)
+		{
+			perror("shm poll");
+			return -1;
+		}
+	}
+	drainFd(c->wake);
+	return 0;
+}
+
+static ssize_t shmRecv(void *ctx, void *buf, size_t len, int flags)
+{
+	ShmConn *c = ctx;
+	size_t got = 0;
+	int drained = 0;
+
+	while (1)
+	{
+		got += ringRead(c->rx, c->peer_wake, (uint8_t *)buf + got, len - got);
+		if (got == len || (got > 0 && !(flags & MSG_WAITALL)))
+			break;
+		atomic_thread_fence(memory_order_seq_cst);
+		if (ringUsed(c->rx) > 0)
+			continue;
+		if (atomic_load(&c->region->closed))
+			break; // like a closed socket: short read, then 0
+		if (c->server || (flags & MSG_DONTWAIT))
+		{
+			if (got > 0)
+				break;
+			shmSettle(c, drained);
+			errno = EAGAIN;
+			return -1;
+		}
+		if (shmWait(c) < 0)
+			break;
+		drained = 1;
+	}
+	shmSettle(c, drained);
+	return got;
+}
+
+static ssize_t shmSendmsg(void *ctx, const struct msghdr *msg, int flags)
+{
+	ShmConn *c = ctx;
+	size_t total = 0, i = 0;
+	uint32_t n = 0, len = 0;
+	int drained = 0;
+
+	if (atomic_load(&c->region->closed))
+	{
+		errno = EPIPE;
+		return -1;
+	}
+
+	for (i = 0; i < msg->msg_iovlen; i++)
+		total += msg->msg_iov[i].iov_len;
+
+	// the client waits until the whole frame fits
+	while (!c->server && ringFree(c->tx) < total)
+	{
+		atomic_store(&c->tx->waiting, 1);
+		atomic_thread_fence(memory_order_seq_cst);
+		if (ringFree(c->tx) >= total)
+			break;
+		if (shmWait(c) < 0)
+		{
+			errno = EPIPE;
+			return -1;
+		}
+		drained = 1;
+	}
+
+	total = 0;
+	for (i = 0; i < msg->msg_iovlen; i++)
+	{
+		len = msg->msg_iov[i].iov_len;
+		n = ringWrite(c->tx, c->peer_wake, msg->msg_iov[i].iov_base, len);
+		total += n;
+		if (n < len)
+			break;
+	}
+
+	// the server takes what fits and is woken when there's room for more
+	c->blocked = i < msg->msg_iovlen;
+	if (c->blocked)
+	{
+		atomic_store(&c->tx->waiting, 1);
+		atomic_thread_fence(memory_order_seq_cst);
+		if (ringFree(c->tx) > 0)
+			signalFd(c->wake); // the reader caught up meanwhile
+	}
+	shmSettle(c, drained);
+	if (total == 0 && c->blocked)
+	{
+		errno = EAGAIN;
+		return -1;
+	}
+	return total;
+}
+
+static short shmRevents(void *ctx, short events)
+{
+	ShmConn *c = ctx;
+	short ready = 0;
+
+	if (ringUsed(c->rx) > 0 || atomic_load(&c->region->closed))
+		ready |= POLLIN;
+	if (c->blocked && ringFree(c->tx) > 0)
+		ready |= POLLOUT;
+	if (ready == 0)
+		shmSettle(c, 0); // woken for something already dealt with
+	return ready & events;
+}
+
+static void shmClose(void *ctx)
+{
+	ShmConn *c = ctx;
+
+	atomic_store(&c->region->closed, 1);
+	signalFd(c->peer_wake);
+	munmap(c->region, sizeof(ShmRegion));
+	close(c->memfd);
+	close(c->wake);
+	close(c->peer_wake);
+	free(c);
+}
+
+static ShmConn *shmAttach(int socketNum, int memfd, int wake, int peerWake, int server)
+{
+	ShmConn *c = NULL;
+	void *region = mmap(NULL, sizeof(ShmRegion), PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+
+	if (region == MAP_FAILED)
+	{
+		perror("shm mmap");
+		return NULL;
+	}
+	c = sCalloc(1, sizeof(ShmConn));
+	c->region = region;
+	c->rx = server ? &c->region->up : &c->region->down;
+	c->tx = server ? &c->region->down : &c->region->up;
+	c->socket = socketNum;
+	c->memfd = memfd;
+	c->wake = wake;
+	c->peer_wake = peerWake;
+	c->server = server;
+	c->transport.recv = shmRecv;
+	c->transport.sendmsg = shmSendmsg;
+	c->transport.revents = shmRevents;
+	c->transport.close = shmClose;
+	c->transport.wake_fd = wake;
+	c->transport.ctx = c;
+	setTransport(socketNum, &c->transport);
+	return c;
+}
+
+/* Flag 24 with fds attached (none = refused) */
+static int shmSetupReply(int socketNum, int *fds, int numFds)
+{
+	uint8_t frame[MAXBUF];
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg = NULL;
+	union {
+		char buf[CMSG_SPACE(sizeof(int) * SHM_FDS)];
+		struct cmsghdr align;
+	} control;
+
+	makeChatHeader(frame, SHM_SETUP_FLAG, sizeof(ChatHeader));
+	iov.iov_base = frame;
+	iov.iov_len = sizeof(ChatHeader);
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	if (numFds > 0)
+	{
+		memset(&control, 0, sizeof(control));
+		msg.msg_control = control.buf;
+		msg.msg_controllen = CMSG_SPACE(sizeof(int) * numFds);
+		cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int) * numFds);
+		memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * numFds);
+	}
+	if (sendmsg(socketNum, &msg, MSG_NOSIGNAL) < (ssize_t)sizeof(ChatHeader))
+	{
+		perror("shm setup sendmsg");
+		return -1;
+	}
+	return 0;
+}
+
+/* Server side of SHM_SETUP_FLAG: creates the region and eventfds, sends
+ * them to the client and switches the socket over. 0 on success, -1 if
+ * refused (the client carries on over the socket)
+ */
+int shmAccept(int socketNum)
+{
+	struct sockaddr_storage addr;
+	socklen_t addrLen = sizeof(addr);
+	int fds[SHM_FDS] = {-1, -1, -1}; // memfd, client wake, server wake
+	int i;
+
+	// the eventfds and memfd only make sense to a process on this host;
+	// the memfd is sealed at its size, or the client could shrink it
+	// under the server's mapping (SIGBUS)
+	if (getsockname(socketNum, (struct sockaddr *)&addr, &addrLen) < 0 || addr.ss_family != AF_UNIX
+		|| (fds[0] = memfd_create("chat-shm", MFD_CLOEXEC | MFD_ALLOW_SEALING)) < 0
+		|| ftruncate(fds[0], sizeof(ShmRegion)) < 0
+		|| fcntl(fds[0], F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) < 0
+		|| (fds[1] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0
+		|| (fds[2] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0
+		|| shmSetupReply(socketNum, fds, SHM_FDS) < 0
+		|| shmAttach(socketNum, fds[0], fds[2], fds[1], 1) == NULL)
+	{
+		for (i = 0; i < SHM_FDS; i++)
+			if (fds[i] >= 0)
+				close(fds[i]);
+		shmSetupReply(socketNum, NULL, 0);
+		return -1;
+	}
+	return 0;
+}
+
+/* Client side: asks the server to move this Unix socket connection to
+ * shared memory, before logging in. 0 if it did, -1 if it stays on the
+ * socket
+ */
+int shmConnect(int socketNum)
+{
+	uint8_t frame[MAXBUF];
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg = NULL;
+	union {
+		char buf[CMSG_SPACE(sizeof(int) * SHM_FDS)];
+		struct cmsghdr align;
+	} control;
+	int fds[SHM_FDS];
+	int numFds = 0;
+
+	makeChatHeader(frame, SHM_SETUP_FLAG, sizeof(ChatHeader));
+	sendPacket(socketNum, frame, sizeof(ChatHeader));
+
+	iov.iov_base = frame;
+	iov.iov_len = sizeof(ChatHeader);
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = sizeof(control.buf);
+	if (recvmsg(socketNum, &msg, MSG_WAITALL | MSG_CMSG_CLOEXEC) < (ssize_t)sizeof(ChatHeader)
+		|| frame[PKT_LEN] != SHM_SETUP_FLAG)
+	{
+		fprintf(stderr, "server doesn't support shared memory connections\n");
+		exit(EXIT_FAILURE);
+	}
+	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg))
+	{
+		if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+		{
+			numFds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+			if (numFds > SHM_FDS)
+				numFds = SHM_FDS; // all fds has room for
+			memcpy(fds, CMSG_DATA(cmsg), sizeof(int) * numFds);
+		}
+	}
+	if (numFds != SHM_FDS || shmAttach(socketNum, fds[0], fds[1], fds[2], 0) == NULL)
+		return -1;
+	return 0;
+}
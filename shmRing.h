@@ -0,0 +1,42 @@
+/* Shared memory transport for clients on the server's host.
+ * A client connected to the Unix socket (-s) can ask for its frames to
+ * go through a memfd mapped by both processes instead: two single
+ * producer, single consumer byte rings, one each way. Each side has an
+ * eventfd the other writes only when a ring it reads goes from empty to
+ * non-empty, or when it was waiting for space in a ring it writes, so a
+ * busy connection moves frames without system calls.
+ *
+ * The socket stays open as the connection's identity and carries the
+ * setup exchange (SHM_SETUP_FLAG with the memfd and both eventfds
+ * attached); after that it is plugged into packets.c as the socket's
+ * transport, so the framing and event loops are unchanged.
+ */
+
+#ifndef SHMRING_H
+#define SHMRING_H
+
+#include <stdint.h>
+#include <stdatomic.h>
+
+#define SHM_RING_BYTES 65536 // per direction, a power of two
+#define SHM_CACHE_LINE 64
+
+typedef struct {
+	_Atomic uint32_t head; // producer's position, free running
+	uint8_t pad1[SHM_CACHE_LINE - sizeof(uint32_t)];
+	_Atomic uint32_t tail; // consumer's position
+	_Atomic uint32_t waiting; // producer found the ring full, wants a wakeup
+	uint8_t pad2[SHM_CACHE_LINE - 2 * sizeof(uint32_t)];
+	uint8_t data[SHM_RING_BYTES];
+} ShmRing;
+
+typedef struct {
+	ShmRing up; // client -> server
+	ShmRing down; // server -> client
+	_Atomic uint32_t closed; // either side has gone
+} ShmRegion;
+
+int shmAccept(int socketNum);
+int shmConnect(int socketNum);
+
+#endif
@@ -0,0 +1,172 @@
+/* Slab pools, see slabPool.h.
+ * Slabs are anonymous mappings carved into objects threaded onto the
+ * free list, newest slab first. Nothing is ever unmapped: what a pool
+ * needed once it is likely to need again.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "slabPool.h"
+#include "pollLib.h"
+
+static int useHugePages = 0;
+static int prefault = 0; // MAP_POPULATE
+static SlabPool chunks[CHUNK_CLASSES];
+static const size_t chunkSizes[CHUNK_CLASSES] = CHUNK_SIZES;
+
+static void addSlab(SlabPool *p, size_t count);
+static void *mapSlab(size_t *bytes, uint8_t *huge);
+static int chunkClass(size_t size);
+
+/* Whether slabs mapped from now on try huge pages (-H) */
+void slabUseHugePages(int enable)
+{
+	useHugePages = enable;
+}
+
+/* Whether slabs mapped from now on are faulted in straight away, by
+ * (and so on the NUMA node of) the thread mapping them, instead of as
+ * the message path first touches them
+ */
+void slabPrefault(int enable)
+{
+	prefault = enable ? MAP_POPULATE : 0;
+}
+
+/* Sets up p for objects of objectSize and maps room for capacity of them
+ * (none yet if 0, the first poolAlloc() maps a slab)
+ */
+void poolInit(SlabPool *p, const char *name, size_t objectSize, size_t capacity)
+{
+	memset(p, 0, sizeof(SlabPool));
+	p->name = name;
+	if (objectSize < sizeof(void *))
+		objectSize = sizeof(void *);
+	p->object_size = (objectSize + SLAB_ALIGN - 1) / SLAB_ALIGN * SLAB_ALIGN;
+	if (capacity > 0)
+		addSlab(p, capacity);
+	p->grows = 0;
+}
+
+void *poolAlloc(SlabPool *p)
+{
+	void *object = NULL;
+
+	if (p->free_list == NULL)
+		addSlab(p, SLAB_GROW_BYTES / p->object_size > 0 ? SLAB_GROW_BYTES / p->object_size : 1);
+	object = p->free_list;
+	p->free_list = *(void **) object;
+	p->allocs++;
+	if (++p->in_use > p->peak)
+		p->peak = p->in_use;
+	return object;
+}
+
+void poolFree(SlabPool *p, void *object)
+{
+	*(void **) object = p->free_list;
+	p->free_list = object;
+	p->in_use--;
+}
+
+/* Preallocates capacity chunks of the smallest class, half as many of
+ * the next, and so on
+ */
+void chunkSetup(size_t capacity)
+{
+	static const char *names[CHUNK_CLASSES] = { "chunks 256", "chunks 512", "chunks 2048" };
+	int i;
+
+	for (i = 0; i < CHUNK_CLASSES; i++)
+		poolInit(&chunks[i], names[i], chunkSizes[i], capacity >> i);
+}
+
+/* A chunk of at least size bytes, from the heap if no class is that big */
+void *chunkAlloc(size_t size)
+{
+	int cls = chunkClass(size);
+
+	if (cls < 0)
+		return srealloc(NULL, size);
+	if (chunks[cls].object_size == 0)
+		chunkSetup(0); // a client that never set up its own
+	return poolAlloc(&chunks[cls]);
+}
+
+/* size as given to chunkAlloc() */
+void chunkFree(void *chunk, size_t size)
+{
+	int cls = chunkClass(size);
+
+	if (cls < 0)
+		free(chunk);
+	else
+		poolFree(&chunks[cls], chunk);
+}
+
+SlabPool *chunkPool(int cls)
+{
+	return &chunks[cls];
+}
+
+static int chunkClass(size_t size)
+{
+	int i;
+
+	for (i = 0; i < CHUNK_CLASSES; i++)
+		if (size <= chunkSizes[i])
+			return i;
+	return -1;
+}
+
+/* Maps room for at least count more objects and frees them all onto p */
+static void addSlab(SlabPool *p, size_t count)
+{
+	size_t bytes = count * p->object_size;
+	uint8_t huge = SLAB_PAGES_NORMAL;
+	uint8_t *slab = mapSlab(&bytes, &huge);
+	size_t i;
+
+	if (p->capacity == 0)
+		p->huge = huge;
+	count = bytes / p->object_size; // the mapping may be larger
+	for (i = count; i-- > 0;)
+	{
+		*(void **) (slab + i * p->object_size) = p->free_list;
+		p->free_list = slab + i * p->object_size;
+	}
+	p->capacity += count;
+	p->grows++;
+}
+
+/* bytes is rounded up to what was mapped */
+static void *mapSlab(size_t *bytes, uint8_t *huge)
+{
+	void *slab = MAP_FAILED;
+	size_t hugeBytes = (*bytes + SLAB_HUGE_PAGE - 1) / SLAB_HUGE_PAGE * SLAB_HUGE_PAGE;
+
+	if (useHugePages)
+	{
+		slab = mmap(NULL, hugeBytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | prefault, -1, 0);
+		if (slab != MAP_FAILED)
+		{
+			*bytes = hugeBytes;
+			*huge = SLAB_PAGES_HUGE;
+			return slab;
+		}
+		*bytes = hugeBytes; // whole huge pages, so transparent ones can back it
+	}
+	else
+		*bytes = (*bytes + SLAB_PAGE - 1) / SLAB_PAGE * SLAB_PAGE;
+	if ((slab = mmap(NULL, *bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | prefault, -1, 0)) == MAP_FAILED)
+	{
+		perror("mmap slab");
+		exit(-1);
+	}
+	if (useHugePages && madvise(slab, *bytes, MADV_HUGEPAGE) == 0)
+		*huge = SLAB_PAGES_ADVISED;
+	return slab;
+}
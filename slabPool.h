@@ -0,0 +1,57 @@
+/* Slab pools.
+ * A pool hands out objects of one size from slabs it maps up front,
+ * sized for the capacity it is set up with, and takes them back onto a
+ * free list. Once the server is up, taking and returning an object is
+ * a pointer swap: no malloc, no lock (pools are only used by the event
+ * loop thread). A pool that runs out maps another slab, which the
+ * counters show, and keeps it.
+ *
+ * Frame chunks are pools in a few size classes, for frames that
+ * outlive the handler that read or built them (queued input and
+ * output). Their users pass the size back when freeing.
+ */
+
+#ifndef SLABPOOL_H
+#define SLABPOOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SLAB_ALIGN 16
+#define SLAB_GROW_BYTES 65536 // mapped at a time once a pool runs out
+#define SLAB_PAGE 4096
+#define SLAB_HUGE_PAGE 2097152
+
+/* frame chunk classes, each preallocated with half as many as the one before */
+#define CHUNK_CLASSES 3
+#define CHUNK_SIZES { 256, 512, 2048 } // the last holds any frame (MAXBUF) with its header
+
+/* SlabPool.huge */
+#define SLAB_PAGES_NORMAL 0
+#define SLAB_PAGES_HUGE 1 // MAP_HUGETLB
+#define SLAB_PAGES_ADVISED 2 // no huge pages reserved - transparent ones asked for instead
+
+typedef struct {
+	const char *name;
+	size_t object_size; // rounded up to SLAB_ALIGN, 0 until poolInit()
+	void *free_list; // each free object starts with the next one
+	size_t capacity; // objects in all slabs
+	size_t in_use;
+	size_t peak;
+	uint64_t allocs;
+	uint64_t grows; // slabs mapped after poolInit()
+	uint8_t huge; // SLAB_PAGES_* of the first slab
+} SlabPool;
+
+void slabUseHugePages(int enable);
+void slabPrefault(int enable);
+void poolInit(SlabPool *p, const char *name, size_t objectSize, size_t capacity);
+void *poolAlloc(SlabPool *p);
+void poolFree(SlabPool *p, void *object);
+
+void chunkSetup(size_t capacity); // before the first chunkAlloc(), if at all
+void *chunkAlloc(size_t size);
+void chunkFree(void *chunk, size_t size);
+SlabPool *chunkPool(int cls);
+
+#endif
@@ -0,0 +1,241 @@
+/* Hierarchical timer wheel for the server event loop.
+ * Level 0 holds timers due within the next 64 ticks, each higher level
+ * covers 64 times the range of the one below it. When level 0 wraps
+ * the matching slot of the next level is cascaded down, so a timer is
+ * touched at most once per level before it fires.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "timerWheel.h"
+#include "pollLib.h"
+
+#define TIMER_LEVEL_MASK (TIMER_LEVEL_SIZE - 1)
+#define TIMER_MAX_TICKS ((1ULL << (TIMER_LEVEL_BITS * TIMER_LEVELS)) - 1)
+
+// Timer wheel global variables (slot heads are circular list sentinels)
+static Timer wheel[TIMER_LEVELS][TIMER_LEVEL_SIZE];
+static uint64_t currentTick = 0;
+static int numTimers = 0;
+
+static void placeTimer(Timer *t);
+static void cascade(int level);
+static void runTick();
+
+void setupTimerWheel()
+{
+	int level, slot;
+	for (level = 0; level < TIMER_LEVELS; level++)
+	{
+		for (slot = 0; slot < TIMER_LEVEL_SIZE; slot++)
+		{
+			wheel[level][slot].next = &wheel[level][slot];
+			wheel[level][slot].prev = &wheel[level][slot];
+		}
+	}
+	currentTick = timerNowMs() / TIMER_TICK_MS;
+	numTimers = 0;
+}
+
+/* milliseconds from a monotonic clock */
+uint64_t timerNowMs()
+{
+	struct timespec ts;
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) < 0)
+	{
+		perror("clock_gettime");
+		exit(-1);
+	}
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void timerInit(Timer *t, TimerCallback callback, void *arg)
+{
+	t->next = NULL;
+	t->prev = NULL;
+	t->expires = 0;
+	t->callback = callback;
+	t->arg = arg;
+}
+
+/* (re)arms the timer to fire timeInMilliSeconds from now */
+void timerAdd(Timer *t, int timeInMilliSeconds)
+{
+	uint64_t ticks = (timeInMilliSeconds + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+	uint64_t now = timerNowMs() / TIMER_TICK_MS;
+
+	if (timerPending(t))
+		timerCancel(t);
+
+	if (ticks == 0)
+		ticks = 1;
+	if (now < currentTick)
+		now = currentTick;
+
+	t->expires = now + ticks;
+	placeTimer(t);
+	numTimers++;
+}
+
+void timerCancel(Timer *t)
+{
+	if (!timerPending(t))
+		return;
+
+	t->prev->next = t->next;
+	t->next->prev = t->prev;
+	t->next = NULL;
+	t->prev = NULL;
+	numTimers--;
+}
+
+int timerPending(Timer *t)
+{
+	return t->next != NULL;
+}
+
+/* ms until t fires, 0 if it isn't armed (or is already due) */
+int timerRemaining(Timer *t)
+{
+	uint64_t due = t->expires * TIMER_TICK_MS;
+	uint64_t now = timerNowMs();
+
+	if (!timerPending(t) || due <= now)
+		return 0;
+	return due - now;
+}
+
+/* Returns how long poll() may sleep before the next timer is due,
+ * or POLL_WAIT_FOREVER if no timers are armed.
+ * Only level 0 is scanned: anything in a higher level can't be due
+ * before level 0 wraps, so that bounds the wait.
+ */
+int timerNextTimeout()
+{
+	int index = currentTick & TIMER_LEVEL_MASK;
+	int ticks = 0;
+	int64_t timeout = 0;
+
+	if (numTimers == 0)
+		return POLL_WAIT_FOREVER;
+
+	for (ticks = 0; index + ticks < TIMER_LEVEL_SIZE; ticks++)
+	{
+		Timer *head = &wheel[0][index + ticks];
+		if (head->next != head)
+			break;
+	}
+
+	timeout = (int64_t)((currentTick + ticks) * TIMER_TICK_MS) - (int64_t)timerNowMs();
+	if (timeout < 0)
+		timeout = 0;
+
+	return (int)timeout;
+}
+
+/* Fires every timer that is due. Called once per pass of the event loop */
+void timerRunExpired()
+{
+	uint64_t now = timerNowMs() / TIMER_TICK_MS;
+
+	while (currentTick <= now)
+	{
+		if (numTimers == 0)
+		{
+			// nothing armed - skip the idle ticks instead of walking them
+			currentTick = now + 1;
+			break;
+		}
+		runTick();
+	}
+}
+
+static void runTick()
+{
+	int index = currentTick & TIMER_LEVEL_MASK;
+	Timer expired;
+	Timer *head = &wheel[0][index];
+	Timer *t = NULL;
+
+	if (index == 0)
+		cascade(1);
+
+	// detach the slot so callbacks can safely re-arm or cancel timers
+	expired.next = &expired;
+	expired.prev = &expired;
+	if (head->next != head)
+	{
+		expired.next = head->next;
+		expired.prev = head->prev;
+		expired.next->prev = &expired;
+		expired.prev->next = &expired;
+		head->next = head;
+		head->prev = head;
+	}
+
+	currentTick++;
+
+	while ((t = expired.next) != &expired)
+	{
+		expired.next = t->next;
+		t->next->prev = &expired;
+		t->next = NULL;
+		t->prev = NULL;
+		numTimers--;
+		t->callback(t->arg);
+	}
+}
+
+/* moves the current slot of level down into the levels below it */
+static void cascade(int level)
+{
+	int index = 0;
+	Timer *head = NULL;
+	Timer *t = NULL;
+
+	if (level >= TIMER_LEVELS)
+		return;
+
+	index = (currentTick >> (TIMER_LEVEL_BITS * level)) & TIMER_LEVEL_MASK;
+	if (index == 0)
+		cascade(level + 1);
+
+	head = &wheel[level][index];
+	while ((t = head->next) != head)
+	{
+		head->next = t->next;
+		t->next->prev = head;
+		placeTimer(t);
+	}
+}
+
+/* links t into the slot matching its expiry relative to currentTick */
+static void placeTimer(Timer *t)
+{
+	uint64_t delta = 0;
+	int level = 0;
+	int index = 0;
+	Timer *head = NULL;
+
+	if (t->expires < currentTick)
+		t->expires = currentTick;
+	delta = t->expires - currentTick;
+	if (delta > TIMER_MAX_TICKS)
+	{
+		delta = TIMER_MAX_TICKS;
+		t->expires = currentTick + delta;
+	}
+
+	while (level < TIMER_LEVELS - 1 && delta >= (1ULL << (TIMER_LEVEL_BITS * (level + 1))))
+		level++;
+
+	index = (t->expires >> (TIMER_LEVEL_BITS * level)) & TIMER_LEVEL_MASK;
+	head = &wheel[level][index];
+
+	t->prev = head->prev;
+	t->next = head;
+	head->prev->next = t;
+	head->prev = t;
+}
@@ -0,0 +1,37 @@
+/* Hierarchical timer wheel for the server event loop.
+ * Timers are intrusive (embedded in the owning structure) so adding,
+ * cancelling and expiring a timer never allocates and is O(1).
+ * Like pollLib there is a single wheel per process.
+ */
+
+#ifndef TIMERWHEEL_H
+#define TIMERWHEEL_H
+
+#include <stdint.h>
+
+#define TIMER_TICK_MS 10   // resolution of the wheel
+#define TIMER_LEVEL_BITS 6
+#define TIMER_LEVEL_SIZE (1 << TIMER_LEVEL_BITS) // slots per level
+#define TIMER_LEVELS 4     // 64^4 ticks * 10ms ~ 46 hours of range
+
+typedef void (*TimerCallback)(void *arg);
+
+typedef struct timer {
+   struct timer *next;
+   struct timer *prev;
+   uint64_t expires; // absolute tick
+   TimerCallback callback;
+   void *arg;
+} Timer;
+
+void setupTimerWheel();
+void timerInit(Timer *t, TimerCallback callback, void *arg);
+void timerAdd(Timer *t, int timeInMilliSeconds);
+void timerCancel(Timer *t);
+int timerPending(Timer *t);
+int timerRemaining(Timer *t);
+int timerNextTimeout();
+void timerRunExpired();
+uint64_t timerNowMs();
+
+#endif
@@ -0,0 +1,598 @@
+/* TLS transport, see tlsSocket.h.
+ * The socket is non-blocking from the handshake on; calls made without
+ * MSG_DONTWAIT wait in poll() like they would on a blocking socket.
+ *
+ * In user space, records are encrypted into a memory BIO and written by
+ * us rather than by OpenSSL, so a send can report exactly how much of
+ * the caller's data reached the socket: a record counts once all of it
+ * has. A record that didn't is left pending, and the caller's retry of
+ * the same data (outQueue.c always retries) only pushes it on. Each
+ * buffer is its own record, so a record never holds part of a frame
+ * another retry left out.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/x509v3.h>
+
+#include "tlsSocket.h"
+#include "packets.h"
+#include "pollLib.h"
+
+typedef struct {
+	size_t end; // offset in out just past the record
+	size_t plain; // the caller's bytes in it, 0 if they aren't counted
+} TlsRecord;
+
+typedef struct {
+	Transport transport; // registered with setTransport()
+	SSL *ssl;
+	int socket;
+	int server; // accepted, so read from the event loop - never waits
+	int handshaking; // server side, until tlsHandshake() finishes it
+	int kernel; // TLS_KERNEL_* bits
+	uint8_t *out; // user space records, sent up to out_sent
+	size_t out_len, out_sent, out_size;
+	TlsRecord *records; // those not completely sent, in order
+	int num_records;
+	size_t records_size;
+	uint8_t *plain; // the counted records' plaintext, to recognise a retry
+	size_t plain_len, plain_size;
+} TlsConn;
+
+static SSL_CTX *serverCtx = NULL;
+static SSL_CTX *clientCtx = NULL;
+
+static ssize_t tlsRecv(void *ctx, void *buf, size_t len, int flags);
+static ssize_t tlsSendmsg(void *ctx, const struct msghdr *msg, int flags);
+static short tlsRevents(void *ctx, short events);
+static void tlsClose(void *ctx);
+static void tlsMoved(void *ctx, int socketNum);
+static TlsConn *tlsNew(int socketNum, SSL_CTX *ctx);
+static TlsConn *tlsOf(int socketNum);
+static void tlsReady(TlsConn *c);
+static ssize_t recvSome(TlsConn *c, uint8_t *buf, size_t len);
+static ssize_t sendSome(TlsConn *c, const uint8_t *buf, size_t len);
+static ssize_t userSend(TlsConn *c, const struct msghdr *msg);
+static size_t matchPending(TlsConn *c, const struct msghdr *msg);
+static int encryptRecord(TlsConn *c, const uint8_t *buf, size_t len);
+static void takeRecord(TlsConn *c, size_t plain);
+static int flushOut(TlsConn *c);
+static size_t popSent(TlsConn *c);
+static int waitFd(int fd, short events, int timeoutMs);
+static void *grow(void *buf, size_t *size, size_t need, size_t unit);
+static SSL_CTX *newCtx(const SSL_METHOD *method);
+static uint64_t nowMs();
+
+/* Sets up accepting TLS with the certificate (chain) and key in PEM
+ * files. 0, or -1 after printing why not
+ */
+int tlsServerInit(const char *certFile, const char *keyFile)
+{
+	serverCtx = newCtx(TLS_server_method());
+	// no session tickets: nothing resumes, and it keeps records after the handshake to application data
+	SSL_CTX_set_num_tickets(serverCtx, 0);
+	if (SSL_CTX_use_certificate_chain_file(serverCtx, certFile) != 1
+		|| SSL_CTX_use_PrivateKey_file(serverCtx, keyFile, SSL_FILETYPE_PEM) != 1
+		|| SSL_CTX_check_private_key(serverCtx) != 1)
+	{
+		fprintf(stderr, "TLS certificate %s / key %s: ", certFile, keyFile);
+		ERR_print_errors_fp(stderr);
+		SSL_CTX_free(serverCtx);
+		serverCtx = NULL;
+		return -1;
+	}
+	return 0;
+}
+
+/* Trust the CA certificates in caFile (PEM) for tlsConnect(), or the
+ * system's with NULL. 0, or -1 after printing why not
+ */
+int tlsClientInit(const char *caFile)
+{
+	SSL_CTX *ctx = newCtx(TLS_client_method());
+	int ok = 0;
+
+	SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, NULL);
+	if (caFile != NULL)
+		ok = SSL_CTX_load_verify_locations(ctx, caFile, NULL);
+	else
+		ok = SSL_CTX_set_default_verify_paths(ctx);
+	if (ok != 1)
+	{
+		fprintf(stderr, "TLS CA file %s: ", caFile != NULL ? caFile : "(system)");
+		ERR_print_errors_fp(stderr);
+		SSL_CTX_free(ctx);
+		return -1;
+	}
+	if (clientCtx != NULL)
+		SSL_CTX_free(clientCtx);
+	clientCtx = ctx;
+	return 0;
+}
+
+/* Starts the server side of a handshake on a newly accepted socket. It
+ * is carried on by tlsHandshake() as the client's messages arrive.
+ * 0, or -1 if tlsServerInit() wasn't called
+ */
+int tlsAccept(int socketNum)
+{
+	TlsConn *c = NULL;
+
+	if (serverCtx == NULL || (c = tlsNew(socketNum, serverCtx)) == NULL)
+		return -1;
+	SSL_set_accept_state(c->ssl);
+	c->server = 1;
+	c->handshaking = 1;
+	return 0;
+}
+
+/* For a readable socket: 1 if it's ready for frames (or not TLS at all),
+ * 0 if its handshake took another step instead, -1 if that failed
+ */
+int tlsHandshake(int socketNum)
+{
+	TlsConn *c = tlsOf(socketNum);
+	int ret = 0;
+
+	if (c == NULL || !c->handshaking)
+		return 1;
+	ERR_clear_error();
+	if ((ret = SSL_do_handshake(c->ssl)) == 1)
+	{
+		tlsReady(c);
+		// the first frame may have come with the last handshake message
+		transportSetBuffered(socketNum, SSL_has_pending(c->ssl));
+		return 0;
+	}
+	ret = SSL_get_error(c->ssl, ret);
+	if (ret == SSL_ERROR_WANT_READ || ret == SSL_ERROR_WANT_WRITE)
+		return 0;
+	return -1;
+}
+
+/* The client side of a handshake on a connected socket, checking the
+ * server's certificate is for host (a name or address). Waits up to
+ * TLS_HANDSHAKE_TIMEOUT. 0, or -1 after printing why not, leaving the
+ * socket (non-blocking now) for the caller to close
+ */
+int tlsConnect(int socketNum, const char *host)
+{
+	uint8_t addr[sizeof(struct in6_addr)];
+	uint64_t deadline = nowMs() + TLS_HANDSHAKE_TIMEOUT;
+	TlsConn *c = NULL;
+	long verify = 0;
+	int ret = 0, err = 0, wait = 0;
+
+	if ((clientCtx == NULL && tlsClientInit(NULL) < 0) || (c = tlsNew(socketNum, clientCtx)) == NULL)
+		return -1;
+	if (host != NULL && (inet_pton(AF_INET, host, addr) == 1 || inet_pton(AF_INET6, host, addr) == 1))
+		X509_VERIFY_PARAM_set1_ip_asc(SSL_get0_param(c->ssl), host);
+	else if (host != NULL)
+	{
+		SSL_set_tlsext_host_name(c->ssl, host);
+		SSL_set1_host(c->ssl, host);
+	}
+
+	ERR_clear_error();
+	while ((ret = SSL_connect(c->ssl)) != 1)
+	{
+		err = SSL_get_error(c->ssl, ret);
+		if (err != SSL_ERROR_WANT_READ && err != SSL_ERROR_WANT_WRITE)
+			break;
+		wait = deadline > nowMs() ? deadline - nowMs() : 0;
+		if (waitFd(socketNum, err == SSL_ERROR_WANT_READ ? POLLIN : POLLOUT, wait) <= 0)
+			break;
+	}
+	if (ret == 1)
+	{
+		tlsReady(c);
+		return 0;
+	}
+
+	if ((verify = SSL_get_verify_result(c->ssl)) != X509_V_OK)
+		fprintf(stderr, "TLS: %s: %s\n", host, X509_verify_cert_error_string(verify));
+	else if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE)
+		fprintf(stderr, "TLS: %s: handshake timed out\n", host);
+	else
+	{
+		fprintf(stderr, "TLS: %s: handshake failed (%d)\n", host, err);
+		ERR_print_errors_fp(stderr);
+	}
+	transportClose(socketNum);
+	return -1;
+}
+
+/* TLS_KERNEL_* bits for a TLS socket, -1 for any other */
+int tlsKernel(int socketNum)
+{
+	TlsConn *c = tlsOf(socketNum);
+	return c == NULL ? -1 : c->kernel;
+}
+
+static ssize_t tlsRecv(void *ctx, void *buf, size_t len, int flags)
+{
+	TlsConn *c = (TlsConn *)ctx;
+	size_t got = 0;
+	ssize_t n = 0;
+	int error = 0;
+
+	while (got < len)
+	{
+		if ((n = recvSome(c, (uint8_t *)buf + got, len - got)) > 0)
+		{
+			got += n;
+			if (!(flags & MSG_WAITALL))
+				break;
+			continue;
+		}
+		if (n == 0)
+			break; // closed
+		// the server takes what has arrived, the rest comes on a later poll
+		if (errno != EAGAIN || c->server || (flags & MSG_DONTWAIT))
+			break;
+		if (waitFd(c->socket, POLLIN, -1) < 0)
+			return -1;
+	}
+
+	error = errno;
+	// poll() can't see a record OpenSSL has read but we haven't
+	if (!(c->kernel & TLS_KERNEL_RX))
+		transportSetBuffered(c->socket, SSL_has_pending(c->ssl));
+	// nor what reading made it write (alerts, key updates)
+	if (!(c->kernel & TLS_KERNEL_TX))
+	{
+		takeRecord(c, 0);
+		flushOut(c);
+	}
+	if (got == 0 && n < 0)
+	{
+		errno = error;
+		return -1;
+	}
+	return got;
+}
+
+static ssize_t tlsSendmsg(void *ctx, const struct msghdr *msg, int flags)
+{
+	TlsConn *c = (TlsConn *)ctx;
+	const struct iovec *iov = msg->msg_iov;
+	size_t total = 0, done = 0;
+	ssize_t n = 0;
+	size_t i = 0;
+
+	if (flags & MSG_DONTWAIT)
+	{
+		if (c->kernel & TLS_KERNEL_TX)
+			return sendmsg(c->socket, msg, flags); // as plain as it gets
+		return userSend(c, msg);
+	}
+
+	// a blocking send, one buffer at a time
+	for (i = 0; i < msg->msg_iovlen; i++)
+	{
+		for (done = 0; done < iov[i].iov_len; )
+		{
+			if ((n = sendSome(c, (uint8_t *)iov[i].iov_base + done, iov[i].iov_len - done)) > 0)
+			{
+				done += n;
+				continue;
+			}
+			if ((errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+				|| waitFd(c->socket, POLLOUT, -1) < 0)
+				return total + done > 0 ? (ssize_t)(total + done) : -1;
+		}
+		total += done;
+	}
+	return total;
+}
+
+// the socket itself is polled, so what poll() says is what's ready
+static short tlsRevents(void *ctx, short events)
+{
+	return events;
+}
+
+/* No close_notify: the socket may already be dead (a client resuming
+ * closes its old connection this way), and frames carry their own lengths
+ */
+static void tlsClose(void *ctx)
+{
+	TlsConn *c = (TlsConn *)ctx;
+
+	transportSetBuffered(c->socket, 0);
+	SSL_free(c->ssl);
+	free(c->out);
+	free(c->records);
+	free(c->plain);
+	free(c);
+}
+
+// the socket was dup2()ed, OpenSSL's end too
+static void tlsMoved(void *ctx, int socketNum)
+{
+	TlsConn *c = (TlsConn *)ctx;
+
+	BIO_set_fd(SSL_get_rbio(c->ssl), socketNum, BIO_NOCLOSE);
+	c->socket = socketNum;
+	c->transport.wake_fd = socketNum;
+}
+
+static TlsConn *tlsNew(int socketNum, SSL_CTX *ctx)
+{
+	TlsConn *c = NULL;
+	int flags = fcntl(socketNum, F_GETFL);
+
+	if (flags < 0 || fcntl(socketNum, F_SETFL, flags | O_NONBLOCK) < 0)
+	{
+		perror("tls fcntl");
+		return NULL;
+	}
+	c = sCalloc(1, sizeof(TlsConn));
+	if ((c->ssl = SSL_new(ctx)) == NULL || SSL_set_fd(c->ssl, socketNum) != 1)
+	{
+		ERR_print_errors_fp(stderr);
+		SSL_free(c->ssl);
+		free(c);
+		return NULL;
+	}
+	c->socket = socketNum;
+	c->transport.recv = tlsRecv;
+	c->transport.sendmsg = tlsSendmsg;
+	c->transport.revents = tlsRevents;
+	c->transport.close = tlsClose;
+	c->transport.moved = tlsMoved;
+	c->transport.wake_fd = socketNum;
+	c->transport.ctx = c;
+	setTransport(socketNum, &c->transport);
+	return c;
+}
+
+static TlsConn *tlsOf(int socketNum)
+{
+	Transport *t = getTransport(socketNum);
+	return t != NULL && t->recv == tlsRecv ? (TlsConn *)t->ctx : NULL;
+}
+
+/* Handshake done: the kernel took over what it could. If not the
+ * sending side, records are written to memory from here on, and sent by us
+ */
+static void tlsReady(TlsConn *c)
+{
+	c->handshaking = 0;
+	c->kernel = 0;
+	if (BIO_get_ktls_send(SSL_get_wbio(c->ssl)))
+		c->kernel |= TLS_KERNEL_TX;
+	if (BIO_get_ktls_recv(SSL_get_rbio(c->ssl)))
+		c->kernel |= TLS_KERNEL_RX;
+	if (!(c->kernel & TLS_KERNEL_TX))
+		SSL_set0_wbio(c->ssl, BIO_new(BIO_s_mem()));
+}
+
+/* Some of what's there without waiting. 0 when closed, -1 with errno
+ * EAGAIN if nothing is
+ */
+static ssize_t recvSome(TlsConn *c, uint8_t *buf, size_t len)
+{
+	ssize_t n = 0;
+	int err = 0;
+
+	if (c->kernel & TLS_KERNEL_RX)
+	{
+		n = recv(c->socket, buf, len, MSG_DONTWAIT);
+		if (n < 0 && errno == EIO)
+			return 0; // a record other than data, e.g. the peer's close_notify
+		return n;
+	}
+	ERR_clear_error();
+	if ((n = SSL_read(c->ssl, buf, len)) > 0)
+		return n;
+	err = SSL_get_error(c->ssl, n);
+	if (err == SSL_ERROR_ZERO_RETURN)
+		return 0;
+	errno = err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE ? EAGAIN : ECONNRESET;
+	return -1;
+}
+
+static ssize_t sendSome(TlsConn *c, const uint8_t *buf, size_t len)
+{
+	struct iovec iov;
+	struct msghdr msg;
+
+	if (c->kernel & TLS_KERNEL_TX)
+		return send(c->socket, buf, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+	iov.iov_base = (void *)buf;
+	iov.iov_len = len;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	return userSend(c, &msg);
+}
+
+/* The caller's bytes that are now completely on the wire, or -1 with
+ * errno EAGAIN if none are. New data is only encrypted once nothing
+ * else is waiting, so at most one call's worth ever is
+ */
+static ssize_t userSend(TlsConn *c, const struct msghdr *msg)
+{
+	const struct iovec *iov = msg->msg_iov;
+	size_t matched = matchPending(c, msg);
+	size_t sent = 0, off = 0, skip = 0, total = 0;
+	size_t i = 0;
+
+	if (flushOut(c) < 0)
+		return -1;
+	sent = popSent(c);
+	if (c->num_records == 0)
+	{
+		for (i = 0; i < msg->msg_iovlen; i++)
+		{
+			// past what was sent just now
+			skip = matched > off ? matched - off : 0;
+			if (skip < iov[i].iov_len
+				&& encryptRecord(c, (uint8_t *)iov[i].iov_base + skip, iov[i].iov_len - skip) < 0)
+				return -1;
+			off += iov[i].iov_len;
+		}
+		if (flushOut(c) < 0)
+			return -1;
+		sent += popSent(c);
+	}
+
+	for (i = 0; i < msg->msg_iovlen; i++)
+		total += iov[i].iov_len;
+	if (sent == 0 && total > 0)
+	{
+		errno = EAGAIN;
+		return -1;
+	}
+	return sent;
+}
+
+/* How much of the caller's data is the pending records' plaintext, i.e.
+ * is being retried. If it isn't (a queued frame was dropped meanwhile)
+ * the pending records still go out - whole frames - but aren't counted
+ */
+static size_t matchPending(TlsConn *c, const struct msghdr *msg)
+{
+	const struct iovec *iov = msg->msg_iov;
+	size_t done = 0, n = 0;
+	size_t i = 0;
+	int j = 0;
+
+	for (i = 0; i < msg->msg_iovlen && done < c->plain_len; i++)
+	{
+		n = iov[i].iov_len < c->plain_len - done ? iov[i].iov_len : c->plain_len - done;
+		if (memcmp(iov[i].iov_base, c->plain + done, n) != 0)
+			break;
+		done += n;
+	}
+	if (done == c->plain_len)
+		return done;
+	for (j = 0; j < c->num_records; j++)
+		c->records[j].plain = 0;
+	c->plain_len = 0;
+	return 0;
+}
+
+static int encryptRecord(TlsConn *c, const uint8_t *buf, size_t len)
+{
+	if (len == 0)
+		return 0;
+	ERR_clear_error();
+	if (SSL_write(c->ssl, buf, len) != (int)len) // to memory, so all or nothing
+	{
+		ERR_print_errors_fp(stderr);
+		errno = EPROTO;
+		return -1;
+	}
+	c->plain = grow(c->plain, &c->plain_size, c->plain_len + len, 1);
+	memcpy(c->plain + c->plain_len, buf, len);
+	c->plain_len += len;
+	takeRecord(c, len);
+	return 0;
+}
+
+// moves what OpenSSL wrote to memory onto the end of out, as one record
+static void takeRecord(TlsConn *c, size_t plain)
+{
+	BIO *wbio = SSL_get_wbio(c->ssl);
+	size_t pending = BIO_ctrl_pending(wbio);
+
+	if (pending == 0)
+		return;
+	c->out = grow(c->out, &c->out_size, c->out_len + pending, 1);
+	BIO_read(wbio, c->out + c->out_len, pending);
+	c->out_len += pending;
+	c->records = grow(c->records, &c->records_size, c->num_records + 1, sizeof(TlsRecord));
+	c->records[c->num_records].end = c->out_len;
+	c->records[c->num_records++].plain = plain;
+}
+
+static int flushOut(TlsConn *c)
+{
+	ssize_t n = 0;
+
+	while (c->out_sent < c->out_len)
+	{
+		if ((n = send(c->socket, c->out + c->out_sent, c->out_len - c->out_sent, MSG_DONTWAIT | MSG_NOSIGNAL)) < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+		}
+		c->out_sent += n;
+	}
+	return 0;
+}
+
+// forgets the records that are completely sent, returns the caller's bytes in them
+static size_t popSent(TlsConn *c)
+{
+	size_t plain = 0;
+	int i = 0;
+
+	while (i < c->num_records && c->records[i].end <= c->out_sent)
+		plain += c->records[i++].plain;
+	memmove(c->records, c->records + i, sizeof(TlsRecord) * (c->num_records - i));
+	c->num_records -= i;
+	memmove(c->plain, c->plain + plain, c->plain_len - plain);
+	c->plain_len -= plain;
+	if (c->out_sent == c->out_len)
+		c->out_sent = c->out_len = 0;
+	return plain;
+}
+
+// >0 ready, 0 timed out, -1 error. timeoutMs -1 = forever
+static int waitFd(int fd, short events, int timeoutMs)
+{
+	struct pollfd p;
+	int ret = 0;
+
+	p.fd = fd;
+	p.events = events;
+	while ((ret = poll(&p, 1, timeoutMs)) < 0 && errno == EINTR)
+		;
+	return ret;
+}
+
+static void *grow(void *buf, size_t *size, size_t need, size_t unit)
+{
+	if (need <= *size)
+		return buf;
+	*size = need * 2 > 4096 ? need * 2 : 4096;
+	return srealloc(buf, *size * unit);
+}
+
+static SSL_CTX *newCtx(const SSL_METHOD *method)
+{
+	SSL_CTX *ctx = SSL_CTX_new(method);
+
+	if (ctx == NULL)
+	{
+		ERR_print_errors_fp(stderr);
+		exit(-1);
+	}
+	SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+	// kernel offload once the keys are known, and a peer that just
+	// closes the connection is a close rather than an error
+	SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS | SSL_OP_IGNORE_UNEXPECTED_EOF);
+	return ctx;
+}
+
+static uint64_t nowMs()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
@@ -0,0 +1,30 @@
+/* TLS for TCP connections.
+ * OpenSSL does the handshake. After that, where the kernel supports the
+ * negotiated cipher, the record keys are handed to it (kTLS) and frames
+ * are read and written with the socket's own calls, so the send,
+ * batching and fan-out paths cost what they do in plaintext. Where it
+ * doesn't (or only one way), OpenSSL encrypts in user space instead.
+ * Either way the connection is plugged into packets.c as the socket's
+ * transport, so the framing and event loops are unchanged.
+ *
+ * Clients reach a TLS server as tls:<host> (see networks.h) and check
+ * its certificate against the system's CAs or tlsClientInit()'s file.
+ */
+
+#ifndef TLSSOCKET_H
+#define TLSSOCKET_H
+
+#define TLS_HANDSHAKE_TIMEOUT 5000 // ms a connecting side waits for the handshake
+
+/* tlsKernel() bits */
+#define TLS_KERNEL_TX 1 // records sent are encrypted by the kernel
+#define TLS_KERNEL_RX 2 // and received ones decrypted
+
+int tlsServerInit(const char *certFile, const char *keyFile);
+int tlsClientInit(const char *caFile);
+int tlsAccept(int socketNum);
+int tlsHandshake(int socketNum);
+int tlsConnect(int socketNum, const char *host);
+int tlsKernel(int socketNum);
+
+#endif
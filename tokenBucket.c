@@ -0,0 +1,50 @@
+/* Token bucket rate limiter.
+ * Callers check bucketReady() before taking work from a client, then
+ * charge what the work actually cost. Charging after the fact lets a
+ * single frame overdraw the bucket, which just delays the next one.
+ */
+
+#include "tokenBucket.h"
+
+static void bucketRefill(TokenBucket *b, uint64_t now);
+
+void bucketInit(TokenBucket *b, double rate, double burst, uint64_t now)
+{
+	b->rate = rate;
+	b->burst = burst < 1 ? 1 : burst;
+	b->tokens = b->burst;
+	b->last_refill = now;
+}
+
+/* returns 1 if the bucket has at least one token (or is unlimited) */
+int bucketReady(TokenBucket *b, uint64_t now)
+{
+	if (b->rate == 0)
+		return 1;
+	bucketRefill(b, now);
+	return b->tokens >= 1;
+}
+
+void bucketCharge(TokenBucket *b, double tokens)
+{
+	if (b->rate != 0)
+		b->tokens -= tokens;
+}
+
+/* ms until the bucket is back to one token (call after bucketReady) */
+int bucketWaitTime(TokenBucket *b)
+{
+	if (b->rate == 0 || b->tokens >= 1)
+		return 0;
+	return (int)((1 - b->tokens) * 1000 / b->rate) + 1;
+}
+
+static void bucketRefill(TokenBucket *b, uint64_t now)
+{
+	if (now <= b->last_refill)
+		return;
+	b->tokens += (now - b->last_refill) * b->rate / 1000;
+	if (b->tokens > b->burst)
+		b->tokens = b->burst;
+	b->last_refill = now;
+}
@@ -0,0 +1,23 @@
+/* Token bucket rate limiter.
+ * A bucket holds up to burst tokens and refills at rate tokens per
+ * second. A rate of 0 disables the bucket (every take succeeds).
+ */
+
+#ifndef TOKENBUCKET_H
+#define TOKENBUCKET_H
+
+#include <stdint.h>
+
+typedef struct {
+   double tokens; // may go negative - a large frame borrows from later refills
+   double rate; // tokens per second, 0 = unlimited
+   double burst; // bucket capacity
+   uint64_t last_refill; // ms
+} TokenBucket;
+
+void bucketInit(TokenBucket *b, double rate, double burst, uint64_t now);
+int bucketReady(TokenBucket *b, uint64_t now);
+void bucketCharge(TokenBucket *b, double tokens);
+int bucketWaitTime(TokenBucket *b);
+
+#endif
@@ -0,0 +1,228 @@
+/* Byte level checks for what clients send.
+ * The vector loops only look for the first byte outside a printable
+ * range: compared as signed bytes, everything from 0x80 up is negative,
+ * so one "less than" catches both non-ASCII and control characters. The
+ * loop to use is picked on the first call.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define VALIDATE_X86
+#endif
+
+#include "validate.h"
+#include "networks.h"
+
+#define PLAIN_TEXT 0x20 // lowest byte plain in text (space)
+#define PLAIN_HANDLE 0x21 // and in a handle
+#define DEL 0x7f
+#define SCALAR_RUN 16 // ASCII bytes after a non-ASCII character checked one at a time
+
+typedef size_t (*SpanFunc)(const uint8_t *p, size_t len, uint8_t low);
+
+static size_t pickSpan(const uint8_t *p, size_t len, uint8_t low);
+static size_t spanScalar(const uint8_t *p, size_t len, uint8_t low);
+#ifdef VALIDATE_X86
+static size_t spanSse2(const uint8_t *p, size_t len, uint8_t low);
+static size_t spanAvx2(const uint8_t *p, size_t len, uint8_t low);
+#endif
+static size_t utf8Char(const uint8_t *p, size_t len);
+
+static struct {
+	const char *name;
+	SpanFunc span;
+} impls[] = {
+#ifdef VALIDATE_X86
+	{ "avx2", spanAvx2 },
+	{ "sse2", spanSse2 },
+#endif
+	{ "scalar", spanScalar },
+};
+
+static SpanFunc plainSpan = pickSpan; // bytes from p up to the first not in [low, DEL)
+static const char *implName = NULL;
+
+int validHandle(const uint8_t *handle, size_t len)
+{
+	if (len < 1 || len > MAX_HANDLE)
+		return 0;
+	if (!((handle[0] >= 'a' && handle[0] <= 'z') || (handle[0] >= 'A' && handle[0] <= 'Z')))
+		return 0;
+	return plainSpan(handle, len, PLAIN_HANDLE) == len;
+}
+
+int validText(const uint8_t *text, size_t len)
+{
+	size_t i = 0;
+	size_t n = 0;
+	int run = 0;
+
+	while ((i += plainSpan(text + i, len - i, PLAIN_TEXT)) < len)
+	{
+		// in non-Latin text the ASCII between characters is a space or
+		// two, not worth setting up a vector loop for
+		do
+		{
+			if (text[i] == '\t' || text[i] == '\n' || text[i] == '\r')
+				i++;
+			else if ((n = utf8Char(text + i, len - i)) == 0)
+				return 0;
+			else
+				i += n;
+			for (run = 0; run < SCALAR_RUN && i < len && text[i] >= PLAIN_TEXT && text[i] < DEL; run++)
+				i++;
+		} while (run < SCALAR_RUN && i < len);
+	}
+	return 1;
+}
+
+/* Where to cut text longer than len bytes so no UTF-8 character is
+ * split: len, or up to 3 bytes less
+ */
+size_t utf8Boundary(const uint8_t *text, size_t len)
+{
+	size_t n = len;
+
+	// back over continuation bytes (10xxxxxx) to the start of the character
+	while (n > 0 && len - n < 3 && (text[n] & 0xc0) == 0x80)
+		n--;
+	return (text[n] & 0xc0) == 0x80 ? len : n;
+}
+
+/* Picks the loop by name (scalar, sse2, avx2), for benchmarks. -1 if
+ * this CPU or build doesn't have it
+ */
+int validateUse(const char *impl)
+{
+	size_t i;
+
+	for (i = 0; i < sizeof(impls) / sizeof(impls[0]); i++)
+	{
+		if (strcmp(impls[i].name, impl) != 0)
+			continue;
+#ifdef VALIDATE_X86
+		if (impls[i].span == spanAvx2 && !__builtin_cpu_supports("avx2"))
+			return -1;
+#endif
+		plainSpan = impls[i].span;
+		implName = impls[i].name;
+		return 0;
+	}
+	return -1;
+}
+
+/* name of the loop in use */
+const char *validateImpl()
+{
+	if (implName == NULL)
+		pickSpan((const uint8_t *)"", 0, 0);
+	return implName;
+}
+
+static size_t pickSpan(const uint8_t *p, size_t len, uint8_t low)
+{
+	size_t i;
+
+	for (i = 0; validateUse(impls[i].name) < 0; i++)
+		;
+	return plainSpan(p, len, low);
+}
+
+static size_t spanScalar(const uint8_t *p, size_t len, uint8_t low)
+{
+	size_t i = 0;
+
+	while (i < len && p[i] >= low && p[i] < DEL)
+		i++;
+	return i;
+}
+
+#ifdef VALIDATE_X86
+static size_t spanSse2(const uint8_t *p, size_t len, uint8_t low)
+{
+	const __m128i lows = _mm_set1_epi8(low);
+	const __m128i dels = _mm_set1_epi8(DEL);
+	__m128i v;
+	size_t i = 0;
+	int bad = 0;
+
+	for (; i + 16 <= len; i += 16)
+	{
+		v = _mm_loadu_si128((const __m128i *)(p + i));
+		bad = _mm_movemask_epi8(_mm_or_si128(_mm_cmplt_epi8(v, lows), _mm_cmpeq_epi8(v, dels)));
+		if (bad != 0)
+			return i + __builtin_ctz(bad);
+	}
+	return i + spanScalar(p + i, len - i, low);
+}
+
+__attribute__((target("avx2")))
+static size_t spanAvx2(const uint8_t *p, size_t len, uint8_t low)
+{
+	const __m256i lows = _mm256_set1_epi8(low);
+	const __m256i dels = _mm256_set1_epi8(DEL);
+	__m256i v;
+	size_t i = 0;
+	unsigned bad = 0;
+
+	for (; i + 32 <= len; i += 32)
+	{
+		v = _mm256_loadu_si256((const __m256i *)(p + i));
+		bad = _mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpgt_epi8(lows, v), _mm256_cmpeq_epi8(v, dels)));
+		if (bad != 0)
+			break;
+	}
+	// the compiler only adds this itself when optimizing, and SSE code
+	// run with the upper halves dirty is slowed on every instruction
+	_mm256_zeroupper();
+	if (bad != 0)
+		return i + __builtin_ctz(bad);
+	return i + spanSse2(p + i, len - i, low);
+}
+#endif
+
+/* Length of the well formed, non control character at p (the Unicode
+ * standard's table 3-7), or 0
+ */
+static size_t utf8Char(const uint8_t *p, size_t len)
+{
+	uint8_t min = 0x80; // range of the second byte
+	uint8_t max = 0xbf;
+	size_t n = 0;
+	size_t i;
+
+	if (p[0] >= 0xc2 && p[0] <= 0xdf)
+	{
+		n = 2;
+		if (p[0] == 0xc2)
+			min = 0xa0; // U+0080 to U+009F are C1 controls
+	}
+	else if (p[0] >= 0xe0 && p[0] <= 0xef)
+	{
+		n = 3;
+		if (p[0] == 0xe0)
+			min = 0xa0; // overlong
+		else if (p[0] == 0xed)
+			max = 0x9f; // surrogates
+	}
+	else if (p[0] >= 0xf0 && p[0] <= 0xf4)
+	{
+		n = 4;
+		if (p[0] == 0xf0)
+			min = 0x90; // overlong
+		else if (p[0] == 0xf4)
+			max = 0x8f; // past U+10FFFF
+	}
+	else
+		return 0; // ASCII control or DEL, continuation, overlong C0/C1, F5 up
+
+	if (n > len || p[1] < min || p[1] > max)
+		return 0;
+	for (i = 2; i < n; i++)
+		if ((p[i] & 0xc0) != 0x80)
+			return 0;
+	return n;
+}
@@ -0,0 +1,22 @@
+/* Byte level checks for what clients send.
+ * Handles are 1 to MAX_HANDLE visible ASCII characters starting with a
+ * letter. Message text is well formed UTF-8 (no overlongs, surrogates or
+ * code points past U+10FFFF) without control characters other than tab,
+ * newline and carriage return. Printable ASCII, nearly all chat text, is
+ * skipped 16 or 32 bytes at a time with SSE2 or AVX2, whichever the CPU
+ * has; anything else is checked a character at a time.
+ */
+
+#ifndef VALIDATE_H
+#define VALIDATE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+int validHandle(const uint8_t *handle, size_t len);
+int validText(const uint8_t *text, size_t len);
+size_t utf8Boundary(const uint8_t *text, size_t len);
+int validateUse(const char *impl);
+const char *validateImpl();
+
+#endif
@@ -0,0 +1,135 @@
+/* Microbenchmark for validate.c.
+ * Runs validHandle() and validText() over the same inputs with each loop
+ * this CPU has (scalar, sse2, avx2) and prints the bytes checked per
+ * second:
+ *
+ *   handle   - MAX_HANDLE byte handles
+ *   message  - MAX_MESSAGE - 1 bytes of ASCII text, a full %M or %B
+ *   utf8     - the same length of mixed 1 to 4 byte characters
+ *   block    - BENCH_BLOCK bytes of ASCII text, the vector loops flat out
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "validate.h"
+#include "networks.h"
+#include "packets.h"
+
+#define BENCH_DEFAULT_MB 256 // checked per input per loop
+#define BENCH_BLOCK 65536
+
+typedef struct {
+   char *name;
+   uint8_t *data;
+   size_t len;
+   int handle; // validHandle() rather than validText()
+} BenchInput;
+
+double benchInput(BenchInput *in, uint64_t bytes);
+void fillText(uint8_t *buf, size_t len, int utf8);
+uint64_t nowNs();
+void usage(char *prog);
+
+int main(int argc, char *argv[]) {
+
+   char *impls[] = { "scalar", "sse2", "avx2" };
+   uint8_t handle[MAX_HANDLE], message[MAX_MESSAGE - 1], utf8[MAX_MESSAGE - 1];
+   static uint8_t block[BENCH_BLOCK];
+   BenchInput inputs[] = {
+      { "handle", handle, sizeof(handle), 1 },
+      { "message", message, sizeof(message), 0 },
+      { "utf8", utf8, 0, 0 },
+      { "block", block, BENCH_BLOCK, 0 },
+   };
+   int numInputs = sizeof(inputs) / sizeof(inputs[0]);
+   uint64_t bytes = (uint64_t)BENCH_DEFAULT_MB << 20;
+   int opt, i, j;
+
+   while((opt = getopt(argc, argv, "m:")) != -1) {
+      switch(opt) {
+         case 'm':
+            bytes = (uint64_t)atoi(optarg) << 20;
+            break;
+         default:
+            usage(argv[0]);
+      }
+   }
+   if(optind != argc || bytes == 0)
+      usage(argv[0]);
+
+   handle[0] = 'h';
+   fillText(handle + 1, sizeof(handle) - 1, 0);
+   for(i = 0; i < (int)sizeof(handle); i++)
+      if(handle[i] == ' ')
+         handle[i] = '_';
+   fillText(message, sizeof(message), 0);
+   fillText(utf8, sizeof(utf8), 1);
+   inputs[2].len = utf8Boundary(utf8, sizeof(utf8) - 1);
+   fillText(block, BENCH_BLOCK, 0);
+
+   printf("%-8s", "GB/s");
+   for(i = 0; i < numInputs; i++)
+      printf(" %10s", inputs[i].name);
+   printf("\n");
+   for(j = 0; j < (int)(sizeof(impls) / sizeof(impls[0])); j++) {
+      if(validateUse(impls[j]) < 0)
+         continue;
+      printf("%-8s", impls[j]);
+      for(i = 0; i < numInputs; i++)
+         printf(" %10.2f", benchInput(&inputs[i], bytes));
+      printf("\n");
+   }
+   return 0;
+}
+
+/* Checks in over and over until bytes have been looked at */
+double benchInput(BenchInput *in, uint64_t bytes) {
+
+   uint64_t rounds = bytes / in->len + 1, start, i;
+   int ok = 1;
+
+   start = nowNs();
+   for(i = 0; i < rounds; i++)
+      ok &= in->handle ? validHandle(in->data, in->len) : validText(in->data, in->len);
+   if(!ok) {
+      fprintf(stderr, "%s input rejected\n", in->name);
+      exit(EXIT_FAILURE);
+   }
+   return (double)rounds * in->len / (nowNs() - start);
+}
+
+/* Words of printable ASCII, or of characters 1 to 4 bytes long */
+void fillText(uint8_t *buf, size_t len, int utf8) {
+
+   static const char *ascii[] = { "hello ", "there ", "everyone, ", "how's ", "it ", "going? " };
+   static const char *mixed[] = { "h\xc3\xa9llo ", "w\xc3\xb6rld ", "\xe2\x9c\x93 ", "\xe6\x97\xa5\xe6\x9c\xac ", "\xf0\x9f\x98\x80 " };
+   const char **words = utf8 ? mixed : ascii;
+   int numWords = utf8 ? 5 : 6;
+   size_t i = 0, n;
+   int w = 0;
+
+   while(i < len) {
+      n = strlen(words[w]);
+      if(n > len - i)
+         n = len - i;
+      memcpy(buf + i, words[w], n);
+      i += n;
+      w = (w + 1) % numWords;
+   }
+}
+
+uint64_t nowNs() {
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+void usage(char *prog) {
+   fprintf(stderr, "Usage %s [-m megabytes-per-test]\n", prog);
+   exit(EXIT_FAILURE);
+}